@@ -89,6 +89,7 @@ struct blocklist {
 
 struct gfs2_options {
 	char *device;
+	unsigned int direct:1;
 	unsigned int yes:1;
 	unsigned int no:1;
 	unsigned int query:1;
@@ -153,6 +154,7 @@ static void convert_bitmaps(struct gfs2_sbd *sdp, struct rgrp_tree *rg)
 				}
 			}
 	}
+	lgfs2_rgrp_extents_free(rg);
 }/* convert_bitmaps */
 
 /* ------------------------------------------------------------------------- */
@@ -275,16 +277,11 @@ static void fix_metatree(struct gfs2_sbd *sbp, struct gfs2_inode *ip,
 		  struct blocklist *blk, __be64 *first_nonzero_ptr,
 		  unsigned int size)
 {
-	uint64_t block;
 	struct gfs2_buffer_head *bh;
 	unsigned int amount, ptramt;
 	int hdrsize, h, copied = 0, new;
-	struct gfs2_meta_header mh = {0};
 	char *srcptr = (char *)first_nonzero_ptr;
 
-	mh.mh_magic = cpu_to_be32(GFS2_MAGIC);
-	mh.mh_type = cpu_to_be32(GFS2_METATYPE_IN);
-	mh.mh_format = cpu_to_be32(GFS2_FORMAT_IN);
 	if (!ip->i_height)
 		unstuff_dinode(ip);
 
@@ -292,22 +289,11 @@ static void fix_metatree(struct gfs2_sbd *sbp, struct gfs2_inode *ip,
 	amount = size;
 
 	while (copied < size) {
-		bh = ip->i_bh;
 		/* First, build up the metatree */
-		for (h = 0; h < blk->height; h++) {
-			new = 0;
-			lookup_block(ip, bh, h, &blk->mp, 1, &new, &block);
-			if (bh != ip->i_bh)
-				brelse(bh);
-			if (!block)
-				break;
-
-			bh = bread(sbp, block);
-			if (new)
-				memset(bh->b_data, 0, sbp->sd_bsize);
-			memcpy(bh->b_data, &mh, sizeof(mh));
-			bmodified(bh);
-		}
+		new = 0;
+		bh = lgfs2_metapath_get(ip, &blk->mp, blk->height, 1, &new);
+		if (bh == NULL)
+			return;
 
 		hdrsize = blk->height ? sizeof(struct gfs2_meta_header) :
 			sizeof(struct gfs2_dinode);
@@ -318,8 +304,7 @@ static void fix_metatree(struct gfs2_sbd *sbp, struct gfs2_inode *ip,
 		memcpy(bh->b_data + hdrsize + ptramt, (char *)srcptr, amount);
 		srcptr += amount;
 		bmodified(bh);
-		if (bh != ip->i_bh)
-			brelse(bh);
+		lgfs2_metapath_put(ip, bh);
 
 		copied += amount;
 
@@ -734,6 +719,8 @@ static int adjust_indirect_blocks(struct gfs2_sbd *sbp, struct gfs2_inode *ip)
 
 	/* Now run through the block list a second time.  If the block
 	   is a data block, rewrite the data to the gfs2 offset. */
+	if (isreg || isdir)
+		lgfs2_mpcache_start(ip);
 	osi_list_foreach_safe(tmp, &blocks.list, x) {
 
 		blk = osi_list_entry(tmp, struct blocklist, list);
@@ -758,6 +745,7 @@ static int adjust_indirect_blocks(struct gfs2_sbd *sbp, struct gfs2_inode *ip)
 		free(blk->ptrbuf);
 		free(blk);
 	}
+	lgfs2_mpcache_stop(ip);
 
 	ip->i_size = dinode_size;
 
@@ -767,6 +755,7 @@ static int adjust_indirect_blocks(struct gfs2_sbd *sbp, struct gfs2_inode *ip)
 	return error;
 
 out:
+	lgfs2_mpcache_stop(ip);
 	while (!osi_list_empty(&blocks.list)) {
 		blk = osi_list_entry(tmp, struct blocklist, list);
 		osi_list_del(&blocks.list);
@@ -1621,6 +1610,11 @@ static int init(struct gfs2_sbd *sbp, struct gfs2_options *opts)
 		sizeof(uint64_t);
 	sbp->sd_jbsize = sbp->sd_bsize - sizeof(struct gfs2_meta_header);
 	brelse(bh);
+	if (opts->direct && lgfs2_set_direct_io(sbp, 1) != 0)
+		log_crit(_("Unable to use direct I/O, continuing without it: %s\n"),
+		         strerror(errno));
+	/* Buffers and inodes are allocated with calloc() if this fails */
+	lgfs2_slab_init(sbp);
 	if (compute_heightsize(sbp->sd_bsize, sbp->sd_heightsize, &sbp->sd_max_height,
 				sbp->sd_bsize, sbp->sd_diptrs, sbp->sd_inptrs)) {
 		log_crit("%s\n", _("Failed to compute file system constants"));
@@ -1728,8 +1722,9 @@ static void usage(const char *name)
 {
 	give_warning();
 	printf(_("\nUsage:\n"));
-	printf(_("%s [-hnqvVy] <device>\n\n"), name);
+	printf(_("%s [-DhnqvVy] <device>\n\n"), name);
 	printf("Flags:\n");
+	printf(_("\tD - use direct I/O, bypassing the page cache\n"));
 	printf(_("\th - print this help message\n"));
 	printf(_("\tn - assume 'no' to all questions\n"));
 	printf(_("\tq - quieter output\n"));
@@ -1746,15 +1741,19 @@ static void process_parameters(int argc, char **argv, struct gfs2_options *opts)
 {
 	int c;
 
+	opts->direct = 0;
 	opts->yes = 0;
 	opts->no = 0;
 	if (argc == 1) {
 		usage(argv[0]);
 		exit(0);
 	}
-	while((c = getopt(argc, argv, "hnqvyV")) != -1) {
+	while((c = getopt(argc, argv, "DhnqvyV")) != -1) {
 		switch(c) {
 
+		case 'D':
+			opts->direct = 1;
+			break;
 		case 'h':
 			usage(argv[0]);
 			exit(0);
@@ -1887,7 +1886,7 @@ static int journ_space_to_rg(struct gfs2_sbd *sdp)
 			exit(-1);
 		}
 
-		rgd->bits[0].bi_data = calloc(rgd->rt_length, sdp->sd_bsize);
+		rgd->bits[0].bi_data = lgfs2_dev_buf(sdp, rgd->rt_length * sdp->sd_bsize);
 		if (rgd->bits[0].bi_data == NULL) {
 			perror("");
 			exit(-1);
@@ -2183,6 +2182,8 @@ int main(int argc, char **argv)
 	/* Set i18n support to gfs2_convert */
 	setlocale(LC_ALL, "");
 	textdomain("gfs2-utils");
+	if (lgfs2_iostats_init() != 0)
+		log_err(_("Unable to enable I/O statistics: %s\n"), strerror(errno));
 
 	version();
 	process_parameters(argc, argv, &opts);
@@ -374,7 +374,7 @@ static void print_block_details(struct iinfo *ind, int level, int cur_height,
 			"display_indirect\n");
 		return;
 	}
-	tmpbuf = malloc(sbd.sd_bsize);
+	tmpbuf = lgfs2_dev_buf(&sbd, sbd.sd_bsize);
 	if (!tmpbuf) {
 		fprintf(stderr, "Out of memory in function "
 			"display_indirect\n");
@@ -383,7 +383,7 @@ static void print_block_details(struct iinfo *ind, int level, int cur_height,
 	}
 	while (thisblk) {
 		/* read in the desired block */
-		if (pread(sbd.device_fd, tmpbuf, sbd.sd_bsize, thisblk * sbd.sd_bsize) != sbd.sd_bsize) {
+		if (lgfs2_dev_pread(&sbd, tmpbuf, sbd.sd_bsize, thisblk * sbd.sd_bsize) != sbd.sd_bsize) {
 			fprintf(stderr, "bad read: %s from %s:%d: block %"PRIu64
 				" (0x%"PRIx64")\n", strerror(errno), __FUNCTION__,
 				__LINE__, ind->ii[pndx].block, ind->ii[pndx].block);
@@ -536,16 +536,18 @@ static int parse_rindex(struct gfs2_inode *dip, int print_rindex)
 			if (print_rindex)
 				lgfs2_rindex_print(&ri);
 			else {
-				struct gfs2_rgrp r = {0};
-				ssize_t ret;
+				struct gfs2_buffer_head *rbh;
 
-				ret = pread(sbd.device_fd, &r, sizeof(r), rg.rt_addr * sbd.sd_bsize);
-				if (ret != sizeof(r)) {
+				/* Read the whole block so that it works with direct I/O */
+				rbh = bread(&sbd, rg.rt_addr);
+				if (rbh == NULL) {
 					perror("Failed to read resource group");
-				} else if (sbd.gfs1) {
-					gfs_rgrp_print(&r);
 				} else {
-					lgfs2_rgrp_print(&r);
+					if (sbd.gfs1)
+						gfs_rgrp_print(rbh->b_data);
+					else
+						lgfs2_rgrp_print(rbh->b_data);
+					brelse(rbh);
 				}
 			}
 			last_entry_onscreen[dmode] = print_entry_ndx;
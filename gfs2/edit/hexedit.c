@@ -42,6 +42,7 @@ static long int gziplevel = 9;
 static int termcols;
 static struct lgfs2_inum gfs1_quota_di;
 static struct lgfs2_inum gfs1_license_di;
+static int direct_io;
 
 int details = 0;
 char *device = NULL;
@@ -807,7 +808,7 @@ static void set_rgrp_flags(int rgnum, uint32_t new_flags, int modify, int full)
 	}
 	brelse(rbh);
 	if (modify)
-		fsync(sbd.device_fd);
+		lgfs2_dev_sync(&sbd);
 }
 
 /* ------------------------------------------------------------------------ */
@@ -890,14 +891,19 @@ static int block_has_extended_info(void)
 	return FALSE;
 }
 
-static void read_superblock(int fd)
+static void read_superblock(void)
 {
+	struct gfs2_sbd dev = sbd;
 	struct gfs2_meta_header *mh;
 
-	ioctl(fd, BLKFLSBUF, 0);
+	ioctl(sbd.device_fd, BLKFLSBUF, 0);
+	/* Keep what lgfs2_dev_open() set up */
 	memset(&sbd, 0, sizeof(struct gfs2_sbd));
+	sbd.device_fd = dev.device_fd;
+	sbd.dev_ops = dev.dev_ops;
+	sbd.dev_priv = dev.dev_priv;
+	sbd.dinfo = dev.dinfo;
 	sbd.sd_bsize = GFS2_DEFAULT_BSIZE;
-	sbd.device_fd = fd;
 	bh = bread(&sbd, 0x10);
 	sbd.jsize = GFS2_DEFAULT_JSIZE;
 	sbd.rgsize = GFS2_DEFAULT_RGSIZE;
@@ -917,14 +923,15 @@ static void read_superblock(int fd)
 		sbd.gfs1 = FALSE;
 	if (!sbd.sd_bsize)
 		sbd.sd_bsize = GFS2_DEFAULT_BSIZE;
-	if (lgfs2_get_dev_info(fd, &sbd.dinfo)) {
-		perror(device);
-		exit(-1);
-	}
 	if(compute_constants(&sbd)) {
 		fprintf(stderr, "Failed to compute constants.\n");
 		exit(-1);
 	}
+	if (direct_io && lgfs2_set_direct_io(&sbd, 1) != 0)
+		fprintf(stderr, "Unable to use direct I/O, continuing without it: %s\n",
+		        strerror(errno));
+	/* Buffers and inodes are allocated with calloc() if this fails */
+	lgfs2_slab_init(&sbd);
 	if (sbd.gfs1 || (be32_to_cpu(mh->mh_magic) == GFS2_MAGIC &&
 	                 be32_to_cpu(mh->mh_type) == GFS2_METATYPE_SB))
 		block = 0x10 * (GFS2_DEFAULT_BSIZE / sbd.sd_bsize);
@@ -1155,7 +1162,7 @@ static uint64_t find_metablockoftype_slow(uint64_t startblk, int metatype, int p
 	int found = 0;
 	struct gfs2_buffer_head *lbh;
 
-	last_fs_block = lseek(sbd.device_fd, 0, SEEK_END) / sbd.sd_bsize;
+	last_fs_block = lgfs2_dev_size(&sbd) / sbd.sd_bsize;
 	for (blk = startblk + 1; blk < last_fs_block; blk++) {
 		lbh = bread(&sbd, blk);
 		/* Can't use get_block_type here (returns false "none") */
@@ -1471,7 +1478,7 @@ static void hex_edit(int *exitch)
 					ch += (estring[i+1] - 'A' + 0x0a);
 				bh->b_data[offset + hexoffset] = ch;
 			}
-			if (pwrite(sbd.device_fd, bh->b_data, sbd.sd_bsize, dev_offset) !=
+			if (lgfs2_dev_pwrite(&sbd, bh->b_data, sbd.sd_bsize, dev_offset) !=
 			    sbd.sd_bsize) {
 				fprintf(stderr, "write error: %s from %s:%d: "
 					"offset %lld (0x%llx)\n",
@@ -1481,7 +1488,7 @@ static void hex_edit(int *exitch)
 					(unsigned long long)dev_offset);
 				exit(-1);
 			}
-			fsync(sbd.device_fd);
+			lgfs2_dev_sync(&sbd);
 		}
 	}
 }
@@ -1710,7 +1717,7 @@ static void find_change_block_alloc(int *newval)
 	}
 	gfs2_rgrp_free(&sbd, &sbd.rgtree);
 	if (newval)
-		fsync(sbd.device_fd);
+		lgfs2_dev_sync(&sbd);
 	exit(0);
 }
 
@@ -1766,7 +1773,7 @@ static void process_field(const char *field, const char *nstr)
 	}
 
 	brelse(rbh);
-	fsync(sbd.device_fd);
+	lgfs2_dev_sync(&sbd);
 	exit(0);
 }
 
@@ -2067,6 +2074,7 @@ static void usage(void)
 	fprintf(stderr,"-V   prints version number.\n");
 	fprintf(stderr,"-c 1 selects alternate color scheme 1\n");
 	fprintf(stderr,"-d   prints details (for printing journals)\n");
+	fprintf(stderr,"-direct uses direct I/O, bypassing the page cache.\n");
 	fprintf(stderr,"-p   prints GFS2 structures or blocks to stdout.\n");
 	fprintf(stderr,"     sb - prints the superblock.\n");
 	fprintf(stderr,"     size - prints the filesystem size.\n");
@@ -2192,24 +2200,17 @@ static int count_dinode_blks(struct rgrp_tree *rgd, int bitmap,
 
 static int count_dinode_bits(struct gfs2_buffer_head *rbh)
 {
-	uint64_t blk;
 	struct gfs2_meta_header *mh = (struct gfs2_meta_header *)rbh->b_data;
-	char *byte;
-	int bit;
-	int dinodes = 0;
+	uint32_t count[4];
+	unsigned off;
 
 	if (be32_to_cpu(mh->mh_type) == GFS2_METATYPE_RG)
-		blk = sizeof(struct gfs2_rgrp);
+		off = sizeof(struct gfs2_rgrp);
 	else
-		blk = sizeof(struct gfs2_meta_header);
+		off = sizeof(struct gfs2_meta_header);
 
-	for (; blk < sbd.sd_bsize; blk++) {
-		byte = rbh->b_data + (blk / GFS2_NBBY);
-		bit = (blk % GFS2_NBBY) * GFS2_BIT_SIZE;
-		if (((*byte >> bit) & GFS2_BIT_MASK) == GFS2_BLKST_DINODE)
-			dinodes++;
-	}
-	return dinodes;
+	lgfs2_bm_count((unsigned char *)rbh->b_data + off, sbd.sd_bsize - off, count);
+	return count[GFS2_BLKST_DINODE];
 }
 
 static void rg_repair(void)
@@ -2314,6 +2315,8 @@ static void parameterpass1(int argc, char *argv[], int i)
 	else if (!strcasecmp(argv[i], "-d") ||
 		 !strcasecmp(argv[i], "-details"))
 		details = 1;
+	else if (!strcasecmp(argv[i], "-direct"))
+		direct_io = 1;
 	else if (!strcasecmp(argv[i], "savemeta"))
 		termlines = 0;
 	else if (!strcasecmp(argv[i], "savemetaslow"))
@@ -2537,8 +2540,10 @@ static void process_parameters(int argc, char *argv[], int pass)
 #ifndef UNITTESTS
 int main(int argc, char *argv[])
 {
-	int i, j, fd;
+	int i, j, error;
 
+	if (lgfs2_iostats_init() != 0)
+		fprintf(stderr, "Unable to enable I/O statistics: %s\n", strerror(errno));
 	indirect = malloc(sizeof(struct iinfo));
 	if (!indirect)
 		die("Out of memory.");
@@ -2572,15 +2577,18 @@ int main(int argc, char *argv[])
 	if (dmode == INIT_MODE)
 		dmode = HEX_MODE;
 
-	fd = open(device, O_RDWR);
-	if (fd < 0)
+	error = lgfs2_dev_open(&sbd, device, O_RDWR);
+	/* Read-only backends can still be displayed and saved */
+	if (error != 0 && errno == EROFS)
+		error = lgfs2_dev_open(&sbd, device, O_RDONLY);
+	if (error != 0)
 		die("can't open %s: %s\n", device, strerror(errno));
-	max_block = lseek(fd, 0, SEEK_END) / sbd.sd_bsize;
+	max_block = lgfs2_dev_size(&sbd) / sbd.sd_bsize;
 
-	read_superblock(fd);
+	read_superblock();
 	if (read_rindex())
 		exit(-1);
-	max_block = lseek(fd, 0, SEEK_END) / sbd.sd_bsize;
+	max_block = lgfs2_dev_size(&sbd) / sbd.sd_bsize;
 	if (sbd.gfs1)
 		edit_row[GFS2_MODE]++;
 	else if (read_master_dir() != 0)
@@ -2609,7 +2617,7 @@ int main(int argc, char *argv[])
 			i++;
 		}
 	}
-	close(fd);
+	lgfs2_dev_close(&sbd);
 	if (indirect)
 		free(indirect);
 	gfs2_rgrp_free(&sbd, &sbd.rgtree);
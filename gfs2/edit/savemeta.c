@@ -29,31 +29,12 @@
 #define DFT_SAVE_FILE "/tmp/gfsmeta.XXXXXX"
 #define MAX_JOURNALS_SAVED 256
 
-/* Header for the savemeta output file */
-struct savemeta_header {
-#define SAVEMETA_MAGIC (0x01171970)
-	__be32 sh_magic;
-#define SAVEMETA_FORMAT (1)
-	__be32 sh_format; /* In case we want to change the layout */
-	__be64 sh_time; /* When savemeta was run */
-	__be64 sh_fs_bytes; /* Size of the fs */
-	uint8_t __reserved[104];
-};
-
 struct savemeta {
 	time_t sm_time;
 	unsigned sm_format;
 	size_t sm_fs_bytes;
 };
 
-struct saved_metablock {
-	__be64 blk;
-	__be16 siglen; /* significant data length */
-/* This needs to be packed because old versions of gfs2_edit read and write the
-   individual fields separately, so the hole after siglen must be eradicated
-   before the struct reflects what's on disk. */
-} __attribute__((__packed__));
-
 struct metafd {
 	int fd;
 	gzFile gzfd;
@@ -573,11 +554,12 @@ struct block_range {
 	unsigned *blktype;
 	unsigned *blklen;
 	char *buf;
+	int pending;
 };
 
 static int block_range_prepare(struct block_range *br)
 {
-	br->buf = calloc(br->len, sbd.sd_bsize + sizeof(*br->blktype) + sizeof(*br->blklen));
+	br->buf = lgfs2_dev_buf(&sbd, br->len * (sbd.sd_bsize + sizeof(*br->blktype) + sizeof(*br->blklen)));
 	if (br->buf == NULL) {
 		perror("Failed to allocate block range buffer");
 		return 1;
@@ -668,7 +650,7 @@ static int check_read_range(int fd, struct block_range *br, uint64_t owner)
 		return 1;
 
 	size = br->len * sbd.sd_bsize;
-	if (pread(sbd.device_fd, br->buf, size, sbd.sd_bsize * br->start) != size) {
+	if (lgfs2_dev_pread(&sbd, br->buf, size, sbd.sd_bsize * br->start) != size) {
 		fprintf(stderr, "Failed to read block range 0x%"PRIx64" (%u blocks): %s\n",
 		        br->start, br->len, strerror(errno));
 		free(br->buf);
@@ -807,7 +789,7 @@ static int save_leaf_chain(struct metafd *mfd, struct gfs2_sbd *sdp, char *buf)
 		if (gfs2_check_range(sdp, blk) != 0)
 			return 0;
 
-		r = pread(sdp->device_fd, buf, sdp->sd_bsize, sdp->sd_bsize * blk);
+		r = lgfs2_dev_pread(sdp, buf, sdp->sd_bsize, sdp->sd_bsize * blk);
 		if (r != sdp->sd_bsize) {
 			fprintf(stderr, "Failed to read leaf block %"PRIx64": %s\n",
 			        blk, strerror(errno));
@@ -989,6 +971,81 @@ static void save_allocated_range(struct metafd *mfd, struct block_range *br)
 	free(br->buf);
 }
 
+/* Limits on the dinode block ranges being read ahead by save_allocated() */
+#define SAVE_AIO_DEPTH (16)
+#define SAVE_AIO_BYTES (16 << 20)
+static struct lgfs2_aio *save_aio = NULL;
+
+static void save_allocated_reap(size_t *inflight)
+{
+	struct lgfs2_aio_done done;
+	struct block_range *br;
+
+	if (lgfs2_aio_reap(save_aio, &done, 1) != 1)
+		return;
+	br = done.ad_priv;
+	br->pending = 0;
+	*inflight -= br->len * sbd.sd_bsize;
+	if (done.ad_error) {
+		fprintf(stderr, "Failed to read block range 0x%"PRIx64" (%u blocks): %s\n",
+		        br->start, br->len, strerror(done.ad_error));
+		free(br->buf);
+		br->buf = NULL;
+		return;
+	}
+	block_range_setinfo(br, 0);
+}
+
+/**
+ * Save the dinode block ranges in q, in order, while the ranges following
+ * the one being saved are read in the background. The ranges are freed.
+ */
+static void save_allocated_queue(struct metafd *mfd, struct block_range_queue *q)
+{
+	struct block_range *next = q->tail;
+	size_t inflight = 0;
+
+	while (save_aio == NULL && q->tail != NULL) {
+		struct block_range *br = block_range_queue_pop(q);
+
+		save_allocated_range(mfd, br);
+		block_range_free(&br);
+	}
+	while (q->tail != NULL) {
+		struct block_range *br;
+
+		while (next != NULL && lgfs2_aio_space(save_aio) > 0 &&
+		       (inflight == 0 || inflight + next->len * sbd.sd_bsize <= SAVE_AIO_BYTES)) {
+			br = next;
+			next = next->next;
+			if (block_range_prepare(br) != 0 || block_range_check(br) != 0)
+				continue;
+			if (lgfs2_aio_read(save_aio, br->buf, br->start, br->len, br) != 0) {
+				free(br->buf);
+				br->buf = NULL;
+				continue;
+			}
+			br->pending = 1;
+			inflight += br->len * sbd.sd_bsize;
+		}
+		lgfs2_aio_submit(save_aio);
+
+		br = block_range_queue_pop(q);
+		while (br->pending)
+			save_allocated_reap(&inflight);
+		if (br->buf != NULL) {
+			save_range(mfd, br);
+			for (unsigned i = 0; i < br->len; i++) {
+				char *buf = br->buf + (i * sbd.sd_bsize);
+
+				if (br->blktype[i] == GFS2_METATYPE_DI)
+					save_inode_data(mfd, buf, br->start + i);
+			}
+		}
+		block_range_free(&br);
+	}
+}
+
 static void save_allocated(struct rgrp_tree *rgd, struct metafd *mfd)
 {
 	uint64_t blk = 0;
@@ -996,26 +1053,29 @@ static void save_allocated(struct rgrp_tree *rgd, struct metafd *mfd)
 	uint64_t *ibuf = malloc(sbd.sd_bsize * GFS2_NBBY * sizeof(uint64_t));
 
 	for (i = 0; i < rgd->rt_length; i++) {
-		struct block_range br = {0};
+		struct block_range_queue q = {NULL};
+		struct block_range *br = NULL;
 
+		block_range_queue_init(&q);
 		m = lgfs2_bm_scan(rgd, i, ibuf, GFS2_BLKST_DINODE);
 
 		for (j = 0; j < m; j++) {
 			blk = ibuf[j];
-			if (br.start == 0) {
-				br.start = blk;
-				br.len = 1;
-			} else if (blk == br.start + br.len) {
-				br.len++;
+			if (br != NULL && blk == br->start + br->len) {
+				br->len++;
 			} else {
-				save_allocated_range(mfd, &br);
-				br.start = blk;
-				br.len = 1;
+				br = calloc(1, sizeof(*br));
+				if (br == NULL) {
+					perror("Failed to save allocated blocks");
+					exit(1);
+				}
+				br->start = blk;
+				br->len = 1;
+				block_range_queue_insert(&q, br);
 			}
 			report_progress(blk, 0);
 		}
-		if (br.start != 0)
-			save_allocated_range(mfd, &br);
+		save_allocated_queue(mfd, &q);
 
 		if (!sbd.gfs1)
 			continue;
@@ -1044,11 +1104,11 @@ static char *rgrp_read(struct gfs2_sbd *sdp, uint64_t addr, unsigned blocks)
 	if (blocks == 0 || gfs2_check_range(sdp, addr))
 		return NULL;
 
-	buf = calloc(1, len);
+	buf = lgfs2_dev_buf(sdp, len);
 	if (buf == NULL)
 		return NULL;
 
-	if (pread(sdp->device_fd, buf, len, off) != len) {
+	if (lgfs2_dev_pread(sdp, buf, len, off) != len) {
 		free(buf);
 		return NULL;
 	}
@@ -1186,6 +1246,8 @@ void savemeta(char *out_fn, int saveoption, int gziplevel)
 			}
 		}
 	}
+	/* Falls back to reading the dinode ranges one by one if this fails */
+	save_aio = lgfs2_aio_init(&sbd, SAVE_AIO_DEPTH, 0);
 	/* Walk through the resource groups saving everything within */
 	for (n = osi_first(&sbd.rgtree); n; n = osi_next(n)) {
 		struct rgrp_tree *rgd;
@@ -1204,7 +1266,8 @@ void savemeta(char *out_fn, int saveoption, int gziplevel)
 		printf("(uncompressed).\n");
 	}
 	savemetaclose(&mfd);
-	close(sbd.device_fd);
+	lgfs2_aio_free(&save_aio);
+	lgfs2_dev_close(&sbd);
 	destroy_per_node_lookup();
 	free(indirect);
 	gfs2_rgrp_free(&sbd, &sbd.rgtree);
@@ -1262,7 +1325,7 @@ static int restore_super(struct metafd *mfd, void *buf, int printonly)
 	if (ret == 1)
 		sbd.gfs1 = 1;
 	sbd.sd_bsize = sbd.sd_bsize;
-	if ((!printonly) && lgfs2_sb_write(&sbd, sbd.device_fd)) {
+	if ((!printonly) && lgfs2_sb_write(&sbd)) {
 		fprintf(stderr, "Failed to write superblock\n");
 		return -1;
 	}
@@ -25,12 +25,13 @@
 static int find_remove_dup(struct gfs2_inode *ip, uint64_t block,
 			   const char *btype, int *removed_last_meta)
 {
+	struct gfs2_sbd *sdp = ip->i_sbd;
 	struct duptree *dt;
 	struct inode_with_dups *id;
 	int deleted_a_meta_ref = 0;
 	int meta_refs_left = 0;
 
-	dt = dupfind(block);
+	dt = dupfind(sdp, block);
 	if (!dt)
 		return 0;
 
@@ -45,7 +46,7 @@ static int find_remove_dup(struct gfs2_inode *ip, uint64_t block,
 	if (dt->refs == 0) {
 		log_info( _("This was the last reference: it's no longer a "
 			    "duplicate.\n"));
-		dup_delete(dt); /* not duplicate now */
+		dup_delete(sdp, dt); /* not duplicate now */
 		if (deleted_a_meta_ref) {
 			log_debug("Removed the last reference as metadata.\n");
 			*removed_last_meta = 1;
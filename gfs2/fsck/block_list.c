@@ -54,3 +54,249 @@ void gfs2_special_set(struct special_blocks *blocklist, uint64_t block)
 		return;
 	gfs2_special_add(blocklist, block);
 }
+
+/*
+ * A compressed block map keeps the 2-bit state of each block in chunks of
+ * BMAP_CHUNK_BLOCKS blocks, each of which is held in the smallest of three
+ * forms: a single state when every block in the chunk has it, which is what
+ * the free space of a file system and most of its large files look like, an
+ * array of runs of blocks in the same state, or a flat map like the one the
+ * uncompressed block map uses. A run is stored as the offset of its first
+ * block in the chunk shifted left by 2, with the state in the low bits, and
+ * lasts until the next run starts.
+ *
+ * Setting a block in a chunk which isn't flat makes it flat again, so chunks
+ * are only compressed by bmap_compact() once pass1 has finished with them.
+ */
+
+#define BMAP_CHUNK_BYTES (BMAP_CHUNK_BLOCKS / 4)
+#define BMAP_MAX_RUNS (BMAP_CHUNK_BYTES / sizeof(uint16_t) / 4)
+
+static unsigned char state_byte(unsigned state)
+{
+	return state * 0x55;
+}
+
+int bmap_compressed_alloc(struct gfs2_bmap *bmap, uint64_t size)
+{
+	bmap->size = size;
+	bmap->mapsize = 0;
+	bmap->nchunks = (size >> BMAP_CHUNK_SHIFT) + 1;
+	bmap->chunks = calloc(bmap->nchunks, sizeof(*bmap->chunks));
+	return bmap->chunks == NULL ? -1 : 0;
+}
+
+void bmap_compressed_free(struct gfs2_bmap *bmap)
+{
+	for (uint64_t i = 0; i < bmap->nchunks; i++)
+		free(bmap->chunks[i].bc_data);
+	free(bmap->chunks);
+	bmap->chunks = NULL;
+	bmap->nchunks = 0;
+}
+
+/* The memory used by a compressed block map */
+uint64_t bmap_compressed_mem(struct gfs2_bmap *bmap)
+{
+	uint64_t mem = bmap->nchunks * sizeof(*bmap->chunks);
+
+	for (uint64_t i = 0; i < bmap->nchunks; i++) {
+		struct bmap_chunk *bc = &bmap->chunks[i];
+
+		if (bc->bc_data != NULL)
+			mem += bc->bc_runs ? bc->bc_runs * sizeof(uint16_t) : BMAP_CHUNK_BYTES;
+	}
+	return mem;
+}
+
+/* Returns the index of the run holding block offset off */
+static unsigned chunk_run(struct bmap_chunk *bc, unsigned off)
+{
+	const uint16_t *runs = (uint16_t *)bc->bc_data;
+	unsigned lo = 0, hi = bc->bc_runs;
+
+	while (hi - lo > 1) {
+		unsigned mid = lo + (hi - lo) / 2;
+
+		if ((unsigned)(runs[mid] >> 2) <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+int bmap_compressed_type(struct gfs2_bmap *bmap, uint64_t block)
+{
+	struct bmap_chunk *bc = &bmap->chunks[block >> BMAP_CHUNK_SHIFT];
+	unsigned off = block & (BMAP_CHUNK_BLOCKS - 1);
+
+	if (bc->bc_data == NULL)
+		return bc->bc_state;
+	if (bc->bc_runs == 0)
+		return (bc->bc_data[off / 4] >> ((off % 4) * 2)) & 3;
+	return ((uint16_t *)bc->bc_data)[chunk_run(bc, off)] & 3;
+}
+
+/* Set the states of count blocks from block offset off in a flat map */
+static void flat_fill(unsigned char *map, unsigned off, unsigned count, unsigned state)
+{
+	while (count > 0 && off % 4 != 0) {
+		map[off / 4] &= ~(3 << ((off % 4) * 2));
+		map[off / 4] |= state << ((off % 4) * 2);
+		off++;
+		count--;
+	}
+	memset(map + off / 4, state_byte(state), count / 4);
+	off += count & ~3U;
+	for (count %= 4; count > 0; count--, off++) {
+		map[off / 4] &= ~(3 << ((off % 4) * 2));
+		map[off / 4] |= state << ((off % 4) * 2);
+	}
+}
+
+/* Write the flat form of blocks off to off + count * 4 of a run chunk to out */
+static void runs_read(struct bmap_chunk *bc, unsigned off, unsigned char *out, unsigned count)
+{
+	const uint16_t *runs = (uint16_t *)bc->bc_data;
+	unsigned end = off + count * 4;
+
+	for (unsigned r = chunk_run(bc, off); r < bc->bc_runs && (unsigned)(runs[r] >> 2) < end; r++) {
+		unsigned start = runs[r] >> 2;
+		unsigned stop = r + 1 < bc->bc_runs ? runs[r + 1] >> 2 : BMAP_CHUNK_BLOCKS;
+
+		if (start < off)
+			start = off;
+		if (stop > end)
+			stop = end;
+		flat_fill(out, start - off, stop - start, runs[r] & 3);
+	}
+}
+
+static int chunk_flatten(struct bmap_chunk *bc)
+{
+	unsigned char *map = malloc(BMAP_CHUNK_BYTES);
+
+	if (map == NULL)
+		return -1;
+	if (bc->bc_data == NULL)
+		memset(map, state_byte(bc->bc_state), BMAP_CHUNK_BYTES);
+	else
+		runs_read(bc, 0, map, BMAP_CHUNK_BYTES);
+	free(bc->bc_data);
+	bc->bc_data = map;
+	bc->bc_runs = 0;
+	return 0;
+}
+
+int bmap_compressed_set(struct gfs2_bmap *bmap, uint64_t block, int mark)
+{
+	struct bmap_chunk *bc;
+	unsigned off;
+
+	if (block > bmap->size)
+		return -1;
+	bc = &bmap->chunks[block >> BMAP_CHUNK_SHIFT];
+	off = block & (BMAP_CHUNK_BLOCKS - 1);
+	if (bc->bc_data == NULL || bc->bc_runs != 0) {
+		if (bmap_compressed_type(bmap, block) == (mark & 3))
+			return 0;
+		if (chunk_flatten(bc) != 0)
+			return -1;
+	}
+	bc->bc_data[off / 4] &= ~(3 << ((off % 4) * 2));
+	bc->bc_data[off / 4] |= (mark & 3) << ((off % 4) * 2);
+	return 0;
+}
+
+/* Store a flat chunk in the smallest form which holds it */
+static void chunk_compact(struct bmap_chunk *bc)
+{
+	uint16_t runs[BMAP_MAX_RUNS];
+	unsigned nruns = 1;
+	unsigned state = bc->bc_data[0] & 3;
+	uint16_t *copy = NULL;
+
+	runs[0] = state;
+	for (unsigned i = 0; i < BMAP_CHUNK_BYTES; i++) {
+		unsigned char byte = bc->bc_data[i];
+
+		if (byte == state_byte(state))
+			continue;
+		for (unsigned j = 0; j < 4; j++) {
+			unsigned s = (byte >> (j * 2)) & 3;
+
+			if (s == state)
+				continue;
+			if (nruns == BMAP_MAX_RUNS)
+				return;
+			state = s;
+			runs[nruns++] = ((i * 4 + j) << 2) | s;
+		}
+	}
+	if (nruns > 1) {
+		copy = malloc(nruns * sizeof(uint16_t));
+		if (copy == NULL)
+			return;
+		memcpy(copy, runs, nruns * sizeof(uint16_t));
+	}
+	free(bc->bc_data);
+	bc->bc_data = (unsigned char *)copy;
+	bc->bc_runs = nruns > 1 ? nruns : 0;
+	bc->bc_state = state;
+}
+
+/**
+ * bmap_compact - Compress the chunks of a block map which pass1 has finished
+ * The chunks which end in the range of blocks from start to end inclusive are
+ * compressed, so that going through the file system in order compresses
+ * each chunk once, after the last of its blocks has been seen. The last
+ * chunk ends with the last block of the map.
+ */
+void bmap_compact(struct gfs2_bmap *bmap, uint64_t start, uint64_t end)
+{
+	uint64_t first = start >> BMAP_CHUNK_SHIFT;
+	uint64_t last = (end + 1) >> BMAP_CHUNK_SHIFT;
+
+	if (bmap->chunks == NULL)
+		return;
+	if (end >= bmap->size || last > bmap->nchunks)
+		last = bmap->nchunks;
+	for (uint64_t i = first; i < last; i++) {
+		struct bmap_chunk *bc = &bmap->chunks[i];
+
+		if (bc->bc_data != NULL && bc->bc_runs == 0)
+			chunk_compact(bc);
+	}
+}
+
+/* Copy count bytes of the flat form of a compressed block map, starting at
+   byte, to out */
+void bmap_compressed_read(struct gfs2_bmap *bmap, uint64_t byte, unsigned char *out,
+                          unsigned count)
+{
+	while (count > 0) {
+		uint64_t c = byte / BMAP_CHUNK_BYTES;
+		unsigned off = byte % BMAP_CHUNK_BYTES;
+		unsigned len = BMAP_CHUNK_BYTES - off;
+		struct bmap_chunk *bc;
+
+		if (len > count)
+			len = count;
+		if (c >= bmap->nchunks) {
+			memset(out, 0, len);
+			goto next;
+		}
+		bc = &bmap->chunks[c];
+		if (bc->bc_data == NULL)
+			memset(out, state_byte(bc->bc_state), len);
+		else if (bc->bc_runs == 0)
+			memcpy(out, bc->bc_data + off, len);
+		else
+			runs_read(bc, off * 4, out, len);
+next:
+		out += len;
+		byte += len;
+		count -= len;
+	}
+}
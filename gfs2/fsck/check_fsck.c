@@ -1,4 +1,11 @@
+#include <stdlib.h>
+#include <stdint.h>
 #include <check.h>
+#include "libgfs2.h"
+#include "fsck.h"
+#include "inode_hash.h"
+#include "util.h"
+#include <sys/mman.h>
 
 START_TEST(test_fsck_stub)
 {
@@ -6,11 +13,143 @@ START_TEST(test_fsck_stub)
 }
 END_TEST
 
+START_TEST(test_blktab)
+{
+	struct blktab bt = BLKTAB_INIT(struct inode_info);
+	const uint64_t n = 20000;
+	struct inode_info *ii, *prev;
+	uint64_t count, last;
+	int added;
+
+	ck_assert(blktab_next(&bt, 0) == NULL);
+	/* Ascending inserts, as pass1 makes them, then the odd ones backwards */
+	for (uint64_t i = 2; i <= n; i += 2) {
+		ii = blktab_insert(&bt, i, &added);
+		ck_assert(ii != NULL && added);
+		ii->num.in_addr = i;
+	}
+	for (uint64_t i = n; i > 0; i -= 2) {
+		ii = blktab_insert(&bt, i - 1, &added);
+		ck_assert(ii != NULL && added);
+		ii->num.in_addr = i - 1;
+	}
+	ck_assert(bt.bt_count == n);
+	prev = blktab_find(&bt, 1000);
+	ck_assert(prev != NULL && prev->num.in_addr == 1000);
+	ck_assert(blktab_insert(&bt, 1000, &added) == prev && !added);
+	ck_assert(blktab_find(&bt, n + 1) == NULL);
+
+	/* Records don't move when others are deleted */
+	for (uint64_t i = 1; i <= n; i += 3)
+		if (i != 1000)
+			blktab_delete(&bt, i);
+	ck_assert(blktab_find(&bt, 1000) == prev);
+	ck_assert(blktab_find(&bt, 1) == NULL);
+
+	/* Iteration is in address order */
+	count = last = 0;
+	for (ii = blktab_next(&bt, 0); ii; ii = blktab_next(&bt, ii->num.in_addr)) {
+		ck_assert(ii->num.in_addr > last);
+		ck_assert(ii->num.in_addr % 3 != 1 || ii->num.in_addr == 1000);
+		last = ii->num.in_addr;
+		count++;
+	}
+	ck_assert(count == bt.bt_count);
+	ck_assert(last == n);
+	blktab_free(&bt);
+	ck_assert(bt.bt_count == 0 && blktab_find(&bt, 1000) == NULL);
+}
+END_TEST
+
+START_TEST(test_bmap_spill)
+{
+	struct gfs2_bmap bm = {0};
+	const uint64_t size = 1 << 20;
+
+	ck_assert(bmap_alloc(&bm, size, ".", MADV_RANDOM) == 0);
+	ck_assert(bm.mapped);
+	ck_assert(bm.map[0] == 0 && bm.map[size - 1] == 0);
+	bm.map[0] = bm.map[size - 1] = 0xff;
+	ck_assert(bm.map[size - 1] == 0xff);
+	bmap_free(&bm);
+	ck_assert(bm.map == NULL && bm.mapsize == 0 && !bm.mapped);
+
+	ck_assert(bmap_alloc(&bm, size, NULL, MADV_RANDOM) == 0);
+	ck_assert(!bm.mapped && bm.map[size - 1] == 0);
+	bmap_free(&bm);
+
+	ck_assert(bmap_alloc(&bm, size, "./nonexistent", MADV_RANDOM) == -1);
+}
+END_TEST
+
+START_TEST(test_bmap_compressed)
+{
+	const uint64_t size = 5 * BMAP_CHUNK_BLOCKS + 123;
+	struct gfs2_bmap bm = {0};
+	unsigned char *ref = calloc(size + 1, 1);
+	unsigned char flat[BMAP_CHUNK_BLOCKS / 2 + 1];
+	uint64_t mem;
+
+	ck_assert(ref != NULL);
+	ck_assert(bmap_compressed_alloc(&bm, size) == 0);
+	ck_assert(block_type(&bm, size) == GFS2_BLKST_FREE);
+	ck_assert(bmap_compressed_set(&bm, size + 1, GFS2_BLKST_USED) == -1);
+
+	/* A chunk in use, a few runs, scattered blocks and free space */
+	for (uint64_t b = 0; b < BMAP_CHUNK_BLOCKS; b++)
+		ref[b] = GFS2_BLKST_USED;
+	for (uint64_t b = BMAP_CHUNK_BLOCKS + 10; b < 2 * BMAP_CHUNK_BLOCKS; b += 1000)
+		for (uint64_t i = 0; i < 300; i++)
+			ref[b + i] = (b / 1000) % 3 + 1;
+	srandom(7);
+	for (int i = 0; i < 5000; i++)
+		ref[2 * BMAP_CHUNK_BLOCKS + random() % BMAP_CHUNK_BLOCKS] = random() % 4;
+	ref[size] = GFS2_BLKST_DINODE;
+	for (uint64_t b = 0; b <= size; b++)
+		ck_assert(bmap_compressed_set(&bm, b, ref[b]) == 0);
+	mem = bmap_compressed_mem(&bm);
+	bmap_compact(&bm, 0, size);
+	ck_assert(bmap_compressed_mem(&bm) < mem / 2);
+	ck_assert(bm.chunks[0].bc_data == NULL);
+	ck_assert(bm.chunks[1].bc_runs > 1);
+	ck_assert(bm.chunks[2].bc_data != NULL && bm.chunks[2].bc_runs == 0);
+	ck_assert(bm.chunks[3].bc_data == NULL);
+
+	/* Lookups and reads agree with the blocks as they were set */
+	for (uint64_t b = 0; b <= size; b++)
+		ck_assert(block_type(&bm, b) == ref[b]);
+	for (uint64_t b = 0; b < size; b += BMAP_CHUNK_BLOCKS / 3) {
+		unsigned n = sizeof(flat);
+
+		bmap_compressed_read(&bm, b / 4, flat, n);
+		for (unsigned i = 0; i < n * 4 && b / 4 * 4 + i <= size; i++)
+			ck_assert(((flat[i / 4] >> (i % 4 * 2)) & 3) == ref[b / 4 * 4 + i]);
+	}
+
+	/* Changing a compressed chunk */
+	ck_assert(bmap_compressed_set(&bm, 7, GFS2_BLKST_USED) == 0);
+	ck_assert(bm.chunks[0].bc_data == NULL);
+	ck_assert(bmap_compressed_set(&bm, 7, GFS2_BLKST_DINODE) == 0);
+	ck_assert(block_type(&bm, 7) == GFS2_BLKST_DINODE);
+	ck_assert(block_type(&bm, 8) == GFS2_BLKST_USED);
+	ck_assert(bmap_compressed_set(&bm, BMAP_CHUNK_BLOCKS + 11, GFS2_BLKST_FREE) == 0);
+	ck_assert(block_type(&bm, BMAP_CHUNK_BLOCKS + 10) == ref[BMAP_CHUNK_BLOCKS + 10]);
+	ck_assert(block_type(&bm, BMAP_CHUNK_BLOCKS + 11) == GFS2_BLKST_FREE);
+
+	bmap_free(&bm);
+	ck_assert(bm.chunks == NULL);
+	free(ref);
+}
+END_TEST
+
 static Suite *suite_fsck(void)
 {
 	Suite *s = suite_create("main.c");
 	TCase *tc_fsck = tcase_create("fsck.gfs2");
 	tcase_add_test(tc_fsck, test_fsck_stub);
+	tcase_add_test(tc_fsck, test_blktab);
+	tcase_add_test(tc_fsck, test_bmap_spill);
+	tcase_add_test(tc_fsck, test_bmap_compressed);
 	suite_add_tcase(s, tc_fsck);
 	return s;
 }
@@ -24,7 +24,6 @@ static unsigned int sd_replayed_jblocks = 0;
 static unsigned int sd_found_metablocks = 0;
 static unsigned int sd_replayed_metablocks = 0;
 static unsigned int sd_found_revokes = 0;
-static osi_list_t sd_revoke_list;
 static unsigned int sd_replay_tail;
 
 struct gfs2_revoke_replay {
@@ -35,7 +34,7 @@ struct gfs2_revoke_replay {
 
 int gfs2_revoke_add(struct gfs2_sbd *sdp, uint64_t blkno, unsigned int where)
 {
-	osi_list_t *tmp, *head = &sd_revoke_list;
+	osi_list_t *tmp, *head = &sdp->sd_revoke_list;
 	struct gfs2_revoke_replay *rr;
 	int found = 0;
 
@@ -69,7 +68,7 @@ int gfs2_revoke_check(struct gfs2_sbd *sdp, uint64_t blkno, unsigned int where)
 	int wrap, a, b;
 	int found = 0;
 
-	osi_list_foreach(tmp, &sd_revoke_list) {
+	osi_list_foreach(tmp, &sdp->sd_revoke_list) {
 		rr = osi_list_entry(tmp, struct gfs2_revoke_replay, rr_list);
 		if (rr->rr_blkno == blkno) {
 			found = 1;
@@ -88,7 +87,7 @@ int gfs2_revoke_check(struct gfs2_sbd *sdp, uint64_t blkno, unsigned int where)
 
 void gfs2_revoke_clean(struct gfs2_sbd *sdp)
 {
-	osi_list_t *head = &sd_revoke_list;
+	osi_list_t *head = &sdp->sd_revoke_list;
 	struct gfs2_revoke_replay *rr;
 
 	while (!osi_list_empty(head)) {
@@ -109,14 +108,18 @@ static void refresh_rgrp(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
 		if (rgd->rt_addr + i != blkno)
 			continue;
 
+		if (lgfs2_rgrp_pin(rgd) != 0)
+			break;
 		memcpy(rgd->bits[i].bi_data, bh->b_data, sdp->sd_bsize);
 		rgd->bits[i].bi_modified = 1;
+		lgfs2_rgrp_extents_free(rgd);
 		if (i == 0) { /* this is the rgrp itself */
 			if (sdp->gfs1)
 				lgfs2_gfs_rgrp_in(rgd, rgd->bits[0].bi_data);
 			else
 				lgfs2_rgrp_in(rgd, rgd->bits[0].bi_data);
 		}
+		lgfs2_rgrp_unpin(rgd);
 		break;
 	}
 }
@@ -496,7 +499,7 @@ static int gfs2_recover_journal(struct gfs2_inode *ip, int j, int preen,
 	*was_clean = 0;
 	log_info( _("jid=%u: Looking at journal...\n"), j);
 
-	osi_list_init(&sd_revoke_list);
+	osi_list_init(&sdp->sd_revoke_list);
 	error = lgfs2_find_jhead(ip, &head);
 	if (!error) {
 		error = check_journal_seq_no(ip, 0);
@@ -731,7 +734,8 @@ int replay_journals(struct gfs2_sbd *sdp, int preen, int force_check,
 		}
 	}
 	/* Sync the buffers to disk so we get a fresh start. */
-	fsync(sdp->device_fd);
+	lgfs2_bcache_flush(sdp);
+	lgfs2_dev_sync(sdp);
 	return error;
 }
 
@@ -27,15 +27,27 @@
 
 #define BAD_POINTER_TOLERANCE 10 /* How many bad pointers is too many? */
 
+/* A compressed block map is split into chunks of this many blocks */
+#define BMAP_CHUNK_SHIFT (14)
+#define BMAP_CHUNK_BLOCKS (1 << BMAP_CHUNK_SHIFT)
+
+struct bmap_chunk {
+	unsigned char *bc_data; /* NULL if every block in the chunk is in bc_state */
+	uint16_t bc_runs;       /* Runs in bc_data, or 0 if it is a flat map */
+	uint8_t bc_state;
+};
+
 struct gfs2_bmap {
 	uint64_t size;
 	uint64_t mapsize;
 	unsigned char *map;
+	struct bmap_chunk *chunks; /* Used instead of map if it is compressed */
+	uint64_t nchunks;
+	unsigned mapped:1; /* map is a mapping of a scratch file */
 };
 
 struct inode_info
 {
-	struct osi_node node;
 	struct lgfs2_inum num;
 	uint32_t   di_nlink;    /* the number of links the inode
 				 * thinks it has */
@@ -44,7 +56,6 @@ struct inode_info
 
 struct dir_info
 {
-	struct osi_node node;
 	struct lgfs2_inum dinode;
 	uint64_t treewalk_parent;
 	struct lgfs2_inum dotdot_parent;
@@ -53,6 +64,46 @@ struct dir_info
 	uint8_t  checked:1;
 };
 
+/*
+ * A table of fixed size records keyed by block address, see inode_hash.c.
+ * Records don't move, so pointers to them stay valid until they are deleted.
+ */
+struct blktab_leaf;
+struct blktab {
+	size_t bt_recsize;
+	struct blktab_leaf **bt_leaves; /* Sorted index of the records */
+	uint64_t *bt_first;     /* The first address in each leaf */
+	size_t bt_nleaves;
+	size_t bt_maxleaves;
+	char **bt_chunks;       /* Records are allocated from these in bulk */
+	size_t bt_nchunks;
+	size_t bt_chunk_used;   /* Records handed out from the last chunk */
+	void *bt_free;          /* Deleted records, linked through their first word */
+	uint64_t bt_count;
+};
+
+#define BLKTAB_INIT(type) { .bt_recsize = sizeof(type) }
+
+/*
+ * The state which the passes build up and share. It belongs to the file
+ * system being checked rather than the process, so it is reached through
+ * sdp->sd_private instead of globals.
+ */
+struct fsck_cx {
+	struct osi_root dup_blocks;
+	struct blktab dirtree;
+	struct blktab inodetree;
+	struct gfs2_bmap *bl;       /* Block types found by pass1 */
+	struct gfs2_bmap nlink1map; /* map of dinodes with nlink == 1 */
+	struct gfs2_bmap clink1map; /* map of dinodes w/counted links == 1 */
+	struct lgfs2_rgpool *pool;  /* Threads for per-rgrp work, see -j */
+};
+
+static inline struct fsck_cx *fsck_cx(struct gfs2_sbd *sdp)
+{
+	return sdp->sd_private;
+}
+
 struct dir_status {
 	uint8_t dotdir:1;
 	uint8_t dotdotdir:1;
@@ -127,16 +178,31 @@ extern int pass5(struct gfs2_sbd *sdp, struct gfs2_bmap *bl);
 extern int rindex_repair(struct gfs2_sbd *sdp, int trust_lvl, int *ok);
 extern int fsck_query(const char *format, ...)
 	__attribute__((format(printf,1,2)));
-extern struct dir_info *dirtree_find(uint64_t block);
-extern void dup_delete(struct duptree *dt);
-extern void dirtree_delete(struct dir_info *b);
+extern struct dir_info *dirtree_find(struct gfs2_sbd *sdp, uint64_t block);
+extern void dup_delete(struct gfs2_sbd *sdp, struct duptree *dt);
+extern void dirtree_delete(struct gfs2_sbd *sdp, struct dir_info *b);
+extern struct dir_info *dirtree_first(struct gfs2_sbd *sdp);
+extern struct dir_info *dirtree_next(struct gfs2_sbd *sdp, struct dir_info *b);
 
 /* FIXME: Hack to get this going for pass2 - this should be pulled out
  * of pass1 and put somewhere else... */
-struct dir_info *dirtree_insert(struct lgfs2_inum inum);
+struct dir_info *dirtree_insert(struct gfs2_sbd *sdp, struct lgfs2_inum inum);
+
+#define FSCK_DEFAULT_CACHE_MB (64)
+#define FSCK_DEFAULT_RA_DEPTH (32)
+#define FSCK_MAX_RA_DEPTH (1024)
+#define FSCK_MAP_MB_AUTO ((unsigned long)-1)
 
 struct gfs2_options {
 	char *device;
+	unsigned long cache_mb; /* Block cache size, 0 to disable */
+	unsigned long bitmap_mb; /* Memory for resource group bitmaps, 0 for no limit */
+	unsigned jobs; /* Threads to use for per-rgrp work */
+	unsigned ra_depth; /* Reads to keep in progress while reading inodes ahead */
+	unsigned long map_mb; /* Memory for the block maps before they spill to disk */
+	const char *scratch_dir; /* Where the block maps spill to */
+	unsigned int direct:1; /* Bypass the page cache */
+	unsigned int compress_map:1; /* Compress the block map */
 	unsigned int yes:1;
 	unsigned int no:1;
 	unsigned int query:1;
@@ -151,9 +217,6 @@ extern int skip_this_pass, fsck_abort;
 extern int errors_found, errors_corrected;
 extern uint64_t last_data_block;
 extern uint64_t first_data_block;
-extern struct osi_root dup_blocks;
-extern struct osi_root dirtree;
-extern struct osi_root inodetree;
 extern int dups_found; /* How many duplicate references have we found? */
 extern int dups_found_first; /* How many duplicates have we found the original
 				reference for? */
@@ -199,6 +262,14 @@ struct special_blocks {
 extern struct special_blocks *blockfind(struct special_blocks *blist, uint64_t num);
 extern void gfs2_special_set(struct special_blocks *blocklist, uint64_t block);
 extern void gfs2_special_free(struct special_blocks *blist);
+extern int bmap_compressed_alloc(struct gfs2_bmap *bmap, uint64_t size);
+extern void bmap_compressed_free(struct gfs2_bmap *bmap);
+extern uint64_t bmap_compressed_mem(struct gfs2_bmap *bmap);
+extern int bmap_compressed_type(struct gfs2_bmap *bmap, uint64_t block);
+extern int bmap_compressed_set(struct gfs2_bmap *bmap, uint64_t block, int mark);
+extern void bmap_compressed_read(struct gfs2_bmap *bmap, uint64_t byte, unsigned char *out,
+                                 unsigned count);
+extern void bmap_compact(struct gfs2_bmap *bmap, uint64_t start, uint64_t end);
 extern int sb_fixed;
 
 #endif /* _FSCK_H */
@@ -60,43 +60,22 @@ static int block_mounters(struct gfs2_sbd *sdp, int block_em)
 		}
 	}
 
-	if (lgfs2_sb_write(sdp, sdp->device_fd)) {
+	lgfs2_bcache_invalidate(sdp, LGFS2_SB_ADDR(sdp), 1);
+	if (lgfs2_sb_write(sdp)) {
 		stack;
 		return -1;
 	}
 	return 0;
 }
 
-static void gfs2_dup_free(void)
+static void gfs2_dup_free(struct gfs2_sbd *sdp)
 {
 	struct osi_node *n;
 	struct duptree *dt;
 
-	while ((n = osi_first(&dup_blocks))) {
+	while ((n = osi_first(&fsck_cx(sdp)->dup_blocks))) {
 		dt = (struct duptree *)n;
-		dup_delete(dt);
-	}
-}
-
-static void gfs2_dirtree_free(void)
-{
-	struct osi_node *n;
-	struct dir_info *dt;
-
-	while ((n = osi_first(&dirtree))) {
-		dt = (struct dir_info *)n;
-		dirtree_delete(dt);
-	}
-}
-
-static void gfs2_inodetree_free(void)
-{
-	struct osi_node *n;
-	struct inode_info *dt;
-
-	while ((n = osi_first(&inodetree))) {
-		dt = (struct inode_info *)n;
-		inodetree_delete(dt);
+		dup_delete(sdp, dt);
 	}
 }
 
@@ -114,9 +93,9 @@ static void empty_super_block(struct gfs2_sbd *sdp)
 	log_info( _("Freeing buffers.\n"));
 	gfs2_rgrp_free(sdp, &sdp->rgtree);
 
-	gfs2_inodetree_free();
-	gfs2_dirtree_free();
-	gfs2_dup_free();
+	blktab_free(&fsck_cx(sdp)->inodetree);
+	blktab_free(&fsck_cx(sdp)->dirtree);
+	gfs2_dup_free(sdp);
 }
 
 
@@ -133,7 +112,7 @@ static int set_block_ranges(struct gfs2_sbd *sdp)
 {
 	struct osi_node *n, *next = NULL;
 	struct rgrp_tree *rgd;
-	char buf[sdp->sd_bsize];
+	char *buf;
 	uint64_t rmax = 0;
 	uint64_t rmin = 0;
 	int error;
@@ -162,15 +141,13 @@ static int set_block_ranges(struct gfs2_sbd *sdp)
 	last_data_block = rmax;
 	first_data_block = rmin;
 
-	if (fsck_lseek(sdp->device_fd, (last_fs_block * sdp->sd_bsize))){
-		log_crit( _("Can't seek to last block in file system: %llu"
-			 " (0x%llx)\n"), (unsigned long long)last_fs_block,
-			 (unsigned long long)last_fs_block);
+	buf = lgfs2_dev_buf(sdp, sdp->sd_bsize);
+	if (buf == NULL) {
+		log_crit(_("Failed to allocate a block buffer: %s\n"), strerror(errno));
 		goto fail;
 	}
-
-	memset(buf, 0, sdp->sd_bsize);
-	error = read(sdp->device_fd, buf, sdp->sd_bsize);
+	error = lgfs2_dev_pread(sdp, buf, sdp->sd_bsize, last_fs_block * sdp->sd_bsize);
+	free(buf);
 	if (error != sdp->sd_bsize){
 		log_crit( _("Can't read last block in file system (error %u), "
 			 "last_fs_block: %llu (0x%llx)\n"), error,
@@ -188,24 +165,30 @@ static int set_block_ranges(struct gfs2_sbd *sdp)
 	return -1;
 }
 
+/* What count_rgrp_blocks() found in a resource group's bitmaps */
+struct rgrp_counts {
+	uint32_t rc_free;     /* Free blocks, not counting unlinked ones */
+	uint32_t rc_unlinked;
+	uint32_t rc_usedmeta;
+	uint32_t rc_useddi;
+};
+
 /**
- * check_rgrp_integrity - verify a rgrp free block count against the bitmap
+ * count_rgrp_blocks - count the blocks in each state in a rgrp's bitmaps
+ *
+ * This only reads the bitmaps and, for gfs1, the dinode blocks, so it can run
+ * in any thread.
  */
-static void check_rgrp_integrity(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
-				 int *fixit, int *this_rg_fixed,
-				 int *this_rg_bad, int *this_rg_cleaned)
+static void count_rgrp_blocks(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
+			      struct rgrp_counts *rc)
 {
-	uint32_t rg_free, rg_reclaimed, rg_unlinked, rg_usedmeta, rg_useddi;
-	int rgb, x, y, off, bytes_to_check, total_bytes_to_check, asked = 0;
+	int rgb, x, y, off, bytes_to_check, total_bytes_to_check;
 	unsigned int state;
 	uint64_t diblock;
 	struct gfs2_buffer_head *bh;
 
-	rg_free = rg_reclaimed = rg_unlinked = rg_usedmeta = rg_useddi = 0;
 	total_bytes_to_check = rgd->rt_bitbytes;
 
-	*this_rg_fixed = *this_rg_bad = *this_rg_cleaned = 0;
-
 	diblock = rgd->rt_data0;
 	for (rgb = 0; rgb < rgd->rt_length; rgb++){
 		/* Count up the free blocks in the bitmap */
@@ -217,44 +200,85 @@ static void check_rgrp_integrity(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
 			bytes_to_check = sdp->sd_bsize - off;
 		total_bytes_to_check -= bytes_to_check;
 		for (x = 0; x < bytes_to_check; x++) {
-			unsigned char *byte;
+			unsigned char byte;
 
-			byte = (unsigned char *)&rgd->bits[rgb].bi_data[off + x];
-			if (*byte == 0x55) {
+			byte = rgd->bits[rgb].bi_data[off + x];
+			if (byte == 0x55) {
 				diblock += GFS2_NBBY;
 				continue;
 			}
-			if (*byte == 0x00) {
+			if (byte == 0x00) {
 				diblock += GFS2_NBBY;
-				rg_free += GFS2_NBBY;
+				rc->rc_free += GFS2_NBBY;
 				continue;
 			}
-			for (y = 0; y < GFS2_NBBY; y++) {
-				state = (*byte >>
+			for (y = 0; y < GFS2_NBBY; y++, diblock++) {
+				state = (byte >>
 					 (GFS2_BIT_SIZE * y)) & GFS2_BIT_MASK;
-				if (state == GFS2_BLKST_USED) {
-					diblock++;
+				if (state == GFS2_BLKST_USED)
 					continue;
-				}
 				if (state == GFS2_BLKST_DINODE) {
 					if (sdp->gfs1) {
 						bh = bread(sdp, diblock);
 						if (!gfs2_check_meta(bh->b_data,
 							GFS2_METATYPE_DI))
-							rg_useddi++;
+							rc->rc_useddi++;
 						else
-							rg_usedmeta++;
+							rc->rc_usedmeta++;
 						brelse(bh);
 					}
-					diblock++;
 					continue;
 				}
-				if (state == GFS2_BLKST_FREE) {
-					diblock++;
-					rg_free++;
+				if (state == GFS2_BLKST_FREE)
+					rc->rc_free++;
+				else /* GFS2_BLKST_UNLINKED */
+					rc->rc_unlinked++;
+			}
+		}
+	}
+}
+
+/**
+ * reclaim_unlinked - offer to free the unlinked blocks in a rgrp
+ * @unlinked: set to the number of unlinked blocks left alone
+ *
+ * Returns: the number of blocks reclaimed
+ */
+static uint32_t reclaim_unlinked(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
+				 int *fixit, uint32_t *unlinked)
+{
+	uint32_t rg_reclaimed = 0;
+	int rgb, x, y, off, bytes_to_check, total_bytes_to_check, asked = 0;
+	unsigned int state;
+	uint64_t diblock;
+	struct gfs2_buffer_head *bh;
+
+	*unlinked = 0;
+	total_bytes_to_check = rgd->rt_bitbytes;
+
+	diblock = rgd->rt_data0;
+	for (rgb = 0; rgb < rgd->rt_length; rgb++){
+		off = (rgb) ? sizeof(struct gfs2_meta_header) :
+			sizeof(struct gfs2_rgrp);
+		if (total_bytes_to_check <= sdp->sd_bsize - off)
+			bytes_to_check = total_bytes_to_check;
+		else
+			bytes_to_check = sdp->sd_bsize - off;
+		total_bytes_to_check -= bytes_to_check;
+		for (x = 0; x < bytes_to_check; x++) {
+			unsigned char *byte;
+
+			byte = (unsigned char *)&rgd->bits[rgb].bi_data[off + x];
+			/* Skip bytes with no unlinked (binary 10) entries */
+			if (!((*byte >> 1) & ~*byte & 0x55)) {
+				diblock += GFS2_NBBY;
+				continue;
+			}
+			for (y = 0; y < GFS2_NBBY; y++, diblock++) {
+				state = (*byte >>
+					 (GFS2_BIT_SIZE * y)) & GFS2_BIT_MASK;
+				if (state != GFS2_BLKST_UNLINKED)
 					continue;
-				}
-				/* GFS2_BLKST_UNLINKED */
 				if (sdp->gfs1)
 					log_info(_("Free metadata block 0x%llx"
 						   " found.\n"),
@@ -276,15 +300,13 @@ static void check_rgrp_integrity(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
 						*fixit = 1;
 				}
 				if (!(*fixit)) {
-					rg_unlinked++;
-					diblock++;
+					(*unlinked)++;
 					continue;
 				}
 				*byte &= ~(GFS2_BIT_MASK <<
 					   (GFS2_BIT_SIZE * y));
 				rgd->bits[rgb].bi_modified = 1;
 				rg_reclaimed++;
-				rg_free++;
 				rgd->rt_free++;
 				if (sdp->gfs1 && rgd->rt_freemeta)
 					rgd->rt_freemeta--;
@@ -307,21 +329,43 @@ static void check_rgrp_integrity(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
 					fsck_inode_put(&ip);
 				}
 				brelse(bh);
-				diblock++;
 			}
 		}
 	}
-	/* The unlinked blocks we reclaim shouldn't be considered errors,
-	   since we're just reclaiming them as a courtesy. If we already
-	   got permission to reclaim them, we adjust the rgrp counts
-	   accordingly. That way, only "real" rgrp count inconsistencies
-	   will be reported. */
+	return rg_reclaimed;
+}
+
+/**
+ * check_rgrp_integrity - verify a rgrp free block count against the bitmap
+ * @rc: the blocks counted by count_rgrp_blocks()
+ */
+static void check_rgrp_integrity(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
+				 const struct rgrp_counts *rc, int *fixit,
+				 int *this_rg_fixed, int *this_rg_bad,
+				 int *this_rg_cleaned)
+{
+	uint32_t rg_free, rg_reclaimed = 0, rg_unlinked = 0, rg_usedmeta, rg_useddi;
+
+	rg_free = rc->rc_free;
+	rg_usedmeta = rc->rc_usedmeta;
+	rg_useddi = rc->rc_useddi;
+
+	*this_rg_fixed = *this_rg_bad = *this_rg_cleaned = 0;
+
+	if (rc->rc_unlinked) {
+		if (lgfs2_rgrp_pin(rgd) == 0) {
+			rg_reclaimed = reclaim_unlinked(sdp, rgd, fixit, &rg_unlinked);
+			lgfs2_rgrp_unpin(rgd);
+		} else {
+			/* The unlinked blocks can't be reclaimed */
+			log_err(_("Unable to read the bitmaps of resource group %"PRIu64": %s\n"),
+			        rgd->rt_addr, strerror(errno));
+			*this_rg_bad = 1;
+		}
+	}
+	rg_free += rg_reclaimed;
 	if (rg_reclaimed && *fixit) {
-		if (sdp->gfs1)
-			lgfs2_gfs_rgrp_out(rgd, rgd->bits[0].bi_data);
-		else
-			lgfs2_rgrp_out(rgd, rgd->bits[0].bi_data);
-		rgd->bits[0].bi_modified = 1;
+		lgfs2_rgrp_hdr_update(sdp, rgd);
 		*this_rg_cleaned = 1;
 		log_info(_("The rgrp at %"PRIu64" (0x%"PRIx64") was cleaned of %d "
 			    "free metadata blocks.\n"),
@@ -335,11 +379,7 @@ static void check_rgrp_integrity(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
 		        rgd->rt_addr, rgd->rt_addr, rgd->rt_free, rg_free);
 		if (query( _("Fix the rgrp free blocks count? (y/n)"))) {
 			rgd->rt_free = rg_free;
-			if (sdp->gfs1)
-				lgfs2_gfs_rgrp_out(rgd, rgd->bits[0].bi_data);
-			else
-				lgfs2_rgrp_out(rgd, rgd->bits[0].bi_data);
-			rgd->bits[0].bi_modified = 1;
+			lgfs2_rgrp_hdr_update(sdp, rgd);
 			*this_rg_fixed = 1;
 			log_err( _("The rgrp was fixed.\n"));
 		} else
@@ -356,8 +396,7 @@ static void check_rgrp_integrity(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
 		        rgd->rt_addr, rgd->rt_addr, rgd->rt_freemeta, rg_unlinked);
 		if (query( _("Fix the rgrp free meta blocks count? (y/n)"))) {
 			rgd->rt_freemeta = rg_unlinked;
-			lgfs2_gfs_rgrp_out(rgd, rgd->bits[0].bi_data);
-			rgd->bits[0].bi_modified = 1;
+			lgfs2_rgrp_hdr_update(sdp, rgd);
 			*this_rg_fixed = 1;
 			log_err( _("The rgrp was fixed.\n"));
 		} else
@@ -371,8 +410,7 @@ static void check_rgrp_integrity(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
 		        rgd->rt_addr, rgd->rt_addr, rgd->rt_useddi, rg_useddi);
 		if (query( _("Fix the rgrp used dinode block count? (y/n)"))) {
 			rgd->rt_useddi = rg_useddi;
-			lgfs2_gfs_rgrp_out(rgd, rgd->bits[0].bi_data);
-			rgd->bits[0].bi_modified = 1;
+			lgfs2_rgrp_hdr_update(sdp, rgd);
 			*this_rg_fixed = 1;
 			log_err( _("The rgrp was fixed.\n"));
 		} else
@@ -386,8 +424,7 @@ static void check_rgrp_integrity(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
 		        rgd->rt_addr, rgd->rt_addr, rgd->rt_usedmeta, rg_usedmeta);
 		if (query( _("Fix the rgrp used meta blocks count? (y/n)"))) {
 			rgd->rt_usedmeta = rg_usedmeta;
-			lgfs2_gfs_rgrp_out(rgd, rgd->bits[0].bi_data);
-			rgd->bits[0].bi_modified = 1;
+			lgfs2_rgrp_hdr_update(sdp, rgd);
 			*this_rg_fixed = 1;
 			log_err( _("The rgrp was fixed.\n"));
 		} else
@@ -403,44 +440,71 @@ static void check_rgrp_integrity(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
 	}*/
 }
 
+/* The tallies kept by check_rgrps_integrity() */
+struct rgrps_check {
+	int rgs_good, rgs_bad, rgs_fixed, rgs_cleaned;
+	int reclaim_unlinked;
+};
+
+static int count_rgrp_job(struct gfs2_sbd *sdp, lgfs2_rgrp_t rgd, void *result, void *arg)
+{
+	if (lgfs2_rgrp_pin(rgd) != 0)
+		return -1;
+	count_rgrp_blocks(sdp, rgd, result);
+	lgfs2_rgrp_unpin(rgd);
+	return 0;
+}
+
+static int check_rgrp_job(struct gfs2_sbd *sdp, lgfs2_rgrp_t rgd, void *result, void *arg)
+{
+	struct rgrps_check *rc = arg;
+	int was_bad = 0, was_fixed = 0, was_cleaned = 0;
+
+	check_rgrp_integrity(sdp, rgd, result, &rc->reclaim_unlinked,
+			     &was_fixed, &was_bad, &was_cleaned);
+	if (was_fixed)
+		rc->rgs_fixed++;
+	if (was_cleaned)
+		rc->rgs_cleaned++;
+	else if (was_bad)
+		rc->rgs_bad++;
+	else
+		rc->rgs_good++;
+	return 0;
+}
+
 /**
  * check_rgrps_integrity - verify rgrp consistency
  * Note: We consider an rgrp "cleaned" if the unlinked meta blocks are
  *       cleaned, so not quite "bad" and not quite "good" but rewritten anyway.
  *
+ * The bitmaps are counted by the threads of the pool, and the counts are
+ * checked, and any questions asked, in rgrp order in this thread.
+ *
  * Returns: 0 on success, 1 if errors were detected
  */
 static void check_rgrps_integrity(struct gfs2_sbd *sdp)
 {
-	struct osi_node *n, *next = NULL;
-	int rgs_good = 0, rgs_bad = 0, rgs_fixed = 0, rgs_cleaned = 0;
-	int was_bad = 0, was_fixed = 0, was_cleaned = 0;
-	struct rgrp_tree *rgd;
-	int reclaim_unlinked = 0;
+	struct rgrps_check rc = {0};
+	struct lgfs2_rgjob job = {
+		.rj_work = count_rgrp_job,
+		.rj_done = check_rgrp_job,
+		.rj_arg = &rc,
+		.rj_result_size = sizeof(struct rgrp_counts),
+		.rj_cancel = &fsck_abort,
+	};
 
 	log_info( _("Checking the integrity of all resource groups.\n"));
-	for (n = osi_first(&sdp->rgtree); n; n = next) {
-		next = osi_next(n);
-		rgd = (struct rgrp_tree *)n;
-		if (fsck_abort)
-			return;
-		check_rgrp_integrity(sdp, rgd, &reclaim_unlinked,
-				     &was_fixed, &was_bad, &was_cleaned);
-		if (was_fixed)
-			rgs_fixed++;
-		if (was_cleaned)
-			rgs_cleaned++;
-		else if (was_bad)
-			rgs_bad++;
-		else
-			rgs_good++;
-	}
-	if (rgs_bad || rgs_cleaned) {
+	if (lgfs2_rgpool_run(fsck_cx(sdp)->pool, sdp, &job) != 0 && !fsck_abort)
+		log_err(_("Failed to check the resource groups: %s\n"), strerror(errno));
+	if (fsck_abort)
+		return;
+	if (rc.rgs_bad || rc.rgs_cleaned) {
 		log_err( _("RGs: Consistent: %d   Cleaned: %d   Inconsistent: "
 			   "%d   Fixed: %d   Total: %d\n"),
-			 rgs_good, rgs_cleaned, rgs_bad, rgs_fixed,
-			 rgs_good + rgs_bad + rgs_cleaned);
-		if (rgs_cleaned && blks_2free)
+			 rc.rgs_good, rc.rgs_cleaned, rc.rgs_bad, rc.rgs_fixed,
+			 rc.rgs_good + rc.rgs_bad + rc.rgs_cleaned);
+		if (rc.rgs_cleaned && blks_2free)
 			log_err(_("%lld blocks may need to be freed in pass 5 "
 				  "due to the cleaned resource groups.\n"),
 				blks_2free);
@@ -635,29 +699,6 @@ static void lookup_per_node(struct gfs2_sbd *sdp, int allow_rebuild)
 	}
 }
 
-#define RA_WINDOW 32
-
-static unsigned gfs2_rgrp_reada(struct gfs2_sbd *sdp, unsigned cur_window,
-				struct osi_node *n)
-{
-	struct rgrp_tree *rgd;
-	unsigned i;
-	off_t start, len;
-
-	for (i = 0; i < RA_WINDOW; i++, n = osi_next(n)) {
-		if (n == NULL)
-			return i;
-		if (i < cur_window)
-			continue;
-		rgd = (struct rgrp_tree *)n;
-		start = rgd->rt_addr * sdp->sd_bsize;
-		len = rgd->rt_length * sdp->sd_bsize;
-		posix_fadvise(sdp->device_fd, start, len, POSIX_FADV_WILLNEED);
-	}
-
-	return i;
-}
-
 /**
  * read_rgrps - attach rgrps to the super block
  * @sdp: incore superblock data
@@ -675,22 +716,21 @@ static int read_rgrps(struct gfs2_sbd *sdp, uint64_t expected)
 	uint64_t errblock = 0;
 	uint64_t rmax = 0;
 	struct osi_node *n, *next = NULL;
-	unsigned ra_window = 0;
-
-	/* Turn off generic readhead */
-	posix_fadvise(sdp->device_fd, 0, 0, POSIX_FADV_RANDOM);
 
+	lgfs2_ra_start(sdp);
+	for (n = osi_first(&sdp->rgtree); n; n = osi_next(n)) {
+		rgd = (struct rgrp_tree *)n;
+		lgfs2_ra_hint(sdp, rgd->rt_addr, rgd->rt_length);
+	}
 	for (n = osi_first(&sdp->rgtree); n; n = next) {
 		next = osi_next(n);
 		rgd = (struct rgrp_tree *)n;
-		/* Readahead resource group headers */
-		if (ra_window < RA_WINDOW/2)
-			ra_window = gfs2_rgrp_reada(sdp, ra_window, n);
 		/* Read resource group header */
 		errblock = gfs2_rgrp_read(sdp, rgd);
-		if (errblock)
+		if (errblock) {
+			lgfs2_ra_stop(sdp);
 			return errblock;
-		ra_window--;
+		}
 		count++;
 		if (rgd->rt_data0 + rgd->rt_data - 1 > rmax)
 			rmax = rgd->rt_data0 + rgd->rt_data - 1;
@@ -700,11 +740,11 @@ static int read_rgrps(struct gfs2_sbd *sdp, uint64_t expected)
 	if (count != expected)
 		goto fail;
 
-	posix_fadvise(sdp->device_fd, 0, 0, POSIX_FADV_NORMAL);
+	lgfs2_ra_stop(sdp);
 	return 0;
 
  fail:
-	posix_fadvise(sdp->device_fd, 0, 0, POSIX_FADV_NORMAL);
+	lgfs2_ra_stop(sdp);
 	gfs2_rgrp_free(sdp, &sdp->rgtree);
 	return -1;
 }
@@ -1330,7 +1370,7 @@ static int sb_repair(struct gfs2_sbd *sdp)
 			return -1;
 		}
 		sdp->sd_fs_format = GFS2_FORMAT_FS;
-		lgfs2_sb_write(sdp, sdp->device_fd);
+		lgfs2_sb_write(sdp);
 		inode_put(&sdp->md.rooti);
 		inode_put(&sdp->master_dir);
 		sb_fixed = 1;
@@ -1555,6 +1595,15 @@ static int init_rindex(struct gfs2_sbd *sdp)
 	return 0;
 }
 
+/* Writes are deferred by the block cache so don't lose them on exit() */
+static void bcache_exit(int status, void *arg)
+{
+	struct gfs2_sbd *sdp = arg;
+
+	if (sdp->bcache != NULL && lgfs2_bcache_free(sdp) != 0)
+		log_err(_("Failed to write back cached blocks\n"));
+}
+
 /**
  * initialize - initialize superblock pointer
  *
@@ -1572,6 +1621,15 @@ int initialize(struct gfs2_sbd *sdp, int force_check, int preen,
 	else
 		open_flag = O_RDWR | O_EXCL;
 
+	/* Image files read through a backend can't be mounted */
+	if (lgfs2_dev_type(opts.device) != LGFS2_DEV_TYPE_FD) {
+		if (lgfs2_dev_open(sdp, opts.device, open_flag) != 0) {
+			log_crit(_("Unable to open device: %s: %s\n"), opts.device,
+			         strerror(errno));
+			return FSCK_USAGE;
+		}
+		goto opened;
+	}
 	sdp->device_fd = open(opts.device, open_flag);
 	if (sdp->device_fd < 0) {
 		struct mntent *mnt;
@@ -1608,11 +1666,37 @@ int initialize(struct gfs2_sbd *sdp, int force_check, int preen,
 		return FSCK_ERROR;
 	}
 
+opened:
 	/* read in sb from disk */
 	err = fill_super_block(sdp);
 	if (err != FSCK_OK)
 		return err;
 
+	/* Switch before any rgrps are read so that their buffers are aligned */
+	if (opts.direct && lgfs2_set_direct_io(sdp, 1) != 0)
+		log_warn(_("Unable to use direct I/O (non-fatal): %s\n"), strerror(errno));
+
+	/* Nothing is written with -n so there's nothing to defer */
+	if (opts.cache_mb &&
+	    lgfs2_bcache_init(sdp, opts.cache_mb << 20, opts.no ? 0 : LGFS2_BCACHE_WRITEBACK) != 0)
+		log_warn(_("Unable to set up the block cache (non-fatal): %s\n"),
+		         strerror(errno));
+	else if (opts.cache_mb)
+		on_exit(bcache_exit, sdp);
+	if (lgfs2_slab_init(sdp) != 0)
+		log_warn(_("Unable to set up the buffer and inode pools (non-fatal): %s\n"),
+		         strerror(errno));
+	if (lgfs2_ra_init(sdp) != 0)
+		log_warn(_("Unable to set up readahead (non-fatal): %s\n"), strerror(errno));
+	if (opts.bitmap_mb && lgfs2_rgcache_init(sdp, opts.bitmap_mb << 20) != 0)
+		log_warn(_("Unable to limit the memory used for bitmaps (non-fatal): %s\n"),
+		         strerror(errno));
+	fsck_cx(sdp)->pool = lgfs2_rgpool_init(opts.jobs);
+	if (fsck_cx(sdp)->pool == NULL)
+		log_warn(_("Unable to start worker threads (non-fatal): %s\n"), strerror(errno));
+	else if (opts.jobs > 1)
+		log_info(_("Using %u threads\n"), lgfs2_rgpool_threads(fsck_cx(sdp)->pool));
+
 	/* Change lock protocol to be fsck_* instead of lock_* */
 	if (!opts.no && preen_is_safe(sdp, preen, force_check)) {
 		if (block_mounters(sdp, 1)) {
@@ -1694,18 +1778,81 @@ mount_fail:
 	return FSCK_USAGE;
 }
 
+static void bcache_destroy(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_bcache_stats st;
+
+	if (sdp->bcache == NULL)
+		return;
+	lgfs2_bcache_stats(sdp, &st);
+	log_info(_("Block cache: %"PRIu64" hits, %"PRIu64" misses, %"PRIu64" evictions, "
+	           "%"PRIu64" of %"PRIu64" buffers in use\n"),
+	         st.bs_hits, st.bs_misses, st.bs_evictions, st.bs_cached, st.bs_max);
+	log_info(_("Block cache: %"PRIu64" blocks written back in %"PRIu64" writes\n"),
+	         st.bs_writebacks, st.bs_writes);
+	if (lgfs2_bcache_free(sdp) != 0)
+		log_err(_("Failed to write back cached blocks\n"));
+}
+
+static void slab_destroy(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_slab_stats bufs, inodes;
+
+	if (sdp->slab == NULL)
+		return;
+	lgfs2_slab_stats(sdp, &bufs, &inodes);
+	log_info(_("Buffer pool: %"PRIu64" allocations, %"PRIu64" peak, %"PRIu64"MB\n"),
+	         bufs.ss_allocs, bufs.ss_peak, bufs.ss_bytes >> 20);
+	log_info(_("Inode pool: %"PRIu64" allocations, %"PRIu64" peak, %"PRIu64"MB\n"),
+	         inodes.ss_allocs, inodes.ss_peak, inodes.ss_bytes >> 20);
+	lgfs2_slab_free(sdp);
+}
+
+static void ra_destroy(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_ra_stats st;
+
+	if (sdp->readahead == NULL)
+		return;
+	lgfs2_ra_stats(sdp, &st);
+	log_info(_("Readahead: %"PRIu64" blocks prefetched in %"PRIu64" requests, "
+	           "%"PRIu64" used, %"PRIu64" wasted, window %"PRIu64" blocks\n"),
+	         st.rs_issued, st.rs_extents, st.rs_useful, st.rs_wasted, st.rs_window);
+	lgfs2_ra_free(sdp);
+}
+
+static void rgcache_destroy(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_rgcache_stats st;
+
+	if (sdp->rgcache == NULL)
+		return;
+	lgfs2_rgcache_stats(sdp, &st);
+	log_info(_("Bitmaps: %"PRIu64" loads, %"PRIu64" evictions, %"PRIu64" written back, "
+	           "%"PRIu64"MB peak of %"PRIu64"MB\n"),
+	         st.rcs_loads, st.rcs_evictions, st.rcs_writebacks,
+	         st.rcs_peak >> 20, st.rcs_max >> 20);
+	if (lgfs2_rgcache_free(sdp) != 0)
+		log_err(_("Failed to write back resource group bitmaps\n"));
+}
+
 void destroy(struct gfs2_sbd *sdp)
 {
+	bcache_destroy(sdp);
 	if (!opts.no) {
 		if (block_mounters(sdp, 0)) {
 			log_warn( _("Unable to unblock other mounters - manual intervention required\n"));
 			log_warn( _("Use 'gfs2_tool sb <device> proto' to fix\n"));
 		}
 		log_info( _("Syncing the device.\n"));
-		fsync(sdp->device_fd);
+		lgfs2_dev_sync(sdp);
 	}
 	empty_super_block(sdp);
-	close(sdp->device_fd);
+	rgcache_destroy(sdp);
+	lgfs2_rgpool_free(&fsck_cx(sdp)->pool);
+	slab_destroy(sdp);
+	ra_destroy(sdp);
+	lgfs2_dev_close(sdp);
 	if (was_mounted_ro && errors_corrected) {
 		sdp->device_fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
 		if (sdp->device_fd >= 0) {
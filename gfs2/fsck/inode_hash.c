@@ -1,6 +1,7 @@
 #include "clusterautoconfig.h"
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <libintl.h>
 #include <string.h>
@@ -12,56 +13,290 @@
 #include "fsck.h"
 #define _(String) gettext(String)
 
-struct inode_info *inodetree_find(uint64_t block)
+/*
+ * The inode and directory tables hold a record for every dinode found by
+ * pass1, so there can be hundreds of millions of them. Instead of a tree of
+ * individually allocated nodes, a table allocates its records from large
+ * chunks and indexes them with a sorted array of block addresses and record
+ * pointers. The index is split into leaves, found by a binary search of the
+ * first address in each leaf, so an insert only moves the entries of one
+ * leaf. pass1 inserts in address order, which appends to the last leaf.
+ */
+
+#define BLKTAB_LEAF_SIZE (256)
+#define BLKTAB_CHUNK_RECS (16384)
+
+struct blktab_leaf {
+	unsigned bl_count;
+	uint64_t bl_addr[BLKTAB_LEAF_SIZE];
+	void *bl_rec[BLKTAB_LEAF_SIZE];
+};
+
+/* Returns the leaf which would hold block, which is the last leaf with a
+   first address no greater than block, or the first leaf. */
+static size_t blktab_leaf_idx(struct blktab *bt, uint64_t block)
 {
-	struct osi_node *node = inodetree.osi_node;
+	size_t lo = 0, hi = bt->bt_nleaves;
 
-	while (node) {
-		struct inode_info *data = (struct inode_info *)node;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
 
-		if (block < data->num.in_addr)
-			node = node->osi_left;
-		else if (block > data->num.in_addr)
-			node = node->osi_right;
+		if (bt->bt_first[mid] <= block)
+			lo = mid;
 		else
-			return data;
+			hi = mid;
 	}
-	return NULL;
+	return lo;
 }
 
-struct inode_info *inodetree_insert(struct lgfs2_inum no)
+/* Returns the index of the first entry in the leaf not less than block */
+static unsigned blktab_entry_idx(struct blktab_leaf *bl, uint64_t block)
 {
-	struct osi_node **newn = &inodetree.osi_node, *parent = NULL;
-	struct inode_info *data;
+	unsigned lo = 0, hi = bl->bl_count;
 
-	/* Figure out where to put new node */
-	while (*newn) {
-		struct inode_info *cur = (struct inode_info *)*newn;
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
 
-		parent = *newn;
-		if (no.in_addr < cur->num.in_addr)
-			newn = &((*newn)->osi_left);
-		else if (no.in_addr > cur->num.in_addr)
-			newn = &((*newn)->osi_right);
+		if (bl->bl_addr[mid] < block)
+			lo = mid + 1;
 		else
-			return cur;
+			hi = mid;
+	}
+	return lo;
+}
+
+void *blktab_find(struct blktab *bt, uint64_t block)
+{
+	struct blktab_leaf *bl;
+	unsigned i;
+
+	if (bt->bt_nleaves == 0)
+		return NULL;
+	bl = bt->bt_leaves[blktab_leaf_idx(bt, block)];
+	i = blktab_entry_idx(bl, block);
+	if (i < bl->bl_count && bl->bl_addr[i] == block)
+		return bl->bl_rec[i];
+	return NULL;
+}
+
+static void *blktab_rec_alloc(struct blktab *bt)
+{
+	void *rec = bt->bt_free;
+
+	if (rec != NULL) {
+		bt->bt_free = *(void **)rec;
+	} else {
+		if (bt->bt_nchunks == 0 || bt->bt_chunk_used == BLKTAB_CHUNK_RECS) {
+			char **chunks = realloc(bt->bt_chunks, (bt->bt_nchunks + 1) * sizeof(*chunks));
+			if (chunks == NULL)
+				return NULL;
+			bt->bt_chunks = chunks;
+			chunks[bt->bt_nchunks] = malloc(BLKTAB_CHUNK_RECS * bt->bt_recsize);
+			if (chunks[bt->bt_nchunks] == NULL)
+				return NULL;
+			bt->bt_nchunks++;
+			bt->bt_chunk_used = 0;
+		}
+		rec = bt->bt_chunks[bt->bt_nchunks - 1] + bt->bt_chunk_used * bt->bt_recsize;
+		bt->bt_chunk_used++;
 	}
+	memset(rec, 0, bt->bt_recsize);
+	return rec;
+}
+
+static void blktab_rec_put(struct blktab *bt, void *rec)
+{
+	*(void **)rec = bt->bt_free;
+	bt->bt_free = rec;
+}
+
+/* Adds an empty leaf to the index after leaf idx, or at the start if idx is
+   the number of leaves. */
+static struct blktab_leaf *blktab_leaf_add(struct blktab *bt, size_t idx)
+{
+	struct blktab_leaf *bl;
+
+	if (bt->bt_nleaves == bt->bt_maxleaves) {
+		size_t max = bt->bt_maxleaves ? bt->bt_maxleaves * 2 : 16;
+		struct blktab_leaf **leaves;
+		uint64_t *first;
+
+		leaves = realloc(bt->bt_leaves, max * sizeof(*leaves));
+		if (leaves == NULL)
+			return NULL;
+		bt->bt_leaves = leaves;
+		first = realloc(bt->bt_first, max * sizeof(*first));
+		if (first == NULL)
+			return NULL;
+		bt->bt_first = first;
+		bt->bt_maxleaves = max;
+	}
+	bl = malloc(sizeof(*bl));
+	if (bl == NULL)
+		return NULL;
+	bl->bl_count = 0;
+	memmove(bt->bt_leaves + idx + 1, bt->bt_leaves + idx,
+	        (bt->bt_nleaves - idx) * sizeof(*bt->bt_leaves));
+	memmove(bt->bt_first + idx + 1, bt->bt_first + idx,
+	        (bt->bt_nleaves - idx) * sizeof(*bt->bt_first));
+	bt->bt_leaves[idx] = bl;
+	bt->bt_nleaves++;
+	return bl;
+}
+
+/**
+ * Find the record for a block, adding a zeroed one if there isn't one.
+ * added: Set to 1 if a record was added, 0 if it was found
+ * Returns the record or NULL with errno set if one could not be allocated
+ */
+void *blktab_insert(struct blktab *bt, uint64_t block, int *added)
+{
+	struct blktab_leaf *bl = NULL;
+	size_t l = 0;
+	unsigned i = 0;
+	void *rec;
+
+	*added = 0;
+	if (bt->bt_nleaves > 0) {
+		l = blktab_leaf_idx(bt, block);
+		bl = bt->bt_leaves[l];
+		i = blktab_entry_idx(bl, block);
+		if (i < bl->bl_count && bl->bl_addr[i] == block)
+			return bl->bl_rec[i];
+	}
+	rec = blktab_rec_alloc(bt);
+	if (rec == NULL)
+		return NULL;
+	if (bl == NULL) {
+		bl = blktab_leaf_add(bt, 0);
+		if (bl == NULL)
+			goto fail;
+	} else if (bl->bl_count == BLKTAB_LEAF_SIZE) {
+		struct blktab_leaf *nl = blktab_leaf_add(bt, l + 1);
+		unsigned half = BLKTAB_LEAF_SIZE / 2;
 
-	data = calloc(1, sizeof(struct inode_info));
+		if (nl == NULL)
+			goto fail;
+		/* Appending to the last leaf starts a new one, otherwise the
+		   upper half of the full leaf moves to the new one. */
+		if (l + 2 == bt->bt_nleaves && i == BLKTAB_LEAF_SIZE)
+			half = BLKTAB_LEAF_SIZE;
+		nl->bl_count = BLKTAB_LEAF_SIZE - half;
+		memcpy(nl->bl_addr, bl->bl_addr + half, nl->bl_count * sizeof(uint64_t));
+		memcpy(nl->bl_rec, bl->bl_rec + half, nl->bl_count * sizeof(void *));
+		bl->bl_count = half;
+		bt->bt_first[l + 1] = nl->bl_count ? nl->bl_addr[0] : block;
+		if (i >= half) {
+			bl = nl;
+			i -= half;
+			l++;
+		}
+	}
+	memmove(bl->bl_addr + i + 1, bl->bl_addr + i, (bl->bl_count - i) * sizeof(uint64_t));
+	memmove(bl->bl_rec + i + 1, bl->bl_rec + i, (bl->bl_count - i) * sizeof(void *));
+	bl->bl_addr[i] = block;
+	bl->bl_rec[i] = rec;
+	bl->bl_count++;
+	if (i == 0)
+		bt->bt_first[l] = block;
+	bt->bt_count++;
+	*added = 1;
+	return rec;
+fail:
+	blktab_rec_put(bt, rec);
+	return NULL;
+}
+
+/* Remove the record for a block, which must be in the table */
+void blktab_delete(struct blktab *bt, uint64_t block)
+{
+	size_t l = blktab_leaf_idx(bt, block);
+	struct blktab_leaf *bl = bt->bt_leaves[l];
+	unsigned i = blktab_entry_idx(bl, block);
+	void *rec = bl->bl_rec[i];
+
+	bl->bl_count--;
+	memmove(bl->bl_addr + i, bl->bl_addr + i + 1, (bl->bl_count - i) * sizeof(uint64_t));
+	memmove(bl->bl_rec + i, bl->bl_rec + i + 1, (bl->bl_count - i) * sizeof(void *));
+	if (bl->bl_count == 0) {
+		free(bl);
+		bt->bt_nleaves--;
+		memmove(bt->bt_leaves + l, bt->bt_leaves + l + 1,
+		        (bt->bt_nleaves - l) * sizeof(*bt->bt_leaves));
+		memmove(bt->bt_first + l, bt->bt_first + l + 1,
+		        (bt->bt_nleaves - l) * sizeof(*bt->bt_first));
+	} else if (i == 0) {
+		bt->bt_first[l] = bl->bl_addr[0];
+	}
+	blktab_rec_put(bt, rec);
+	bt->bt_count--;
+}
+
+/* Returns the record with the lowest address greater than block. Pass 0 to
+   get the first record. */
+void *blktab_next(struct blktab *bt, uint64_t block)
+{
+	struct blktab_leaf *bl;
+	size_t l;
+	unsigned i;
+
+	if (bt->bt_nleaves == 0)
+		return NULL;
+	l = blktab_leaf_idx(bt, block);
+	bl = bt->bt_leaves[l];
+	i = blktab_entry_idx(bl, block);
+	if (i < bl->bl_count && bl->bl_addr[i] == block)
+		i++;
+	if (i < bl->bl_count)
+		return bl->bl_rec[i];
+	if (++l < bt->bt_nleaves)
+		return bt->bt_leaves[l]->bl_rec[0];
+	return NULL;
+}
+
+void blktab_free(struct blktab *bt)
+{
+	for (size_t i = 0; i < bt->bt_nleaves; i++)
+		free(bt->bt_leaves[i]);
+	for (size_t i = 0; i < bt->bt_nchunks; i++)
+		free(bt->bt_chunks[i]);
+	free(bt->bt_leaves);
+	free(bt->bt_first);
+	free(bt->bt_chunks);
+	*bt = (struct blktab){ .bt_recsize = bt->bt_recsize };
+}
+
+struct inode_info *inodetree_find(struct gfs2_sbd *sdp, uint64_t block)
+{
+	return blktab_find(&fsck_cx(sdp)->inodetree, block);
+}
+
+struct inode_info *inodetree_insert(struct gfs2_sbd *sdp, struct lgfs2_inum no)
+{
+	struct inode_info *data;
+	int added;
+
+	data = blktab_insert(&fsck_cx(sdp)->inodetree, no.in_addr, &added);
 	if (!data) {
 		log_crit( _("Unable to allocate inode_info structure\n"));
 		return NULL;
 	}
-	/* Add new node and rebalance tree. */
-	data->num = no;
-	osi_link_node(&data->node, parent, newn);
-	osi_insert_color(&data->node, &inodetree);
-
+	if (added)
+		data->num = no;
 	return data;
 }
 
-void inodetree_delete(struct inode_info *b)
+void inodetree_delete(struct gfs2_sbd *sdp, struct inode_info *b)
+{
+	blktab_delete(&fsck_cx(sdp)->inodetree, b->num.in_addr);
+}
+
+struct inode_info *inodetree_first(struct gfs2_sbd *sdp)
+{
+	return blktab_next(&fsck_cx(sdp)->inodetree, 0);
+}
+
+struct inode_info *inodetree_next(struct gfs2_sbd *sdp, struct inode_info *b)
 {
-	osi_erase(&b->node, &inodetree);
-	free(b);
+	return blktab_next(&fsck_cx(sdp)->inodetree, b->num.in_addr);
 }
@@ -2,9 +2,18 @@
 #define _INODE_HASH_H
 
 struct inode_info;
+struct blktab;
 
-extern struct inode_info *inodetree_find(uint64_t block);
-extern struct inode_info *inodetree_insert(struct lgfs2_inum no);
-extern void inodetree_delete(struct inode_info *b);
+extern void *blktab_find(struct blktab *bt, uint64_t block);
+extern void *blktab_insert(struct blktab *bt, uint64_t block, int *added);
+extern void blktab_delete(struct blktab *bt, uint64_t block);
+extern void *blktab_next(struct blktab *bt, uint64_t block);
+extern void blktab_free(struct blktab *bt);
+
+extern struct inode_info *inodetree_find(struct gfs2_sbd *sdp, uint64_t block);
+extern struct inode_info *inodetree_insert(struct gfs2_sbd *sdp, struct lgfs2_inum no);
+extern void inodetree_delete(struct gfs2_sbd *sdp, struct inode_info *b);
+extern struct inode_info *inodetree_first(struct gfs2_sbd *sdp);
+extern struct inode_info *inodetree_next(struct gfs2_sbd *sdp, struct inode_info *b);
 
 #endif /* _INODE_HASH_H */
@@ -15,8 +15,6 @@
 #include "link.h"
 #include "util.h"
 
-struct gfs2_bmap nlink1map = { 0 }; /* map of dinodes with nlink == 1 */
-struct gfs2_bmap clink1map = { 0 }; /* map of dinodes w/counted links == 1 */
 
 int link1_set(struct gfs2_bmap *bmap, uint64_t bblock, int mark)
 {
@@ -37,11 +35,12 @@ int link1_set(struct gfs2_bmap *bmap, uint64_t bblock, int mark)
 
 int set_di_nlink(struct gfs2_inode *ip)
 {
+	struct gfs2_sbd *sdp = ip->i_sbd;
 	struct inode_info *ii;
 	struct dir_info *di;
 
 	if (is_dir(ip, ip->i_sbd->gfs1)) {
-		di = dirtree_find(ip->i_num.in_addr);
+		di = dirtree_find(sdp, ip->i_num.in_addr);
 		if (di == NULL) {
 			log_err(_("Error: directory %"PRIu64" (0x%"PRIx64") is not "
 				  "in the dir_tree (set).\n"),
@@ -52,16 +51,16 @@ int set_di_nlink(struct gfs2_inode *ip)
 		return 0;
 	}
 	if (ip->i_nlink == 1) {
-		link1_set(&nlink1map, ip->i_num.in_addr, 1);
+		link1_set(&fsck_cx(sdp)->nlink1map, ip->i_num.in_addr, 1);
 		return 0;
 	}
 	/*log_debug( _("Setting link count to %u for %" PRIu64
 	  " (0x%" PRIx64 ")\n"), count, inode_no, inode_no);*/
 	/* If the list has entries, look for one that matches inode_no */
-	ii = inodetree_find(ip->i_num.in_addr);
+	ii = inodetree_find(sdp, ip->i_num.in_addr);
 	if (!ii) {
 		struct lgfs2_inum no = ip->i_num;
-		ii = inodetree_insert(no);
+		ii = inodetree_insert(sdp, no);
 	}
 	if (ii)
 		ii->di_nlink = ip->i_nlink;
@@ -78,14 +77,15 @@ int set_di_nlink(struct gfs2_inode *ip)
 		  (unsigned long long)referenced_from, counted_links,	\
 		  (unsigned long long)no_addr, why);
 
-int incr_link_count(struct lgfs2_inum no, struct gfs2_inode *ip, const char *why)
+int incr_link_count(struct gfs2_sbd *sdp, struct lgfs2_inum no, struct gfs2_inode *ip,
+		    const char *why)
 {
 	struct inode_info *ii = NULL;
 	uint64_t referenced_from = ip ? ip->i_num.in_addr : 0;
 	struct dir_info *di;
 	struct gfs2_inode *link_ip;
 
-	di = dirtree_find(no.in_addr);
+	di = dirtree_find(sdp, no.in_addr);
 	if (di) {
 		if (di->dinode.in_formal_ino != no.in_formal_ino)
 			return INCR_LINK_INO_MISMATCH;
@@ -94,7 +94,7 @@ int incr_link_count(struct lgfs2_inum no, struct gfs2_inode *ip, const char *why
 		whyincr(no.in_addr, why, referenced_from, di->counted_links);
 		return INCR_LINK_GOOD;
 	}
-	ii = inodetree_find(no.in_addr);
+	ii = inodetree_find(sdp, no.in_addr);
 	/* If the list has entries, look for one that matches inode_no */
 	if (ii) {
 		if (ii->num.in_formal_ino != no.in_formal_ino)
@@ -104,26 +104,26 @@ int incr_link_count(struct lgfs2_inum no, struct gfs2_inode *ip, const char *why
 		whyincr(no.in_addr, why, referenced_from, ii->counted_links);
 		return INCR_LINK_GOOD;
 	}
-	if (link1_type(&clink1map, no.in_addr) != 1) {
-		link1_set(&clink1map, no.in_addr, 1);
+	if (link1_type(&fsck_cx(sdp)->clink1map, no.in_addr) != 1) {
+		link1_set(&fsck_cx(sdp)->clink1map, no.in_addr, 1);
 		whyincr(no.in_addr, why, referenced_from, 1);
 		return INCR_LINK_GOOD;
 	}
 
-	link_ip = fsck_load_inode(ip->i_sbd, no.in_addr);
+	link_ip = fsck_load_inode(sdp, no.in_addr);
 	/* Check formal ino against dinode before adding to inode tree. */
 	if (no.in_formal_ino != link_ip->i_num.in_formal_ino) {
 		fsck_inode_put(&link_ip);
 		return INCR_LINK_INO_MISMATCH; /* inode mismatch */
 	}
 	/* Move it from the link1 maps to a real inode tree entry */
-	link1_set(&nlink1map, no.in_addr, 0);
-	link1_set(&clink1map, no.in_addr, 0);
+	link1_set(&fsck_cx(sdp)->nlink1map, no.in_addr, 0);
+	link1_set(&fsck_cx(sdp)->clink1map, no.in_addr, 0);
 
 	/* If no match was found, it must be a hard link. In theory, it can't
 	   be a duplicate because those were resolved in pass1b. Add a new
 	   inodetree entry and set its counted links to 2 */
-	ii = inodetree_insert(no);
+	ii = inodetree_insert(sdp, no);
 	if (!ii) {
 		log_debug( _("Ref: (0x%llx) Error incrementing link for "
 			     "(0x%llx)!\n"),
@@ -152,13 +152,13 @@ int incr_link_count(struct lgfs2_inum no, struct gfs2_inode *ip, const char *why
 		  (unsigned long long)referenced_from, counted_links,	\
 		  (unsigned long long)no_addr, why);
 
-int decr_link_count(uint64_t inode_no, uint64_t referenced_from, int gfs1,
+int decr_link_count(struct gfs2_sbd *sdp, uint64_t inode_no, uint64_t referenced_from,
 		    const char *why)
 {
 	struct inode_info *ii = NULL;
 	struct dir_info *di;
 
-	di = dirtree_find(inode_no);
+	di = dirtree_find(sdp, inode_no);
 	if (di) {
 		if (!di->counted_links) {
 			log_debug( _("Dir (0x%llx)'s link to "
@@ -172,7 +172,7 @@ int decr_link_count(uint64_t inode_no, uint64_t referenced_from, int gfs1,
 		return 0;
 	}
 
-	ii = inodetree_find(inode_no);
+	ii = inodetree_find(sdp, inode_no);
 	/* If the list has entries, look for one that matches
 	 * inode_no */
 	if (ii) {
@@ -187,8 +187,8 @@ int decr_link_count(uint64_t inode_no, uint64_t referenced_from, int gfs1,
 		whydecr(inode_no, why, referenced_from, ii->counted_links);
 		return 0;
 	}
-	if (link1_type(&clink1map, inode_no) == 1) { /* 1 -> 0 */
-		link1_set(&clink1map, inode_no, 0);
+	if (link1_type(&fsck_cx(sdp)->clink1map, inode_no) == 1) { /* 1 -> 0 */
+		link1_set(&fsck_cx(sdp)->clink1map, inode_no, 0);
 		whydecr(inode_no, why, referenced_from, 0);
 		return 0;
 	}
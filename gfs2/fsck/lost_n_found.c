@@ -30,7 +30,7 @@ static void add_dotdot(struct gfs2_inode *ip)
 
 	/* If there's a pre-existing .. directory entry, we have to
 	   back out the links. */
-	di = dirtree_find(ip->i_num.in_addr);
+	di = dirtree_find(sdp, ip->i_num.in_addr);
 	if (di && valid_block(sdp, di->dotdot_parent.in_addr)) {
 		struct gfs2_inode *dip;
 
@@ -38,7 +38,7 @@ static void add_dotdot(struct gfs2_inode *ip)
 		          ip->i_num.in_addr, di->dotdot_parent.in_addr);
 		dip = fsck_load_inode(sdp, di->dotdot_parent.in_addr);
 		if (dip->i_num.in_formal_ino == di->dotdot_parent.in_formal_ino) {
-			decr_link_count(di->dotdot_parent.in_addr, ip->i_num.in_addr, sdp->gfs1,
+			decr_link_count(sdp, di->dotdot_parent.in_addr, ip->i_num.in_addr,
 					_(".. unlinked, moving to lost+found"));
 			if (dip->i_nlink > 0) {
 			  dip->i_nlink--;
@@ -133,7 +133,7 @@ void make_sure_lf_exists(struct gfs2_inode *ip)
 		/* FIXME: i'd feel better about this if fs_mkdir returned
 		   whether it created a new directory or just found an old one,
 		   and we used that instead of the bitmap_type to run this */
-		dirtree_insert(no);
+		dirtree_insert(sdp, no);
 		/* Set the bitmap AFTER the dirtree insert so that function
 		   check_n_fix_bitmap will realize it's a dinode and adjust
 		   the rgrp counts properly. */
@@ -141,19 +141,19 @@ void make_sure_lf_exists(struct gfs2_inode *ip)
 		/* root inode links to lost+found */
 		no.in_addr = sdp->md.rooti->i_num.in_addr;
 		no.in_formal_ino = sdp->md.rooti->i_num.in_formal_ino;
-		incr_link_count(no, lf_dip, _("root"));
+		incr_link_count(sdp, no, lf_dip, _("root"));
 		/* lost+found link for '.' from itself */
 		no.in_addr = lf_dip->i_num.in_addr;
 		no.in_formal_ino = lf_dip->i_num.in_formal_ino;
-		incr_link_count(no, lf_dip, "\".\"");
+		incr_link_count(sdp, no, lf_dip, "\".\"");
 		/* lost+found link for '..' back to root */
-		incr_link_count(no, sdp->md.rooti, "\"..\"");
+		incr_link_count(sdp, no, sdp->md.rooti, "\"..\"");
 		if (sdp->gfs1)
 			lf_dip->i_di_type = GFS_FILE_DIR;
 	}
 	log_info(_("lost+found directory is dinode %"PRIu64" (0x%"PRIx64")\n"),
 	         lf_dip->i_num.in_addr, lf_dip->i_num.in_addr);
-	di = dirtree_find(lf_dip->i_num.in_addr);
+	di = dirtree_find(sdp, lf_dip->i_num.in_addr);
 	if (di) {
 		log_info( _("Marking lost+found inode connected\n"));
 		di->checked = 1;
@@ -234,11 +234,11 @@ int add_inode_to_lf(struct gfs2_inode *ip){
 	}
 
 	/* This inode is linked from lost+found */
-	incr_link_count(no, lf_dip, _("from lost+found"));
+	incr_link_count(sdp, no, lf_dip, _("from lost+found"));
 	/* If it's a directory, lost+found is back-linked to it via .. */
 	if (mode == S_IFDIR) {
 		no = lf_dip->i_num;
-		incr_link_count(no, ip, _("to lost+found"));
+		incr_link_count(sdp, no, ip, _("to lost+found"));
 	}
 	log_notice(_("Added inode #%"PRIu64" (0x%"PRIx64") to lost+found\n"),
 	           ip->i_num.in_addr, ip->i_num.in_addr);
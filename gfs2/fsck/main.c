@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <libgen.h>
 #include <string.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <ctype.h>
 #include <signal.h>
@@ -34,9 +35,6 @@ int skip_this_pass = 0, fsck_abort = 0;
 int errors_found = 0, errors_corrected = 0;
 uint64_t last_data_block;
 uint64_t first_data_block;
-struct osi_root dup_blocks;
-struct osi_root dirtree;
-struct osi_root inodetree;
 int dups_found = 0, dups_found_first = 0;
 int sb_fixed = 0;
 int print_level = MSG_NOTICE;
@@ -58,7 +56,7 @@ void print_it(const char *label, const char *fmt, const char *fmt2, ...)
 
 static void usage(char *name)
 {
-	printf("Usage: %s [-afhnpqvVy] <device> \n", basename(name));
+	printf("Usage: %s [-aDfhnpqvVy] [-b <megabytes>] [-c <megabytes>] [-j <threads>] [-m <megabytes>] [-r <reads>] [-s <directory>] [-z] <device> \n", basename(name));
 }
 
 static void version(void)
@@ -71,8 +69,10 @@ static void version(void)
 static int read_cmdline(int argc, char **argv, struct gfs2_options *gopts)
 {
 	int c;
+	char *endptr;
+	unsigned long depth;
 
-	while ((c = getopt(argc, argv, "afhnpqvyV")) != -1) {
+	while ((c = getopt(argc, argv, "ab:c:Dfhj:m:npqr:s:vyVz")) != -1) {
 		switch(c) {
 
 		case 'a':
@@ -84,6 +84,25 @@ static int read_cmdline(int argc, char **argv, struct gfs2_options *gopts)
 			preen = 1;
 			gopts->yes = 1;
 			break;
+		case 'b':
+			errno = 0;
+			gopts->bitmap_mb = strtoul(optarg, &endptr, 10);
+			if (errno || *endptr != '\0' || optarg[0] == '-') {
+				fprintf(stderr, _("Invalid bitmap memory size: %s\n"), optarg);
+				return FSCK_USAGE;
+			}
+			break;
+		case 'c':
+			errno = 0;
+			gopts->cache_mb = strtoul(optarg, &endptr, 10);
+			if (errno || *endptr != '\0' || optarg[0] == '-') {
+				fprintf(stderr, _("Invalid block cache size: %s\n"), optarg);
+				return FSCK_USAGE;
+			}
+			break;
+		case 'D':
+			gopts->direct = 1;
+			break;
 		case 'f':
 			force_check = 1;
 			break;
@@ -91,6 +110,21 @@ static int read_cmdline(int argc, char **argv, struct gfs2_options *gopts)
 			usage(argv[0]);
 			exit(FSCK_OK);
 			break;
+		case 'j':
+			if (lgfs2_parse_jobs(optarg, &gopts->jobs) != 0) {
+				fprintf(stderr, _("Invalid number of threads: %s\n"), optarg);
+				return FSCK_USAGE;
+			}
+			break;
+		case 'm':
+			errno = 0;
+			gopts->map_mb = strtoul(optarg, &endptr, 10);
+			if (errno || *endptr != '\0' || optarg[0] == '-' ||
+			    gopts->map_mb == FSCK_MAP_MB_AUTO) {
+				fprintf(stderr, _("Invalid block map memory size: %s\n"), optarg);
+				return FSCK_USAGE;
+			}
+			break;
 		case 'n':
 			if (gopts->yes || preen) {
 				fprintf(stderr, _("Options -p/-a, -y and -n may not be used together\n"));
@@ -101,6 +135,19 @@ static int read_cmdline(int argc, char **argv, struct gfs2_options *gopts)
 		case 'q':
 			decrease_verbosity();
 			break;
+		case 'r':
+			errno = 0;
+			depth = strtoul(optarg, &endptr, 10);
+			if (errno || *endptr != '\0' || optarg[0] == '-' ||
+			    depth == 0 || depth > FSCK_MAX_RA_DEPTH) {
+				fprintf(stderr, _("Invalid read-ahead depth: %s\n"), optarg);
+				return FSCK_USAGE;
+			}
+			gopts->ra_depth = depth;
+			break;
+		case 's':
+			gopts->scratch_dir = optarg;
+			break;
 		case 'v':
 			increase_verbosity();
 			break;
@@ -115,6 +162,9 @@ static int read_cmdline(int argc, char **argv, struct gfs2_options *gopts)
 			}
 			gopts->yes = 1;
 			break;
+		case 'z':
+			gopts->compress_map = 1;
+			break;
 		case ':':
 		case '?':
 			fprintf(stderr, _("Please use '-h' for help.\n"));
@@ -159,7 +209,7 @@ static void interrupt(int sig)
 		return;
 	}
 	else if (tolower(response) == 'a') {
-		fsck_abort = 1;
+		__atomic_store_n(&fsck_abort, 1, __ATOMIC_RELAXED);
 		return;
 	}
 }
@@ -260,6 +310,9 @@ static int fsck_pass(const struct fsck_pass *p, struct gfs2_sbd *sdp)
 	gettimeofday(&timer, NULL);
 
 	ret = p->f(sdp);
+	/* Each pass finishes with its changes written out */
+	if (lgfs2_bcache_flush(sdp) != 0)
+		log_err(_("Failed to write back cached blocks\n"));
 	if (ret)
 		exit(ret);
 	if (skip_this_pass || fsck_abort) {
@@ -307,6 +360,10 @@ int main(int argc, char **argv)
 {
 	struct gfs2_sbd sb;
 	struct gfs2_sbd *sdp = &sb;
+	struct fsck_cx cx = {
+		.dirtree = BLKTAB_INIT(struct dir_info),
+		.inodetree = BLKTAB_INIT(struct inode_info),
+	};
 	int j;
 	int i;
 	int error = 0;
@@ -321,10 +378,17 @@ int main(int argc, char **argv)
 	on_exit(exitlog, NULL);
 
 	memset(sdp, 0, sizeof(*sdp));
+	sdp->sd_private = &cx;
+	opts.cache_mb = FSCK_DEFAULT_CACHE_MB;
+	opts.ra_depth = FSCK_DEFAULT_RA_DEPTH;
+	opts.map_mb = FSCK_MAP_MB_AUTO;
 
 	if ((error = read_cmdline(argc, argv, &opts)))
 		exit(error);
 	setbuf(stdout, NULL);
+	/* Before any threads are started, as it blocks SIGUSR1 */
+	if (lgfs2_iostats_init() != 0)
+		log_err(_("Unable to enable I/O statistics: %s\n"), strerror(errno));
 	log_notice( _("Initializing fsck\n"));
 	if ((error = initialize(sdp, force_check, preen, &all_clean)))
 		exit(error);
@@ -361,9 +425,10 @@ int main(int argc, char **argv)
 
 	if (!opts.no && errors_corrected)
 		log_notice( _("Writing changes to disk\n"));
-	fsync(sdp->device_fd);
-	link1_destroy(&nlink1map);
-	link1_destroy(&clink1map);
+	lgfs2_bcache_flush(sdp);
+	lgfs2_dev_sync(sdp);
+	link1_destroy(&fsck_cx(sdp)->nlink1map);
+	link1_destroy(&fsck_cx(sdp)->clink1map);
 	destroy(sdp);
 	if (sb_fixed)
 		log_warn(_("Superblock was reset. Use tunegfs2 to manually "
@@ -21,7 +21,99 @@
 #include "metawalk.h"
 #include "inode_hash.h"
 
-#define COMFORTABLE_BLKS 5242880 /* 20GB in 4K blocks */
+/* The rgrp bitmap states of the pointers in the metadata block being walked,
+   for passes which set batch_bitmap. They are looked up with one call to
+   lgfs2_get_bitmaps() per metadata block instead of one lookup per pointer,
+   and dropped whenever check_n_fix_bitmap() changes the bitmap. */
+static struct {
+	uint64_t *blks;
+	int *states;
+	unsigned size;
+	unsigned count;
+	unsigned cur; /* The pointer being checked */
+} ptr_states;
+
+static void ptr_states_load(struct gfs2_sbd *sdp, const __be64 *ptr, const __be64 *end)
+{
+	unsigned n = end - ptr;
+
+	ptr_states.count = 0;
+	if (n > ptr_states.size) {
+		uint64_t *blks = realloc(ptr_states.blks, n * sizeof(*blks));
+		int *states = realloc(ptr_states.states, n * sizeof(*states));
+
+		if (blks != NULL)
+			ptr_states.blks = blks;
+		if (states != NULL)
+			ptr_states.states = states;
+		if (blks == NULL || states == NULL)
+			return; /* Fall back to looking up each block */
+		ptr_states.size = n;
+	}
+	for (unsigned i = 0; i < n; i++)
+		ptr_states.blks[i] = be64_to_cpu(ptr[i]);
+	lgfs2_get_bitmaps(sdp, ptr_states.blks, n, ptr_states.states);
+	ptr_states.count = n;
+}
+
+/* The gfs2_disk_hash() of the names of the entries in the directory block
+   being checked, computed together by lgfs2_dirent_hashes(). dent is the
+   entry passed to check_dentry, and is only set during the call. */
+static struct {
+	uint32_t *hashes;
+	unsigned size;
+	unsigned count;
+	uint64_t blk;
+	unsigned cur;
+	const struct gfs2_dirent *dent;
+} dent_hashes;
+
+static void dent_hashes_load(struct gfs2_sbd *sdp, struct gfs2_buffer_head *bh,
+                             const struct gfs2_dirent *dent)
+{
+	unsigned len = bh->b_data + sdp->sd_bsize - (char *)dent;
+	unsigned n = len / sizeof(struct gfs2_dirent) + 1;
+
+	dent_hashes.count = 0;
+	if (n > dent_hashes.size) {
+		uint32_t *hashes = realloc(dent_hashes.hashes, n * sizeof(*hashes));
+
+		if (hashes == NULL)
+			return;
+		dent_hashes.hashes = hashes;
+		dent_hashes.size = n;
+	}
+	dent_hashes.count = lgfs2_dirent_hashes((char *)dent, len, dent_hashes.hashes, n);
+	dent_hashes.blk = bh->b_blocknr;
+}
+
+/**
+ * dentry_hash - Get the hash of a directory entry's name
+ * @dent: The entry being checked by a check_dentry function
+ *
+ * Returns: gfs2_disk_hash() of the entry's name
+ */
+uint32_t dentry_hash(const struct gfs2_dirent *dent)
+{
+	if (dent == dent_hashes.dent && dent_hashes.cur < dent_hashes.count)
+		return dent_hashes.hashes[dent_hashes.cur];
+	return gfs2_disk_hash((const char *)(dent + 1), be16_to_cpu(dent->de_name_len));
+}
+
+/**
+ * ptr_bitmap_state - Get the bitmap state looked up for a block pointer
+ * @blk: The block the pointer being checked points to
+ *
+ * Returns: The rgrp bitmap state of blk, or -1 if it has not been looked up
+ *          or is not represented in the bitmap.
+ */
+int ptr_bitmap_state(uint64_t blk)
+{
+	if (ptr_states.cur < ptr_states.count &&
+	    ptr_states.blks[ptr_states.cur] == blk)
+		return ptr_states.states[ptr_states.cur];
+	return -1;
+}
 
 /* There are two bitmaps: (1) The "blockmap" that fsck uses to keep track of
    what block type has been discovered, and (2) The rgrp bitmap.  Function
@@ -47,7 +139,9 @@ int check_n_fix_bitmap(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
 		rgd = gfs2_blk2rgrpd(sdp, blk);
 		prevrgd = rgd;
 	}
-	old_state = lgfs2_get_bitmap(sdp, blk, rgd);
+	old_state = ptr_bitmap_state(blk);
+	if (old_state < 0)
+		old_state = lgfs2_get_bitmap(sdp, blk, rgd);
 	if (old_state < 0) {
 		log_err( _("Block %llu (0x%llx) is not represented in the "
 			   "system bitmap; part of an rgrp or superblock.\n"),
@@ -82,6 +176,7 @@ int check_n_fix_bitmap(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
 	   subtract to the free space.  If the type changed from dinode to 
 	   data or data to dinode, no change in free space. */
 	gfs2_set_bitmap(rgd, blk, new_state);
+	ptr_states.count = 0;
 	if (new_state == GFS2_BLKST_FREE) {
 		rgd->rt_free++;
 		rewrite_rgrp = 1;
@@ -95,18 +190,18 @@ int check_n_fix_bitmap(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
 		struct dir_info *dt;
 		struct inode_info *ii;
 
-		dt = dirtree_find(blk);
+		dt = dirtree_find(sdp, blk);
 		if (dt) {
-			dirtree_delete(dt);
+			dirtree_delete(sdp, dt);
 			treat_as_inode = 1;
 		}
-		ii = inodetree_find(blk);
+		ii = inodetree_find(sdp, blk);
 		if (ii) {
-			inodetree_delete(ii);
+			inodetree_delete(sdp, ii);
 			treat_as_inode = 1;
 		} else if (!sdp->gfs1) {
 			treat_as_inode = 1;
-		} else if (link1_type(&nlink1map, blk) == 1) {
+		} else if (link1_type(&fsck_cx(sdp)->nlink1map, blk) == 1) {
 			/* This is a GFS1 fs (so all metadata is marked inode).
 			   We need to verify it is an inode before we can decr
 			   the rgrp inode count. */
@@ -119,7 +214,7 @@ int check_n_fix_bitmap(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
 				rgd->rt_usedmeta--;
 			rewrite_rgrp = 1;
 		}
-		link1_set(&nlink1map, blk, 0);
+		link1_set(&fsck_cx(sdp)->nlink1map, blk, 0);
 	} else if (new_state == GFS2_BLKST_DINODE) {
 		if (!sdp->gfs1) {
 			treat_as_inode = 1;
@@ -127,17 +222,17 @@ int check_n_fix_bitmap(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
 			/* This is GFS1 (so all metadata is marked inode). We
 			   need to verify it is an inode before we can decr
 			   the rgrp inode count. */
-			if (link1_type(&nlink1map, blk) == 1)
+			if (link1_type(&fsck_cx(sdp)->nlink1map, blk) == 1)
 				treat_as_inode = 1;
 			else {
 				struct dir_info *dt;
 				struct inode_info *ii;
 
-				dt = dirtree_find(blk);
+				dt = dirtree_find(sdp, blk);
 				if (dt)
 					treat_as_inode = 1;
 				else {
-					ii = inodetree_find(blk);
+					ii = inodetree_find(sdp, blk);
 					if (ii)
 						treat_as_inode = 1;
 				}
@@ -149,13 +244,8 @@ int check_n_fix_bitmap(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
 			rgd->rt_usedmeta++;
 		rewrite_rgrp = 1;
 	}
-	if (rewrite_rgrp) {
-		if (sdp->gfs1)
-			lgfs2_gfs_rgrp_out(rgd, rgd->bits[0].bi_data);
-		else
-			lgfs2_rgrp_out(rgd, rgd->bits[0].bi_data);
-		rgd->bits[0].bi_modified = 1;
-	}
+	if (rewrite_rgrp)
+		lgfs2_rgrp_hdr_update(sdp, rgd);
 	log_err( _("The bitmap was fixed.\n"));
 	return 0;
 }
@@ -211,9 +301,9 @@ int _fsck_bitmap_set(struct gfs2_inode *ip, uint64_t bblock,
 	return error;
 }
 
-struct duptree *dupfind(uint64_t block)
+struct duptree *dupfind(struct gfs2_sbd *sdp, uint64_t block)
 {
-	struct osi_node *node = dup_blocks.osi_node;
+	struct osi_node *node = fsck_cx(sdp)->dup_blocks.osi_node;
 
 	while (node) {
 		struct duptree *dt = (struct duptree *)node;
@@ -395,6 +485,7 @@ static int check_entries(struct gfs2_inode *ip, struct gfs2_buffer_head *bh,
 	char *bh_end;
 	char *filename;
 	int first = 1;
+	unsigned ndent;
 
 	bh_end = bh->b_data + ip->i_sbd->sd_bsize;
 
@@ -411,7 +502,8 @@ static int check_entries(struct gfs2_inode *ip, struct gfs2_buffer_head *bh,
 	if (!pass->check_dentry)
 		return 0;
 
-	while (1) {
+	dent_hashes_load(ip->i_sbd, bh, dent);
+	for (ndent = 0; ; ndent++) {
 		if (skip_this_pass || fsck_abort)
 			return FSCK_OK;
 		lgfs2_dirent_in(&d, dent);
@@ -426,6 +518,7 @@ static int check_entries(struct gfs2_inode *ip, struct gfs2_buffer_head *bh,
 				bh->b_blocknr, bh->b_blocknr, (*count) + 1,
 				ip->i_num.in_addr, ip->i_num.in_addr);
 			if (query( _("Attempt to repair it? (y/n) "))) {
+				dent_hashes.count = 0;
 				if (dirent_repair(ip, bh, &d, dent, type,
 						  first)) {
 					if (first) /* make a new sentinel */
@@ -482,10 +575,15 @@ static int check_entries(struct gfs2_inode *ip, struct gfs2_buffer_head *bh,
 				/* Mark dirent buffer as modified */
 				first = 0;
 			} else {
+				if (dent_hashes.blk == bh->b_blocknr) {
+					dent_hashes.cur = ndent;
+					dent_hashes.dent = dent;
+				}
 				error = pass->check_dentry(ip, dent, prev, bh,
 							   filename, count,
 							   &lindex,
 							   pass->private);
+				dent_hashes.dent = NULL;
 				if (error < 0) {
 					stack;
 					return error;
@@ -675,12 +773,13 @@ static void dir_leaf_reada(struct gfs2_inode *ip, __be64 *tbl, unsigned hsize)
 
 	for (i = 0; i < hsize; i++) {
 		leaf_no = be64_to_cpu(tbl[i]);
-		if (valid_block_ip(ip, leaf_no))
-			t[n++] = leaf_no * sdp->sd_bsize;
+		/* Hash table entries usually repeat */
+		if (valid_block_ip(ip, leaf_no) && (n == 0 || t[n - 1] != leaf_no))
+			t[n++] = leaf_no;
 	}
 	qsort(t, n, sizeof(uint64_t), u64cmp);
 	for (i = 0; i < n; i++)
-		posix_fadvise(sdp->device_fd, t[i], sdp->sd_bsize, POSIX_FADV_WILLNEED);
+		lgfs2_ra_hint(sdp, t[i], 1);
 }
 
 /* Checks exhash directory entries */
@@ -707,17 +806,14 @@ int check_leaf_blks(struct gfs2_inode *ip, struct metawalk_fxns *pass)
 	orig_di_height = ip->i_height;
 	orig_di_blocks = ip->i_blocks;
 
-	/* Turn off system readahead */
-	posix_fadvise(sdp->device_fd, 0, 0, POSIX_FADV_RANDOM);
-
-	/* Readahead */
+	lgfs2_ra_start(sdp);
 	dir_leaf_reada(ip, tbl, hsize);
 
 	if (pass->check_hash_tbl) {
 		error = pass->check_hash_tbl(ip, tbl, hsize, pass->private);
 		if (error < 0) {
 			free(tbl);
-			posix_fadvise(sdp->device_fd, 0, 0, POSIX_FADV_NORMAL);
+			lgfs2_ra_stop(sdp);
 			return error;
 		}
 		/* If hash table changes were made, read it in again. */
@@ -726,6 +822,7 @@ int check_leaf_blks(struct gfs2_inode *ip, struct metawalk_fxns *pass)
 			tbl = get_dir_hash(ip);
 			if (tbl == NULL) {
 				perror("get_dir_hash");
+				lgfs2_ra_stop(sdp);
 				return -1;
 			}
 		}
@@ -752,7 +849,7 @@ int check_leaf_blks(struct gfs2_inode *ip, struct metawalk_fxns *pass)
 		log_err(_("Directory #%"PRIu64" (0x%"PRIx64") has no valid leaf blocks\n"),
 		        ip->i_num.in_addr, ip->i_num.in_addr);
 		free(tbl);
-		posix_fadvise(sdp->device_fd, 0, 0, POSIX_FADV_NORMAL);
+		lgfs2_ra_stop(sdp);
 		return 1;
 	}
 	lindex = 0;
@@ -769,6 +866,7 @@ int check_leaf_blks(struct gfs2_inode *ip, struct metawalk_fxns *pass)
 			tbl = get_dir_hash(ip);
 			if (tbl == NULL) {
 				perror("get_dir_hash");
+				lgfs2_ra_stop(sdp);
 				return -1;
 			}
 			tbl_valid = 1;
@@ -796,7 +894,7 @@ int check_leaf_blks(struct gfs2_inode *ip, struct metawalk_fxns *pass)
 			struct lgfs2_leaf leaf;
 			if (fsck_abort) {
 				free(tbl);
-				posix_fadvise(sdp->device_fd, 0, 0, POSIX_FADV_NORMAL);
+				lgfs2_ra_stop(sdp);
 				return 0;
 			}
 			error = check_leaf(ip, lindex, pass, &leaf_no, &leaf,
@@ -810,6 +908,7 @@ int check_leaf_blks(struct gfs2_inode *ip, struct metawalk_fxns *pass)
 			}
 			if (error < 0) {
 				free(tbl);
+				lgfs2_ra_stop(sdp);
 				return error;
 			}
 			if (!leaf.lf_next || error)
@@ -839,7 +938,7 @@ int check_leaf_blks(struct gfs2_inode *ip, struct metawalk_fxns *pass)
 		lindex += ref_count;
 	} /* for every leaf block */
 	free(tbl);
-	posix_fadvise(sdp->device_fd, 0, 0, POSIX_FADV_NORMAL);
+	lgfs2_ra_stop(sdp);
 	return 0;
 }
 
@@ -1114,8 +1213,8 @@ static void file_ra(struct gfs2_inode *ip, struct gfs2_buffer_head *bh,
 		    int head_size, int maxptrs, int h)
 {
 	struct gfs2_sbd *sdp = ip->i_sbd;
-	uint64_t sblock = 0, block;
-	int extlen = 0;
+	uint64_t sblock, block;
+	int extlen;
 	__be64 *p;
 
 	if (h + 2 == ip->i_height) {
@@ -1125,43 +1224,19 @@ static void file_ra(struct gfs2_inode *ip, struct gfs2_buffer_head *bh,
 			p++;
 			block = be64_to_cpu(*p);
 			extlen = block - sblock;
+			/* Guess that the whole block's worth is contiguous */
 			if (extlen > 1 && extlen <= maxptrs) {
-				posix_fadvise(sdp->device_fd,
-					      sblock * sdp->sd_bsize,
-					      (extlen + 1) * sdp->sd_bsize,
-					      POSIX_FADV_WILLNEED);
+				lgfs2_ra_hint(sdp, sblock, extlen + 1);
 				return;
 			}
 		}
-		extlen = 0;
 	}
+	/* The readahead engine merges adjacent blocks */
 	for (p = (__be64 *)(bh->b_data + head_size);
 	     p < (__be64 *)(bh->b_data + sdp->sd_bsize); p++) {
-		if (*p) {
-			if (!sblock) {
-				sblock = be64_to_cpu(*p);
-				extlen = 1;
-				continue;
-			}
-			block = be64_to_cpu(*p);
-			if (block == sblock + extlen) {
-				extlen++;
-				continue;
-			}
-		}
-		if (extlen && sblock) {
-			if (extlen > 1)
-				extlen--;
-			posix_fadvise(sdp->device_fd, sblock * sdp->sd_bsize,
-				      extlen * sdp->sd_bsize,
-				      POSIX_FADV_WILLNEED);
-			extlen = 0;
-			p--;
-		}
+		if (*p)
+			lgfs2_ra_hint(sdp, be64_to_cpu(*p), 1);
 	}
-	if (extlen)
-		posix_fadvise(sdp->device_fd, sblock * sdp->sd_bsize,
-			      extlen * sdp->sd_bsize, POSIX_FADV_WILLNEED);
 }
 
 static int do_check_metalist(struct iptr iptr, int height, struct gfs2_buffer_head **bhp,
@@ -1282,25 +1357,34 @@ static int build_and_check_metalist(struct gfs2_inode *ip, osi_list_t *mlp,
 			}
 			if (pass->readahead)
 				file_ra(ip, iptr.ipt_bh, head_size, maxptrs, h);
+			if (pass->batch_bitmap)
+				ptr_states_load(ip->i_sbd, (__be64 *)(iptr_buf(iptr) + head_size),
+				                iptr_endptr(iptr));
 
 			/* Now check the metadata itself */
 			for (; iptr.ipt_off < ip->i_sbd->sd_bsize; iptr.ipt_off += sizeof(uint64_t)) {
 				struct gfs2_buffer_head *nbh = NULL;
 
-				if (skip_this_pass || fsck_abort)
+				if (skip_this_pass || fsck_abort) {
+					ptr_states.count = 0;
 					return META_IS_GOOD;
+				}
 				if (!iptr_block(iptr))
 					continue;
 
+				ptr_states.cur = (iptr.ipt_off - head_size) / sizeof(uint64_t);
 				error = do_check_metalist(iptr, h, &nbh, pass);
-				if (error == META_ERROR || error == META_SKIP_FURTHER)
+				if (error == META_ERROR || error == META_SKIP_FURTHER) {
+					ptr_states.count = 0;
 					goto error_undo;
+				}
 				if (error == META_SKIP_ONE)
 					continue;
 				if (!nbh)
 					nbh = bread(ip->i_sbd, iptr_block(iptr));
 				osi_list_add_prev(&nbh->b_altlist, cur_list);
 			} /* for all data on the indirect block */
+			ptr_states.count = 0;
 		} /* for blocks at that height */
 	} /* for height */
 	return 0;
@@ -1409,13 +1493,16 @@ static int metawalk_check_data(struct gfs2_inode *ip, struct metawalk_fxns *pass
 	/* If there isn't much pointer corruption check the pointers */
 	log_debug("Processing data blocks for inode 0x%"PRIx64", metadata block 0x%"PRIx64".\n",
 	          ip->i_num.in_addr, metablock);
+	if (pass->batch_bitmap)
+		ptr_states_load(ip->i_sbd, ptr_start, ptr_end);
 	for (ptr = ptr_start ; ptr < ptr_end && !fsck_abort; ptr++) {
 		if (!*ptr)
 			continue;
 
 		if (skip_this_pass || fsck_abort)
-			return error;
+			break;
 		block =  be64_to_cpu(*ptr);
+		ptr_states.cur = ptr - ptr_start;
 		/* It's important that we don't call valid_block() and
 		   bypass calling check_data on invalid blocks because that
 		   would defeat the rangecheck_block related functions in
@@ -1428,9 +1515,10 @@ static int metawalk_check_data(struct gfs2_inode *ip, struct metawalk_fxns *pass
 			error = rc;
 		}
 		if (rc < 0)
-			return rc;
+			break;
 		(*blks_checked)++;
 	}
+	ptr_states.count = 0;
 	return error;
 }
 
@@ -1527,7 +1615,11 @@ int check_metatree(struct gfs2_inode *ip, struct metawalk_fxns *pass)
 		osi_list_init(&metalist[i]);
 
 	/* create and check the metadata list for each height */
+	if (pass->readahead)
+		lgfs2_ra_start(ip->i_sbd);
 	error = build_and_check_metalist(ip, metalist, pass);
+	if (pass->readahead)
+		lgfs2_ra_stop(ip->i_sbd);
 	if (error) {
 		stack;
 		goto undo_metalist;
@@ -4,6 +4,8 @@
 #define DIR_LINEAR 1
 #define DIR_EXHASH 2
 
+#define COMFORTABLE_BLKS 5242880 /* 20GB in 4K blocks */
+
 #include "util.h"
 
 struct metawalk_fxns;
@@ -25,11 +27,13 @@ extern int _fsck_bitmap_set(struct gfs2_inode *ip, uint64_t bblock,
 extern int check_n_fix_bitmap(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
 			      uint64_t blk, int error_on_dinode,
 			      int new_state);
-extern struct duptree *dupfind(uint64_t block);
+extern int ptr_bitmap_state(uint64_t blk);
+extern uint32_t dentry_hash(const struct gfs2_dirent *dent);
+extern struct duptree *dupfind(struct gfs2_sbd *sdp, uint64_t block);
 extern struct gfs2_inode *fsck_system_inode(struct gfs2_sbd *sdp,
 					    uint64_t block);
 
-#define is_duplicate(dblock) ((dupfind(dblock)) ? 1 : 0)
+#define is_duplicate(sdp, dblock) ((dupfind(sdp, dblock)) ? 1 : 0)
 
 #define fsck_bitmap_set(ip, b, bt, m) \
 	_fsck_bitmap_set(ip, b, bt, m, 0, __FUNCTION__, __LINE__)
@@ -72,6 +76,7 @@ struct metawalk_fxns {
 	void *private;
 	int invalid_meta_is_fatal;
 	int readahead;
+	int batch_bitmap; /* Look up the bitmap states of each block's pointers together */
 	int (*check_leaf_depth) (struct gfs2_inode *ip, uint64_t leaf_no,
 				 int ref_count, struct gfs2_buffer_head *lbh);
 	int (*check_leaf) (struct gfs2_inode *ip, uint64_t block,
@@ -16,6 +16,8 @@
 #include <time.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <libintl.h>
 #define _(String) gettext(String)
@@ -30,7 +32,38 @@
 #include "fs_recovery.h"
 
 static struct special_blocks gfs1_rindex_blks;
-static struct gfs2_bmap *bl = NULL;
+
+/*
+ * The dinode blocks found in the bitmaps are read ahead of the checks through
+ * a ring of reads, each of a run of consecutive blocks, which go into the
+ * block cache. Up to opts.ra_depth reads are in the ring at once.
+ */
+#define PASS1_RUN_MAX (32)
+
+struct pass1_run {
+	unsigned pr_first;  /* Index in ibuf of the first block of the run */
+	unsigned pr_count;
+	int pr_pending;     /* The read hasn't completed yet */
+	struct gfs2_buffer_head *pr_bhs[PASS1_RUN_MAX];
+};
+
+static struct pass1_ring {
+	struct lgfs2_aio *aio;
+	struct pass1_run *runs;
+	unsigned depth;
+	unsigned max_blocks; /* Most blocks in the ring, to fit in the block cache */
+	unsigned blocks;     /* Blocks in the ring */
+	unsigned head;       /* Runs queued so far */
+	unsigned tail;       /* Runs which have been checked */
+	unsigned next;       /* The index in ibuf of the next block to read */
+	int full;            /* The ring has been full since the last run was retired */
+	/* Reported at the end of the pass */
+	uint64_t reads;
+	uint64_t read_blocks;
+	uint64_t read_stalls;  /* Times the ring filled up with blocks waiting to be checked */
+	uint64_t check_stalls; /* Times the checks waited for a read to complete */
+	uint64_t check_wait;   /* Nanoseconds spent waiting */
+} pass1_ring;
 
 struct block_count {
 	uint64_t indir_count;
@@ -80,6 +113,8 @@ static int gfs2_blockmap_set(struct gfs2_bmap *bmap, uint64_t bblock, int mark)
 
 	if (!bmap)
 		return 0;
+	if (bmap->chunks != NULL)
+		return bmap_compressed_set(bmap, bblock, mark);
 	if (bblock > bmap->size)
 		return -1;
 
@@ -98,12 +133,13 @@ static int _fsck_blockmap_set(struct gfs2_inode *ip, uint64_t bblock,
 			      const char *btype, int mark, int error_on_dinode,
 			      const char *caller, int fline)
 {
+	struct gfs2_sbd *sdp = ip->i_sbd;
 	int error = _fsck_bitmap_set(ip, bblock, btype, mark, error_on_dinode,
 				     caller, fline);
 	if (error)
 		return error;
 
-	return gfs2_blockmap_set(bl, bblock, mark);
+	return gfs2_blockmap_set(fsck_cx(sdp)->bl, bblock, mark);
 }
 
 #define fsck_blockmap_set(ip, b, bt, m) \
@@ -166,6 +202,7 @@ out:
 
 static struct metawalk_fxns pass1_fxns = {
 	.private = NULL,
+	.batch_bitmap = 1,
 	.check_leaf = p1check_leaf,
 	.check_metalist = pass1_check_metalist,
 	.check_data = pass1_check_data,
@@ -274,6 +311,7 @@ static struct metawalk_fxns sysdir_fxns = {
 
 static int p1check_leaf(struct gfs2_inode *ip, uint64_t block, void *private)
 {
+	struct gfs2_sbd *sdp = ip->i_sbd;
 	struct block_count *bc = (struct block_count *) private;
 	int q;
 
@@ -281,7 +319,7 @@ static int p1check_leaf(struct gfs2_inode *ip, uint64_t block, void *private)
 	   check in metawalk: gfs2_check_meta(lbh, GFS2_METATYPE_LF).
 	   So we know it's a leaf block. */
 	bc->indir_count++;
-	q = block_type(bl, block);
+	q = block_type(fsck_cx(sdp)->bl, block);
 	if (q != GFS2_BLKST_FREE) {
 		log_err(_("Found duplicate block #%"PRIu64" (0x%"PRIx64") referenced "
 		          "as a directory leaf in dinode "
@@ -301,11 +339,21 @@ static int p1check_leaf(struct gfs2_inode *ip, uint64_t block, void *private)
 	return 0;
 }
 
+/* valid_block_ip() for a block pointer whose bitmap state has been looked up
+   by the metawalk code, which saves finding its resource group again */
+static int valid_ptr_block(struct gfs2_inode *ip, uint64_t block)
+{
+	if (block <= ip->i_sbd->fssize && ptr_bitmap_state(block) >= 0)
+		return 1;
+	return valid_block_ip(ip, block);
+}
+
 static int pass1_check_metalist(struct iptr iptr, struct gfs2_buffer_head **bh, int h,
                                 int *is_valid, int *was_duplicate, void *private)
 {
 	struct block_count *bc = (struct block_count *)private;
 	struct gfs2_inode *ip = iptr.ipt_ip;
+	struct gfs2_sbd *sdp = ip->i_sbd;
 	uint64_t block = iptr_block(iptr);
 	struct gfs2_buffer_head *nbh;
 	const char *blktypedesc;
@@ -316,7 +364,7 @@ static int pass1_check_metalist(struct iptr iptr, struct gfs2_buffer_head **bh,
 
 	*was_duplicate = 0;
 	*is_valid = 0;
-	if (!valid_block_ip(ip, block)) { /* blk outside of FS */
+	if (!valid_ptr_block(ip, block)) { /* blk outside of FS */
 		/* The bad dinode should be invalidated later due to
 		   "unrecoverable" errors.  The inode itself should be
 		   set "free" and removed from the inodetree by
@@ -336,7 +384,7 @@ static int pass1_check_metalist(struct iptr iptr, struct gfs2_buffer_head **bh,
 		iblk_type = GFS2_METATYPE_IN;
 		blktypedesc = _("a journaled data block");
 	}
-	q = block_type(bl, block);
+	q = block_type(fsck_cx(sdp)->bl, block);
 	if (q != GFS2_BLKST_FREE) {
 		log_err(_("Found duplicate block #%"PRIu64" (0x%"PRIx64") referenced "
 		          "as metadata in indirect block for dinode "
@@ -393,6 +441,7 @@ static int pass1_check_metalist(struct iptr iptr, struct gfs2_buffer_head **bh,
 static int undo_reference(struct gfs2_inode *ip, uint64_t block, int meta,
 			  void *private)
 {
+	struct gfs2_sbd *sdp = ip->i_sbd;
 	struct block_count *bc = (struct block_count *)private;
 	struct duptree *dt;
 	struct inode_with_dups *id;
@@ -406,7 +455,7 @@ static int undo_reference(struct gfs2_inode *ip, uint64_t block, int meta,
 
 	if (meta)
 		bc->indir_count--;
-	dt = dupfind(block);
+	dt = dupfind(sdp, block);
 	if (dt) {
 		/* remove all duplicate reference structures from this inode */
 		do {
@@ -425,7 +474,7 @@ static int undo_reference(struct gfs2_inode *ip, uint64_t block, int meta,
 			if (dt->refs == 1) {
 				log_err(_("This was the only duplicate "
 					  "reference so far; removing it.\n"));
-				dup_delete(dt);
+				dup_delete(sdp, dt);
 			}
 			return 1;
 		}
@@ -500,10 +549,11 @@ static int pass1_check_data(struct gfs2_inode *ip, uint64_t metablock,
 		      uint64_t block, void *private,
 		      struct gfs2_buffer_head *bbh, __be64 *ptr)
 {
+	struct gfs2_sbd *sdp = ip->i_sbd;
 	int q;
 	struct block_count *bc = (struct block_count *) private;
 
-	if (!valid_block_ip(ip, block)) {
+	if (!valid_ptr_block(ip, block)) {
 		log_err(_("inode %"PRIu64" (0x%"PRIx64") has a bad data block pointer "
 		          "%"PRIu64" (0x%"PRIx64") (invalid or out of range) "),
 		        ip->i_num.in_addr, ip->i_num.in_addr, block, block);
@@ -519,7 +569,7 @@ static int pass1_check_data(struct gfs2_inode *ip, uint64_t metablock,
 		return -1;
 	}
 	bc->data_count++; /* keep the count sane anyway */
-	q = block_type(bl, block);
+	q = block_type(fsck_cx(sdp)->bl, block);
 	if (q != GFS2_BLKST_FREE) {
 		struct gfs2_buffer_head *bh;
 		struct gfs2_meta_header *mh;
@@ -638,7 +688,7 @@ static int undo_eattr_indir_or_leaf(struct gfs2_inode *ip, uint64_t block,
 
 	/* Need to check block_type before undoing the reference, which can
 	   set it to free, which would cause the test below to fail. */
-	q = block_type(bl, block);
+	q = block_type(fsck_cx(sdp)->bl, block);
 
 	error = undo_reference(ip, block, 0, private);
 	if (error)
@@ -684,7 +734,7 @@ static int check_eattr_indir(struct gfs2_inode *ip, uint64_t indirect,
 		 * in pass1c */
 		return 1;
 	}
-	q = block_type(bl, indirect);
+	q = block_type(fsck_cx(sdp)->bl, indirect);
 
 	/* Special duplicate processing:  If we have an EA block,
 	   check if it really is an EA.  If it is, let duplicate
@@ -760,7 +810,7 @@ static int check_ealeaf_block(struct gfs2_inode *ip, uint64_t block, int btype,
 	int q;
 	struct block_count *bc = (struct block_count *) private;
 
-	q = block_type(bl, block);
+	q = block_type(fsck_cx(sdp)->bl, block);
 	/* Special duplicate processing:  If we have an EA block, check if it
 	   really is an EA.  If it is, let duplicate handling sort it out.
 	   If it isn't, clear it but don't count it as a duplicate. */
@@ -1018,6 +1068,7 @@ static int rangecheck_block(struct gfs2_inode *ip, uint64_t block,
 			    struct gfs2_buffer_head **bh, enum b_types btype,
 			    void *private)
 {
+	struct gfs2_sbd *sdp = ip->i_sbd;
 	long *bad_pointers = (long *)private;
 	int q;
 
@@ -1032,7 +1083,7 @@ static int rangecheck_block(struct gfs2_inode *ip, uint64_t block,
 			return META_ERROR; /* Exits check_metatree quicker */
 	}
 	/* See how many duplicate blocks it has */
-	q = block_type(bl, block);
+	q = block_type(fsck_cx(sdp)->bl, block);
 	if (q != GFS2_BLKST_FREE) {
 		(*bad_pointers)++;
 		log_info(_("Duplicated %s block pointer (violation %ld, block %"PRIu64
@@ -1112,6 +1163,7 @@ static struct metawalk_fxns eattr_undo_fxns = {
  */
 static int set_ip_blockmap(struct gfs2_inode *ip)
 {
+	struct gfs2_sbd *sdp = ip->i_sbd;
 	uint64_t block = ip->i_bh->b_blocknr;
 	struct lgfs2_inum no;
 	uint32_t mode;
@@ -1149,7 +1201,7 @@ static int set_ip_blockmap(struct gfs2_inode *ip)
 	}
 	no = ip->i_num;
 	if (fsck_blockmap_set(ip, block, ty, GFS2_BLKST_DINODE) ||
-	    (mode == S_IFDIR && !dirtree_insert(no))) {
+	    (mode == S_IFDIR && !dirtree_insert(sdp, no))) {
 		stack;
 		return -EPERM;
 	}
@@ -1161,6 +1213,7 @@ static int alloc_metalist(struct iptr iptr, struct gfs2_buffer_head **bh, int h,
 {
 	const char *desc = (const char *)private;
 	struct gfs2_inode *ip = iptr.ipt_ip;
+	struct gfs2_sbd *sdp = ip->i_sbd;
 	uint64_t block = iptr_block(iptr);
 	int q;
 
@@ -1176,7 +1229,7 @@ static int alloc_metalist(struct iptr iptr, struct gfs2_buffer_head **bh, int h,
 			    "%lld (0x%llx) is now marked as indirect.\n"),
 			  desc, (unsigned long long)block,
 			  (unsigned long long)block);
-		gfs2_blockmap_set(bl, block, ip->i_sbd->gfs1 ?
+		gfs2_blockmap_set(fsck_cx(sdp)->bl, block, ip->i_sbd->gfs1 ?
 				  GFS2_BLKST_DINODE : GFS2_BLKST_USED);
 	}
 	return META_IS_GOOD;
@@ -1198,7 +1251,7 @@ static int alloc_data(struct gfs2_inode *ip, uint64_t metablock,
 			    "%lld (0x%llx) is now marked as data.\n"),
 			  desc, (unsigned long long)block,
 			  (unsigned long long)block);
-		gfs2_blockmap_set(bl, block, GFS2_BLKST_USED);
+		gfs2_blockmap_set(fsck_cx(ip->i_sbd)->bl, block, GFS2_BLKST_USED);
 	}
 	return 0;
 }
@@ -1247,7 +1300,7 @@ static int pass1_check_metatree(struct gfs2_inode *ip,
 
 	error = check_metatree(ip, pass);
 	if (error)
-		gfs2_blockmap_set(bl, ip->i_num.in_addr, GFS2_BLKST_FREE);
+		gfs2_blockmap_set(fsck_cx(ip->i_sbd)->bl, ip->i_num.in_addr, GFS2_BLKST_FREE);
 	return error;
 }
 
@@ -1478,14 +1531,14 @@ static int check_system_inode(struct gfs2_sbd *sdp,
 				   "%llu (0x%llx)\n"),
 				 (unsigned long long)iblock,
 				 (unsigned long long)iblock);
-			gfs2_blockmap_set(bl, iblock, GFS2_BLKST_FREE);
+			gfs2_blockmap_set(fsck_cx(sdp)->bl, iblock, GFS2_BLKST_FREE);
 			check_n_fix_bitmap(sdp, (*sysinode)->i_rgd, iblock, 0,
 					   GFS2_BLKST_FREE);
 			inode_put(sysinode);
 		}
 	}
 	if (*sysinode) {
-		ds.q = block_type(bl, iblock);
+		ds.q = block_type(fsck_cx(sdp)->bl, iblock);
 		/* If the inode exists but the block is marked free, we might
 		   be recovering from a corrupt bitmap.  In that case, don't
 		   rebuild the inode.  Just reuse the inode and fix the
@@ -1498,7 +1551,7 @@ static int check_system_inode(struct gfs2_sbd *sdp,
 			ds.q = GFS2_BLKST_DINODE;
 			if (isdir) {
 				struct lgfs2_inum no = (*sysinode)->i_num;
-				dirtree_insert(no);
+				dirtree_insert(sdp, no);
 			}
 		}
 		/* Make sure it's marked as a system file/directory */
@@ -1514,7 +1567,7 @@ static int check_system_inode(struct gfs2_sbd *sdp,
 				/* Set the blockmap (but not bitmap) back to
 				   'free' so that it gets checked like any
 				   normal dinode. */
-				gfs2_blockmap_set(bl, iblock, GFS2_BLKST_FREE);
+				gfs2_blockmap_set(fsck_cx(sdp)->bl, iblock, GFS2_BLKST_FREE);
 				log_err( _("Removed system inode \"%s\".\n"),
 					 filename);
 			}
@@ -1548,7 +1601,7 @@ static int check_system_inode(struct gfs2_sbd *sdp,
 			ds.q = GFS2_BLKST_DINODE;
 			if (isdir) {
 				struct lgfs2_inum no = (*sysinode)->i_num;
-				dirtree_insert(no);
+				dirtree_insert(sdp, no);
 			}
 		} else {
 			log_err( _("Cannot continue without valid %s inode\n"),
@@ -1666,13 +1719,13 @@ static int check_system_inodes(struct gfs2_sbd *sdp)
 		   therefore not linked to anything else. We need to adjust
 		   the link counts so pass4 doesn't get confused. */
 		no = sdp->md.statfs->i_num;
-		incr_link_count(no, NULL, _("gfs1 statfs inode"));
+		incr_link_count(sdp, no, NULL, _("gfs1 statfs inode"));
 		no = sdp->md.jiinode->i_num;
-		incr_link_count(no, NULL, _("gfs1 jindex inode"));
+		incr_link_count(sdp, no, NULL, _("gfs1 jindex inode"));
 		no = sdp->md.riinode->i_num;
-		incr_link_count(no, NULL, _("gfs1 rindex inode"));
+		incr_link_count(sdp, no, NULL, _("gfs1 rindex inode"));
 		no = sdp->md.qinode->i_num;
-		incr_link_count(no, NULL, _("gfs1 quota inode"));
+		incr_link_count(sdp, no, NULL, _("gfs1 quota inode"));
 		return 0;
 	}
 	for (sdp->md.journals = 0; sdp->md.journals < journal_count;
@@ -1691,28 +1744,271 @@ static int check_system_inodes(struct gfs2_sbd *sdp)
 	return 0;
 }
 
-static int pass1_process_bitmap(struct gfs2_sbd *sdp, struct rgrp_tree *rgd, uint64_t *ibuf, unsigned n)
+static int pass1_ring_init(struct gfs2_sbd *sdp)
+{
+	struct pass1_ring *r = &pass1_ring;
+	struct lgfs2_bcache_stats bs;
+
+	memset(r, 0, sizeof(*r));
+	r->depth = opts.ra_depth;
+	r->runs = calloc(r->depth, sizeof(*r->runs));
+	if (r->runs == NULL)
+		return -1;
+	r->aio = lgfs2_aio_init(sdp, r->depth, 0);
+	if (r->aio == NULL) {
+		free(r->runs);
+		r->runs = NULL;
+		return -1;
+	}
+	/* Leave most of the cache for the blocks the checks read */
+	lgfs2_bcache_stats(sdp, &bs);
+	r->max_blocks = bs.bs_max / 4 > PASS1_RUN_MAX ? bs.bs_max / 4 : PASS1_RUN_MAX;
+	return 0;
+}
+
+static void pass1_ring_free(void)
+{
+	struct pass1_ring *r = &pass1_ring;
+
+	if (r->aio == NULL)
+		return;
+	lgfs2_aio_free(&r->aio);
+	free(r->runs);
+	r->runs = NULL;
+	log_info(_("Inode read-ahead: %"PRIu64" blocks in %"PRIu64" reads, the checks waited "
+	           "%"PRIu64" times for %.3fs, the reads waited %"PRIu64" times for the checks\n"),
+	         r->read_blocks, r->reads, r->check_stalls, r->check_wait / 1e9, r->read_stalls);
+}
+
+/**
+ * Collect a completed read. The buffers are released into the block cache
+ * where the bread() in pass1_process_bitmap() will find them.
+ */
+static int pass1_ring_reap(int wait)
+{
+	struct pass1_ring *r = &pass1_ring;
+	struct lgfs2_aio_done done;
+	int ret;
+
+	ret = lgfs2_aio_reap(r->aio, &done, wait);
+	if (ret == 1) {
+		r->runs[(unsigned long)done.ad_priv % r->depth].pr_pending = 0;
+		for (unsigned i = 0; i < done.ad_count; i++)
+			if (done.ad_bhs[i] != NULL)
+				brelse(done.ad_bhs[i]);
+	}
+	return ret;
+}
+
+/**
+ * Queue reads of the runs of dinode blocks in ibuf, up to index n, while
+ * there is room in the ring.
+ */
+static void pass1_ring_fill(uint64_t *ibuf, unsigned n)
+{
+	struct pass1_ring *r = &pass1_ring;
+
+	while (pass1_ring_reap(0) == 1);
+
+	while (r->next < n) {
+		struct pass1_run *run = &r->runs[r->head % r->depth];
+		unsigned count = 1;
+
+		while (r->next + count < n && count < PASS1_RUN_MAX &&
+		       ibuf[r->next + count] == ibuf[r->next] + count)
+			count++;
+		if (r->head - r->tail == r->depth || r->blocks + count > r->max_blocks) {
+			if (!r->full)
+				r->read_stalls++;
+			r->full = 1;
+			break;
+		}
+		if (lgfs2_aio_breadm(r->aio, run->pr_bhs, count, ibuf[r->next],
+		                     (void *)(unsigned long)r->head) != 0)
+			break;
+		run->pr_first = r->next;
+		run->pr_count = count;
+		run->pr_pending = 1;
+		r->head++;
+		r->blocks += count;
+		r->next += count;
+		r->reads++;
+		r->read_blocks += count;
+	}
+	lgfs2_aio_submit(r->aio);
+}
+
+/**
+ * Wait for the read of ibuf[i] to complete, so that bread() doesn't race
+ * with it, and retire the runs before it.
+ */
+static void pass1_ring_wait(unsigned i)
+{
+	struct pass1_ring *r = &pass1_ring;
+
+	while (r->tail != r->head) {
+		struct pass1_run *run = &r->runs[r->tail % r->depth];
+		struct timespec start, end;
+
+		if (run->pr_first > i)
+			break;
+		if (run->pr_pending && i < run->pr_first + run->pr_count) {
+			r->check_stalls++;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			while (run->pr_pending && pass1_ring_reap(1) == 1);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			r->check_wait += (end.tv_sec - start.tv_sec) * 1000000000ULL +
+			                 end.tv_nsec - start.tv_nsec;
+		}
+		if (i < run->pr_first + run->pr_count)
+			break;
+		/* Every block of this run has been checked or skipped */
+		while (run->pr_pending && pass1_ring_reap(1) == 1);
+		r->blocks -= run->pr_count;
+		r->tail++;
+		r->full = 0;
+	}
+}
+
+/* Wait for the reads still in the ring and empty it for the next bitmap */
+static void pass1_ring_drain(void)
+{
+	struct pass1_ring *r = &pass1_ring;
+
+	while (pass1_ring_reap(1) == 1);
+	for (; r->tail != r->head; r->tail++)
+		r->runs[r->tail % r->depth].pr_pending = 0;
+	r->blocks = 0;
+	r->next = 0;
+	r->full = 0;
+}
+
+/*
+ * With -j, the pool's threads check the dinodes of the resource groups just
+ * ahead of the one being committed, and walk their metadata trees. What pass1
+ * makes of a block depends on what it found in the blocks before it, so the
+ * results are committed in this thread in block order: for each dinode which
+ * a thread found nothing wrong with, pass1_commit_inode() makes the changes to
+ * the block map and the inode and directory trees which handle_di() would
+ * make. Any other dinode, and every dinode once an error has been found, goes
+ * through handle_di(), so the results and the output are the same whatever
+ * the number of threads.
+ */
+
+/* A run of blocks which a checked dinode refers to */
+struct pass1_extent {
+	uint64_t pe_start;
+	uint64_t pe_len;
+};
+
+/* A dinode which one of the pool's threads found nothing wrong with */
+struct pass1_inode {
+	uint64_t pi_addr;
+	size_t pi_first; /* Index in pc_exts of its first extent */
+	size_t pi_count;
+};
+
+/* The dinodes checked in a resource group, in block order */
+struct pass1_checked {
+	osi_list_t pc_list; /* In pj_checked until pass1_check_job() takes it */
+	struct pass1_inode *pc_inodes;
+	size_t pc_ninodes;
+	size_t pc_inodes_size;
+	struct pass1_extent *pc_exts;
+	size_t pc_nexts;
+	size_t pc_exts_size;
+	size_t pc_next;     /* The next of pc_inodes to commit */
+	int pc_errors;      /* The checks are only good while errors_found is this */
+};
+
+static void pass1_checked_free(struct pass1_checked *pc)
+{
+	if (pc == NULL)
+		return;
+	free(pc->pc_inodes);
+	free(pc->pc_exts);
+	free(pc);
+}
+
+/**
+ * Find the checks which the pool's threads made of the dinode at block.
+ * Nothing on disk has been changed since they were made unless an error has
+ * been found, so they are dropped then.
+ */
+static struct pass1_inode *pass1_checked_inode(struct pass1_checked *pc, uint64_t block)
+{
+	if (pc == NULL || errors_found != pc->pc_errors)
+		return NULL;
+	while (pc->pc_next < pc->pc_ninodes && pc->pc_inodes[pc->pc_next].pi_addr < block)
+		pc->pc_next++;
+	if (pc->pc_next < pc->pc_ninodes && pc->pc_inodes[pc->pc_next].pi_addr == block)
+		return &pc->pc_inodes[pc->pc_next];
+	return NULL;
+}
+
+/**
+ * Make the changes which handle_di() would make for a dinode which one of the
+ * pool's threads found nothing wrong with. The threads can't use the block
+ * map, so the blocks which the dinode refers to are looked up in it here and
+ * if any of them has been seen before, handle_di() is left to sort it out.
+ *
+ * Returns: 0 if the dinode has been processed, 1 if handle_di() should process
+ *          it, -1 on error
+ */
+static int pass1_commit_inode(struct gfs2_sbd *sdp, struct rgrp_tree *rgd,
+                              struct gfs2_buffer_head *bh, struct pass1_checked *pc,
+                              struct pass1_inode *pi)
+{
+	struct gfs2_bmap *bl = fsck_cx(sdp)->bl;
+	struct pass1_extent *first = pc->pc_exts + pi->pi_first;
+	struct pass1_extent *end = first + pi->pi_count;
+	struct gfs2_inode *ip;
+
+	for (struct pass1_extent *pe = first; pe < end; pe++)
+		for (uint64_t b = pe->pe_start; b < pe->pe_start + pe->pe_len; b++)
+			if (block_type(bl, b) != GFS2_BLKST_FREE)
+				return 1;
+
+	ip = fsck_inode_get(sdp, rgd, bh);
+	if (set_ip_blockmap(ip) != 0 || set_di_nlink(ip) != 0) {
+		stack;
+		fsck_inode_put(&ip);
+		return -1;
+	}
+	/* The threads found the blocks in use in the bitmap already, so this is
+	   all that pass1_check_metalist() and pass1_check_data() would do */
+	for (struct pass1_extent *pe = first; pe < end; pe++)
+		for (uint64_t b = pe->pe_start; b < pe->pe_start + pe->pe_len; b++)
+			gfs2_blockmap_set(bl, b, GFS2_BLKST_USED);
+	fsck_inode_put(&ip);
+	return 0;
+}
+
+static int pass1_process_bitmap(struct gfs2_sbd *sdp, struct rgrp_tree *rgd, uint64_t *ibuf, unsigned n,
+                                struct pass1_checked *pc)
 {
 	struct gfs2_buffer_head *bh;
+	struct pass1_inode *pi;
 	unsigned i;
 	uint64_t block;
 	struct gfs2_inode *ip;
 	int q;
-	/* Readahead numbers arrived at by experiment */
-	unsigned rawin = 50;
-	unsigned ralen = 100 * sdp->sd_bsize;
-	unsigned r = 0;
+	int ret = 0;
 
+	/* Without the block cache, let the readahead engine pace the reads */
+	lgfs2_ra_start(sdp);
+	if (pass1_ring.aio == NULL) {
+		for (i = 0; i < n; i++)
+			lgfs2_ra_hint(sdp, ibuf[i], 1);
+	}
 	for (i = 0; i < n; i++) {
 		int is_inode;
 		__be32 check_magic;
 
 		block = ibuf[i];
 
-		if (r++ == rawin) {
-			posix_fadvise(sdp->device_fd, block * sdp->sd_bsize, ralen, POSIX_FADV_WILLNEED);
-			r = 0;
-		}
+		if (pass1_ring.aio != NULL)
+			pass1_ring_fill(ibuf, n);
 
 		/* skip gfs1 rindex indirect blocks */
 		if (sdp->gfs1 && blockfind(&gfs1_rindex_blks, block)) {
@@ -1726,7 +2022,7 @@ static int pass1_process_bitmap(struct gfs2_sbd *sdp, struct rgrp_tree *rgd, uin
 
 		if (fsck_abort) { /* if asked to abort */
 			gfs2_special_free(&gfs1_rindex_blks);
-			return FSCK_OK;
+			goto out;
 		}
 		if (skip_this_pass) {
 			printf( _("Skipping pass 1 is not a good idea.\n"));
@@ -1741,6 +2037,8 @@ static int pass1_process_bitmap(struct gfs2_sbd *sdp, struct rgrp_tree *rgd, uin
 			continue;
 		}
 
+		if (pass1_ring.aio != NULL)
+			pass1_ring_wait(i);
 		bh = bread(sdp, block);
 
 		is_inode = 0;
@@ -1750,7 +2048,7 @@ static int pass1_process_bitmap(struct gfs2_sbd *sdp, struct rgrp_tree *rgd, uin
 		check_magic = ((struct gfs2_meta_header *)
 			       (bh->b_data))->mh_magic;
 
-		q = block_type(bl, block);
+		q = block_type(fsck_cx(sdp)->bl, block);
 		if (q != GFS2_BLKST_FREE) {
 			if (be32_to_cpu(check_magic) == GFS2_MAGIC &&
 			    sdp->gfs1 && !is_inode) {
@@ -1804,11 +2102,21 @@ static int pass1_process_bitmap(struct gfs2_sbd *sdp, struct rgrp_tree *rgd, uin
 				 (unsigned long long)block);
 			check_n_fix_bitmap(sdp, rgd, block, 0,
 					   GFS2_BLKST_FREE);
-		} else if (handle_di(sdp, rgd, bh) < 0) {
-			stack;
-			brelse(bh);
-			gfs2_special_free(&gfs1_rindex_blks);
-			return FSCK_ERROR;
+		} else {
+			int error = 1;
+
+			pi = pass1_checked_inode(pc, block);
+			if (pi != NULL)
+				error = pass1_commit_inode(sdp, rgd, bh, pc, pi);
+			if (error > 0)
+				error = handle_di(sdp, rgd, bh);
+			if (error < 0) {
+				stack;
+				brelse(bh);
+				gfs2_special_free(&gfs1_rindex_blks);
+				ret = FSCK_ERROR;
+				goto out;
+			}
 		}
 		/* Ignore everything else - they should be hit by the
 		   handle_di step.  Don't check NONE either, because
@@ -1819,11 +2127,14 @@ static int pass1_process_bitmap(struct gfs2_sbd *sdp, struct rgrp_tree *rgd, uin
 		   caught in pass5. */
 		brelse(bh);
 	}
-
-	return 0;
+out:
+	if (pass1_ring.aio != NULL)
+		pass1_ring_drain();
+	lgfs2_ra_stop(sdp);
+	return ret;
 }
 
-static int pass1_process_rgrp(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
+static int pass1_process_rgrp(struct gfs2_sbd *sdp, struct rgrp_tree *rgd, struct pass1_checked *pc)
 {
 	unsigned k, n, i;
 	uint64_t *ibuf = malloc(sdp->sd_bsize * GFS2_NBBY * sizeof(uint64_t));
@@ -1831,12 +2142,18 @@ static int pass1_process_rgrp(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
 
 	if (ibuf == NULL)
 		return FSCK_ERROR;
+	if (lgfs2_rgrp_pin(rgd) != 0) {
+		log_err(_("Unable to read the bitmaps of resource group %"PRIu64": %s\n"),
+		        rgd->rt_addr, strerror(errno));
+		free(ibuf);
+		return FSCK_ERROR;
+	}
 
 	for (k = 0; k < rgd->rt_length; k++) {
 		n = lgfs2_bm_scan(rgd, k, ibuf, GFS2_BLKST_DINODE);
 
 		if (n) {
-			ret = pass1_process_bitmap(sdp, rgd, ibuf, n);
+			ret = pass1_process_bitmap(sdp, rgd, ibuf, n, pc);
 			if (ret)
 				goto out;
 		}
@@ -1853,86 +2170,411 @@ static int pass1_process_rgrp(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
 
 		n = lgfs2_bm_scan(rgd, k, ibuf, GFS2_BLKST_UNLINKED);
 		for (i = 0; i < n; i++) {
-			gfs2_blockmap_set(bl, ibuf[i], GFS2_BLKST_UNLINKED);
+			gfs2_blockmap_set(fsck_cx(sdp)->bl, ibuf[i], GFS2_BLKST_UNLINKED);
 			if (fsck_abort)
 				goto out;
 		}
 	}
 
 out:
+	lgfs2_rgrp_unpin(rgd);
 	free(ibuf);
 	return ret;
 }
 
-static int gfs2_blockmap_create(struct gfs2_bmap *bmap, uint64_t size)
+struct pass1_job {
+	uint64_t pj_count;     /* Resource groups checked so far */
+	int pj_errors;         /* errors_found when the run started */
+	int pj_serial;         /* Set, atomically, when the threads' checks can't be used */
+	pthread_mutex_t pj_lock;
+	osi_list_t pj_checked; /* Checks which haven't been committed, for freeing */
+};
+
+/* The blocks which the metadata tree of a dinode refers to */
+struct pass1_walk {
+	uint64_t *pw_blks;
+	int *pw_states;
+	uint64_t pw_count;
+	uint64_t pw_max;   /* Most blocks the tree can have, from di_blocks */
+	uint64_t pw_size;  /* Size of pw_blks and pw_states */
+};
+
+/* For the pool's threads, see rj_cancel */
+static int pass1_aborted(void)
 {
-	bmap->size = size;
+	return __atomic_load_n(&fsck_abort, __ATOMIC_RELAXED);
+}
 
-	/* Have to add 1 to BLOCKMAP_SIZE since it's 0-based and mallocs
-	 * must be 1-based */
-	bmap->mapsize = BLOCKMAP_SIZE2(size) + 1;
+static int pass1_stopped(struct pass1_job *pj)
+{
+	return pass1_aborted() || __atomic_load_n(&pj->pj_serial, __ATOMIC_RELAXED);
+}
+
+static int pass1_blkcmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int pass1_walk_tree(struct gfs2_sbd *sdp, struct pass1_job *pj, struct pass1_walk *pw,
+                           const __be64 *ptr, const __be64 *end, unsigned height)
+{
+	for (; ptr < end; ptr++) {
+		uint64_t block = be64_to_cpu(*ptr);
+		struct gfs2_buffer_head *bh;
+		int ret;
 
-	if (!(bmap->map = calloc(bmap->mapsize, sizeof(char))))
-		return -ENOMEM;
+		if (block == 0)
+			continue;
+		if (pw->pw_count == pw->pw_max ||
+		    block <= LGFS2_SB_ADDR(sdp) || block > sdp->fssize)
+			return -1;
+		pw->pw_blks[pw->pw_count++] = block;
+		if (height == 1)
+			continue;
+		bh = bread(sdp, block);
+		if (bh == NULL)
+			return -1;
+		ret = gfs2_check_meta(bh->b_data, GFS2_METATYPE_IN);
+		if (ret == 0)
+			ret = pass1_walk_tree(sdp, pj, pw,
+			                      (__be64 *)(bh->b_data + sizeof(struct gfs2_meta_header)),
+			                      (__be64 *)(bh->b_data + sdp->sd_bsize), height - 1);
+		brelse(bh);
+		if (ret != 0 || pass1_stopped(pj))
+			return -1;
+	}
 	return 0;
 }
 
+/**
+ * Check a dinode and its metadata tree in one of the pool's threads. Only a
+ * dinode in which handle_di() would find nothing to report or fix passes, as
+ * long as the blocks it refers to turn out to be free in the block map:
+ * anything out of the ordinary is left to handle_di().
+ *
+ * Returns: 0 if the dinode passes, with the blocks it refers to in pw, sorted
+ */
+static int pass1_check_dinode(struct gfs2_sbd *sdp, struct pass1_job *pj,
+                              struct gfs2_buffer_head *bh, struct pass1_walk *pw)
+{
+	struct gfs2_dinode *di = (struct gfs2_dinode *)bh->b_data;
+	uint32_t flags = be32_to_cpu(di->di_flags);
+	uint16_t height = be16_to_cpu(di->di_height);
+	uint64_t blocks = be64_to_cpu(di->di_blocks);
+	uint64_t goal = be64_to_cpu(di->di_goal_meta);
+
+	pw->pw_count = 0;
+	if (gfs2_check_meta(bh->b_data, GFS2_METATYPE_DI) != 0 ||
+	    be64_to_cpu(di->di_num.no_addr) != bh->b_blocknr)
+		return -1;
+	/* See check_i_goal() */
+	if (!(flags & GFS2_DIF_SYSTEM) && (goal <= LGFS2_SB_ADDR(sdp) || goal > sdp->fssize))
+		return -1;
+	/* See set_ip_blockmap() */
+	switch (be32_to_cpu(di->di_mode) & S_IFMT) {
+	case S_IFDIR:
+		/* Only stuffed, linear directories have nothing more to check */
+		if (height != 0 || flags & GFS2_DIF_EXHASH)
+			return -1;
+		break;
+	case S_IFREG:
+	case S_IFLNK:
+	case S_IFBLK:
+	case S_IFCHR:
+	case S_IFIFO:
+	case S_IFSOCK:
+		break;
+	default:
+		return -1;
+	}
+	/* Extended attributes and big file messages are left to handle_ip() */
+	if (di->di_eattr != 0 || height > sdp->sd_max_height ||
+	    blocks == 0 || blocks > COMFORTABLE_BLKS)
+		return -1;
+
+	pw->pw_max = blocks - 1;
+	if (pw->pw_max > pw->pw_size) {
+		uint64_t *blks = realloc(pw->pw_blks, pw->pw_max * sizeof(*blks));
+		int *states = realloc(pw->pw_states, pw->pw_max * sizeof(*states));
+
+		if (blks != NULL)
+			pw->pw_blks = blks;
+		if (states != NULL)
+			pw->pw_states = states;
+		if (blks == NULL || states == NULL)
+			return -1;
+		pw->pw_size = pw->pw_max;
+	}
+	if (height > 0 &&
+	    pass1_walk_tree(sdp, pj, pw, (__be64 *)(bh->b_data + sizeof(struct gfs2_dinode)),
+	                    (__be64 *)(bh->b_data + sdp->sd_bsize), height) != 0)
+		return -1;
+	/* See the block count check in handle_ip() */
+	if (pw->pw_count != pw->pw_max)
+		return -1;
+	/* Otherwise check_n_fix_bitmap() would have something to say */
+	lgfs2_get_bitmaps(sdp, pw->pw_blks, pw->pw_count, pw->pw_states);
+	for (uint64_t i = 0; i < pw->pw_count; i++)
+		if (pw->pw_states[i] != GFS2_BLKST_USED)
+			return -1;
+	/* A block referenced twice is a duplicate for pass1b */
+	qsort(pw->pw_blks, pw->pw_count, sizeof(*pw->pw_blks), pass1_blkcmp);
+	for (uint64_t i = 1; i < pw->pw_count; i++)
+		if (pw->pw_blks[i] == pw->pw_blks[i - 1])
+			return -1;
+	return 0;
+}
 
-static int link1_create(struct gfs2_bmap *bmap, uint64_t size)
+/* Add a checked dinode, with the sorted blocks it refers to, to pc */
+static int pass1_checked_add(struct pass1_checked *pc, uint64_t addr, const struct pass1_walk *pw)
 {
-	bmap->size = size;
+	struct pass1_inode *pi;
 
-	/* Have to add 1 to BLOCKMAP_SIZE since it's 0-based and mallocs
-	 * must be 1-based */
-	bmap->mapsize = BLOCKMAP_SIZE1(size) + 1;
+	if (pc->pc_ninodes == pc->pc_inodes_size) {
+		size_t size = pc->pc_inodes_size ? pc->pc_inodes_size * 2 : 64;
+		struct pass1_inode *inodes = realloc(pc->pc_inodes, size * sizeof(*inodes));
 
-	if (!(bmap->map = calloc(bmap->mapsize, sizeof(char))))
-		return -ENOMEM;
+		if (inodes == NULL)
+			return -1;
+		pc->pc_inodes = inodes;
+		pc->pc_inodes_size = size;
+	}
+	pi = &pc->pc_inodes[pc->pc_ninodes];
+	pi->pi_addr = addr;
+	pi->pi_first = pc->pc_nexts;
+	pi->pi_count = 0;
+	for (uint64_t i = 0; i < pw->pw_count; i++) {
+		struct pass1_extent *pe;
+
+		if (pi->pi_count > 0) {
+			pe = &pc->pc_exts[pc->pc_nexts - 1];
+			if (pe->pe_start + pe->pe_len == pw->pw_blks[i]) {
+				pe->pe_len++;
+				continue;
+			}
+		}
+		if (pc->pc_nexts == pc->pc_exts_size) {
+			size_t size = pc->pc_exts_size ? pc->pc_exts_size * 2 : 256;
+			struct pass1_extent *exts = realloc(pc->pc_exts, size * sizeof(*exts));
+
+			if (exts == NULL) {
+				pc->pc_nexts = pi->pi_first;
+				return -1;
+			}
+			pc->pc_exts = exts;
+			pc->pc_exts_size = size;
+		}
+		pe = &pc->pc_exts[pc->pc_nexts++];
+		pe->pe_start = pw->pw_blks[i];
+		pe->pe_len = 1;
+		pi->pi_count++;
+	}
+	pc->pc_ninodes++;
 	return 0;
 }
 
-static struct gfs2_bmap *gfs2_bmap_create(struct gfs2_sbd *sdp, uint64_t size,
-					  uint64_t *addl_mem_needed)
+static int pass1_check_rgrp(struct gfs2_sbd *sdp, lgfs2_rgrp_t rgd, void *result, void *arg)
 {
-	struct gfs2_bmap *il;
+	struct pass1_job *pj = arg;
+	struct pass1_walk pw = {0};
+	struct pass1_checked *pc;
+	uint64_t *ibuf;
 
-	*addl_mem_needed = 0L;
-	il = calloc(1, sizeof(*il));
-	if (!il)
-		return NULL;
+	if (pass1_stopped(pj))
+		return 0;
+	/* Errors are left for pass1_process_rgrp() to find and report */
+	pc = calloc(1, sizeof(*pc));
+	ibuf = malloc(sdp->sd_bsize * GFS2_NBBY * sizeof(uint64_t));
+	if (pc == NULL || ibuf == NULL || lgfs2_rgrp_pin(rgd) != 0) {
+		free(pc);
+		free(ibuf);
+		return 0;
+	}
+	for (unsigned k = 0; k < rgd->rt_length && !pass1_stopped(pj); k++) {
+		unsigned n = lgfs2_bm_scan(rgd, k, ibuf, GFS2_BLKST_DINODE);
+
+		for (unsigned i = 0; i < n && !pass1_stopped(pj); i++) {
+			struct gfs2_buffer_head *bh = bread(sdp, ibuf[i]);
+			int ret = 0;
 
-	if (gfs2_blockmap_create(il, size)) {
-		*addl_mem_needed = il->mapsize;
-		free(il);
-		il = NULL;
+			if (bh == NULL)
+				continue;
+			if (pass1_check_dinode(sdp, pj, bh, &pw) == 0)
+				ret = pass1_checked_add(pc, ibuf[i], &pw);
+			brelse(bh);
+			/* The dinodes after this one are left to handle_di() */
+			if (ret != 0)
+				goto out;
+		}
 	}
-	return il;
+out:
+	lgfs2_rgrp_unpin(rgd);
+	free(pw.pw_blks);
+	free(pw.pw_states);
+	free(ibuf);
+	pthread_mutex_lock(&pj->pj_lock);
+	osi_list_add_prev(&pc->pc_list, &pj->pj_checked);
+	pthread_mutex_unlock(&pj->pj_lock);
+	*(struct pass1_checked **)result = pc;
+	return 0;
+}
+
+static int pass1_check_job(struct gfs2_sbd *sdp, lgfs2_rgrp_t rgd, void *result, void *arg)
+{
+	struct pass1_job *pj = arg;
+	struct pass1_checked *pc = *(struct pass1_checked **)result;
+	int ret;
+
+	if (pc != NULL) {
+		pthread_mutex_lock(&pj->pj_lock);
+		osi_list_del(&pc->pc_list);
+		pthread_mutex_unlock(&pj->pj_lock);
+		pc->pc_errors = pj->pj_errors;
+	}
+	log_debug("Checking metadata in resource group #%"PRIu64"\n", pj->pj_count++);
+	for (uint64_t i = 0; i < rgd->rt_length; i++) {
+		log_debug("rgrp block %"PRIu64" (0x%"PRIx64") is now marked as 'rgrp data'\n",
+			   rgd->rt_addr + i, rgd->rt_addr + i);
+		if (gfs2_blockmap_set(fsck_cx(sdp)->bl, rgd->rt_addr + i, GFS2_BLKST_USED)) {
+			stack;
+			pass1_checked_free(pc);
+			return FSCK_ERROR;
+		}
+		/* rgrps and bitmaps don't have bits to represent
+		   their blocks, so don't do this:
+		check_n_fix_bitmap(sdp, rgd, rgd->ri.ri_num.in_addr + i, 0,
+		gfs2_meta_rgrp);*/
+	}
+	ret = pass1_process_rgrp(sdp, rgd, pc);
+	pass1_checked_free(pc);
+	/* The threads' checks may have been made before the changes */
+	if (errors_found != pj->pj_errors)
+		__atomic_store_n(&pj->pj_serial, 1, __ATOMIC_RELAXED);
+	bmap_compact(fsck_cx(sdp)->bl, rgd->rt_addr, rgd->rt_data0 + rgd->rt_data - 1);
+	return ret;
 }
 
-static void gfs2_blockmap_destroy(struct gfs2_bmap *bmap)
+/* The memory which the block maps for a file system of size blocks need,
+   leaving out a compressed block map as its size can't be known up front */
+static uint64_t blockmaps_size(uint64_t size)
 {
-	if (bmap->map)
-		free(bmap->map);
-	bmap->size = 0;
-	bmap->mapsize = 0;
+	/* Have to add 1 to BLOCKMAP_SIZE since it's 0-based and mallocs
+	 * must be 1-based */
+	uint64_t need = 2 * (BLOCKMAP_SIZE1(size) + 1);
+
+	if (!opts.compress_map)
+		need += BLOCKMAP_SIZE2(size) + 1;
+	return need;
 }
 
-static void *gfs2_bmap_destroy(struct gfs2_sbd *sdp, struct gfs2_bmap *il)
+/* An estimate of the memory which the block maps can use without pushing
+   the rest of fsck into swap */
+static uint64_t blockmaps_mem(void)
 {
-	if (il) {
-		gfs2_blockmap_destroy(il);
-		free(il);
-		il = NULL;
+	uint64_t avail = 0, reserved;
+	char line[128];
+	FILE *f;
+
+	if (opts.map_mb != FSCK_MAP_MB_AUTO)
+		return (uint64_t)opts.map_mb << 20;
+
+	f = fopen("/proc/meminfo", "r");
+	if (f != NULL) {
+		while (fgets(line, sizeof(line), f) != NULL)
+			if (sscanf(line, "MemAvailable: %"SCNu64" kB", &avail) == 1)
+				break;
+		fclose(f);
+		avail <<= 10;
+	}
+	if (avail == 0)
+		avail = (uint64_t)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+	/* Leave room for the block cache and a quarter of the rest for the
+	   inode and directory tables and everything else */
+	reserved = (uint64_t)opts.cache_mb << 20;
+	if (avail < reserved)
+		return 0;
+	return (avail - reserved) / 4 * 3;
+}
+
+static const char *scratch_dir(void)
+{
+	const char *dir = opts.scratch_dir;
+
+	if (dir == NULL)
+		dir = getenv("TMPDIR");
+	if (dir == NULL || *dir == '\0')
+		dir = "/var/tmp";
+	return dir;
+}
+
+static void blockmaps_free(struct fsck_cx *cx)
+{
+	if (cx->bl != NULL) {
+		bmap_free(cx->bl);
+		free(cx->bl);
+		cx->bl = NULL;
 	}
-	return il;
+	link1_destroy(&cx->nlink1map);
+	link1_destroy(&cx->clink1map);
 }
 
-static void enomem(uint64_t addl_mem_needed)
+/* Allocate the block maps in memory, or in scratch files in spill_dir */
+static int blockmaps_alloc(struct fsck_cx *cx, uint64_t size, const char *spill_dir)
 {
-	log_crit( _("This system doesn't have enough memory and swap space to fsck this file system.\n"));
-	log_crit( _("Additional memory needed is approximately: %lluMB\n"),
-		  (unsigned long long)(addl_mem_needed / 1048576ULL));
-	log_crit( _("Please increase your swap space by that amount and run fsck.gfs2 again.\n"));
+	/* pass2 looks up the link maps by directory entry, so there is no
+	   point in reading ahead in them */
+	cx->bl = calloc(1, sizeof(*cx->bl));
+	if (cx->bl == NULL ||
+	    (opts.compress_map ? bmap_compressed_alloc(cx->bl, size) :
+	     bmap_alloc(cx->bl, BLOCKMAP_SIZE2(size) + 1, spill_dir, MADV_NORMAL)) != 0 ||
+	    bmap_alloc(&cx->nlink1map, BLOCKMAP_SIZE1(size) + 1, spill_dir, MADV_RANDOM) != 0 ||
+	    bmap_alloc(&cx->clink1map, BLOCKMAP_SIZE1(size) + 1, spill_dir, MADV_RANDOM) != 0) {
+		int err = errno;
+
+		blockmaps_free(cx);
+		errno = err;
+		return -1;
+	}
+	cx->bl->size = cx->nlink1map.size = cx->clink1map.size = size;
+	return 0;
+}
+
+/**
+ * blockmaps_create - Set up the block type map and the link count maps
+ *
+ * They take 4 bits for each block in the file system, which can be more than
+ * the memory there is, so if the estimate of what's available says they won't
+ * fit they are kept in scratch files which the kernel can page out instead.
+ */
+static int blockmaps_create(struct gfs2_sbd *sdp)
+{
+	struct fsck_cx *cx = fsck_cx(sdp);
+	uint64_t size = last_fs_block + 1;
+	uint64_t need = blockmaps_size(size);
+	uint64_t need_mb = (need + (1 << 20) - 1) >> 20;
+	uint64_t mem = blockmaps_mem();
+	const char *dir = scratch_dir();
+
+	if (need <= mem) {
+		if (blockmaps_alloc(cx, size, NULL) == 0)
+			return 0;
+		log_notice(_("Unable to allocate %"PRIu64"MB for the block maps, "
+		             "keeping them in scratch files in %s instead.\n"),
+		           need_mb, dir);
+	} else {
+		log_notice(_("The block maps need %"PRIu64"MB, more than the %"PRIu64"MB "
+		             "of memory for them, so they will be kept in scratch files in %s.\n"),
+		           need_mb, mem >> 20, dir);
+	}
+	if (blockmaps_alloc(cx, size, dir) == 0)
+		return 0;
+	log_crit(_("Unable to create %"PRIu64"MB of scratch files in %s: %s\n"),
+	         need_mb, dir, strerror(errno));
+	log_crit(_("Please use -s to give a directory with enough free space and run fsck.gfs2 again.\n"));
+	return -1;
 }
 
 /**
@@ -1950,32 +2592,22 @@ static void enomem(uint64_t addl_mem_needed)
  */
 int pass1(struct gfs2_sbd *sdp)
 {
-	struct osi_node *n, *next = NULL;
-	struct rgrp_tree *rgd;
-	uint64_t i;
-	uint64_t rg_count = 0;
 	struct timeval timer;
 	int ret = FSCK_OK;
-	uint64_t addl_mem_needed;
-
-	bl = gfs2_bmap_create(sdp, last_fs_block+1, &addl_mem_needed);
-	if (!bl) {
-		enomem(addl_mem_needed);
-		return FSCK_ERROR;
-	}
-	addl_mem_needed = link1_create(&nlink1map, last_fs_block+1);
-	if (addl_mem_needed) {
-		enomem(addl_mem_needed);
-		gfs2_bmap_destroy(sdp, bl);
+	struct fsck_cx *cx = fsck_cx(sdp);
+	unsigned threads = lgfs2_rgpool_threads(cx->pool);
+	struct pass1_job pj = {0};
+	struct lgfs2_rgjob job = {
+		.rj_work = pass1_check_rgrp,
+		.rj_done = pass1_check_job,
+		.rj_arg = &pj,
+		.rj_result_size = sizeof(struct pass1_checked *),
+		.rj_cancel = &fsck_abort,
+		.rj_window = 2 * threads,
+	};
+
+	if (blockmaps_create(sdp) != 0)
 		return FSCK_ERROR;
-	}
-	addl_mem_needed = link1_create(&clink1map, last_fs_block+1);
-	if (addl_mem_needed) {
-		enomem(addl_mem_needed);
-		link1_destroy(&nlink1map);
-		gfs2_bmap_destroy(sdp, bl);
-		return FSCK_ERROR;
-	}
 	osi_list_init(&gfs1_rindex_blks.list);
 
 	/* FIXME: In the gfs fsck, we had to mark things like the
@@ -1987,6 +2619,10 @@ int pass1(struct gfs2_sbd *sdp)
 	/* Make sure the system inodes are okay & represented in the bitmap. */
 	check_system_inodes(sdp);
 
+	/* Readahead goes through the block cache so it needs one to work with */
+	if (sdp->bcache != NULL && pass1_ring_init(sdp) != 0)
+		log_err(_("Unable to set up the inode read-ahead: %s\n"), strerror(errno));
+
 	/* So, do we do a depth first search starting at the root
 	 * inode, or use the rg bitmaps, or just read every fs block
 	 * to find the inodes?  If we use the depth first search, why
@@ -1995,41 +2631,55 @@ int pass1(struct gfs2_sbd *sdp)
 	 * things will probably be intolerably slow.  The current fsck
 	 * uses the rg bitmaps, so maybe that's the best way to start
 	 * things - we can change the method later if necessary.
+	 *
+	 * The threads' checks are only used while the output would be the
+	 * same: with debug messages, handle_di() reports every block it marks.
+	 * GFS1 rindex blocks look like dinodes in the bitmaps, so leave GFS1
+	 * to this thread.
 	 */
-	for (n = osi_first(&sdp->rgtree); n; n = next, rg_count++) {
-		if (fsck_abort) {
-			ret = FSCK_CANCELED;
-			goto out;
-		}
-		next = osi_next(n);
-		log_debug("Checking metadata in resource group #%"PRIu64"\n", rg_count);
-		rgd = (struct rgrp_tree *)n;
-		for (i = 0; i < rgd->rt_length; i++) {
-			log_debug("rgrp block %"PRIu64" (0x%"PRIx64") is now marked as 'rgrp data'\n",
-				   rgd->rt_addr + i, rgd->rt_addr + i);
-			if (gfs2_blockmap_set(bl, rgd->rt_addr + i, GFS2_BLKST_USED)) {
-				stack;
-				gfs2_special_free(&gfs1_rindex_blks);
-				ret = FSCK_ERROR;
-				goto out;
-			}
-			/* rgrps and bitmaps don't have bits to represent
-			   their blocks, so don't do this:
-			check_n_fix_bitmap(sdp, rgd, rgd->ri.ri_num.in_addr + i, 0,
-			gfs2_meta_rgrp);*/
-		}
-
-		ret = pass1_process_rgrp(sdp, rgd);
-		if (ret)
-			goto out;
+	pthread_mutex_init(&pj.pj_lock, NULL);
+	osi_list_init(&pj.pj_checked);
+	pj.pj_errors = errors_found;
+	pj.pj_serial = threads == 1 || sdp->gfs1 || print_level >= MSG_DEBUG;
+	ret = lgfs2_rgpool_run(cx->pool, sdp, &job);
+	if (fsck_abort) {
+		ret = FSCK_CANCELED;
+		goto out;
 	}
+	if (ret == -1) {
+		log_err(_("Failed to check the resource groups: %s\n"), strerror(errno));
+		ret = FSCK_ERROR;
+	}
+	if (ret)
+		goto out;
 	log_notice(_("Reconciling bitmaps.\n"));
 	gettimeofday(&timer, NULL);
-	pass5(sdp, bl);
+	/* pass5 goes through the block map in address order */
+	if (cx->bl->mapped)
+		madvise(cx->bl->map, cx->bl->mapsize, MADV_SEQUENTIAL);
+	if (cx->bl->chunks != NULL) {
+		/* Catch the chunks which were changed after they were compacted */
+		bmap_compact(cx->bl, 0, cx->bl->size);
+		log_info(_("Block map: %"PRIu64"kB, compressed from %"PRIu64"kB\n"),
+		         bmap_compressed_mem(cx->bl) >> 10, (BLOCKMAP_SIZE2(cx->bl->size) + 1) >> 10);
+	}
+	pass5(sdp, cx->bl);
 	print_pass_duration("reconcile_bitmaps", &timer);
 out:
+	/* The checks of the resource groups which weren't reached */
+	while (!osi_list_empty(&pj.pj_checked)) {
+		struct pass1_checked *pc = osi_list_entry(pj.pj_checked.next,
+		                                          struct pass1_checked, pc_list);
+		osi_list_del(&pc->pc_list);
+		pass1_checked_free(pc);
+	}
+	pthread_mutex_destroy(&pj.pj_lock);
+	pass1_ring_free();
 	gfs2_special_free(&gfs1_rindex_blks);
-	if (bl)
-		gfs2_bmap_destroy(sdp, bl);
+	if (cx->bl) {
+		bmap_free(cx->bl);
+		free(cx->bl);
+		cx->bl = NULL;
+	}
 	return ret;
 }
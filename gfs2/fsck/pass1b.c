@@ -142,7 +142,7 @@ static void clone_data_block(struct gfs2_sbd *sdp, struct duptree *dt,
  * constantly being changed. This function revises the duplicate handler so
  * that it accurately matches what's in the duplicate tree regarding this block
  */
-static void revise_dup_handler(uint64_t dup_blk, struct dup_handler *dh)
+static void revise_dup_handler(struct gfs2_sbd *sdp, uint64_t dup_blk, struct dup_handler *dh)
 {
 	osi_list_t *tmp;
 	struct duptree *dt;
@@ -152,7 +152,7 @@ static void revise_dup_handler(uint64_t dup_blk, struct dup_handler *dh)
 	dh->ref_count = 0;
 	dh->dt = NULL;
 
-	dt = dupfind(dup_blk);
+	dt = dupfind(sdp, dup_blk);
 	if (!dt)
 		return;
 
@@ -282,7 +282,7 @@ static void resolve_dup_references(struct gfs2_sbd *sdp, struct duptree *dt,
 			   this_ref == REF_AS_DATA) {
 			clone_data_block(sdp, dt, id);
 			dup_listent_delete(dt, id);
-			revise_dup_handler(dt->block, dh);
+			revise_dup_handler(sdp, dt->block, dh);
 			continue;
 		} else if (!(query( _("Okay to delete %s inode %lld (0x%llx)? "
 				      "(y/n) "),
@@ -354,13 +354,13 @@ static void resolve_dup_references(struct gfs2_sbd *sdp, struct duptree *dt,
 						_("duplicate referencing bad"),
 						GFS2_BLKST_FREE);
 				/* Remove the inode from the inode tree */
-				ii = inodetree_find(ip->i_num.in_addr);
+				ii = inodetree_find(sdp, ip->i_num.in_addr);
 				if (ii)
-					inodetree_delete(ii);
-				di = dirtree_find(ip->i_num.in_addr);
+					inodetree_delete(sdp, ii);
+				di = dirtree_find(sdp, ip->i_num.in_addr);
 				if (di)
-					dirtree_delete(di);
-				link1_set(&nlink1map, ip->i_num.in_addr,
+					dirtree_delete(sdp, di);
+				link1_set(&fsck_cx(sdp)->nlink1map, ip->i_num.in_addr,
 					  0);
 				/* We delete the dup_handler inode count and
 				   duplicate id BEFORE clearing the metadata,
@@ -631,7 +631,7 @@ static void resolve_last_reference(struct gfs2_sbd *sdp, struct duptree *dt,
 	fsck_inode_put(&ip); /* out, brelse, free */
 	log_debug(_("Done with duplicate reference to block 0x%llx\n"),
 		  (unsigned long long)dt->block);
-	dup_delete(dt);
+	dup_delete(sdp, dt);
 }
 
 /* handle_dup_blk - handle a duplicate block reference.
@@ -649,7 +649,7 @@ static int handle_dup_blk(struct gfs2_sbd *sdp, struct duptree *dt)
 	uint64_t dup_blk;
 
 	dup_blk = dt->block;
-	revise_dup_handler(dup_blk, &dh);
+	revise_dup_handler(sdp, dup_blk, &dh);
 
 	/* Log the duplicate references */
 	log_notice( _("Block %llu (0x%llx) has %d inodes referencing it"
@@ -717,7 +717,7 @@ static int handle_dup_blk(struct gfs2_sbd *sdp, struct duptree *dt)
 			   (unsigned long long)dt->block);
 		resolve_dup_references(sdp, dt, &dt->ref_invinode_list,
 				       &dh, 1, REF_TYPES);
-		revise_dup_handler(dup_blk, &dh);
+		revise_dup_handler(sdp, dup_blk, &dh);
 	}
 	/* Step 2 - eliminate reference from inodes that reference it as the
 	 *          wrong type.  For example, a data file referencing it as
@@ -732,7 +732,7 @@ static int handle_dup_blk(struct gfs2_sbd *sdp, struct duptree *dt)
 			   (unsigned long long)dt->block);
 		resolve_dup_references(sdp, dt, &dt->ref_inode_list, &dh, 0,
 				       acceptable_ref);
-		revise_dup_handler(dup_blk, &dh);
+		revise_dup_handler(sdp, dup_blk, &dh);
 	}
 	/* Step 3 - We have multiple dinodes referencing it as the correct
 	 *          type.  Just blast one of them.
@@ -746,7 +746,7 @@ static int handle_dup_blk(struct gfs2_sbd *sdp, struct duptree *dt)
 			   (unsigned long long)dt->block);
 		resolve_dup_references(sdp, dt, &dt->ref_inode_list, &dh, 0,
 				       REF_TYPES);
-		revise_dup_handler(dup_blk, &dh);
+		revise_dup_handler(sdp, dup_blk, &dh);
 	}
 	/* If there's still a last remaining reference, and it's a valid
 	   reference, use it to determine the correct block type for our
@@ -767,7 +767,7 @@ static int handle_dup_blk(struct gfs2_sbd *sdp, struct duptree *dt)
 				    (unsigned long long)dup_blk,
 				    (unsigned long long)dup_blk);
 			if (dh.dt)
-				dup_delete(dh.dt);
+				dup_delete(sdp, dh.dt);
 			check_n_fix_bitmap(sdp, NULL, dup_blk, 0,
 					   GFS2_BLKST_FREE);
 		}
@@ -914,7 +914,7 @@ int pass1b(struct gfs2_sbd *sdp)
 	log_info( _("Looking for duplicate blocks...\n"));
 
 	/* If there were no dups in the bitmap, we don't need to do anymore */
-	if (dup_blocks.osi_node == NULL) {
+	if (fsck_cx(sdp)->dup_blocks.osi_node == NULL) {
 		log_info( _("No duplicate blocks found\n"));
 		return FSCK_OK;
 	}
@@ -960,7 +960,7 @@ int pass1b(struct gfs2_sbd *sdp)
 	log_info( _("Handling duplicate blocks\n"));
 out:
 	/* Resolve all duplicates by clearing out the dup tree */
-        while ((n = osi_first(&dup_blocks))) {
+        while ((n = osi_first(&fsck_cx(sdp)->dup_blocks))) {
                 dt = (struct duptree *)n;
 		if (!skip_this_pass && !rc) /* no error & not asked to skip the rest */
 			handle_dup_blk(sdp, dt);
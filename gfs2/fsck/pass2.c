@@ -36,7 +36,7 @@ static int set_parent_dir(struct gfs2_sbd *sdp, struct lgfs2_inum child, struct
 {
 	struct dir_info *di;
 
-	di = dirtree_find(child.in_addr);
+	di = dirtree_find(sdp, child.in_addr);
 	if (!di) {
 		log_err(_("Unable to find block %"PRIu64" (0x%"PRIx64") in dir_info list\n"),
 		        child.in_addr, child.in_addr);
@@ -66,7 +66,7 @@ static int set_dotdot_dir(struct gfs2_sbd *sdp, uint64_t childblock, struct lgfs
 {
 	struct dir_info *di;
 
-	di = dirtree_find(childblock);
+	di = dirtree_find(sdp, childblock);
 	if (!di) {
 		log_err( _("Unable to find block %"PRIu64" (0x%" PRIx64
 			   ") in dir_info tree\n"), childblock, childblock);
@@ -120,8 +120,8 @@ static const char *de_type_string(uint8_t de_type)
 	return de_types[3]; /* invalid */
 }
 
-static int check_file_type(uint64_t block, uint8_t de_type, int q,
-			   int gfs1, int *isdir)
+static int check_file_type(struct gfs2_sbd *sdp, uint64_t block, uint8_t de_type,
+			   int q, int *isdir)
 {
 	struct dir_info *dt;
 
@@ -130,10 +130,10 @@ static int check_file_type(uint64_t block, uint8_t de_type, int q,
 		log_err( _("Invalid block type\n"));
 		return -1;
 	}
-	if (de_type == (gfs1 ? GFS_FILE_DIR : DT_DIR))
+	if (de_type == (sdp->gfs1 ? GFS_FILE_DIR : DT_DIR))
 		*isdir = 1;
 	/* Check if the dinode is in the dir tree */
-	dt = dirtree_find(block);
+	dt = dirtree_find(sdp, block);
 	/* This is a bit confusing, so let me explain:
 	   If the dirent says the inode supposed to be for a directory,
 	   it should be in the dir tree. If it is, no problem, return 0.
@@ -172,14 +172,14 @@ static int bad_formal_ino(struct gfs2_inode *ip, struct gfs2_dirent *dent,
 	int error;
 	struct lgfs2_inum inum = {0};
 
-	ii = inodetree_find(entry.in_addr);
+	ii = inodetree_find(sdp, entry.in_addr);
 	if (ii)
 		inum = ii->num;
 	else {
-		di = dirtree_find(entry.in_addr);
+		di = dirtree_find(sdp, entry.in_addr);
 		if (di)
 			inum = di->dinode;
-		else if (link1_type(&clink1map, entry.in_addr) == 1) {
+		else if (link1_type(&fsck_cx(sdp)->clink1map, entry.in_addr) == 1) {
 			struct gfs2_inode *dent_ip;
 
 			dent_ip = fsck_load_inode(ip->i_sbd, entry.in_addr);
@@ -215,7 +215,7 @@ static int bad_formal_ino(struct gfs2_inode *ip, struct gfs2_dirent *dent,
 			d->dr_inum.in_formal_ino = entry.in_formal_ino;
 			lgfs2_dirent_out(d, dent);
 			bmodified(bh);
-			incr_link_count(entry, ip, _("fixed reference"));
+			incr_link_count(sdp, entry, ip, _("fixed reference"));
 			set_parent_dir(sdp, entry, ip->i_num);
 		} else {
 			log_err( _("Directory entry not fixed.\n"));
@@ -392,7 +392,7 @@ static int wrong_leaf(struct gfs2_inode *ip, struct lgfs2_inum *entry,
 				   deal properly with the hard link. */
 				return 0;
 		}
-		error = incr_link_count(*entry, ip, _("moved valid reference"));
+		error = incr_link_count(sdp, *entry, ip, _("moved valid reference"));
 		if (error > 0 &&
 		    bad_formal_ino(ip, dent, *entry, tmp_name, q, d, bh) == 1)
 			return 1; /* nuke it */
@@ -472,7 +472,11 @@ static int basic_dentry_checks(struct gfs2_inode *ip, struct gfs2_dirent *dent,
 		return 1;
 	}
 
-	calculated_hash = gfs2_disk_hash(tmp_name, d->dr_name_len);
+	/* tmp_name stops at the first nul, which the hash has always used */
+	if (memchr(tmp_name, '\0', d->dr_name_len) == NULL)
+		calculated_hash = dentry_hash(dent);
+	else
+		calculated_hash = gfs2_disk_hash(tmp_name, d->dr_name_len);
 	if (d->dr_hash != calculated_hash){
 	        log_err( _("Dir entry with bad hash or name length\n"
 			   "\tHash found         = %u (0x%x)\n"
@@ -540,7 +544,7 @@ static int basic_dentry_checks(struct gfs2_inode *ip, struct gfs2_dirent *dent,
 		return 1;
 	}
 
-	error = check_file_type(entry->in_addr, d->dr_type, *q, sdp->gfs1, isdir);
+	error = check_file_type(sdp, entry->in_addr, d->dr_type, *q, isdir);
 	if (error < 0) {
 		log_err(_("Error: directory entry type is incompatible with block type at block %"PRIu64
 		          " (0x%"PRIx64") in directory inode %"PRIu64" (0x%"PRIx64").\n"),
@@ -571,14 +575,14 @@ static int basic_dentry_checks(struct gfs2_inode *ip, struct gfs2_dirent *dent,
 	}
 	/* We need to verify the formal inode number matches. If it doesn't,
 	   it needs to be deleted. */
-	ii = inodetree_find(entry->in_addr);
+	ii = inodetree_find(sdp, entry->in_addr);
 	if (ii)
 		inum = ii->num;
 	else {
-		di = dirtree_find(entry->in_addr);
+		di = dirtree_find(sdp, entry->in_addr);
 		if (di)
 			inum = di->dinode;
-		else if (link1_type(&nlink1map, entry->in_addr) == 1) {
+		else if (link1_type(&fsck_cx(sdp)->nlink1map, entry->in_addr) == 1) {
 			/* Since we don't have ii or di, the only way to
 			   validate formal_ino is to read in the inode, which
 			   would kill performance. So skip it for now. */
@@ -621,6 +625,7 @@ static int dirref_find(struct gfs2_inode *ip, struct gfs2_dirent *dent,
 		       char *filename, uint32_t *count, int *lindex,
 		       void *private)
 {
+	struct gfs2_sbd *sdp = ip->i_sbd;
 	/* the metawalk_fxn's private field must be set to the dentry
 	 * block we want to clear */
 	struct lgfs2_inum *entry = private;
@@ -656,7 +661,7 @@ static int dirref_find(struct gfs2_inode *ip, struct gfs2_dirent *dent,
 		log_err(_("The corrupt directory entry was not fixed.\n"));
 		goto out;
 	}
-	decr_link_count(entry->in_addr, ip->i_num.in_addr, ip->i_sbd->gfs1,
+	decr_link_count(sdp, entry->in_addr, ip->i_num.in_addr,
 	                _("bad original reference"));
 	dirent2_del(ip, bh, prev, dent);
 	log_err(_("The corrupt directory entry '%s' was deleted.\n"), fn);
@@ -683,8 +688,7 @@ out:
 static int check_suspicious_dirref(struct gfs2_sbd *sdp,
 				   struct lgfs2_inum *entry)
 {
-	struct osi_node *tmp, *next = NULL;
-	struct dir_info *dt;
+	struct dir_info *dt, *next = NULL;
 	struct gfs2_inode *ip;
 	uint64_t dirblk;
 	int error = FSCK_OK;
@@ -696,9 +700,8 @@ static int check_suspicious_dirref(struct gfs2_sbd *sdp,
 	log_debug("This dentry is good, but since this is a second "
 		  "reference to block 0x%"PRIx64", we need to check the "
 		  "original.\n", entry->in_addr);
-	for (tmp = osi_first(&dirtree); tmp; tmp = next) {
-		next = osi_next(tmp);
-		dt = (struct dir_info *)tmp;
+	for (dt = dirtree_first(sdp); dt; dt = next) {
+		next = dirtree_next(sdp, dt);
 		dirblk = dt->dinode.in_addr;
 		if (skip_this_pass || fsck_abort) /* asked to skip the rest */
 			break;
@@ -902,7 +905,7 @@ static int check_dentry(struct gfs2_inode *ip, struct gfs2_dirent *dent,
 	}
 dentry_is_valid:
 	/* This directory inode links to this inode via this dentry */
-	error = incr_link_count(entry, ip, _("valid reference"));
+	error = incr_link_count(sdp, entry, ip, _("valid reference"));
 	if (error == INCR_LINK_CHECK_ORIG) {
 		error = check_suspicious_dirref(sdp, &entry);
 	} else if (error == INCR_LINK_INO_MISMATCH) {
@@ -1077,6 +1080,7 @@ static void pad_with_leafblks(struct gfs2_inode *ip, __be64 *tbl,
 static int lost_leaf(struct gfs2_inode *ip, __be64 *tbl, uint64_t leafno,
 		     int ref_count, int lindex, struct gfs2_buffer_head *bh)
 {
+	struct gfs2_sbd *sdp = ip->i_sbd;
 	char *filename;
 	char *bh_end = bh->b_data + ip->i_sbd->sd_bsize;
 	struct gfs2_dirent *dent;
@@ -1138,13 +1142,13 @@ static int lost_leaf(struct gfs2_inode *ip, __be64 *tbl, uint64_t leafno,
 					return error;
 				}
 				/* This inode is linked from lost+found */
-				incr_link_count(de.dr_inum, lf_dip,
+				incr_link_count(sdp, de.dr_inum, lf_dip,
 						_("from lost+found"));
 				/* If it's a directory, lost+found is
 				   back-linked to it via .. */
 				if (isdir) {
 					struct lgfs2_inum no = lf_dip->i_num;
-					incr_link_count(no, NULL, _("to lost+found"));
+					incr_link_count(sdp, no, NULL, _("to lost+found"));
 				}
 				log_err(_("Relocated \"%s\", block %"PRIu64" (0x%"PRIx64") to lost+found.\n"),
 					tmp_name, de.dr_inum.in_addr, de.dr_inum.in_addr);
@@ -1947,7 +1951,7 @@ static int check_system_dir(struct gfs2_inode *sysinode, const char *dirname,
 				return -errno;
 			}
 			/* This system inode is linked to itself via '.' */
-			incr_link_count(no, sysinode, "sysinode \".\"");
+			incr_link_count(sysinode->i_sbd, no, sysinode, "sysinode \".\"");
 			ds.entry_count++;
 		} else
 			log_err( _("The directory was not fixed.\n"));
@@ -2021,7 +2025,7 @@ static int pass2_check_dir(struct gfs2_sbd *sdp, struct gfs2_inode *ip)
 	if (error > 0) {
 		struct dir_info *di;
 
-		di = dirtree_find(dirblk);
+		di = dirtree_find(sdp, dirblk);
 		if (!di) {
 			stack;
 			return FSCK_ERROR;
@@ -2068,7 +2072,7 @@ static int pass2_check_dir(struct gfs2_sbd *sdp, struct gfs2_inode *ip)
 				return -errno;
 			}
 			/* directory links to itself via '.' */
-			incr_link_count(no, ip, _("\". (itself)\""));
+			incr_link_count(sdp, no, ip, _("\". (itself)\""));
 			ds.entry_count++;
 			log_err(_("The directory was fixed.\n"));
 		} else {
@@ -2102,9 +2106,8 @@ static int pass2_check_dir(struct gfs2_sbd *sdp, struct gfs2_inode *ip)
  */
 int pass2(struct gfs2_sbd *sdp)
 {
-	struct osi_node *tmp, *next = NULL;
 	struct gfs2_inode *ip;
-	struct dir_info *dt;
+	struct dir_info *dt, *next = NULL;
 	uint64_t dirblk;
 	int error;
 
@@ -2138,10 +2141,9 @@ int pass2(struct gfs2_sbd *sdp)
 		return FSCK_OK;
 	log_info( _("Checking directory inodes.\n"));
 	/* Grab each directory inode, and run checks on it */
-	for (tmp = osi_first(&dirtree); tmp; tmp = next) {
-		next = osi_next(tmp);
+	for (dt = dirtree_first(sdp); dt; dt = next) {
+		next = dirtree_next(sdp, dt);
 
-		dt = (struct dir_info *)tmp;
 		dirblk = dt->dinode.in_addr;
 		warm_fuzzy_stuff(dirblk);
 		if (skip_this_pass || fsck_abort) /* if asked to skip the rest */
@@ -39,7 +39,7 @@ static int attach_dotdot_to(struct gfs2_sbd *sdp, uint64_t newdotdot,
 	if (gfs2_dirent_del(ip, filename, filename_len))
 		log_warn( _("Unable to remove \"..\" directory entry.\n"));
 	else
-		decr_link_count(olddotdot, block, sdp->gfs1, _("old \"..\""));
+		decr_link_count(sdp, olddotdot, block, _("old \"..\""));
 	no = pip->i_num;
 	err = dir_add(ip, filename, filename_len, &no,
 		      (sdp->gfs1 ? GFS_FILE_DIR : DT_DIR));
@@ -48,7 +48,7 @@ static int attach_dotdot_to(struct gfs2_sbd *sdp, uint64_t newdotdot,
 		        filename, strerror(errno));
 		exit(FSCK_ERROR);
 	}
-	incr_link_count(no, ip, _("new \"..\""));
+	incr_link_count(sdp, no, ip, _("new \"..\""));
 	fsck_inode_put(&ip);
 	fsck_inode_put(&pip);
 	return 0;
@@ -83,9 +83,9 @@ static struct dir_info *mark_and_return_parent(struct gfs2_sbd *sdp,
 	log_notice(_("'..' has %"PRIu64" (0x%"PRIx64"), treewalk has %"PRIu64" (0x%"PRIx64")\n"),
 	           di->dotdot_parent.in_addr, di->dotdot_parent.in_addr, di->treewalk_parent, di->treewalk_parent);
 	q_dotdot = bitmap_type(sdp, di->dotdot_parent.in_addr);
-	dt_dotdot = dirtree_find(di->dotdot_parent.in_addr);
+	dt_dotdot = dirtree_find(sdp, di->dotdot_parent.in_addr);
 	q_treewalk = bitmap_type(sdp, di->treewalk_parent);
-	dt_treewalk = dirtree_find(di->treewalk_parent);
+	dt_treewalk = dirtree_find(sdp, di->treewalk_parent);
 	/* if the dotdot entry isn't a directory, but the
 	 * treewalk is, treewalk is correct - if the treewalk
 	 * entry isn't a directory, but the dotdot is, dotdot
@@ -147,7 +147,7 @@ static struct dir_info *mark_and_return_parent(struct gfs2_sbd *sdp,
 	return NULL;
 
 out:
-	pdi = dirtree_find(di->dotdot_parent.in_addr);
+	pdi = dirtree_find(sdp, di->dotdot_parent.in_addr);
 
 	return pdi;
 }
@@ -160,43 +160,42 @@ out:
  */
 int pass3(struct gfs2_sbd *sdp)
 {
-	struct osi_node *tmp, *next = NULL;
-	struct dir_info *di, *tdi;
+	struct dir_info *di, *tdi, *next = NULL;
 	struct gfs2_inode *ip;
 	int q;
 
-	di = dirtree_find(sdp->md.rooti->i_num.in_addr);
+	di = dirtree_find(sdp, sdp->md.rooti->i_num.in_addr);
 	if (di) {
 		log_info( _("Marking root inode connected\n"));
 		di->checked = 1;
 	}
 	if (sdp->gfs1) {
-		di = dirtree_find(sdp->md.statfs->i_num.in_addr);
+		di = dirtree_find(sdp, sdp->md.statfs->i_num.in_addr);
 		if (di) {
 			log_info( _("Marking GFS1 statfs file inode "
 				    "connected\n"));
 			di->checked = 1;
 		}
-		di = dirtree_find(sdp->md.jiinode->i_num.in_addr);
+		di = dirtree_find(sdp, sdp->md.jiinode->i_num.in_addr);
 		if (di) {
 			log_info( _("Marking GFS1 jindex file inode "
 				    "connected\n"));
 			di->checked = 1;
 		}
-		di = dirtree_find(sdp->md.riinode->i_num.in_addr);
+		di = dirtree_find(sdp, sdp->md.riinode->i_num.in_addr);
 		if (di) {
 			log_info( _("Marking GFS1 rindex file inode "
 				    "connected\n"));
 			di->checked = 1;
 		}
-		di = dirtree_find(sdp->md.qinode->i_num.in_addr);
+		di = dirtree_find(sdp, sdp->md.qinode->i_num.in_addr);
 		if (di) {
 			log_info( _("Marking GFS1 quota file inode "
 				    "connected\n"));
 			di->checked = 1;
 		}
 	} else {
-		di = dirtree_find(sdp->master_dir->i_num.in_addr);
+		di = dirtree_find(sdp, sdp->master_dir->i_num.in_addr);
 		if (di) {
 			log_info( _("Marking master directory inode "
 				    "connected\n"));
@@ -209,9 +208,8 @@ int pass3(struct gfs2_sbd *sdp)
 	 * find a parent, put in lost+found.
 	 */
 	log_info( _("Checking directory linkage.\n"));
-	for (tmp = osi_first(&dirtree); tmp; tmp = next) {
-		next = osi_next(tmp);
-		di = (struct dir_info *)tmp;
+	for (di = dirtree_first(sdp); di; di = next) {
+		next = dirtree_next(sdp, di);
 		while (!di->checked) {
 			/* FIXME: Change this so it returns success or
 			 * failure and put the parent inode in a
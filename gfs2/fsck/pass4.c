@@ -151,7 +151,7 @@ static void handle_inconsist(struct gfs2_sbd *sdp, uint64_t no_addr,
 	}
 }
 
-static int adjust_lf_links(int lf_addition)
+static int adjust_lf_links(struct gfs2_sbd *sdp, int lf_addition)
 {
 	struct dir_info *lf_di;
 
@@ -161,7 +161,7 @@ static int adjust_lf_links(int lf_addition)
 	if (!lf_addition)
 		return 0;
 
-	if (!(lf_di = dirtree_find(lf_dip->i_num.in_addr))) {
+	if (!(lf_di = dirtree_find(sdp, lf_dip->i_num.in_addr))) {
 		log_crit(_("Unable to find lost+found inode in "
 			   "inode_hash!!\n"));
 		return -1;
@@ -173,17 +173,15 @@ static int adjust_lf_links(int lf_addition)
 
 static int scan_inode_list(struct gfs2_sbd *sdp)
 {
-	struct osi_node *tmp, *next = NULL;
-	struct inode_info *ii;
+	struct inode_info *ii, *next = NULL;
 	int lf_addition = 0;
 
 	/* FIXME: should probably factor this out into a generic
 	 * scanning fxn */
-	for (tmp = osi_first(&inodetree); tmp; tmp = next) {
+	for (ii = inodetree_first(sdp); ii; ii = next) {
 		if (skip_this_pass || fsck_abort) /* if asked to skip the rest */
 			return 0;
-		next = osi_next(tmp);
-		ii = (struct inode_info *)tmp;
+		next = inodetree_next(sdp, ii);
 		/* Don't check reference counts on the special gfs files */
 		if (sdp->gfs1 &&
 		    ((ii->num.in_addr == sdp->md.riinode->i_num.in_addr) ||
@@ -202,24 +200,22 @@ static int scan_inode_list(struct gfs2_sbd *sdp)
 		log_debug( _("block %llu (0x%llx) has link count %d\n"),
 			 (unsigned long long)ii->num.in_addr,
 			 (unsigned long long)ii->num.in_addr, ii->di_nlink);
-	} /* osi_list_foreach(tmp, list) */
+	}
 
-	return adjust_lf_links(lf_addition);
+	return adjust_lf_links(sdp, lf_addition);
 }
 
 static int scan_dir_list(struct gfs2_sbd *sdp)
 {
-	struct osi_node *tmp, *next = NULL;
-	struct dir_info *di;
+	struct dir_info *di, *next = NULL;
 	int lf_addition = 0;
 
 	/* FIXME: should probably factor this out into a generic
 	 * scanning fxn */
-	for (tmp = osi_first(&dirtree); tmp; tmp = next) {
+	for (di = dirtree_first(sdp); di; di = next) {
 		if (skip_this_pass || fsck_abort) /* if asked to skip the rest */
 			return 0;
-		next = osi_next(tmp);
-		di = (struct dir_info *)tmp;
+		next = dirtree_next(sdp, di);
 		/* Don't check reference counts on the special gfs files */
 		if (sdp->gfs1 &&
 		    di->dinode.in_addr == sdp->md.jiinode->i_num.in_addr)
@@ -234,9 +230,9 @@ static int scan_dir_list(struct gfs2_sbd *sdp)
 		}
 		log_debug(_("block %"PRIu64" (0x%"PRIx64") has link count %d\n"),
 		          di->dinode.in_addr, di->dinode.in_addr, di->di_nlink);
-	} /* osi_list_foreach(tmp, list) */
+	}
 
-	return adjust_lf_links(lf_addition);
+	return adjust_lf_links(sdp, lf_addition);
 }
 
 static int scan_nlink1_list(struct gfs2_sbd *sdp)
@@ -248,10 +244,10 @@ static int scan_nlink1_list(struct gfs2_sbd *sdp)
 	for (blk = 0; blk < last_fs_block; blk++) {
 		if (skip_this_pass || fsck_abort)
 			return 0;
-		if (link1_type(&nlink1map, blk) == 0)
+		if (link1_type(&fsck_cx(sdp)->nlink1map, blk) == 0)
 			continue;
 
-		if (link1_type(&clink1map, blk) == 0) {
+		if (link1_type(&fsck_cx(sdp)->clink1map, blk) == 0) {
 			/* In other cases, counted_links is a pointer to a
 			   real count that gets incremented when it's added
 			   to lost+found. In this case, however, there's not a
@@ -262,7 +258,7 @@ static int scan_nlink1_list(struct gfs2_sbd *sdp)
 				continue;
 		}
 	}
-	return adjust_lf_links(lf_addition);
+	return adjust_lf_links(sdp, lf_addition);
 }
 
 /**
@@ -14,115 +14,161 @@
 
 #define GFS1_BLKST_USEDMETA 4
 
+/* The number of bitmap bytes checked at a time */
+#define BITMAP_CHUNK 64
+
+static void check_block(struct gfs2_sbd *sdp, struct gfs2_bmap *bl,
+                        unsigned char rg_status, uint64_t block, uint32_t *count)
+{
+	int q;
+
+	q = block_type(bl, block);
+	/* GFS1 file systems will have to suffer from slower fsck run
+	 * times because in GFS, there's no 1:1 relationship between
+	 * bits and counts. If a bit is marked "dinode" in GFS1, it
+	 * may be dinode -OR- any kind of metadata. I consider GFS1 to
+	 * be a rare exception, so acceptable loss at this point. So
+	 * we must determine whether it's really a dinode or other
+	 * metadata by reading it in. */
+	if (sdp->gfs1 && q == GFS2_BLKST_DINODE) {
+		struct gfs2_buffer_head *bh;
+
+		bh = bread(sdp, block);
+		if (gfs2_check_meta(bh->b_data, GFS2_METATYPE_DI) == 0)
+			count[GFS2_BLKST_DINODE]++;
+		else
+			count[GFS1_BLKST_USEDMETA]++;
+		brelse(bh);
+	} else {
+		count[q]++;
+	}
+
+	/* If one node opens a file and another node deletes it, we
+	   may be left with a block that appears to be "unlinked" in
+	   the bitmap, but nothing links to it. This is a valid case
+	   and should be cleaned up by the file system eventually.
+	   So we ignore it. */
+	if (q == GFS2_BLKST_UNLINKED) {
+		log_err( _("Unlinked inode found at block %llu "
+			   "(0x%llx).\n"),
+			 (unsigned long long)block,
+			 (unsigned long long)block);
+		if (query(_("Do you want to reclaim the block? "
+			   "(y/n) "))) {
+			lgfs2_rgrp_t rg = gfs2_blk2rgrpd(sdp, block);
+			if (gfs2_set_bitmap(rg, block, GFS2_BLKST_FREE))
+				log_err(_("Unlinked block %llu "
+					  "(0x%llx) bitmap not fixed."
+					  "\n"),
+					(unsigned long long)block,
+					(unsigned long long)block);
+			else {
+				log_err(_("Unlinked block %llu "
+					  "(0x%llx) bitmap fixed.\n"),
+					(unsigned long long)block,
+					(unsigned long long)block);
+				count[GFS2_BLKST_UNLINKED]--;
+				count[GFS2_BLKST_FREE]++;
+			}
+		} else {
+			log_info( _("Unlinked block found at block %llu"
+				    " (0x%llx), left unchanged.\n"),
+				(unsigned long long)block,
+				(unsigned long long)block);
+		}
+	} else if (rg_status != q) {
+		log_err( _("Block %llu (0x%llx) bitmap says %u (%s) "
+			   "but FSCK saw %u (%s)\n"),
+			 (unsigned long long)block,
+			 (unsigned long long)block, rg_status,
+			 block_type_string(rg_status), q,
+			 block_type_string(q));
+		if (q) /* Don't print redundant "free" */
+			log_err( _("Metadata type is %u (%s)\n"), q,
+				 block_type_string(q));
+
+		if (query(_("Fix bitmap for block %llu (0x%llx) ? (y/n) "),
+			 (unsigned long long)block,
+			 (unsigned long long)block)) {
+			lgfs2_rgrp_t rg = gfs2_blk2rgrpd(sdp, block);
+			if (gfs2_set_bitmap(rg, block, q))
+				log_err( _("Repair failed.\n"));
+			else
+				log_err( _("Fixed.\n"));
+		} else
+			log_err( _("Bitmap at block %llu (0x%llx) left inconsistent\n"),
+				(unsigned long long)block,
+				(unsigned long long)block);
+	}
+}
+
+/* Copy the blockmap bits for len * GFS2_NBBY blocks from block into out */
+static void blockmap_extract(struct gfs2_bmap *bl, uint64_t block, unsigned char *out,
+                             unsigned len)
+{
+	const unsigned char *map;
+	unsigned shift = BLOCKMAP_BYTE_OFFSET2(block);
+	unsigned char buf[BITMAP_CHUNK + 1];
+	unsigned i;
+
+	if (bl->chunks != NULL) {
+		bmap_compressed_read(bl, BLOCKMAP_SIZE2(block), buf, len + 1);
+		map = buf;
+	} else {
+		map = bl->map + BLOCKMAP_SIZE2(block);
+	}
+	if (shift == 0) {
+		memcpy(out, map, len);
+		return;
+	}
+	for (i = 0; i < len; i++)
+		out[i] = (map[i] >> shift) | (map[i + 1] << (8 - shift));
+}
+
 static int check_block_status(struct gfs2_sbd *sdp,  struct gfs2_bmap *bl,
 			      char *buffer, unsigned int buflen,
 			      uint64_t *rg_block, uint64_t rg_data,
 			      uint32_t *count)
 {
-	unsigned char *byte, *end;
-	unsigned int bit;
-	unsigned char rg_status;
-	int q;
+	unsigned char *bits = (unsigned char *)buffer;
+	unsigned char map[BITMAP_CHUNK];
+	unsigned int off, len, bit;
+	uint32_t chunk[4];
 	uint64_t block;
 
-	/* FIXME verify cast */
-	byte = (unsigned char *) buffer;
-	bit = 0;
-	end = (unsigned char *) buffer + buflen;
-
-	while (byte < end) {
-		rg_status = ((*byte >> bit) & GFS2_BIT_MASK);
+	for (off = 0; off < buflen; off += len) {
+		len = buflen - off < BITMAP_CHUNK ? buflen - off : BITMAP_CHUNK;
 		block = rg_data + *rg_block;
 		warm_fuzzy_stuff(block);
 		if (skip_this_pass || fsck_abort) /* if asked to skip the rest */
 			return 0;
 
-		q = block_type(bl, block);
-		/* GFS1 file systems will have to suffer from slower fsck run
-		 * times because in GFS, there's no 1:1 relationship between
-		 * bits and counts. If a bit is marked "dinode" in GFS1, it
-		 * may be dinode -OR- any kind of metadata. I consider GFS1 to
-		 * be a rare exception, so acceptable loss at this point. So
-		 * we must determine whether it's really a dinode or other
-		 * metadata by reading it in. */
-		if (sdp->gfs1 && q == GFS2_BLKST_DINODE) {
-			struct gfs2_buffer_head *bh;
-
-			bh = bread(sdp, block);
-			if (gfs2_check_meta(bh->b_data, GFS2_METATYPE_DI) == 0)
-				count[GFS2_BLKST_DINODE]++;
-			else
-				count[GFS1_BLKST_USEDMETA]++;
-			brelse(bh);
-		} else {
-			count[q]++;
-		}
-
-		/* If one node opens a file and another node deletes it, we
-		   may be left with a block that appears to be "unlinked" in
-		   the bitmap, but nothing links to it. This is a valid case
-		   and should be cleaned up by the file system eventually.
-		   So we ignore it. */
-		if (q == GFS2_BLKST_UNLINKED) {
-			log_err( _("Unlinked inode found at block %llu "
-				   "(0x%llx).\n"),
-				 (unsigned long long)block,
-				 (unsigned long long)block);
-			if (query(_("Do you want to reclaim the block? "
-				   "(y/n) "))) {
-				lgfs2_rgrp_t rg = gfs2_blk2rgrpd(sdp, block);
-				if (gfs2_set_bitmap(rg, block, GFS2_BLKST_FREE))
-					log_err(_("Unlinked block %llu "
-						  "(0x%llx) bitmap not fixed."
-						  "\n"),
-						(unsigned long long)block,
-						(unsigned long long)block);
-				else {
-					log_err(_("Unlinked block %llu "
-						  "(0x%llx) bitmap fixed.\n"),
-						(unsigned long long)block,
-						(unsigned long long)block);
-					count[GFS2_BLKST_UNLINKED]--;
-					count[GFS2_BLKST_FREE]++;
-				}
-			} else {
-				log_info( _("Unlinked block found at block %llu"
-					    " (0x%llx), left unchanged.\n"),
-					(unsigned long long)block,
-					(unsigned long long)block);
+		/* Usually the bitmap agrees with what we saw, so just count it.
+		   Unlinked blocks and GFS1 dinodes need a closer look. */
+		blockmap_extract(bl, block, map, len);
+		if (memcmp(map, bits + off, len) == 0) {
+			lgfs2_bm_count(map, len, chunk);
+			if (chunk[GFS2_BLKST_UNLINKED] == 0 &&
+			    !(sdp->gfs1 && chunk[GFS2_BLKST_DINODE] != 0)) {
+				for (bit = GFS2_BLKST_FREE; bit <= GFS2_BLKST_DINODE; bit++)
+					count[bit] += chunk[bit];
+				*rg_block += len * GFS2_NBBY;
+				continue;
 			}
-		} else if (rg_status != q) {
-			log_err( _("Block %llu (0x%llx) bitmap says %u (%s) "
-				   "but FSCK saw %u (%s)\n"),
-				 (unsigned long long)block,
-				 (unsigned long long)block, rg_status,
-				 block_type_string(rg_status), q,
-				 block_type_string(q));
-			if (q) /* Don't print redundant "free" */
-				log_err( _("Metadata type is %u (%s)\n"), q,
-					 block_type_string(q));
-
-			if (query(_("Fix bitmap for block %llu (0x%llx) ? (y/n) "),
-				 (unsigned long long)block,
-				 (unsigned long long)block)) {
-				lgfs2_rgrp_t rg = gfs2_blk2rgrpd(sdp, block);
-				if (gfs2_set_bitmap(rg, block, q))
-					log_err( _("Repair failed.\n"));
-				else
-					log_err( _("Fixed.\n"));
-			} else
-				log_err( _("Bitmap at block %llu (0x%llx) left inconsistent\n"),
-					(unsigned long long)block,
-					(unsigned long long)block);
 		}
-		(*rg_block)++;
-		bit += GFS2_BIT_SIZE;
-		if (bit >= 8){
-			bit = 0;
-			byte++;
+		for (bit = 0; bit < len * GFS2_NBBY; bit++) {
+			unsigned char *byte = bits + off + bit / GFS2_NBBY;
+			unsigned char rg_status;
+
+			rg_status = (*byte >> ((bit % GFS2_NBBY) * GFS2_BIT_SIZE)) & GFS2_BIT_MASK;
+			block = rg_data + *rg_block;
+			warm_fuzzy_stuff(block);
+			if (skip_this_pass || fsck_abort)
+				return 0;
+			check_block(sdp, bl, rg_status, block, count);
+			(*rg_block)++;
 		}
 	}
-
 	return 0;
 }
 
@@ -191,11 +237,7 @@ static void update_rgrp(struct gfs2_sbd *sdp, struct rgrp_tree *rgp,
 		if (query( _("Update resource group counts? (y/n) "))) {
 			log_warn( _("Resource group counts updated\n"));
 			/* write out the rgrp */
-			if (sdp->gfs1)
-				lgfs2_gfs_rgrp_out(rgp, rgp->bits[0].bi_data);
-			else
-				lgfs2_rgrp_out(rgp, rgp->bits[0].bi_data);
-			rgp->bits[0].bi_modified = 1;
+			lgfs2_rgrp_hdr_update(sdp, rgp);
 		} else
 			log_err( _("Resource group counts left inconsistent\n"));
 	}
@@ -225,7 +267,13 @@ int pass5(struct gfs2_sbd *sdp, struct gfs2_bmap *bl)
 
 		rg_count++;
 		/* Compare the bitmaps and report the differences */
+		if (lgfs2_rgrp_pin(rgp) != 0) {
+			log_err(_("Unable to read the bitmaps of resource group %"PRIu64": %s\n"),
+			        rgp->rt_addr, strerror(errno));
+			continue;
+		}
 		update_rgrp(sdp, rgp, bl, count);
+		lgfs2_rgrp_unpin(rgp);
 	}
 	/* Fix up superblock info based on this - don't think there's
 	 * anything to do here... */
@@ -63,6 +63,7 @@ static void find_journaled_rgs(struct gfs2_sbd *sdp)
 		          j, ip->i_num.in_addr);
 		jblocks = ip->i_size / sdp->sd_bsize;
 		false_count = 0;
+		lgfs2_mpcache_start(ip);
 		for (b = 0; b < jblocks; b++) {
 			block_map(ip, b, &new, &dblock, NULL, 0);
 			if (!dblock)
@@ -75,6 +76,7 @@ static void find_journaled_rgs(struct gfs2_sbd *sdp)
 			}
 			brelse(bh);
 		}
+		lgfs2_mpcache_stop(ip);
 		log_debug("\n%d false positives identified.\n", false_count);
 	}
 }
@@ -265,11 +267,10 @@ static int find_shortest_rgdist(struct gfs2_sbd *sdp, uint64_t *dist_array,
 static uint64_t count_usedspace(struct gfs2_sbd *sdp, int first,
 				struct gfs2_buffer_head *bh)
 {
-	int off, x, y, bytes_to_check;
-	uint32_t rg_used = 0;
-	unsigned int state;
+	uint32_t count[4];
+	int off;
 
-	/* Count up the free blocks in the bitmap */
+	/* Count up the used blocks in the bitmap */
 	if (first) {
 		if (sdp->gfs1)
 			off = sizeof(struct gfs_rgrp);
@@ -277,26 +278,8 @@ static uint64_t count_usedspace(struct gfs2_sbd *sdp, int first,
 			off = sizeof(struct gfs2_rgrp);
 	} else
 		off = sizeof(struct gfs2_meta_header);
-	bytes_to_check = sdp->sd_bsize - off;
-	for (x = 0; x < bytes_to_check; x++) {
-		unsigned char *byte;
-
-		byte = (unsigned char *)&bh->b_data[off + x];
-		if (*byte == 0x55) {
-			rg_used += GFS2_NBBY;
-			continue;
-		}
-		if (*byte == 0x00)
-			continue;
-		for (y = 0; y < GFS2_NBBY; y++) {
-			state = (*byte >> (GFS2_BIT_SIZE * y)) & GFS2_BIT_MASK;
-			if (state == GFS2_BLKST_FREE ||
-			    state == GFS2_BLKST_UNLINKED)
-				continue;
-			rg_used++;
-		}
-	}
-	return rg_used;
+	lgfs2_bm_count((unsigned char *)bh->b_data + off, sdp->sd_bsize - off, count);
+	return count[GFS2_BLKST_USED] + count[GFS2_BLKST_DINODE];
 }
 
 /*
@@ -873,12 +856,13 @@ static int rewrite_rg_block(struct gfs2_sbd *sdp, struct rgrp_tree *rg,
 
 	log_err(_("Attempting to repair the resource group.\n"));
 
-	buf = calloc(1, sdp->sd_bsize);
+	buf = lgfs2_dev_buf(sdp, sdp->sd_bsize);
 	if (buf == NULL) {
 		log_err(_("Failed to allocate resource group block: %s"), strerror(errno));
 		return 1;
 	}
-	ret = pread(sdp->device_fd, buf, sdp->sd_bsize, errblock * sdp->sd_bsize);
+	lgfs2_bcache_invalidate(sdp, errblock, 1);
+	ret = lgfs2_dev_pread(sdp, buf, sdp->sd_bsize, errblock * sdp->sd_bsize);
 	if (ret != sdp->sd_bsize) {
 		log_err(_("Failed to read resource group block %"PRIu64": %s\n"),
 		        errblock, strerror(errno));
@@ -899,7 +883,7 @@ static int rewrite_rg_block(struct gfs2_sbd *sdp, struct rgrp_tree *rg,
 		else
 			lgfs2_rgrp_out(rg, buf);
 	}
-	ret = pwrite(sdp->device_fd, buf, sdp->sd_bsize, errblock * sdp->sd_bsize);
+	ret = lgfs2_dev_pwrite(sdp, buf, sdp->sd_bsize, errblock * sdp->sd_bsize);
 	if (ret != sdp->sd_bsize) {
 		log_err(_("Failed to write resource group block %"PRIu64": %s\n"),
 		        errblock, strerror(errno));
@@ -10,11 +10,15 @@
 #include <termios.h>
 #include <libintl.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
 #define _(String) gettext(String)
 
 #include <logging.h>
 #include "libgfs2.h"
 #include "metawalk.h"
+#include "inode_hash.h"
 #include "util.h"
 
 const char *reftypes[REF_TYPES + 1] = {"data", "metadata",
@@ -170,7 +174,8 @@ int fsck_query(const char *format, ...)
 	int ret = 0;
 
 	errors_found++;
-	fsck_abort = 0;
+	/* Atomic as the rgrp pool's threads watch it (see rj_cancel) */
+	__atomic_store_n(&fsck_abort, 0, __ATOMIC_RELAXED);
 	if (opts.yes) {
 		errors_corrected++;
 		return 1;
@@ -198,7 +203,7 @@ int fsck_query(const char *format, ...)
 						     "ac");
 			if (response == 'a') {
 				ret = 0;
-				fsck_abort = 1;
+				__atomic_store_n(&fsck_abort, 1, __ATOMIC_RELAXED);
 				break;
 			}
 			printf("Continuing.\n");
@@ -227,9 +232,9 @@ int fsck_query(const char *format, ...)
  * This will return the number of references to the block.
  *
  * create - will be set if the call is supposed to create the reference. */
-static struct duptree *gfs2_dup_set(uint64_t dblock, int create)
+static struct duptree *gfs2_dup_set(struct gfs2_sbd *sdp, uint64_t dblock, int create)
 {
-	struct osi_node **newn = &dup_blocks.osi_node, *parent = NULL;
+	struct osi_node **newn = &fsck_cx(sdp)->dup_blocks.osi_node, *parent = NULL;
 	struct duptree *dt;
 
 	/* Figure out where to put new node */
@@ -261,7 +266,7 @@ static struct duptree *gfs2_dup_set(uint64_t dblock, int create)
 	osi_list_init(&dt->ref_inode_list);
 	osi_list_init(&dt->ref_invinode_list);
 	osi_link_node(&dt->node, parent, newn);
-	osi_insert_color(&dt->node, &dup_blocks);
+	osi_insert_color(&dt->node, &fsck_cx(sdp)->dup_blocks);
 
 	return dt;
 }
@@ -329,6 +334,7 @@ int count_dup_meta_refs(struct duptree *dt)
 int add_duplicate_ref(struct gfs2_inode *ip, uint64_t block,
 		      enum dup_ref_type reftype, int first, int inode_valid)
 {
+	struct gfs2_sbd *sdp = ip->i_sbd;
 	struct inode_with_dups *id;
 	struct duptree *dt;
 
@@ -337,7 +343,7 @@ int add_duplicate_ref(struct gfs2_inode *ip, uint64_t block,
 	/* If this is not the first reference (i.e. all calls from pass1) we
 	   need to create the duplicate reference. If this is pass1b, we want
 	   to ignore references that aren't found. */
-	dt = gfs2_dup_set(block, !first);
+	dt = gfs2_dup_set(sdp, block, !first);
 	if (!dt)        /* If this isn't a duplicate */
 		return META_IS_GOOD;
 
@@ -428,53 +434,26 @@ int add_duplicate_ref(struct gfs2_inode *ip, uint64_t block,
 	return META_IS_GOOD;
 }
 
-struct dir_info *dirtree_insert(struct lgfs2_inum inum)
+struct dir_info *dirtree_insert(struct gfs2_sbd *sdp, struct lgfs2_inum inum)
 {
-	struct osi_node **newn = &dirtree.osi_node, *parent = NULL;
 	struct dir_info *data;
+	int added;
 
-	/* Figure out where to put new node */
-	while (*newn) {
-		struct dir_info *cur = (struct dir_info *)*newn;
-
-		parent = *newn;
-		if (inum.in_addr < cur->dinode.in_addr)
-			newn = &((*newn)->osi_left);
-		else if (inum.in_addr > cur->dinode.in_addr)
-			newn = &((*newn)->osi_right);
-		else
-			return cur;
-	}
-
-	data = calloc(1, sizeof(struct dir_info));
+	data = blktab_insert(&fsck_cx(sdp)->dirtree, inum.in_addr, &added);
 	if (!data) {
 		log_crit( _("Unable to allocate dir_info structure\n"));
 		return NULL;
 	}
-	/* Add new node and rebalance tree. */
-	data->dinode.in_addr = inum.in_addr;
-	data->dinode.in_formal_ino = inum.in_formal_ino;
-	osi_link_node(&data->node, parent, newn);
-	osi_insert_color(&data->node, &dirtree);
-
+	if (added) {
+		data->dinode.in_addr = inum.in_addr;
+		data->dinode.in_formal_ino = inum.in_formal_ino;
+	}
 	return data;
 }
 
-struct dir_info *dirtree_find(uint64_t block)
+struct dir_info *dirtree_find(struct gfs2_sbd *sdp, uint64_t block)
 {
-	struct osi_node *node = dirtree.osi_node;
-
-	while (node) {
-		struct dir_info *data = (struct dir_info *)node;
-
-		if (block < data->dinode.in_addr)
-			node = node->osi_left;
-		else if (block > data->dinode.in_addr)
-			node = node->osi_right;
-		else
-			return data;
-	}
-	return NULL;
+	return blktab_find(&fsck_cx(sdp)->dirtree, block);
 }
 
 /* get_ref_type - figure out if all duplicate references from this inode
@@ -516,7 +495,7 @@ void dup_listent_delete(struct duptree *dt, struct inode_with_dups *id)
 	free(id);
 }
 
-void dup_delete(struct duptree *dt)
+void dup_delete(struct gfs2_sbd *sdp, struct duptree *dt)
 {
 	struct inode_with_dups *id;
 	osi_list_t *tmp;
@@ -531,48 +510,108 @@ void dup_delete(struct duptree *dt)
 		id = osi_list_entry(tmp, struct inode_with_dups, list);
 		dup_listent_delete(dt, id);
 	}
-	osi_erase(&dt->node, &dup_blocks);
+	osi_erase(&dt->node, &fsck_cx(sdp)->dup_blocks);
 	free(dt);
 }
 
-void dirtree_delete(struct dir_info *b)
+void dirtree_delete(struct gfs2_sbd *sdp, struct dir_info *b)
 {
-	osi_erase(&b->node, &dirtree);
-	free(b);
+	blktab_delete(&fsck_cx(sdp)->dirtree, b->dinode.in_addr);
+}
+
+struct dir_info *dirtree_first(struct gfs2_sbd *sdp)
+{
+	return blktab_next(&fsck_cx(sdp)->dirtree, 0);
+}
+
+struct dir_info *dirtree_next(struct gfs2_sbd *sdp, struct dir_info *b)
+{
+	return blktab_next(&fsck_cx(sdp)->dirtree, b->dinode.in_addr);
+}
+
+/**
+ * bmap_alloc - Allocate the zeroed map of a block map
+ * If spill_dir is NULL the map is allocated in memory. Otherwise it is a
+ * shared mapping of a scratch file created in spill_dir, so the kernel can
+ * write its pages out and drop them when memory is short. The file is
+ * unlinked straight away so it goes when fsck exits, however that happens.
+ * Its space is reserved up front where the file system allows it, as running
+ * out of space while writing to the mapping would kill fsck with SIGBUS.
+ * advice: The madvise() advice for the mapping, to say how it will be used
+ * Returns 0 or -1 with errno set
+ */
+int bmap_alloc(struct gfs2_bmap *bmap, uint64_t mapsize, const char *spill_dir,
+               int advice)
+{
+	char *path;
+	void *map;
+	int fd, err;
+
+	bmap->mapsize = mapsize;
+	bmap->mapped = 0;
+	if (spill_dir == NULL) {
+		bmap->map = calloc(mapsize, sizeof(char));
+		return bmap->map == NULL ? -1 : 0;
+	}
+	if (asprintf(&path, "%s/fsck.gfs2-XXXXXX", spill_dir) < 0)
+		return -1;
+	fd = mkstemp(path);
+	if (fd >= 0)
+		unlink(path);
+	free(path);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, mapsize) != 0)
+		goto fail;
+	if (fallocate(fd, 0, 0, mapsize) != 0 && errno != EOPNOTSUPP)
+		goto fail;
+	map = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+	close(fd);
+	madvise(map, mapsize, advice);
+	bmap->map = map;
+	bmap->mapped = 1;
+	return 0;
+fail:
+	err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+void bmap_free(struct gfs2_bmap *bmap)
+{
+	if (bmap->chunks != NULL)
+		bmap_compressed_free(bmap);
+	else if (bmap->mapped)
+		munmap(bmap->map, bmap->mapsize);
+	else
+		free(bmap->map);
+	bmap->map = NULL;
+	bmap->mapsize = 0;
+	bmap->mapped = 0;
 }
 
 uint64_t find_free_blk(struct gfs2_sbd *sdp)
 {
-	struct osi_node *n, *next = NULL;
+	struct osi_node *n;
 	struct rgrp_tree *rl = NULL;
-	struct gfs2_rgrp *rg;
-	unsigned int block, bn = 0, x = 0, y = 0;
-	unsigned int state;
+	uint64_t blk;
 
-	memset(&rg, 0, sizeof(rg));
-	for (n = osi_first(&sdp->rgtree); n; n = next) {
-		next = osi_next(n);
+	for (n = osi_first(&sdp->rgtree); n; n = osi_next(n)) {
 		rl = (struct rgrp_tree *)n;
 		if (rl->rt_free)
 			break;
 	}
 
-	if (n == NULL)
+	if (n == NULL || lgfs2_rgrp_pin(rl) != 0)
 		return 0;
 
-	for (block = 0; block < rl->rt_length; block++) {
-		char *buf = rl->bits[block].bi_data;
-		x = (block) ? sizeof(struct gfs2_meta_header) : sizeof(struct gfs2_rgrp);
-
-		for (; x < sdp->sd_bsize; x++)
-			for (y = 0; y < GFS2_NBBY; y++) {
-				state = (buf[x] >> (GFS2_BIT_SIZE * y)) & 0x03;
-				if (state == GFS2_BLKST_FREE)
-					return rl->rt_data0 + bn;
-				bn++;
-			}
-	}
-	return 0;
+	if (lgfs2_rgrp_extent_find(rl, rl->rt_data0, 1, &blk, NULL) != 0)
+		blk = 0;
+	lgfs2_rgrp_unpin(rl);
+	return blk;
 }
 
 __be64 *get_dir_hash(struct gfs2_inode *ip)
@@ -595,13 +634,14 @@ __be64 *get_dir_hash(struct gfs2_inode *ip)
 
 void delete_all_dups(struct gfs2_inode *ip)
 {
+	struct gfs2_sbd *sdp = ip->i_sbd;
 	struct osi_node *n, *next;
 	struct duptree *dt;
 	osi_list_t *tmp, *x;
 	struct inode_with_dups *id;
 	int found;
 
-	for (n = osi_first(&dup_blocks); n; n = next) {
+	for (n = osi_first(&fsck_cx(sdp)->dup_blocks); n; n = next) {
 		next = osi_next(n);
 		dt = (struct duptree *)n;
 
@@ -629,7 +669,7 @@ void delete_all_dups(struct gfs2_inode *ip)
 			log_debug(_("This was the last reference: 0x%llx is "
 				    "no longer a duplicate.\n"),
 				  (unsigned long long)dt->block);
-			dup_delete(dt); /* not duplicate now */
+			dup_delete(sdp, dt); /* not duplicate now */
 		} else {
 			log_debug(_("%d references remain to 0x%llx\n"),
 				  dt->refs, (unsigned long long)dt->block);
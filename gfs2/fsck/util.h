@@ -6,9 +6,6 @@
 #include "fsck.h"
 #include "libgfs2.h"
 
-#define fsck_lseek(fd, off) \
-  ((lseek((fd), (off), SEEK_SET) == (off)) ? 0 : -1)
-
 #define INODE_VALID 1
 #define INODE_INVALID 0
 
@@ -37,10 +34,12 @@ struct fsck_pass {
 
 static inline int block_type(struct gfs2_bmap *bl, uint64_t bblock)
 {
-	static unsigned char *byte;
-	static uint64_t b;
-	static int btype;
+	unsigned char *byte;
+	uint64_t b;
+	int btype;
 
+	if (bl->chunks != NULL)
+		return bmap_compressed_type(bl, bblock);
 	byte = bl->map + BLOCKMAP_SIZE2(bblock);
 	b = BLOCKMAP_BYTE_OFFSET2(bblock);
 	btype = (*byte & (BLOCKMAP_MASK2 << b )) >> b;
@@ -49,9 +48,9 @@ static inline int block_type(struct gfs2_bmap *bl, uint64_t bblock)
 
 static inline int link1_type(struct gfs2_bmap *bl, uint64_t bblock)
 {
-	static unsigned char *byte;
-	static uint64_t b;
-	static int btype;
+	unsigned char *byte;
+	uint64_t b;
+	int btype;
 
 	byte = bl->map + BLOCKMAP_SIZE1(bblock);
 	b = BLOCKMAP_BYTE_OFFSET1(bblock);
@@ -59,12 +58,14 @@ static inline int link1_type(struct gfs2_bmap *bl, uint64_t bblock)
 	return btype;
 }
 
+extern int bmap_alloc(struct gfs2_bmap *bmap, uint64_t mapsize, const char *spill_dir,
+                      int advice);
+extern void bmap_free(struct gfs2_bmap *bmap);
+
 static inline void link1_destroy(struct gfs2_bmap *bmap)
 {
-	if (bmap->map)
-		free(bmap->map);
+	bmap_free(bmap);
 	bmap->size = 0;
-	bmap->mapsize = 0;
 }
 
 static inline int bitmap_type(struct gfs2_sbd *sdp, uint64_t bblock)
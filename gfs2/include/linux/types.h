@@ -2,6 +2,7 @@
 #define LINUX_TYPES_H
 
 #include <asm/types.h>
+#include <linux/posix_types.h>
 
 /* Satisfy gfs2_ondisk.h with userspace definitions of kernel types */
 
@@ -24,4 +25,9 @@ typedef uint32_t __bitwise __be32;
 typedef uint64_t __bitwise __le64;
 typedef uint64_t __bitwise __be64;
 
+/* Needed by other uapi headers which expect the real linux/types.h */
+#ifndef __aligned_u64
+#define __aligned_u64 __u64 __attribute__((aligned(8)))
+#endif
+
 #endif /* LINUX_TYPES_H */
@@ -0,0 +1,613 @@
+#include "clusterautoconfig.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "libgfs2.h"
+
+#ifndef IOV_MAX
+  #ifdef UIO_MAXIOV
+    #define IOV_MAX UIO_MAXIOV
+  #else
+    #define IOV_MAX (1024)
+  #endif
+#endif
+
+/*
+ * An engine for reading many blocks with a deep device queue. Requests are
+ * queued with lgfs2_aio_read() or lgfs2_aio_bread(), sent to the device
+ * with lgfs2_aio_submit() and their completions are collected with
+ * lgfs2_aio_reap() in the order they complete. When io_uring is not
+ * available the requests are read synchronously at submission time and
+ * complete in the order they were queued.
+ *
+ * The I/O statistics count each read against the caller which queued it.
+ *
+ * lgfs2_aio_breadm() reads a run of blocks into buffer heads with a single
+ * vectored read. Blocks of the run which are already in the block cache are
+ * taken from it, and their part of the read goes into a scratch block, as
+ * one large read costs less than several small ones.
+ */
+
+struct aio_req {
+	struct aio_req *ar_next;
+	struct iovec ar_iov;              /* For lgfs2_aio_breadm(), only the length is used */
+	uint64_t ar_blk;
+	struct gfs2_buffer_head *ar_bh;
+	struct iovec *ar_vec;             /* For lgfs2_aio_breadm(), one per block */
+	struct gfs2_buffer_head **ar_bhs;
+	unsigned ar_count;
+	void *ar_priv;
+	int ar_error;
+	struct timespec ar_start; /* For the I/O statistics */
+	const char *ar_caller;    /* Where the request was queued, for the statistics */
+	int ar_line;
+};
+
+/* A simple FIFO of requests */
+struct aio_queue {
+	struct aio_req *aq_first;
+	struct aio_req **aq_last;
+};
+
+#ifdef HAVE_LINUX_IO_URING_H
+struct aio_ring {
+	int ar_fd;
+	/* Submission queue */
+	void *ar_sqmap;
+	size_t ar_sqmap_len;
+	unsigned *ar_sqhead;
+	unsigned *ar_sqtail;
+	unsigned *ar_sqmask;
+	unsigned *ar_sqarray;
+	struct io_uring_sqe *ar_sqes;
+	size_t ar_sqes_len;
+	/* Completion queue */
+	void *ar_cqmap;
+	size_t ar_cqmap_len;
+	unsigned *ar_cqhead;
+	unsigned *ar_cqtail;
+	unsigned *ar_cqmask;
+	struct io_uring_cqe *ar_cqes;
+};
+#endif
+
+struct lgfs2_aio {
+	struct gfs2_sbd *ai_sdp;
+	unsigned ai_depth;
+	unsigned ai_inflight;     /* Submitted to the kernel but not completed */
+	unsigned ai_unsubmitted;  /* Queued but not yet submitted */
+	struct aio_req *ai_reqs;
+	struct aio_req *ai_free;
+	struct aio_queue ai_queued;
+	struct aio_queue ai_done;
+	void *ai_scratch;         /* Where lgfs2_aio_breadm() reads cached blocks to */
+#ifdef HAVE_LINUX_IO_URING_H
+	struct aio_ring *ai_ring;
+#endif
+};
+
+static void aq_init(struct aio_queue *q)
+{
+	q->aq_first = NULL;
+	q->aq_last = &q->aq_first;
+}
+
+static void aq_push(struct aio_queue *q, struct aio_req *ar)
+{
+	ar->ar_next = NULL;
+	*q->aq_last = ar;
+	q->aq_last = &ar->ar_next;
+}
+
+static struct aio_req *aq_pop(struct aio_queue *q)
+{
+	struct aio_req *ar = q->aq_first;
+
+	if (ar == NULL)
+		return NULL;
+	q->aq_first = ar->ar_next;
+	if (q->aq_first == NULL)
+		q->aq_last = &q->aq_first;
+	return ar;
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+static void ring_free(struct aio_ring *r)
+{
+	if (r->ar_sqes != NULL)
+		munmap(r->ar_sqes, r->ar_sqes_len);
+	if (r->ar_cqmap != NULL)
+		munmap(r->ar_cqmap, r->ar_cqmap_len);
+	if (r->ar_sqmap != NULL)
+		munmap(r->ar_sqmap, r->ar_sqmap_len);
+	close(r->ar_fd);
+	free(r);
+}
+
+static void *ring_mmap(int fd, size_t len, off_t off)
+{
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, off);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+/**
+ * Set up an io_uring instance. Returns NULL if io_uring can't be used, for
+ * example because the kernel is too old or it has been disabled.
+ */
+static struct aio_ring *ring_init(unsigned depth)
+{
+	struct io_uring_params p;
+	struct aio_ring *r;
+	char *sq, *cq;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	r->ar_fd = syscall(__NR_io_uring_setup, depth, &p);
+	if (r->ar_fd < 0) {
+		free(r);
+		return NULL;
+	}
+	/* Without NODROP completions could be lost when the CQ overflows */
+	if (!(p.features & IORING_FEAT_NODROP))
+		goto fail;
+
+	r->ar_sqmap_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->ar_sqmap = sq = ring_mmap(r->ar_fd, r->ar_sqmap_len, IORING_OFF_SQ_RING);
+	if (sq == NULL)
+		goto fail;
+	r->ar_sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->ar_sqes = ring_mmap(r->ar_fd, r->ar_sqes_len, IORING_OFF_SQES);
+	if (r->ar_sqes == NULL)
+		goto fail;
+	r->ar_cqmap_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->ar_cqmap = cq = ring_mmap(r->ar_fd, r->ar_cqmap_len, IORING_OFF_CQ_RING);
+	if (cq == NULL)
+		goto fail;
+
+	r->ar_sqhead = (unsigned *)(sq + p.sq_off.head);
+	r->ar_sqtail = (unsigned *)(sq + p.sq_off.tail);
+	r->ar_sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->ar_sqarray = (unsigned *)(sq + p.sq_off.array);
+	r->ar_cqhead = (unsigned *)(cq + p.cq_off.head);
+	r->ar_cqtail = (unsigned *)(cq + p.cq_off.tail);
+	r->ar_cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->ar_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return r;
+fail:
+	ring_free(r);
+	return NULL;
+}
+
+static int ring_enter(struct aio_ring *r, unsigned submit, unsigned wait)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, r->ar_fd, submit, wait,
+		              wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
+static int ring_submit(struct lgfs2_aio *aio)
+{
+	struct aio_ring *r = aio->ai_ring;
+	unsigned tail = *r->ar_sqtail;
+	struct aio_req *ar;
+	int ret;
+
+	while ((ar = aq_pop(&aio->ai_queued)) != NULL) {
+		unsigned idx = tail & *r->ar_sqmask;
+		struct io_uring_sqe *sqe = &r->ar_sqes[idx];
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_READV;
+		sqe->fd = aio->ai_sdp->device_fd;
+		sqe->addr = (unsigned long)(ar->ar_vec ? ar->ar_vec : &ar->ar_iov);
+		sqe->len = ar->ar_vec ? ar->ar_count : 1;
+		sqe->off = ar->ar_blk * aio->ai_sdp->sd_bsize;
+		sqe->user_data = ar - aio->ai_reqs;
+		if (lgfs2_iostats_on)
+			clock_gettime(CLOCK_MONOTONIC, &ar->ar_start);
+		r->ar_sqarray[idx] = idx;
+		tail++;
+	}
+	__atomic_store_n(r->ar_sqtail, tail, __ATOMIC_RELEASE);
+
+	/* This also retries any entries left over from a failed submission */
+	while (aio->ai_unsubmitted > 0) {
+		ret = ring_enter(r, aio->ai_unsubmitted, 0);
+		if (ret < 0)
+			return -1;
+		aio->ai_inflight += ret;
+		aio->ai_unsubmitted -= ret;
+	}
+	return 0;
+}
+
+/**
+ * Move any completions from the completion queue to the done list.
+ * Returns the number of completions moved.
+ */
+static unsigned ring_collect(struct lgfs2_aio *aio)
+{
+	struct aio_ring *r = aio->ai_ring;
+	unsigned head = *r->ar_cqhead;
+	unsigned tail = __atomic_load_n(r->ar_cqtail, __ATOMIC_ACQUIRE);
+	unsigned n = 0;
+
+	for (; head != tail; head++, n++) {
+		struct io_uring_cqe *cqe = &r->ar_cqes[head & *r->ar_cqmask];
+		struct aio_req *ar = &aio->ai_reqs[cqe->user_data];
+
+		if (cqe->res < 0)
+			ar->ar_error = -cqe->res;
+		else if (cqe->res != ar->ar_iov.iov_len)
+			ar->ar_error = EIO;
+		lgfs2_iostats_account(LGFS2_IOSTATS_READ, ar->ar_blk * aio->ai_sdp->sd_bsize,
+		                      cqe->res, &ar->ar_start, ar->ar_caller, ar->ar_line);
+		aq_push(&aio->ai_done, ar);
+	}
+	__atomic_store_n(r->ar_cqhead, head, __ATOMIC_RELEASE);
+	aio->ai_inflight -= n;
+	return n;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/**
+ * Set up a read engine for a device.
+ * sdp: The superblock, which must have the device open and sd_bsize set
+ * depth: The maximum number of requests in progress at once
+ * flags: LGFS2_AIO_* flags
+ * Returns the engine or NULL on failure with errno set
+ */
+struct lgfs2_aio *lgfs2_aio_init(struct gfs2_sbd *sdp, unsigned depth, unsigned flags)
+{
+	struct lgfs2_aio *aio;
+	unsigned i;
+
+	if (depth == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	aio = calloc(1, sizeof(*aio));
+	if (aio == NULL)
+		return NULL;
+	aio->ai_reqs = calloc(depth, sizeof(*aio->ai_reqs));
+	if (aio->ai_reqs == NULL) {
+		free(aio);
+		return NULL;
+	}
+	for (i = depth; i > 0; i--) {
+		aio->ai_reqs[i - 1].ar_next = aio->ai_free;
+		aio->ai_free = &aio->ai_reqs[i - 1];
+	}
+	aio->ai_sdp = sdp;
+	aio->ai_depth = depth;
+	aq_init(&aio->ai_queued);
+	aq_init(&aio->ai_done);
+#ifdef HAVE_LINUX_IO_URING_H
+	/* Backends without a file descriptor are read synchronously */
+	if (!(flags & LGFS2_AIO_SYNC) &&
+	    (sdp->dev_ops == NULL || (sdp->dev_ops->flags & LGFS2_DEV_FD)))
+		aio->ai_ring = ring_init(depth);
+#endif
+	return aio;
+}
+
+/**
+ * Tear down a read engine. Any requests still in progress are waited for and
+ * their buffers freed.
+ */
+void lgfs2_aio_free(struct lgfs2_aio **aiop)
+{
+	struct lgfs2_aio *aio = *aiop;
+	struct lgfs2_aio_done done;
+
+	if (aio == NULL)
+		return;
+	while (lgfs2_aio_reap(aio, &done, 1) == 1) {
+		if (done.ad_bh != NULL)
+			brelse(done.ad_bh);
+		for (unsigned i = 0; done.ad_bhs != NULL && i < done.ad_count; i++)
+			if (done.ad_bhs[i] != NULL)
+				brelse(done.ad_bhs[i]);
+	}
+#ifdef HAVE_LINUX_IO_URING_H
+	if (aio->ai_ring != NULL)
+		ring_free(aio->ai_ring);
+#endif
+	free(aio->ai_scratch);
+	free(aio->ai_reqs);
+	free(aio);
+	*aiop = NULL;
+}
+
+/**
+ * Returns 1 if requests are processed asynchronously (io_uring is in use)
+ * or 0 if they are read synchronously.
+ */
+int lgfs2_aio_async(const struct lgfs2_aio *aio)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	return aio->ai_ring != NULL;
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Returns the number of requests which have been queued but not reaped.
+ */
+unsigned lgfs2_aio_pending(const struct lgfs2_aio *aio)
+{
+	const struct aio_req *ar;
+	unsigned n = aio->ai_inflight + aio->ai_unsubmitted;
+
+	for (ar = aio->ai_done.aq_first; ar != NULL; ar = ar->ar_next)
+		n++;
+	return n;
+}
+
+/**
+ * Returns the number of requests which can be queued before some must be
+ * reaped.
+ */
+unsigned lgfs2_aio_space(const struct lgfs2_aio *aio)
+{
+	return aio->ai_depth - lgfs2_aio_pending(aio);
+}
+
+static struct aio_req *aio_req_get(struct lgfs2_aio *aio, int line, const char *caller)
+{
+	struct aio_req *ar = aio->ai_free;
+
+	if (ar == NULL) {
+		errno = EAGAIN;
+		return NULL;
+	}
+	aio->ai_free = ar->ar_next;
+	memset(ar, 0, sizeof(*ar));
+	ar->ar_caller = caller;
+	ar->ar_line = line;
+	return ar;
+}
+
+/* Give up the buffers of a lgfs2_aio_breadm() request which failed */
+static void aio_bhs_drop(struct lgfs2_aio *aio, struct aio_req *ar)
+{
+	for (unsigned i = 0; i < ar->ar_count; i++) {
+		/* Buffers taken from the cache are still good */
+		if (ar->ar_vec[i].iov_base == aio->ai_scratch)
+			brelse(ar->ar_bhs[i]);
+		else
+			lgfs2_bh_discard(ar->ar_bhs[i]);
+		ar->ar_bhs[i] = NULL;
+	}
+}
+
+static void aio_req_queue(struct lgfs2_aio *aio, struct aio_req *ar)
+{
+	aq_push(&aio->ai_queued, ar);
+	aio->ai_unsubmitted++;
+}
+
+/**
+ * Queue a read of count blocks, starting at blk, into buf.
+ * Returns 0 on success or -1 with errno set to EAGAIN if the queue is full.
+ */
+int __lgfs2_aio_read(struct lgfs2_aio *aio, void *buf, uint64_t blk, unsigned count, void *priv,
+                     int line, const char *caller)
+{
+	struct aio_req *ar = aio_req_get(aio, line, caller);
+
+	if (ar == NULL)
+		return -1;
+	ar->ar_iov.iov_base = buf;
+	ar->ar_iov.iov_len = (size_t)count * aio->ai_sdp->sd_bsize;
+	ar->ar_blk = blk;
+	ar->ar_priv = priv;
+	aio_req_queue(aio, ar);
+	return 0;
+}
+
+/**
+ * Queue a read of block blk into a buffer head, as bread() would return.
+ * Blocks which are in the block cache complete without any I/O.
+ * Returns 0 on success or -1 with errno set on failure.
+ */
+int __lgfs2_aio_bread(struct lgfs2_aio *aio, uint64_t blk, void *priv, int line,
+                      const char *caller)
+{
+	struct aio_req *ar = aio_req_get(aio, line, caller);
+	struct gfs2_buffer_head *bh;
+
+	if (ar == NULL)
+		return -1;
+	ar->ar_blk = blk;
+	ar->ar_priv = priv;
+
+	bh = lgfs2_bcache_take(aio->ai_sdp, blk);
+	if (bh != NULL) {
+		ar->ar_bh = bh;
+		aq_push(&aio->ai_done, ar);
+		return 0;
+	}
+	bh = lgfs2_bh_new(aio->ai_sdp, blk);
+	if (bh == NULL) {
+		ar->ar_next = aio->ai_free;
+		aio->ai_free = ar;
+		return -1;
+	}
+	ar->ar_bh = bh;
+	ar->ar_iov = bh->iov;
+	aio_req_queue(aio, ar);
+	return 0;
+}
+
+/**
+ * Queue a read of n consecutive blocks, starting at blk, into buffer heads,
+ * as breadm() would return, using one vectored read.
+ * bhs: Where the buffers are put. It must stay in place until the request
+ *      has been reaped.
+ * Returns 0 on success or -1 with errno set on failure.
+ */
+int __lgfs2_aio_breadm(struct lgfs2_aio *aio, struct gfs2_buffer_head **bhs, unsigned n,
+                       uint64_t blk, void *priv, int line, const char *caller)
+{
+	struct gfs2_sbd *sdp = aio->ai_sdp;
+	unsigned cached = 0;
+	struct aio_req *ar;
+	unsigned i;
+
+	if (n == 0 || n > IOV_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (aio->ai_scratch == NULL) {
+		aio->ai_scratch = lgfs2_dev_buf(sdp, sdp->sd_bsize);
+		if (aio->ai_scratch == NULL)
+			return -1;
+	}
+	ar = aio_req_get(aio, line, caller);
+	if (ar == NULL)
+		return -1;
+	ar->ar_vec = calloc(n, sizeof(*ar->ar_vec));
+	if (ar->ar_vec == NULL) {
+		ar->ar_next = aio->ai_free;
+		aio->ai_free = ar;
+		return -1;
+	}
+	ar->ar_blk = blk;
+	ar->ar_priv = priv;
+	ar->ar_bhs = bhs;
+	ar->ar_count = n;
+	ar->ar_iov.iov_len = (size_t)n * sdp->sd_bsize;
+
+	for (i = 0; i < n; i++) {
+		bhs[i] = lgfs2_bcache_take(sdp, blk + i);
+		if (bhs[i] != NULL) {
+			ar->ar_vec[i].iov_base = aio->ai_scratch;
+			ar->ar_vec[i].iov_len = sdp->sd_bsize;
+			cached++;
+			continue;
+		}
+		bhs[i] = lgfs2_bh_new(sdp, blk + i);
+		if (bhs[i] == NULL) {
+			ar->ar_count = i;
+			aio_bhs_drop(aio, ar);
+			free(ar->ar_vec);
+			ar->ar_next = aio->ai_free;
+			aio->ai_free = ar;
+			return -1;
+		}
+		ar->ar_vec[i] = bhs[i]->iov;
+	}
+	if (cached == n)
+		aq_push(&aio->ai_done, ar);
+	else
+		aio_req_queue(aio, ar);
+	return 0;
+}
+
+static void sync_submit(struct lgfs2_aio *aio)
+{
+	struct gfs2_sbd *sdp = aio->ai_sdp;
+	struct aio_req *ar;
+
+	while ((ar = aq_pop(&aio->ai_queued)) != NULL) {
+		ssize_t ret;
+
+		lgfs2_iostats_site(ar->ar_caller, ar->ar_line);
+		if (ar->ar_vec != NULL)
+			ret = lgfs2_dev_preadv(sdp, ar->ar_vec, ar->ar_count, ar->ar_blk * sdp->sd_bsize);
+		else
+			ret = lgfs2_dev_preadv(sdp, &ar->ar_iov, 1, ar->ar_blk * sdp->sd_bsize);
+		if (ret < 0)
+			ar->ar_error = errno;
+		else if (ret != ar->ar_iov.iov_len)
+			ar->ar_error = EIO;
+		aq_push(&aio->ai_done, ar);
+		aio->ai_unsubmitted--;
+	}
+}
+
+/**
+ * Start the I/O for all of the queued requests.
+ * Returns 0 on success or -1 on failure with errno set.
+ */
+int lgfs2_aio_submit(struct lgfs2_aio *aio)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	if (aio->ai_ring != NULL)
+		return ring_submit(aio);
+#endif
+	sync_submit(aio);
+	return 0;
+}
+
+/**
+ * Collect a completed request. Requests which have been queued but not
+ * submitted are submitted first.
+ * done: Filled in with the details of the completed request. For
+ *       lgfs2_aio_bread() requests which failed, ad_bh is NULL.
+ * wait: Whether to wait for a request to complete if none have yet
+ * Returns 1 if a completion was returned in done, 0 if there are none
+ * available or -1 on failure with errno set.
+ */
+int lgfs2_aio_reap(struct lgfs2_aio *aio, struct lgfs2_aio_done *done, int wait)
+{
+	struct aio_req *ar;
+
+	if (aio->ai_unsubmitted > 0 && lgfs2_aio_submit(aio) != 0)
+		return -1;
+#ifdef HAVE_LINUX_IO_URING_H
+	if (aio->ai_ring != NULL && aio->ai_done.aq_first == NULL && aio->ai_inflight > 0) {
+		while (ring_collect(aio) == 0 && wait) {
+			if (ring_enter(aio->ai_ring, 0, 1) < 0)
+				return -1;
+		}
+	}
+#endif
+	ar = aq_pop(&aio->ai_done);
+	if (ar == NULL)
+		return 0;
+
+	done->ad_priv = ar->ar_priv;
+	done->ad_blk = ar->ar_blk;
+	done->ad_error = ar->ar_error;
+	done->ad_bh = ar->ar_bh;
+	done->ad_bhs = ar->ar_bhs;
+	done->ad_count = ar->ar_count;
+	if (ar->ar_error && ar->ar_bh != NULL) {
+		lgfs2_bh_discard(ar->ar_bh);
+		done->ad_bh = NULL;
+	}
+	if (ar->ar_error && ar->ar_bhs != NULL)
+		aio_bhs_drop(aio, ar);
+	free(ar->ar_vec);
+	ar->ar_next = aio->ai_free;
+	aio->ai_free = ar;
+	return 1;
+}
@@ -8,9 +8,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "libgfs2.h"
 
@@ -22,44 +24,517 @@
   #endif
 #endif
 
-struct gfs2_buffer_head *bget(struct gfs2_sbd *sdp, uint64_t num)
+/*
+ * The block cache keeps released buffers around so that repeated bread()s of
+ * the same block are served from memory. Buffers are handed out exclusively:
+ * a bread() of a block whose cached buffer is still held by another caller
+ * gets a private, uncached copy just as it would without the cache. This
+ * keeps the old semantics for callers which chain buffers together through
+ * b_altlist or retarget a buffer by changing its b_blocknr.
+ *
+ * With LGFS2_BCACHE_WRITEBACK, modified buffers released with brelse() are
+ * not written straight away. They are written back by lgfs2_bcache_flush(),
+ * sorted by block number and with adjacent blocks merged into one write,
+ * which happens when:
+ *  - the caller flushes the cache, e.g. at the end of an fsck pass,
+ *  - half of the cache is waiting to be written back,
+ *  - a dirty buffer reaches the end of the LRU list and must be evicted,
+ *  - the cache is freed.
+ * A dirty buffer is also written back on its own before it is handed out
+ * again, and before it is invalidated, so reads which bypass the cache or
+ * get a private copy of the block always see the last released contents.
+ * There is no ordering between the writes of a flush: callers which need
+ * one block on disk before another must flush in between. Buffers which
+ * are not in the cache, or were retargeted, are written by brelse() as
+ * before.
+ *
+ * Writing a private copy of a block drops the cached copy. If the cached copy
+ * is held at the time, it is marked stale instead and dropped when released,
+ * so a caller which read the block just before the write can't put the old
+ * contents back into the cache.
+ *
+ * The cache is shared by all threads and protected by bc_lock, which is
+ * recursive as writing a buffer back drops other copies of the block. A
+ * buffer is only used by the thread which holds it, so the lock isn't held
+ * while a buffer is read in.
+ */
+struct lgfs2_bcache {
+	pthread_mutex_t bc_lock;
+	struct gfs2_buffer_head **bc_hash;
+	unsigned bc_hashbits;
+	osi_list_t bc_lru; /* Unreferenced buffers, least recently used first */
+	unsigned bc_flags;
+	uint64_t bc_dirtymax; /* Flush when this many buffers are dirty */
+	struct lgfs2_bcache_stats bc_stats;
+};
+
+static inline uint64_t bc_hashfn(const struct lgfs2_bcache *bc, uint64_t blk)
 {
-	struct gfs2_buffer_head *bh;
+	return (blk * 0x9e37fffffffc0001ULL) >> (64 - bc->bc_hashbits);
+}
 
-	bh = calloc(1, sizeof(struct gfs2_buffer_head) + sdp->sd_bsize);
-	if (bh == NULL)
-		return NULL;
+static struct gfs2_buffer_head *bc_lookup(struct lgfs2_bcache *bc, uint64_t blk)
+{
+	struct gfs2_buffer_head *bh = bc->bc_hash[bc_hashfn(bc, blk)];
+
+	while (bh != NULL && bh->b_cachenr != blk)
+		bh = bh->b_hnext;
+	return bh;
+}
+
+static void bc_unhash(struct lgfs2_bcache *bc, struct gfs2_buffer_head *bh)
+{
+	struct gfs2_buffer_head **bhp = &bc->bc_hash[bc_hashfn(bc, bh->b_cachenr)];
+
+	while (*bhp != bh)
+		bhp = &(*bhp)->b_hnext;
+	*bhp = bh->b_hnext;
+	bh->b_hnext = NULL;
+}
+
+static void bc_hashin(struct lgfs2_bcache *bc, struct gfs2_buffer_head *bh)
+{
+	struct gfs2_buffer_head **bhp = &bc->bc_hash[bc_hashfn(bc, bh->b_cachenr)];
+
+	bh->b_hnext = *bhp;
+	*bhp = bh;
+}
+
+static void bh_free(struct gfs2_buffer_head *bh)
+{
+	if (bh->b_slab)
+		lgfs2_slab_bh_put(bh);
+	else
+		free(bh);
+}
+
+/* Remove a buffer from the cache and free it, discarding its contents */
+static void bc_drop(struct lgfs2_bcache *bc, struct gfs2_buffer_head *bh)
+{
+	bc_unhash(bc, bh);
+	if (!bh->b_inuse) {
+		osi_list_del(&bh->b_lru);
+		if (bh->b_modified)
+			bc->bc_stats.bs_dirty--;
+	}
+	bc->bc_stats.bs_cached--;
+	bh_free(bh);
+}
+
+static int bc_writeback(struct lgfs2_bcache *bc, struct gfs2_buffer_head *bh)
+{
+	if (bwrite(bh) != 0) {
+		fprintf(stderr, "Failed to write back cached block %"PRIu64": %s\n",
+		        bh->b_blocknr, strerror(errno));
+		return -1;
+	}
+	bc->bc_stats.bs_writebacks++;
+	bc->bc_stats.bs_writes++;
+	bc->bc_stats.bs_dirty--;
+	return 0;
+}
+
+static int bc_blkcmp(const void *a, const void *b)
+{
+	const struct gfs2_buffer_head *bha = *(struct gfs2_buffer_head * const *)a;
+	const struct gfs2_buffer_head *bhb = *(struct gfs2_buffer_head * const *)b;
+
+	if (bha->b_blocknr < bhb->b_blocknr)
+		return -1;
+	return bha->b_blocknr > bhb->b_blocknr;
+}
 
+/**
+ * Write a run of dirty buffers for adjacent blocks with one write. If that
+ * fails, the buffers are written one at a time to find the bad ones.
+ */
+static int bc_writeback_run(struct lgfs2_bcache *bc, struct gfs2_buffer_head **bhs, unsigned n)
+{
+	struct gfs2_sbd *sdp = bhs[0]->sdp;
+	struct iovec *iov = alloca(n * sizeof(*iov));
+	int error = 0;
+
+	for (unsigned i = 0; i < n; i++)
+		iov[i] = bhs[i]->iov;
+	lgfs2_iostats_site(__FUNCTION__, __LINE__);
+	if (lgfs2_dev_pwritev(sdp, iov, n, bhs[0]->b_blocknr * sdp->sd_bsize) == n * sdp->sd_bsize) {
+		for (unsigned i = 0; i < n; i++)
+			bhs[i]->b_modified = 0;
+		bc->bc_stats.bs_writebacks += n;
+		bc->bc_stats.bs_writes++;
+		bc->bc_stats.bs_dirty -= n;
+		return 0;
+	}
+	for (unsigned i = 0; i < n; i++)
+		if (bc_writeback(bc, bhs[i]) != 0)
+			error = -1;
+	return error;
+}
+
+static void bh_init(struct gfs2_buffer_head *bh, struct gfs2_sbd *sdp, uint64_t num)
+{
 	bh->b_blocknr = num;
 	bh->sdp = sdp;
-	bh->iov.iov_base = (char *)bh + sizeof(struct gfs2_buffer_head);
 	bh->iov.iov_len = sdp->sd_bsize;
+	bh->b_stale = 0;
+}
+
+/**
+ * Allocate a buffer for block num. Only buffers for bget() need zeroing as
+ * the others are read into straight away.
+ */
+static struct gfs2_buffer_head *bh_alloc(struct gfs2_sbd *sdp, uint64_t num, int zero)
+{
+	struct gfs2_buffer_head *bh;
+
+	bh = lgfs2_slab_bh_get(sdp);
+	if (bh != NULL) {
+		if (zero)
+			memset(bh->b_data, 0, sdp->sd_bsize);
+	} else if (sdp->dio_align) {
+		/* Keep the data aligned for O_DIRECT and freeable with free(bh) */
+		size_t off = (sizeof(*bh) + sdp->dio_align - 1) & ~(size_t)(sdp->dio_align - 1);
+
+		bh = lgfs2_dev_buf(sdp, off + sdp->sd_bsize);
+		if (bh == NULL)
+			return NULL;
+		bh->iov.iov_base = (char *)bh + off;
+	} else {
+		bh = calloc(1, sizeof(struct gfs2_buffer_head) + sdp->sd_bsize);
+		if (bh == NULL)
+			return NULL;
+		bh->iov.iov_base = (char *)bh + sizeof(struct gfs2_buffer_head);
+	}
+	bh_init(bh, sdp, num);
+	return bh;
+}
 
+/**
+ * Take an unreferenced buffer for block num from the cache.
+ * Returns the buffer, marked as in use, or NULL if there is no cached copy
+ * available to the caller.
+ */
+struct gfs2_buffer_head *lgfs2_bcache_take(struct gfs2_sbd *sdp, uint64_t num)
+{
+	struct lgfs2_bcache *bc = sdp->bcache;
+	struct gfs2_buffer_head *bh;
+
+	if (bc == NULL)
+		return NULL;
+	pthread_mutex_lock(&bc->bc_lock);
+	bh = bc_lookup(bc, num);
+	if (bh == NULL || bh->b_inuse ||
+	    /* Make sure a private copy read while this one is held is up to date */
+	    (bh->b_modified && bc_writeback(bc, bh) != 0)) {
+		bc->bc_stats.bs_misses++;
+		pthread_mutex_unlock(&bc->bc_lock);
+		return NULL;
+	}
+	osi_list_del(&bh->b_lru);
+	bh->b_inuse = 1;
+	bc->bc_stats.bs_hits++;
+	pthread_mutex_unlock(&bc->bc_lock);
 	return bh;
 }
 
+/**
+ * Returns 1 if block num is in the block cache, whether or not it is in use.
+ */
+int lgfs2_bcache_cached(struct gfs2_sbd *sdp, uint64_t num)
+{
+	struct lgfs2_bcache *bc = sdp->bcache;
+	int cached;
+
+	if (bc == NULL)
+		return 0;
+	pthread_mutex_lock(&bc->bc_lock);
+	cached = bc_lookup(bc, num) != NULL;
+	pthread_mutex_unlock(&bc->bc_lock);
+	return cached;
+}
+
+/**
+ * Allocate a buffer for block num which is about to be read from the device.
+ * The buffer is added to the cache if the block isn't cached already and
+ * there is room, possibly after evicting the least recently used buffer.
+ * Otherwise a private buffer is returned. If the read fails the buffer must
+ * be released with lgfs2_bh_discard().
+ */
+struct gfs2_buffer_head *lgfs2_bh_new(struct gfs2_sbd *sdp, uint64_t num)
+{
+	struct lgfs2_bcache *bc = sdp->bcache;
+	struct gfs2_buffer_head *bh;
+
+	if (bc == NULL)
+		return bh_alloc(sdp, num, 0);
+
+	pthread_mutex_lock(&bc->bc_lock);
+	if (bc_lookup(bc, num) != NULL) {
+		bh = NULL;
+	} else if (bc->bc_stats.bs_cached < bc->bc_stats.bs_max) {
+		bh = bh_alloc(sdp, num, 0);
+		if (bh != NULL)
+			bc->bc_stats.bs_cached++;
+	} else if (!osi_list_empty(&bc->bc_lru)) {
+		bh = osi_list_entry(bc->bc_lru.next, struct gfs2_buffer_head, b_lru);
+		/* Write back everything while we're at it */
+		if (bh->b_modified)
+			lgfs2_bcache_flush(sdp);
+		if (bh->b_modified) {
+			bh = NULL;
+		} else {
+			osi_list_del(&bh->b_lru);
+			bc_unhash(bc, bh);
+			bc->bc_stats.bs_evictions++;
+			bh->b_altlist.next = bh->b_altlist.prev = NULL;
+			bh->b_hnext = NULL;
+			bh_init(bh, sdp, num);
+		}
+	} else {
+		/* Every cached buffer is in use */
+		bh = NULL;
+	}
+	if (bh != NULL) {
+		bh->b_cachenr = num;
+		bh->b_cached = 1;
+		bh->b_inuse = 1;
+		bc_hashin(bc, bh);
+	}
+	pthread_mutex_unlock(&bc->bc_lock);
+	if (bh == NULL)
+		bh = bh_alloc(sdp, num, 0);
+	return bh;
+}
+
+/**
+ * Set up a block cache for the device.
+ * sdp: The superblock. sd_bsize must be set.
+ * maxbytes: The memory limit for cached buffers
+ * flags: LGFS2_BCACHE_* flags
+ * Returns 0 on success or -1 on failure with errno set
+ */
+int lgfs2_bcache_init(struct gfs2_sbd *sdp, size_t maxbytes, unsigned flags)
+{
+	struct lgfs2_bcache *bc;
+	pthread_mutexattr_t attr;
+	uint64_t max = maxbytes / (sizeof(struct gfs2_buffer_head) + sdp->sd_bsize);
+	unsigned bits = 4;
+
+	if (sdp->bcache != NULL || max == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (bits < 32 && (1ULL << bits) < max)
+		bits++;
+
+	bc = calloc(1, sizeof(*bc));
+	if (bc == NULL)
+		return -1;
+	bc->bc_hash = calloc(1ULL << bits, sizeof(*bc->bc_hash));
+	if (bc->bc_hash == NULL) {
+		free(bc);
+		return -1;
+	}
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&bc->bc_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	bc->bc_hashbits = bits;
+	bc->bc_flags = flags;
+	bc->bc_stats.bs_max = max;
+	bc->bc_dirtymax = (max + 1) / 2;
+	osi_list_init(&bc->bc_lru);
+	sdp->bcache = bc;
+	return 0;
+}
+
+/**
+ * Write all of the dirty, unreferenced buffers in the cache to the device,
+ * in block order and merging adjacent blocks into single writes. Buffers
+ * which are still in use are written when they are released.
+ * Returns 0 on success or -1 if any write failed.
+ */
+int lgfs2_bcache_flush(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_bcache *bc = sdp->bcache;
+	struct gfs2_buffer_head **bhs;
+	osi_list_t *tmp;
+	uint64_t n = 0;
+	int error = 0;
+
+	if (bc == NULL)
+		return 0;
+	pthread_mutex_lock(&bc->bc_lock);
+	if (bc->bc_stats.bs_dirty == 0) {
+		pthread_mutex_unlock(&bc->bc_lock);
+		return 0;
+	}
+	bhs = malloc(bc->bc_stats.bs_dirty * sizeof(*bhs));
+	osi_list_foreach(tmp, &bc->bc_lru) {
+		struct gfs2_buffer_head *bh;
+
+		bh = osi_list_entry(tmp, struct gfs2_buffer_head, b_lru);
+		if (!bh->b_modified)
+			continue;
+		if (bhs != NULL)
+			bhs[n++] = bh;
+		else if (bc_writeback(bc, bh) != 0)
+			error = -1;
+	}
+	if (bhs == NULL) {
+		pthread_mutex_unlock(&bc->bc_lock);
+		return error;
+	}
+
+	qsort(bhs, n, sizeof(*bhs), bc_blkcmp);
+	for (uint64_t i = 0; i < n;) {
+		unsigned len = 1;
+
+		while (i + len < n && len < IOV_MAX &&
+		       bhs[i + len]->b_blocknr == bhs[i]->b_blocknr + len)
+			len++;
+		if (bc_writeback_run(bc, bhs + i, len) != 0)
+			error = -1;
+		i += len;
+	}
+	pthread_mutex_unlock(&bc->bc_lock);
+	free(bhs);
+	return error;
+}
+
+/**
+ * Drop the cached copies of a range of blocks. This must be called before
+ * writing to those blocks without going through a buffer head so that stale
+ * copies are not handed out later. Dirty buffers are written first. Buffers
+ * which are held are marked stale and dropped when they are released.
+ */
+void lgfs2_bcache_invalidate(struct gfs2_sbd *sdp, uint64_t blk, uint64_t count)
+{
+	struct lgfs2_bcache *bc = sdp->bcache;
+
+	if (bc == NULL)
+		return;
+	pthread_mutex_lock(&bc->bc_lock);
+	for (; count > 0; blk++, count--) {
+		struct gfs2_buffer_head *bh = bc_lookup(bc, blk);
+
+		if (bh == NULL)
+			continue;
+		if (bh->b_inuse) {
+			bh->b_stale = 1;
+			continue;
+		}
+		if (bh->b_modified)
+			bc_writeback(bc, bh);
+		bc_drop(bc, bh);
+	}
+	pthread_mutex_unlock(&bc->bc_lock);
+}
+
+/**
+ * Flush and tear down the block cache. Buffers which are still held are
+ * detached from the cache and freed normally by brelse().
+ * Returns 0 on success or -1 if writing any dirty buffer failed.
+ */
+int lgfs2_bcache_free(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_bcache *bc = sdp->bcache;
+	int error;
+
+	if (bc == NULL)
+		return 0;
+	error = lgfs2_bcache_flush(sdp);
+	for (uint64_t i = 0; i < (1ULL << bc->bc_hashbits); i++) {
+		struct gfs2_buffer_head *bh, *next;
+
+		for (bh = bc->bc_hash[i]; bh != NULL; bh = next) {
+			next = bh->b_hnext;
+			bh->b_hnext = NULL;
+			if (bh->b_inuse)
+				bh->b_cached = 0;
+			else
+				bh_free(bh);
+		}
+	}
+	free(bc->bc_hash);
+	pthread_mutex_destroy(&bc->bc_lock);
+	free(bc);
+	sdp->bcache = NULL;
+	return error;
+}
+
+/**
+ * Free a buffer without writing it, removing it from the cache if necessary.
+ */
+void lgfs2_bh_discard(struct gfs2_buffer_head *bh)
+{
+	struct lgfs2_bcache *bc = bh->sdp->bcache;
+
+	if (bh->b_cached) {
+		pthread_mutex_lock(&bc->bc_lock);
+		bc_drop(bc, bh);
+		pthread_mutex_unlock(&bc->bc_lock);
+	} else {
+		bh_free(bh);
+	}
+}
+
+void lgfs2_bcache_stats(struct gfs2_sbd *sdp, struct lgfs2_bcache_stats *stats)
+{
+	struct lgfs2_bcache *bc = sdp->bcache;
+
+	if (bc == NULL) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+	pthread_mutex_lock(&bc->bc_lock);
+	*stats = bc->bc_stats;
+	pthread_mutex_unlock(&bc->bc_lock);
+}
+
+struct gfs2_buffer_head *bget(struct gfs2_sbd *sdp, uint64_t num)
+{
+	/* The caller is going to fill in the block itself */
+	lgfs2_bcache_invalidate(sdp, num, 1);
+	return bh_alloc(sdp, num, 1);
+}
+
 int __breadm(struct gfs2_sbd *sdp, struct gfs2_buffer_head **bhs, size_t n,
 	     uint64_t block, int line, const char *caller)
 {
 	size_t v = (n < IOV_MAX) ? n : IOV_MAX;
 	struct iovec *iov = alloca(v * sizeof(struct iovec));
 	struct iovec *iovbase = iov;
-	size_t i = 0;
+	struct timespec start;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		bhs[i] = lgfs2_bcache_take(sdp, block + i);
 
+	i = 0;
 	while (i < n) {
 		int j;
 		ssize_t ret;
 		ssize_t size = 0;
 
-		for (j = 0; (i + j < n) && (j < IOV_MAX); j++) {
-			bhs[i + j] = bget(sdp, block + i + j);
+		if (bhs[i] != NULL) {
+			i++;
+			continue;
+		}
+		for (j = 0; (i + j < n) && (bhs[i + j] == NULL) && (j < IOV_MAX); j++) {
+			bhs[i + j] = lgfs2_bh_new(sdp, block + i + j);
 			if (bhs[i + j] == NULL)
 				return -1;
 			iov[j] = bhs[i + j]->iov;
 			size += bhs[i + j]->iov.iov_len;
 		}
 
-		ret = preadv(sdp->device_fd, iovbase, j, (block + i) * sdp->sd_bsize);
+		if (sdp->readahead != NULL)
+			clock_gettime(CLOCK_MONOTONIC, &start);
+		lgfs2_iostats_site(caller, line);
+		ret = lgfs2_dev_preadv(sdp, iovbase, j, (block + i) * sdp->sd_bsize);
+		if (ret == size)
+			lgfs2_ra_note(sdp, block + i, j, &start);
 		if (ret != size) {
 			fprintf(stderr, "bad read: %s from %s:%d: block %llu (0x%llx) "
 					"count: %d size: %zd ret: %zd\n", strerror(errno),
@@ -76,44 +551,93 @@ struct gfs2_buffer_head *__bread(struct gfs2_sbd *sdp, uint64_t num, int line,
 				 const char *caller)
 {
 	struct gfs2_buffer_head *bh;
+	struct timespec start;
 	ssize_t ret;
 
-	bh = bget(sdp, num);
+	bh = lgfs2_bcache_take(sdp, num);
+	if (bh != NULL)
+		return bh;
+
+	bh = lgfs2_bh_new(sdp, num);
 	if (bh == NULL)
 		return NULL;
 
-	ret = pread(sdp->device_fd, bh->b_data, sdp->sd_bsize, num * sdp->sd_bsize);
+	if (sdp->readahead != NULL)
+		clock_gettime(CLOCK_MONOTONIC, &start);
+	lgfs2_iostats_site(caller, line);
+	ret = lgfs2_dev_pread(sdp, bh->b_data, sdp->sd_bsize, num * sdp->sd_bsize);
+	if (ret == sdp->sd_bsize)
+		lgfs2_ra_note(sdp, num, 1, &start);
 	if (ret != sdp->sd_bsize) {
 		fprintf(stderr, "%s:%d: Error reading block %"PRIu64": %s\n",
 		                caller, line, num, strerror(errno));
-		free(bh);
+		lgfs2_bh_discard(bh);
 		bh = NULL;
 	}
 	return bh;
 }
 
-int bwrite(struct gfs2_buffer_head *bh)
+int __bwrite(struct gfs2_buffer_head *bh, int line, const char *caller)
 {
 	struct gfs2_sbd *sdp = bh->sdp;
+	struct lgfs2_bcache *bc = sdp->bcache;
 
-	if (pwritev(sdp->device_fd, &bh->iov, 1, bh->b_blocknr * sdp->sd_bsize) != bh->iov.iov_len)
+	lgfs2_iostats_site(caller, line);
+	if (lgfs2_dev_pwritev(sdp, &bh->iov, 1, bh->b_blocknr * sdp->sd_bsize) != bh->iov.iov_len)
 		return -1;
 	bh->b_modified = 0;
+
+	/* Any other cached copy of the block is now stale */
+	if (bc != NULL && !(bh->b_cached && bh->b_cachenr == bh->b_blocknr)) {
+		struct gfs2_buffer_head *cbh;
+
+		pthread_mutex_lock(&bc->bc_lock);
+		cbh = bc_lookup(bc, bh->b_blocknr);
+		if (cbh != NULL && !cbh->b_inuse)
+			bc_drop(bc, cbh);
+		else if (cbh != NULL)
+			cbh->b_stale = 1;
+		pthread_mutex_unlock(&bc->bc_lock);
+	}
 	return 0;
 }
 
-int brelse(struct gfs2_buffer_head *bh)
+int __brelse(struct gfs2_buffer_head *bh, int line, const char *caller)
 {
+	struct lgfs2_bcache *bc = bh->sdp->bcache;
 	int error = 0;
 
-	if (bh->b_blocknr == -1)
+	if (bh->b_blocknr == -1 || (bh->b_cached && !bh->b_inuse)) {
 		printf("Double free!\n");
-	if (bh->b_modified)
-		error = bwrite(bh);
-	bh->b_blocknr = -1;
+		/* Freeing it again would corrupt the free list */
+		if (bh->b_cached || bh->b_slab)
+			return 0;
+	}
+	if (bh->b_modified &&
+	    (!bh->b_cached || bh->b_blocknr != bh->b_cachenr || bh->b_stale ||
+	     !(bc->bc_flags & LGFS2_BCACHE_WRITEBACK)))
+		error = __bwrite(bh, line, caller);
 	if (bh->b_altlist.next && !osi_list_empty(&bh->b_altlist))
 		osi_list_del(&bh->b_altlist);
-	free(bh);
+
+	if (bh->b_cached) {
+		pthread_mutex_lock(&bc->bc_lock);
+		/* Don't keep buffers which were retargeted, failed to write or
+		   went stale while they were held */
+		if (error || bh->b_blocknr != bh->b_cachenr || bh->b_stale) {
+			bc_drop(bc, bh);
+		} else {
+			bh->b_altlist.next = NULL;
+			bh->b_inuse = 0;
+			osi_list_add_prev(&bh->b_lru, &bc->bc_lru);
+			if (bh->b_modified && ++bc->bc_stats.bs_dirty >= bc->bc_dirtymax)
+				error = lgfs2_bcache_flush(bh->sdp);
+		}
+		pthread_mutex_unlock(&bc->bc_lock);
+		return error;
+	}
+	bh->b_blocknr = -1;
+	bh_free(bh);
 	return error;
 }
 
@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <check.h>
+#include "libgfs2.h"
+#include "check_common.h"
+
+Suite *suite_aio(void);
+
+static void aio_read_blocks(unsigned flags)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct lgfs2_aio_done done;
+	struct lgfs2_aio *aio;
+	char *buf;
+	unsigned seen = 0;
+	unsigned i;
+
+	buf = calloc(8, MOCK_BSIZE);
+	ck_assert(buf != NULL);
+	aio = lgfs2_aio_init(sdp, 7, flags);
+	ck_assert(aio != NULL);
+	if (flags & LGFS2_AIO_SYNC)
+		ck_assert(!lgfs2_aio_async(aio));
+
+	/* One read of two blocks and six single block reads */
+	ck_assert(lgfs2_aio_read(aio, buf, 10, 2, NULL) == 0);
+	for (i = 2; i < 8; i++)
+		ck_assert(lgfs2_aio_read(aio, buf + (i * MOCK_BSIZE), 20 + i, 1,
+		                         (void *)(unsigned long)i) == 0);
+	ck_assert(lgfs2_aio_space(aio) == 0);
+	ck_assert(lgfs2_aio_read(aio, buf, 30, 1, NULL) == -1);
+	ck_assert(lgfs2_aio_submit(aio) == 0);
+	ck_assert(lgfs2_aio_pending(aio) == 7);
+
+	while (lgfs2_aio_reap(aio, &done, 1) == 1) {
+		ck_assert(done.ad_error == 0);
+		ck_assert(done.ad_bh == NULL);
+		i = (unsigned long)done.ad_priv;
+		ck_assert(i == 0 || done.ad_blk == 20 + i);
+		seen |= 1 << i;
+	}
+	ck_assert(seen == 0xfd);
+	ck_assert(lgfs2_aio_pending(aio) == 0);
+
+	ck_assert(mock_block_tag(buf) == 10);
+	ck_assert(mock_block_tag(buf + MOCK_BSIZE) == 11);
+	for (i = 2; i < 8; i++)
+		ck_assert(mock_block_tag(buf + i * MOCK_BSIZE) == 20 + i);
+
+	lgfs2_aio_free(&aio);
+	ck_assert(aio == NULL);
+	free(buf);
+}
+
+START_TEST(test_aio_read_sync)
+{
+	aio_read_blocks(LGFS2_AIO_SYNC);
+}
+END_TEST
+
+START_TEST(test_aio_read)
+{
+	/* Falls back to synchronous reads when io_uring is not available */
+	aio_read_blocks(0);
+}
+END_TEST
+
+START_TEST(test_aio_bread)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct lgfs2_bcache_stats st;
+	struct lgfs2_aio_done done;
+	struct gfs2_buffer_head *bh;
+	struct lgfs2_aio *aio;
+	unsigned n = 0;
+	uint64_t blk;
+
+	ck_assert(lgfs2_bcache_init(sdp, 16 * (sizeof(*bh) + MOCK_BSIZE), 0) == 0);
+	bh = bread(sdp, 42);
+	ck_assert(bh != NULL);
+	brelse(bh);
+
+	aio = lgfs2_aio_init(sdp, 4, 0);
+	ck_assert(aio != NULL);
+	for (blk = 40; blk < 44; blk++)
+		ck_assert(lgfs2_aio_bread(aio, blk, NULL) == 0);
+	while (lgfs2_aio_reap(aio, &done, 1) == 1) {
+		ck_assert(done.ad_error == 0);
+		ck_assert(done.ad_bh != NULL);
+		ck_assert(done.ad_bh->b_blocknr == done.ad_blk);
+		ck_assert(mock_block_tag(done.ad_bh->b_data) == done.ad_blk);
+		brelse(done.ad_bh);
+		n++;
+	}
+	ck_assert(n == 4);
+
+	/* Buffers left unreaped are released when the engine is freed */
+	ck_assert(lgfs2_aio_bread(aio, 50, NULL) == 0);
+	ck_assert(lgfs2_aio_submit(aio) == 0);
+	lgfs2_aio_free(&aio);
+
+	lgfs2_bcache_stats(sdp, &st);
+	ck_assert(st.bs_hits == 1);
+	ck_assert(st.bs_cached == 5);
+}
+END_TEST
+
+START_TEST(test_aio_breadm)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct gfs2_buffer_head *bhs[2][8];
+	struct gfs2_buffer_head *bh;
+	struct lgfs2_bcache_stats st;
+	struct lgfs2_aio_done done;
+	struct lgfs2_aio *aio;
+	unsigned n = 0;
+
+	ck_assert(lgfs2_bcache_init(sdp, 16 * (sizeof(*bh) + MOCK_BSIZE), 0) == 0);
+	bh = bread(sdp, 42);
+	ck_assert(bh != NULL);
+	bh->b_data[0] = 'x'; /* Not written, so only the cached copy has it */
+	brelse(bh);
+
+	aio = lgfs2_aio_init(sdp, 2, 0);
+	ck_assert(aio != NULL);
+	ck_assert(lgfs2_aio_breadm(aio, bhs[0], 8, 40, bhs[0]) == 0);
+	ck_assert(lgfs2_aio_breadm(aio, bhs[1], 1, 42, bhs[1]) == 0);
+	ck_assert(lgfs2_aio_breadm(aio, bhs[1], 1, 43, NULL) == -1);
+	while (lgfs2_aio_reap(aio, &done, 1) == 1) {
+		ck_assert(done.ad_error == 0);
+		ck_assert(done.ad_bh == NULL);
+		ck_assert(done.ad_bhs == done.ad_priv);
+		for (unsigned i = 0; i < done.ad_count; i++) {
+			bh = done.ad_bhs[i];
+			ck_assert(bh->b_blocknr == done.ad_blk + i);
+			/* The second request got a private copy from the device */
+			if (bh->b_blocknr == 42 && done.ad_priv == bhs[0])
+				ck_assert(bh->b_data[0] == 'x');
+			else
+				ck_assert(mock_block_tag(bh->b_data) == bh->b_blocknr);
+		}
+		n += done.ad_count;
+	}
+	ck_assert(n == 9);
+	/* Block 42 was held by the first request when the second was queued */
+	ck_assert(bhs[1][0] != bhs[0][2]);
+	for (unsigned i = 0; i < 8; i++)
+		brelse(bhs[0][i]);
+	brelse(bhs[1][0]);
+	ck_assert(lgfs2_aio_breadm(aio, bhs[0], 0, 40, NULL) == -1);
+	lgfs2_aio_free(&aio);
+
+	lgfs2_bcache_stats(sdp, &st);
+	ck_assert(st.bs_hits == 1);
+	ck_assert(st.bs_cached == 8);
+}
+END_TEST
+
+Suite *suite_aio(void)
+{
+	Suite *s = suite_create("aio.c");
+	TCase *tc;
+
+	tc = tcase_create("aio");
+	tcase_add_checked_fixture(tc, mockup_sdp_tagged, teardown_sdp);
+	tcase_add_test(tc, test_aio_read_sync);
+	tcase_add_test(tc, test_aio_read);
+	tcase_add_test(tc, test_aio_bread);
+	tcase_add_test(tc, test_aio_breadm);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
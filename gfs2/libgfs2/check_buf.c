@@ -0,0 +1,349 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <check.h>
+#include "libgfs2.h"
+#include "check_common.h"
+
+Suite *suite_buf(void);
+
+/* Room for this many buffers in the cache */
+static size_t cache_bytes(unsigned nbufs)
+{
+	return nbufs * (sizeof(struct gfs2_buffer_head) + MOCK_BSIZE);
+}
+
+static char disk_byte(uint64_t blk)
+{
+	char c;
+
+	ck_assert(pread(tc_sdp->device_fd, &c, 1, blk * MOCK_BSIZE) == 1);
+	return c;
+}
+
+START_TEST(test_bcache_hit)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct lgfs2_bcache_stats st;
+	struct gfs2_buffer_head *bh, *bh2;
+
+	ck_assert(lgfs2_bcache_init(sdp, cache_bytes(4), 0) == 0);
+
+	bh = bread(sdp, 10);
+	ck_assert(bh != NULL);
+	/* Held buffers are not shared */
+	bh2 = bread(sdp, 10);
+	ck_assert(bh2 != NULL);
+	ck_assert(bh2 != bh);
+	brelse(bh2);
+	brelse(bh);
+
+	bh2 = bread(sdp, 10);
+	ck_assert(bh2 == bh);
+	brelse(bh2);
+
+	lgfs2_bcache_stats(sdp, &st);
+	ck_assert(st.bs_hits == 1);
+	ck_assert(st.bs_misses == 2);
+	ck_assert(st.bs_cached == 1);
+}
+END_TEST
+
+START_TEST(test_bcache_coherency)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct gfs2_buffer_head *bh;
+
+	ck_assert(lgfs2_bcache_init(sdp, cache_bytes(4), 0) == 0);
+
+	bh = bread(sdp, 5);
+	ck_assert(bh != NULL);
+	brelse(bh);
+
+	/* Writing a fresh buffer must not leave a stale copy behind */
+	bh = bget(sdp, 5);
+	ck_assert(bh != NULL);
+	bh->b_data[0] = 'a';
+	bmodified(bh);
+	brelse(bh);
+	ck_assert(disk_byte(5) == 'a');
+
+	bh = bread(sdp, 5);
+	ck_assert(bh != NULL);
+	ck_assert(bh->b_data[0] == 'a');
+	/* Retargeting a cached buffer writes to the new block only */
+	bh->b_blocknr = 6;
+	bmodified(bh);
+	brelse(bh);
+	ck_assert(disk_byte(6) == 'a');
+
+	bh = bread(sdp, 6);
+	ck_assert(bh != NULL);
+	ck_assert(bh->b_data[0] == 'a');
+	brelse(bh);
+}
+END_TEST
+
+START_TEST(test_bcache_stale)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct gfs2_buffer_head *bh, *bh2;
+
+	ck_assert(lgfs2_bcache_init(sdp, cache_bytes(4), LGFS2_BCACHE_WRITEBACK) == 0);
+
+	/* A private copy is written while the cached copy is held */
+	bh = bread(sdp, 7);
+	ck_assert(bh != NULL);
+	bh2 = bread(sdp, 7);
+	ck_assert(bh2 != NULL && bh2 != bh);
+	bh2->b_data[0] = 'b';
+	bmodified(bh2);
+	brelse(bh2);
+	ck_assert(disk_byte(7) == 'b');
+	/* The old contents must not come back from the cache */
+	brelse(bh);
+	bh = bread(sdp, 7);
+	ck_assert(bh != NULL);
+	ck_assert(bh->b_data[0] == 'b');
+
+	/* Changes made to a stale buffer are still written */
+	bh2 = bread(sdp, 7);
+	ck_assert(bh2 != NULL && bh2 != bh);
+	bmodified(bh2);
+	brelse(bh2);
+	bh->b_data[0] = 'c';
+	bmodified(bh);
+	brelse(bh);
+	ck_assert(disk_byte(7) == 'c');
+	bh = bread(sdp, 7);
+	ck_assert(bh != NULL);
+	ck_assert(bh->b_data[0] == 'c');
+	brelse(bh);
+}
+END_TEST
+
+START_TEST(test_bcache_invalidate_held)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct gfs2_buffer_head *bh;
+	char c = 'd';
+
+	ck_assert(lgfs2_bcache_init(sdp, cache_bytes(4), LGFS2_BCACHE_WRITEBACK) == 0);
+
+	/* The block is written around the cache while its buffer is held */
+	bh = bread(sdp, 8);
+	ck_assert(bh != NULL);
+	ck_assert(pwrite(sdp->device_fd, &c, 1, 8 * MOCK_BSIZE) == 1);
+	lgfs2_bcache_invalidate(sdp, 8, 1);
+	brelse(bh);
+	bh = bread(sdp, 8);
+	ck_assert(bh != NULL);
+	ck_assert(bh->b_data[0] == 'd');
+	brelse(bh);
+}
+END_TEST
+
+START_TEST(test_bcache_writeback)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct lgfs2_bcache_stats st;
+	struct gfs2_buffer_head *bh;
+	uint64_t blk;
+
+	ck_assert(lgfs2_bcache_init(sdp, cache_bytes(4), LGFS2_BCACHE_WRITEBACK) == 0);
+
+	bh = bread(sdp, 20);
+	ck_assert(bh != NULL);
+	bh->b_data[0] = 'w';
+	bmodified(bh);
+	brelse(bh);
+	ck_assert(disk_byte(20) == 0);
+
+	/* Push block 20 out of the cache */
+	for (blk = 21; blk < 25; blk++) {
+		bh = bread(sdp, blk);
+		ck_assert(bh != NULL);
+		brelse(bh);
+	}
+	ck_assert(disk_byte(20) == 'w');
+
+	lgfs2_bcache_stats(sdp, &st);
+	ck_assert(st.bs_evictions == 1);
+	ck_assert(st.bs_writebacks == 1);
+
+	bh = bread(sdp, 22);
+	ck_assert(bh != NULL);
+	bh->b_data[0] = 'x';
+	bmodified(bh);
+	brelse(bh);
+	ck_assert(lgfs2_bcache_flush(sdp) == 0);
+	ck_assert(disk_byte(22) == 'x');
+}
+END_TEST
+
+START_TEST(test_bcache_coalesce)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct lgfs2_bcache_stats st;
+	struct gfs2_buffer_head *bh;
+	uint64_t blks[] = {42, 40, 50, 41};
+	unsigned i;
+
+	ck_assert(lgfs2_bcache_init(sdp, cache_bytes(16), LGFS2_BCACHE_WRITEBACK) == 0);
+
+	for (i = 0; i < 4; i++) {
+		bh = bread(sdp, blks[i]);
+		ck_assert(bh != NULL);
+		bh->b_data[0] = 'c';
+		bmodified(bh);
+		brelse(bh);
+	}
+	lgfs2_bcache_stats(sdp, &st);
+	ck_assert(st.bs_dirty == 4);
+	ck_assert(disk_byte(40) == 0);
+
+	/* 40-42 are written together, 50 on its own */
+	ck_assert(lgfs2_bcache_flush(sdp) == 0);
+	for (i = 0; i < 4; i++)
+		ck_assert(disk_byte(blks[i]) == 'c');
+	lgfs2_bcache_stats(sdp, &st);
+	ck_assert(st.bs_dirty == 0);
+	ck_assert(st.bs_writebacks == 4);
+	ck_assert(st.bs_writes == 2);
+}
+END_TEST
+
+START_TEST(test_bcache_dirty_limit)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct lgfs2_bcache_stats st;
+	struct gfs2_buffer_head *bh, *bh2;
+	uint64_t blk;
+
+	ck_assert(lgfs2_bcache_init(sdp, cache_bytes(8), LGFS2_BCACHE_WRITEBACK) == 0);
+
+	/* Half of the cache being dirty triggers a flush */
+	for (blk = 10; blk < 13; blk++) {
+		bh = bread(sdp, blk);
+		ck_assert(bh != NULL);
+		bh->b_data[0] = 'd';
+		bmodified(bh);
+		brelse(bh);
+	}
+	ck_assert(disk_byte(10) == 0);
+	bh = bread(sdp, 13);
+	ck_assert(bh != NULL);
+	bh->b_data[0] = 'd';
+	bmodified(bh);
+	brelse(bh);
+	for (blk = 10; blk < 14; blk++)
+		ck_assert(disk_byte(blk) == 'd');
+	lgfs2_bcache_stats(sdp, &st);
+	ck_assert(st.bs_dirty == 0);
+	ck_assert(st.bs_writes == 1);
+
+	/* A dirty buffer is written before a second reader gets a private copy */
+	bh = bread(sdp, 20);
+	ck_assert(bh != NULL);
+	bh->b_data[0] = 'e';
+	bmodified(bh);
+	brelse(bh);
+	bh = bread(sdp, 20);
+	ck_assert(bh != NULL);
+	bh2 = bread(sdp, 20);
+	ck_assert(bh2 != NULL);
+	ck_assert(bh2 != bh);
+	ck_assert(bh2->b_data[0] == 'e');
+	brelse(bh2);
+	brelse(bh);
+}
+END_TEST
+
+START_TEST(test_bcache_breadm)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct lgfs2_bcache_stats st;
+	struct gfs2_buffer_head *bhs[8];
+	struct gfs2_buffer_head *bh;
+	unsigned i;
+
+	ck_assert(lgfs2_bcache_init(sdp, cache_bytes(16), 0) == 0);
+
+	bh = bread(sdp, 33);
+	ck_assert(bh != NULL);
+	bh->b_data[0] = 'm';
+	bmodified(bh);
+	brelse(bh);
+
+	ck_assert(breadm(sdp, bhs, 8, 30) == 0);
+	for (i = 0; i < 8; i++) {
+		ck_assert(bhs[i]->b_blocknr == 30 + i);
+		ck_assert(bhs[i]->b_data[0] == (i == 3 ? 'm' : 0));
+		brelse(bhs[i]);
+	}
+	lgfs2_bcache_stats(sdp, &st);
+	ck_assert(st.bs_hits == 1);
+	ck_assert(st.bs_cached == 8);
+}
+END_TEST
+
+START_TEST(test_direct_io)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct gfs2_buffer_head *bhs[2];
+	struct gfs2_buffer_head *bh;
+	uint64_t blk;
+
+	/* Not every file system that the tests might run on supports O_DIRECT */
+	if (lgfs2_set_direct_io(sdp, 1) != 0) {
+		ck_assert(errno == EINVAL);
+		return;
+	}
+	ck_assert(sdp->dio_align >= 512);
+	ck_assert(MOCK_BSIZE % sdp->dio_align == 0);
+	ck_assert(lgfs2_bcache_init(sdp, cache_bytes(4), LGFS2_BCACHE_WRITEBACK) == 0);
+
+	for (blk = 40; blk < 42; blk++) {
+		bh = bget(sdp, blk);
+		ck_assert(bh != NULL);
+		ck_assert(((uintptr_t)bh->b_data % sdp->dio_align) == 0);
+		bh->b_data[0] = 'd';
+		bmodified(bh);
+		brelse(bh);
+	}
+	ck_assert(lgfs2_bcache_flush(sdp) == 0);
+	lgfs2_bcache_invalidate(sdp, 40, 2);
+	ck_assert(breadm(sdp, bhs, 2, 40) == 0);
+	ck_assert(bhs[0]->b_data[0] == 'd' && bhs[1]->b_data[0] == 'd');
+	brelse(bhs[0]);
+	brelse(bhs[1]);
+
+	ck_assert(lgfs2_set_direct_io(sdp, 0) == 0);
+	ck_assert(sdp->dio_align == 0);
+	ck_assert(disk_byte(40) == 'd');
+	ck_assert(disk_byte(41) == 'd');
+}
+END_TEST
+
+Suite *suite_buf(void)
+{
+	Suite *s = suite_create("buf.c");
+	TCase *tc;
+
+	tc = tcase_create("bcache");
+	tcase_add_checked_fixture(tc, mockup_sdp, teardown_sdp);
+	tcase_add_test(tc, test_bcache_hit);
+	tcase_add_test(tc, test_bcache_coherency);
+	tcase_add_test(tc, test_bcache_stale);
+	tcase_add_test(tc, test_bcache_invalidate_held);
+	tcase_add_test(tc, test_bcache_writeback);
+	tcase_add_test(tc, test_bcache_coalesce);
+	tcase_add_test(tc, test_bcache_dirty_limit);
+	tcase_add_test(tc, test_bcache_breadm);
+	tcase_add_test(tc, test_direct_io);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <check.h>
+#include "libgfs2.h"
+#include "check_common.h"
+
+struct gfs2_sbd *tc_sdp;
+
+/**
+ * Set up tc_sdp with a zeroed, unlinked temporary file as the device. Test
+ * cases which need more, e.g. a block cache, call this from their own
+ * fixture and add it.
+ */
+void mockup_sdp(void)
+{
+	char tmpnam[] = "mockdev-XXXXXX";
+	struct gfs2_sbd *sdp;
+
+	sdp = calloc(1, sizeof(*sdp));
+	ck_assert(sdp != NULL);
+
+	sdp->device_fd = mkstemp(tmpnam);
+	ck_assert(sdp->device_fd >= 0);
+	ck_assert(unlink(tmpnam) == 0);
+	ck_assert(ftruncate(sdp->device_fd, MOCK_DEV_BLOCKS * MOCK_BSIZE) == 0);
+	sdp->sd_bsize = MOCK_BSIZE;
+	sdp->device.length = MOCK_DEV_BLOCKS;
+	tc_sdp = sdp;
+}
+
+/**
+ * As mockup_sdp() but each block starts with its own address, so that tests
+ * can tell which block they read. See mock_block_tag().
+ */
+void mockup_sdp_tagged(void)
+{
+	mockup_sdp();
+	for (uint64_t blk = 0; blk < MOCK_DEV_BLOCKS; blk++)
+		ck_assert(pwrite(tc_sdp->device_fd, &blk, sizeof(blk), blk * MOCK_BSIZE) == sizeof(blk));
+}
+
+/* Returns the address stored at the start of a block by mockup_sdp_tagged() */
+uint64_t mock_block_tag(const char *data)
+{
+	uint64_t blk;
+
+	memcpy(&blk, data, sizeof(blk));
+	return blk;
+}
+
+/**
+ * Free tc_sdp along with any read-ahead state, block cache and pools which
+ * the test set up on it.
+ */
+void teardown_sdp(void)
+{
+	lgfs2_ra_free(tc_sdp);
+	ck_assert(tc_sdp->readahead == NULL);
+	ck_assert(lgfs2_bcache_free(tc_sdp) == 0);
+	lgfs2_slab_free(tc_sdp);
+	close(tc_sdp->device_fd);
+	free(tc_sdp);
+	tc_sdp = NULL;
+}
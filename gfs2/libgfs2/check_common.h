@@ -0,0 +1,19 @@
+#ifndef __CHECK_COMMON_DOT_H__
+#define __CHECK_COMMON_DOT_H__
+
+#include <stdint.h>
+#include "libgfs2.h"
+
+/* The mock device is a sparse file, so it can be big enough for any test */
+#define MOCK_DEV_BLOCKS (1024)
+#define MOCK_BSIZE (4096)
+
+/* The file system used by the test case running, set up by mockup_sdp() */
+extern struct gfs2_sbd *tc_sdp;
+
+extern void mockup_sdp(void);
+extern void mockup_sdp_tagged(void);
+extern void teardown_sdp(void);
+extern uint64_t mock_block_tag(const char *data);
+
+#endif /* __CHECK_COMMON_DOT_H__ */
@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <check.h>
+#include "crc32c.h"
+
+Suite *suite_crc32c(void);
+
+#define BUF_SIZE (16384)
+
+static const enum crc32c_impl impls[] = {
+	CRC32C_BYTEWISE, CRC32C_SLICE8, CRC32C_SSE42, CRC32C_ARMV8
+};
+
+START_TEST(test_crc32c_vector)
+{
+	const unsigned char check[] = "123456789";
+
+	for (unsigned i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+		if (crc32c_impl_set(impls[i]) != 0) {
+			ck_assert_int_eq(errno, ENOTSUP);
+			continue;
+		}
+		ck_assert(~crc32c(~0, check, 9) == 0xE3069283);
+		ck_assert(crc32c(0x1234, check, 0) == 0x1234);
+	}
+	crc32c_impl_set(CRC32C_BYTEWISE);
+	ck_assert(strcmp(crc32c_impl_name(), "bytewise") == 0);
+}
+END_TEST
+
+START_TEST(test_crc32c_cross)
+{
+	static const size_t lens[] = {
+		1, 7, 8, 9, 63, 384, 385, 3071, 3072, 3080, 4096 - 4, 4096, 3 * 1024 + 3 * 128 + 17, 12345
+	};
+	unsigned char *buf = malloc(BUF_SIZE + 8);
+
+	ck_assert(buf != NULL);
+	srandom(1);
+	for (unsigned i = 0; i < BUF_SIZE + 8; i++)
+		buf[i] = random();
+
+	for (unsigned l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+		for (unsigned off = 0; off < 8; off++) {
+			uint32_t ref;
+
+			ck_assert(crc32c_impl_set(CRC32C_BYTEWISE) == 0);
+			ref = crc32c(~0, buf + off, lens[l]);
+			for (unsigned i = 1; i < sizeof(impls) / sizeof(impls[0]); i++) {
+				if (crc32c_impl_set(impls[i]) != 0)
+					continue;
+				ck_assert(crc32c(~0, buf + off, lens[l]) == ref);
+			}
+		}
+	}
+	free(buf);
+}
+END_TEST
+
+Suite *suite_crc32c(void)
+{
+	Suite *s = suite_create("crc32c.c");
+	TCase *tc;
+
+	tc = tcase_create("crc32c");
+	tcase_add_test(tc, test_crc32c_vector);
+	tcase_add_test(tc, test_crc32c_cross);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
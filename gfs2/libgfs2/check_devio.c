@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <check.h>
+#include "libgfs2.h"
+
+/* lgfs2_get_dev_info() wants at least 1MB */
+#define MOCK_DEV_BLOCKS (512)
+#define MOCK_BSIZE (4096)
+
+Suite *suite_devio(void);
+
+static char tc_path[] = "mockdev-XXXXXX";
+static char tc_spec[64];
+static struct gfs2_sbd tc_sbd;
+
+static void mockup_image(void)
+{
+	char c = 'i';
+	int fd;
+
+	strcpy(tc_path, "mockdev-XXXXXX");
+	fd = mkstemp(tc_path);
+	ck_assert(fd >= 0);
+	ck_assert(ftruncate(fd, MOCK_DEV_BLOCKS * MOCK_BSIZE) == 0);
+	ck_assert(pwrite(fd, &c, 1, 5 * MOCK_BSIZE) == 1);
+	close(fd);
+	memset(&tc_sbd, 0, sizeof(tc_sbd));
+	tc_sbd.device_fd = -1;
+	tc_sbd.sd_bsize = MOCK_BSIZE;
+}
+
+static void teardown_image(void)
+{
+	lgfs2_dev_close(&tc_sbd);
+	ck_assert(unlink(tc_path) == 0);
+}
+
+static void dev_spec(const char *prefix)
+{
+	snprintf(tc_spec, sizeof(tc_spec), "%s%s", prefix, tc_path);
+}
+
+static char image_byte(uint64_t blk)
+{
+	char c;
+	int fd;
+
+	fd = open(tc_path, O_RDONLY);
+	ck_assert(fd >= 0);
+	ck_assert(pread(fd, &c, 1, blk * MOCK_BSIZE) == 1);
+	close(fd);
+	return c;
+}
+
+START_TEST(test_dev_type)
+{
+	ck_assert(lgfs2_dev_type("/dev/sda1") == LGFS2_DEV_TYPE_FD);
+	ck_assert(lgfs2_dev_type("mmap:/tmp/img") == LGFS2_DEV_TYPE_MMAP);
+	ck_assert(lgfs2_dev_type("memfd:img") == LGFS2_DEV_TYPE_MEMFD);
+	ck_assert(lgfs2_dev_type("savemeta:/tmp/gfsmeta") == LGFS2_DEV_TYPE_SAVEMETA);
+}
+END_TEST
+
+START_TEST(test_dev_fd)
+{
+	struct gfs2_sbd *sdp = &tc_sbd;
+	char buf[2];
+
+	ck_assert(lgfs2_dev_open(sdp, tc_path, O_RDWR) == 0);
+	ck_assert(sdp->device_fd >= 0);
+	ck_assert(sdp->dinfo.size == MOCK_DEV_BLOCKS * MOCK_BSIZE);
+	ck_assert(lgfs2_dev_size(sdp) == MOCK_DEV_BLOCKS * MOCK_BSIZE);
+	ck_assert(lgfs2_dev_pread(sdp, buf, 2, 5 * MOCK_BSIZE) == 2);
+	ck_assert(buf[0] == 'i' && buf[1] == 0);
+	ck_assert(lgfs2_dev_pwrite(sdp, "f", 1, 6 * MOCK_BSIZE) == 1);
+	ck_assert(lgfs2_dev_sync(sdp) == 0);
+	ck_assert(image_byte(6) == 'f');
+}
+END_TEST
+
+START_TEST(test_dev_mmap)
+{
+	struct gfs2_sbd *sdp = &tc_sbd;
+	struct gfs2_buffer_head *bh;
+
+	dev_spec("mmap:");
+	ck_assert(lgfs2_dev_open(sdp, tc_spec, O_RDWR) == -1);
+	ck_assert(errno == EROFS);
+	ck_assert(lgfs2_dev_open(sdp, tc_spec, O_RDONLY) == 0);
+	ck_assert(sdp->dinfo.readonly);
+	ck_assert(lgfs2_dev_size(sdp) == MOCK_DEV_BLOCKS * MOCK_BSIZE);
+
+	bh = bread(sdp, 5);
+	ck_assert(bh != NULL);
+	ck_assert(bh->b_data[0] == 'i' && bh->b_data[1] == 0);
+	ck_assert(bwrite(bh) != 0);
+	ck_assert(errno == EROFS);
+	brelse(bh);
+	/* Reads are cut short at the end of the image */
+	bh = bread(sdp, MOCK_DEV_BLOCKS);
+	ck_assert(bh == NULL);
+	lgfs2_dev_close(sdp);
+	/* Only files and block devices can be mapped */
+	ck_assert(lgfs2_dev_open(sdp, "mmap:/dev/null", O_RDONLY) == -1);
+	ck_assert(errno == ENOTBLK);
+}
+END_TEST
+
+START_TEST(test_dev_memfd)
+{
+	struct gfs2_sbd *sdp = &tc_sbd;
+	char c = 0;
+
+	dev_spec("memfd:");
+	if (lgfs2_dev_open(sdp, tc_spec, O_RDWR) != 0) {
+		/* Not available on older kernels */
+		ck_assert(errno == ENOSYS);
+		return;
+	}
+	ck_assert(sdp->dinfo.size == MOCK_DEV_BLOCKS * MOCK_BSIZE);
+	ck_assert(lgfs2_dev_pread(sdp, &c, 1, 5 * MOCK_BSIZE) == 1);
+	ck_assert(c == 'i');
+	/* Writes don't reach the image file */
+	ck_assert(lgfs2_dev_pwrite(sdp, "m", 1, 5 * MOCK_BSIZE) == 1);
+	ck_assert(lgfs2_dev_pread(sdp, &c, 1, 5 * MOCK_BSIZE) == 1);
+	ck_assert(c == 'm');
+	ck_assert(image_byte(5) == 'i');
+}
+END_TEST
+
+static void write_record(int fd, uint64_t blk, const void *data, uint16_t len)
+{
+	struct saved_metablock svb = {
+		.blk = cpu_to_be64(blk),
+		.siglen = cpu_to_be16(len)
+	};
+
+	ck_assert(write(fd, &svb, sizeof(svb)) == sizeof(svb));
+	ck_assert(write(fd, data, len) == len);
+}
+
+static void mockup_savemeta(int compressed)
+{
+	struct savemeta_header smh = {
+		.sh_magic = cpu_to_be32(SAVEMETA_MAGIC),
+		.sh_format = cpu_to_be32(SAVEMETA_FORMAT),
+		.sh_fs_bytes = cpu_to_be64(MOCK_DEV_BLOCKS * MOCK_BSIZE)
+	};
+	struct gfs2_sb sb = {
+		.sb_header.mh_magic = cpu_to_be32(GFS2_MAGIC),
+		.sb_header.mh_type = cpu_to_be32(GFS2_METATYPE_SB),
+		.sb_bsize = cpu_to_be32(MOCK_BSIZE)
+	};
+	char data[MOCK_BSIZE];
+	int fd;
+
+	fd = open(tc_path, O_WRONLY | O_TRUNC);
+	ck_assert(fd >= 0);
+	if (compressed)
+		ck_assert(write(fd, "\x1f\x8b\x08", 3) == 3);
+	ck_assert(write(fd, &smh, sizeof(smh)) == sizeof(smh));
+	write_record(fd, GFS2_SB_ADDR * GFS2_BASIC_BLOCK / MOCK_BSIZE, &sb, sizeof(sb));
+	memset(data, 'a', sizeof(data));
+	write_record(fd, 20, data, 100);
+	write_record(fd, 21, data, MOCK_BSIZE);
+	/* A later copy of a block replaces the earlier one */
+	memset(data, 'b', sizeof(data));
+	write_record(fd, 20, data, 50);
+	close(fd);
+}
+
+START_TEST(test_dev_savemeta)
+{
+	struct gfs2_sbd *sdp = &tc_sbd;
+	struct gfs2_buffer_head *bh;
+	char buf[MOCK_BSIZE * 2];
+	struct gfs2_sb sb;
+
+	mockup_savemeta(0);
+	dev_spec("savemeta:");
+	ck_assert(lgfs2_dev_open(sdp, tc_spec, O_RDWR) == -1);
+	ck_assert(errno == EROFS);
+	ck_assert(lgfs2_dev_open(sdp, tc_spec, O_RDONLY) == 0);
+	ck_assert(sdp->device_fd == -1);
+	ck_assert(lgfs2_dev_size(sdp) == MOCK_DEV_BLOCKS * MOCK_BSIZE);
+
+	ck_assert(lgfs2_dev_pread(sdp, &sb, sizeof(sb), GFS2_SB_ADDR * GFS2_BASIC_BLOCK) == sizeof(sb));
+	ck_assert(be32_to_cpu(sb.sb_bsize) == MOCK_BSIZE);
+
+	/* Blocks 20 and 21 in one read, block 20 padded with zeroes */
+	ck_assert(lgfs2_dev_pread(sdp, buf, sizeof(buf), 20 * MOCK_BSIZE) == sizeof(buf));
+	ck_assert(buf[0] == 'b' && buf[49] == 'b' && buf[50] == 0 && buf[MOCK_BSIZE - 1] == 0);
+	ck_assert(buf[MOCK_BSIZE] == 'a' && buf[sizeof(buf) - 1] == 'a');
+	/* Unaligned reads */
+	ck_assert(lgfs2_dev_pread(sdp, buf, 2, 21 * MOCK_BSIZE - 1) == 2);
+	ck_assert(buf[0] == 0 && buf[1] == 'a');
+
+	/* Blocks which weren't saved read as zeroes */
+	bh = bread(sdp, 30);
+	ck_assert(bh != NULL);
+	ck_assert(bh->b_data[0] == 0 && bh->b_data[MOCK_BSIZE - 1] == 0);
+	ck_assert(bwrite(bh) != 0);
+	brelse(bh);
+	ck_assert(lgfs2_dev_pread(sdp, buf, 1, MOCK_DEV_BLOCKS * MOCK_BSIZE) == 0);
+}
+END_TEST
+
+START_TEST(test_dev_savemeta_compressed)
+{
+	mockup_savemeta(1);
+	dev_spec("savemeta:");
+	ck_assert(lgfs2_dev_open(&tc_sbd, tc_spec, O_RDONLY) == -1);
+	ck_assert(errno == ENOTSUP);
+	ck_assert(tc_sbd.dev_ops == NULL);
+}
+END_TEST
+
+Suite *suite_devio(void)
+{
+	Suite *s = suite_create("devio.c");
+	TCase *tc;
+
+	tc = tcase_create("devio");
+	tcase_add_checked_fixture(tc, mockup_image, teardown_image);
+	tcase_add_test(tc, test_dev_type);
+	tcase_add_test(tc, test_dev_fd);
+	tcase_add_test(tc, test_dev_mmap);
+	tcase_add_test(tc, test_dev_memfd);
+	tcase_add_test(tc, test_dev_savemeta);
+	tcase_add_test(tc, test_dev_savemeta_compressed);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
@@ -0,0 +1,92 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <check.h>
+#include "libgfs2.h"
+
+Suite *suite_disk_hash(void);
+
+/* Bitwise CRC32, to check the table driven versions against */
+static uint32_t disk_hash_ref(const char *data, unsigned len)
+{
+	uint32_t hash = 0xFFFFFFFF;
+
+	while (len--) {
+		hash ^= (unsigned char)*data++;
+		for (int i = 0; i < 8; i++)
+			hash = (hash >> 1) ^ (0xEDB88320 & -(hash & 1));
+	}
+	return ~hash;
+}
+
+START_TEST(test_disk_hash)
+{
+	char buf[300];
+
+	ck_assert(gfs2_disk_hash("123456789", 9) == 0xCBF43926);
+	ck_assert(gfs2_disk_hash("", 0) == 0);
+	srandom(1);
+	for (unsigned i = 0; i < sizeof(buf); i++)
+		buf[i] = random();
+	for (unsigned len = 0; len < 256; len++)
+		for (unsigned off = 0; off < 8; off++)
+			ck_assert(gfs2_disk_hash(buf + off, len) == disk_hash_ref(buf + off, len));
+}
+END_TEST
+
+static unsigned add_dirent(char *buf, unsigned off, const char *name, unsigned name_len,
+                           unsigned rec_len)
+{
+	struct gfs2_dirent *dent = (struct gfs2_dirent *)(buf + off);
+
+	dent->de_rec_len = cpu_to_be16(rec_len);
+	dent->de_name_len = cpu_to_be16(name_len);
+	memcpy(dent + 1, name, name_len);
+	return off + rec_len;
+}
+
+START_TEST(test_dirent_hashes)
+{
+	char names[64][GFS2_FNAMESIZE];
+	unsigned lens[64];
+	uint32_t hashes[64];
+	char buf[8192] = {0};
+	unsigned off = 0, n;
+
+	srandom(2);
+	/* Names of different lengths, including a sentinel with no name */
+	for (n = 0; n < 64; n++) {
+		lens[n] = n == 0 ? 0 : 1 + random() % (n % 8 == 0 ? GFS2_FNAMESIZE : 24);
+		for (unsigned i = 0; i < lens[n]; i++)
+			names[n][i] = random();
+		off = add_dirent(buf, off, names[n], lens[n],
+		                 GFS2_DIRENT_SIZE(lens[n]) + (n % 3) * 8);
+	}
+	ck_assert(off < sizeof(buf));
+	ck_assert_int_eq(lgfs2_dirent_hashes(buf, off, hashes, 64), 64);
+	for (n = 0; n < 64; n++)
+		ck_assert(hashes[n] == gfs2_disk_hash(names[n], lens[n]));
+
+	/* Stops at max, the end of the buffer and bad record lengths */
+	memset(hashes, 0, sizeof(hashes));
+	ck_assert_int_eq(lgfs2_dirent_hashes(buf, off, hashes, 7), 7);
+	ck_assert(hashes[6] == gfs2_disk_hash(names[6], lens[6]));
+	ck_assert(hashes[7] == 0);
+	ck_assert_int_eq(lgfs2_dirent_hashes(buf, GFS2_DIRENT_SIZE(0) + 4, hashes, 64), 1);
+	add_dirent(buf, GFS2_DIRENT_SIZE(0), names[1], lens[1], sizeof(struct gfs2_dirent));
+	ck_assert_int_eq(lgfs2_dirent_hashes(buf, off, hashes, 64), 1);
+}
+END_TEST
+
+Suite *suite_disk_hash(void)
+{
+	Suite *s = suite_create("gfs2_disk_hash.c");
+	TCase *tc;
+
+	tc = tcase_create("gfs2_disk_hash");
+	tcase_add_test(tc, test_disk_hash);
+	tcase_add_test(tc, test_dirent_hashes);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
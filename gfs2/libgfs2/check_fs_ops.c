@@ -0,0 +1,633 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <check.h>
+#include "libgfs2.h"
+#include "check_common.h"
+
+/* Room for a minimum size resource group after the tagged blocks */
+#define MOCK_FS_BLOCKS (MOCK_DEV_BLOCKS + ((GFS2_MIN_RGSIZE << 20) / MOCK_BSIZE) * 2)
+/* More blocks than gfs2_readi() and gfs2_writei() put in one run when each
+   block has a header */
+#define DIR_BLOCKS (300)
+
+Suite *suite_fs_ops(void);
+
+static lgfs2_rgrps_t tc_rgrps;
+
+/* What the mock device saw, and whether it cuts transfers short */
+static struct {
+	size_t cap;      /* Transfer at most this many bytes if non-zero */
+	unsigned runs;   /* Transfers of more than one block */
+	unsigned shorts; /* Transfers cut short */
+	int maxiov;      /* The most iovecs in a transfer */
+} tc_io;
+
+static ssize_t mock_io(struct gfs2_sbd *sdp, const struct iovec *iov, int iovcnt, off_t offset, int write)
+{
+	struct iovec v[IOV_MAX];
+	size_t total = 0, len = 0;
+	int n;
+
+	for (n = 0; n < iovcnt; n++)
+		total += iov[n].iov_len;
+	if (total > sdp->sd_bsize) {
+		tc_io.runs++;
+		if (iovcnt > tc_io.maxiov)
+			tc_io.maxiov = iovcnt;
+	}
+	for (n = 0; n < iovcnt && n < IOV_MAX; n++) {
+		v[n] = iov[n];
+		if (tc_io.cap != 0 && len + v[n].iov_len > tc_io.cap) {
+			v[n++].iov_len = tc_io.cap - len;
+			tc_io.shorts++;
+			break;
+		}
+		len += v[n].iov_len;
+	}
+	if (write)
+		return pwritev(sdp->device_fd, v, n, offset);
+	return preadv(sdp->device_fd, v, n, offset);
+}
+
+static ssize_t mock_preadv(struct gfs2_sbd *sdp, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return mock_io(sdp, iov, iovcnt, offset, 0);
+}
+
+static ssize_t mock_pwritev(struct gfs2_sbd *sdp, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return mock_io(sdp, iov, iovcnt, offset, 1);
+}
+
+static int mock_sync(struct gfs2_sbd *sdp)
+{
+	return fsync(sdp->device_fd);
+}
+
+static const struct lgfs2_dev_ops mock_dev_ops = {
+	.name = "mock",
+	.flags = LGFS2_DEV_FD,
+	.preadv = mock_preadv,
+	.pwritev = mock_pwritev,
+	.sync = mock_sync,
+};
+
+/* The tagged device with a resource group after the tagged blocks, to
+   allocate from */
+static void mockup_fs(void)
+{
+	struct gfs2_rindex ri = {0};
+	uint32_t rgsize = MOCK_FS_BLOCKS - MOCK_DEV_BLOCKS;
+	struct gfs2_sbd *sdp;
+	lgfs2_rgrp_t rg;
+
+	mockup_sdp_tagged();
+	sdp = tc_sdp;
+	ck_assert(ftruncate(sdp->device_fd, (off_t)MOCK_FS_BLOCKS * MOCK_BSIZE) == 0);
+	sdp->device.length = MOCK_FS_BLOCKS;
+	sdp->dev_ops = &mock_dev_ops;
+	compute_constants(sdp);
+	memset(&tc_io, 0, sizeof(tc_io));
+
+	tc_rgrps = lgfs2_rgrps_init(sdp, 0, 0);
+	ck_assert(tc_rgrps != NULL);
+	ck_assert(lgfs2_rgrps_plan(tc_rgrps, rgsize, rgsize) == 1);
+	ck_assert(lgfs2_rindex_entry_new(tc_rgrps, &ri, MOCK_DEV_BLOCKS, rgsize) != 0);
+	rg = lgfs2_rgrps_append(tc_rgrps, &ri, 0);
+	ck_assert(rg != NULL);
+	ck_assert(lgfs2_rgrp_bitbuf_alloc(rg) == 0);
+	lgfs2_attach_rgrps(sdp, tc_rgrps);
+}
+
+static void teardown_fs(void)
+{
+	lgfs2_rgrp_t rg;
+
+	lgfs2_rgindex_free(tc_sdp);
+	tc_sdp->rgtree.osi_node = NULL;
+	for (rg = lgfs2_rgrp_first(tc_rgrps); rg != NULL; rg = lgfs2_rgrp_next(rg))
+		lgfs2_rgrp_bitbuf_free(rg);
+	lgfs2_rgrps_free(&tc_rgrps);
+	teardown_sdp();
+}
+
+/* An inode of height 1 at block addr, with the data block pointers ptrs */
+static struct gfs2_inode *mock_inode(uint64_t addr, uint32_t mode, uint32_t flags,
+                                     const uint64_t *ptrs, unsigned n, uint64_t size)
+{
+	struct gfs2_buffer_head *bh = bget(tc_sdp, addr);
+	__be64 *p = (__be64 *)(bh->b_data + sizeof(struct gfs2_dinode));
+	struct gfs2_inode *ip;
+
+	for (unsigned i = 0; i < n; i++)
+		p[i] = cpu_to_be64(ptrs[i]);
+	ip = lgfs2_inode_get(tc_sdp, bh);
+	ck_assert(ip != NULL);
+	ip->bh_owned = 1;
+	ip->i_num.in_addr = addr;
+	ip->i_mode = mode;
+	ip->i_flags = flags;
+	ip->i_height = 1;
+	ip->i_size = size;
+	return ip;
+}
+
+/* O_DIRECT makes gfs2_readi() and gfs2_writei() go block by block */
+static void per_block(int on)
+{
+	tc_sdp->dio_align = on ? 512 : 0;
+}
+
+static void fill_pattern(char *buf, size_t size, unsigned seed)
+{
+	for (size_t i = 0; i < size; i++)
+		buf[i] = (char)(i * 7 + i / 4093 + seed);
+}
+
+/* What gfs2_readi() gives for blocks written by mockup_sdp_tagged() */
+static char *tagged_data(const uint64_t *ptrs, unsigned n)
+{
+	char *buf = calloc(n, MOCK_BSIZE);
+
+	ck_assert(buf != NULL);
+	for (unsigned i = 0; i < n; i++)
+		memcpy(buf + (size_t)i * MOCK_BSIZE, &ptrs[i], sizeof(ptrs[i]));
+	return buf;
+}
+
+/* Read with runs and block by block, which must both give expect */
+static void check_readi(struct gfs2_inode *ip, uint64_t offset, unsigned size, const char *expect)
+{
+	char *run = malloc(size);
+	char *blk = malloc(size);
+
+	ck_assert(run != NULL && blk != NULL);
+	per_block(0);
+	ck_assert_int_eq(gfs2_readi(ip, run, offset, size), size);
+	per_block(1);
+	ck_assert_int_eq(gfs2_readi(ip, blk, offset, size), size);
+	per_block(0);
+	ck_assert(memcmp(run, blk, size) == 0);
+	ck_assert(memcmp(run, expect, size) == 0);
+	free(run);
+	free(blk);
+}
+
+static void check_block(uint64_t blk, const char *expect)
+{
+	char buf[MOCK_BSIZE];
+
+	ck_assert(pread(tc_sdp->device_fd, buf, MOCK_BSIZE, blk * MOCK_BSIZE) == MOCK_BSIZE);
+	ck_assert(memcmp(buf, expect, MOCK_BSIZE) == 0);
+}
+
+/* Each data block of the directory must start with a journaled data header */
+static void check_dir_headers(struct gfs2_inode *ip, unsigned nblocks)
+{
+	struct gfs2_meta_header mh;
+
+	for (uint64_t lblock = 0; lblock < nblocks; lblock++) {
+		uint64_t dblock;
+		int new = 0;
+
+		block_map(ip, lblock, &new, &dblock, NULL, 0);
+		ck_assert(dblock != 0);
+		ck_assert(pread(tc_sdp->device_fd, &mh, sizeof(mh), dblock * MOCK_BSIZE) == sizeof(mh));
+		ck_assert(be32_to_cpu(mh.mh_magic) == GFS2_MAGIC);
+		ck_assert(be32_to_cpu(mh.mh_type) == GFS2_METATYPE_JD);
+		ck_assert(be32_to_cpu(mh.mh_format) == GFS2_FORMAT_JD);
+	}
+}
+
+START_TEST(test_readi_holes)
+{
+	/* Runs broken by holes, a backwards jump and a jump forwards */
+	const uint64_t ptrs[] = {10, 11, 12, 0, 0, 20, 21, 22, 23, 0, 30, 5, 6, 31};
+	const unsigned n = sizeof(ptrs) / sizeof(ptrs[0]);
+	struct gfs2_inode *ip = mock_inode(900, S_IFREG | 0644, 0, ptrs, n, n * MOCK_BSIZE);
+	char *expect = tagged_data(ptrs, n);
+
+	check_readi(ip, 0, n * MOCK_BSIZE, expect);
+	ck_assert(tc_io.runs > 0);
+	/* Partial blocks at both ends */
+	check_readi(ip, MOCK_BSIZE / 2, 10 * MOCK_BSIZE, expect + MOCK_BSIZE / 2);
+	check_readi(ip, 3 * MOCK_BSIZE - 8, 4 * MOCK_BSIZE + 16, expect + 3 * MOCK_BSIZE - 8);
+	inode_put(&ip);
+	free(expect);
+}
+END_TEST
+
+START_TEST(test_writei_holes)
+{
+	const uint64_t ptrs[] = {40, 41, 42, 0, 50, 0, 0, 60, 61, 44};
+	const unsigned n = sizeof(ptrs) / sizeof(ptrs[0]);
+	const unsigned size = n * MOCK_BSIZE;
+	struct gfs2_inode *ip = mock_inode(900, S_IFREG | 0644, 0, ptrs, n, size);
+	char *pat = malloc(size);
+	char *pat2 = malloc(size);
+
+	ck_assert(pat != NULL && pat2 != NULL);
+	fill_pattern(pat, size, 1);
+	ck_assert_int_eq(gfs2_writei(ip, pat, 0, size), size);
+	ck_assert(tc_io.runs > 0);
+	check_readi(ip, 0, size, pat);
+	for (unsigned i = 0; i < n; i++)
+		if (ptrs[i] != 0)
+			check_block(ptrs[i], pat + (size_t)i * MOCK_BSIZE);
+
+	/* Partial blocks at both ends, block by block then with runs */
+	fill_pattern(pat2, 6 * MOCK_BSIZE, 2);
+	per_block(1);
+	ck_assert_int_eq(gfs2_writei(ip, pat2, MOCK_BSIZE / 2, 6 * MOCK_BSIZE), 6 * MOCK_BSIZE);
+	memcpy(pat + MOCK_BSIZE / 2, pat2, 6 * MOCK_BSIZE);
+	check_readi(ip, 0, size, pat);
+
+	fill_pattern(pat2, 6 * MOCK_BSIZE, 3);
+	per_block(0);
+	ck_assert_int_eq(gfs2_writei(ip, pat2, MOCK_BSIZE + 100, 6 * MOCK_BSIZE), 6 * MOCK_BSIZE);
+	memcpy(pat + MOCK_BSIZE + 100, pat2, 6 * MOCK_BSIZE);
+	check_readi(ip, 0, size, pat);
+	inode_put(&ip);
+	free(pat);
+	free(pat2);
+}
+END_TEST
+
+START_TEST(test_io_run_cached)
+{
+	const uint64_t ptrs[] = {70, 71, 72, 73};
+	const unsigned n = sizeof(ptrs) / sizeof(ptrs[0]);
+	const unsigned size = n * MOCK_BSIZE;
+	struct gfs2_inode *ip = mock_inode(900, S_IFREG | 0644, 0, ptrs, n, size);
+	char *expect = tagged_data(ptrs, n);
+	char *buf = malloc(size);
+	struct gfs2_buffer_head *bh;
+
+	ck_assert(buf != NULL);
+	ck_assert(lgfs2_bcache_init(tc_sdp, 64 * (sizeof(*bh) + MOCK_BSIZE), LGFS2_BCACHE_WRITEBACK) == 0);
+
+	/* A change which is only in the cache */
+	bh = bread(tc_sdp, 71);
+	ck_assert(bh != NULL);
+	memset(bh->b_data + 8, 0xaa, 16);
+	memset(expect + MOCK_BSIZE + 8, 0xaa, 16);
+	bmodified(bh);
+	brelse(bh);
+	ck_assert(lgfs2_bcache_cached(tc_sdp, 71));
+	ck_assert(!lgfs2_bcache_cached(tc_sdp, 72));
+
+	ck_assert_int_eq(gfs2_readi(ip, buf, 0, size), size);
+	ck_assert(memcmp(buf, expect, size) == 0);
+
+	/* The cached buffer must not be left with stale data */
+	fill_pattern(buf, size, 4);
+	ck_assert_int_eq(gfs2_writei(ip, buf, 0, size), size);
+	ck_assert(tc_io.runs > 0);
+	check_readi(ip, 0, size, buf);
+	ck_assert(lgfs2_bcache_flush(tc_sdp) == 0);
+	for (unsigned i = 0; i < n; i++)
+		check_block(ptrs[i], buf + (size_t)i * MOCK_BSIZE);
+	inode_put(&ip);
+	free(expect);
+	free(buf);
+}
+END_TEST
+
+/* The directory blocks have headers, so each block takes two iovecs */
+START_TEST(test_io_run_dir)
+{
+	const unsigned size = DIR_BLOCKS * tc_sdp->sd_jbsize;
+	struct gfs2_inode *ip = mock_inode(900, S_IFDIR | 0755, 0, NULL, 0, 0);
+	struct gfs2_inode *ip2 = mock_inode(901, S_IFDIR | 0755, 0, NULL, 0, 0);
+	char *pat = malloc(size);
+	char buf[MOCK_BSIZE];
+
+	ck_assert(pat != NULL);
+	fill_pattern(pat, size, 5);
+	ck_assert_int_eq(gfs2_writei(ip, pat, 0, size), size);
+	ck_assert(ip->i_size == size);
+	ck_assert_int_eq(tc_io.runs, (DIR_BLOCKS + 127) / 128);
+	ck_assert_int_eq(tc_io.maxiov, 256);
+
+	per_block(1);
+	ck_assert_int_eq(gfs2_writei(ip2, pat, 0, size), size);
+	per_block(0);
+
+	memset(&tc_io, 0, sizeof(tc_io));
+	check_readi(ip, 0, size, pat);
+	check_readi(ip2, 0, size, pat);
+	ck_assert_int_eq(tc_io.runs, 2 * ((DIR_BLOCKS + 127) / 128));
+	check_readi(ip, tc_sdp->sd_jbsize - 10, 200 * tc_sdp->sd_jbsize, pat + tc_sdp->sd_jbsize - 10);
+
+	/* Both ways give the same blocks, header and all */
+	check_dir_headers(ip, DIR_BLOCKS);
+	for (uint64_t lblock = 0; lblock < DIR_BLOCKS; lblock++) {
+		uint64_t dblock, dblock2;
+		int new = 0;
+
+		block_map(ip, lblock, &new, &dblock, NULL, 0);
+		block_map(ip2, lblock, &new, &dblock2, NULL, 0);
+		ck_assert(pread(tc_sdp->device_fd, buf, MOCK_BSIZE, dblock2 * MOCK_BSIZE) == MOCK_BSIZE);
+		check_block(dblock, buf);
+	}
+	inode_put(&ip);
+	inode_put(&ip2);
+	free(pat);
+}
+END_TEST
+
+/* gfs1 journaled data has a header in each block too */
+START_TEST(test_io_run_jdata)
+{
+	const uint64_t ptrs[] = {80, 81, 82, 0, 84, 85, 86};
+	const unsigned n = sizeof(ptrs) / sizeof(ptrs[0]);
+	const unsigned jbsize = tc_sdp->sd_jbsize;
+	const unsigned size = n * jbsize;
+	struct gfs2_meta_header mh = {
+		.mh_magic = cpu_to_be32(GFS2_MAGIC),
+		.mh_type = cpu_to_be32(GFS2_METATYPE_JD),
+		.mh_format = cpu_to_be32(GFS2_FORMAT_JD),
+	};
+	struct gfs2_inode *ip;
+	char *pat = malloc(size);
+	char buf[MOCK_BSIZE];
+
+	ck_assert(pat != NULL);
+	fill_pattern(pat, size, 6);
+	for (unsigned i = 0; i < n; i++) {
+		if (ptrs[i] == 0) {
+			memset(pat + (size_t)i * jbsize, 0, jbsize);
+			continue;
+		}
+		memcpy(buf, &mh, sizeof(mh));
+		memcpy(buf + sizeof(mh), pat + (size_t)i * jbsize, jbsize);
+		ck_assert(pwrite(tc_sdp->device_fd, buf, MOCK_BSIZE, ptrs[i] * MOCK_BSIZE) == MOCK_BSIZE);
+	}
+	tc_sdp->gfs1 = 1;
+	ip = mock_inode(900, S_IFREG | 0644, GFS2_DIF_JDATA, ptrs, n, size);
+
+	check_readi(ip, 0, size, pat);
+	ck_assert(tc_io.runs > 0);
+	check_readi(ip, jbsize + 1, 5 * jbsize - 2, pat + jbsize + 1);
+	inode_put(&ip);
+	free(pat);
+}
+END_TEST
+
+/* Transfers cut short go again block by block */
+START_TEST(test_io_run_short)
+{
+	const uint64_t ptrs[] = {100, 101, 102, 103, 0, 105, 106};
+	const unsigned n = sizeof(ptrs) / sizeof(ptrs[0]);
+	const unsigned size = n * MOCK_BSIZE;
+	struct gfs2_inode *ip = mock_inode(900, S_IFREG | 0644, 0, ptrs, n, size);
+	struct gfs2_inode *dip = mock_inode(901, S_IFDIR | 0755, 0, NULL, 0, 0);
+	char *expect = tagged_data(ptrs, n);
+	char *pat = malloc(size);
+
+	ck_assert(pat != NULL);
+	tc_io.cap = MOCK_BSIZE;
+	check_readi(ip, 0, size, expect);
+	ck_assert(tc_io.shorts > 0);
+
+	tc_io.shorts = 0;
+	fill_pattern(pat, size, 7);
+	ck_assert_int_eq(gfs2_writei(ip, pat, 0, size), size);
+	ck_assert(tc_io.shorts > 0);
+	tc_io.cap = 0;
+	check_readi(ip, 0, size, pat);
+	for (unsigned i = 0; i < n; i++)
+		if (ptrs[i] != 0)
+			check_block(ptrs[i], pat + (size_t)i * MOCK_BSIZE);
+
+	/* With headers */
+	tc_io.cap = MOCK_BSIZE;
+	tc_io.shorts = 0;
+	ck_assert_int_eq(gfs2_writei(dip, pat, 0, size), size);
+	ck_assert(tc_io.shorts > 0);
+	tc_io.cap = 0;
+	check_readi(dip, 0, size, pat);
+	check_dir_headers(dip, size / tc_sdp->sd_jbsize);
+	inode_put(&ip);
+	inode_put(&dip);
+	free(expect);
+	free(pat);
+}
+END_TEST
+
+/* Blocks which cross into heights 2 and 3, out of order and with holes.
+   1017 and 300000 are both under the second pointer of the dinode before
+   and after the tree grows, so a stale cached path would be taken. */
+static const uint64_t mp_layout[] = {
+	0, 1, 2, 5, 3, 400, 482, 483, 484, 1000, 100, 990, 1018, 1017,
+	300000, 300001, 7, 245847, 4, 299999, 491, 492, 6
+};
+#define MP_LAYOUT_LEN (sizeof(mp_layout) / sizeof(mp_layout[0]))
+
+struct mapped {
+	uint64_t dblock;
+	uint32_t extlen;
+	int new;
+};
+
+static void map_blocks(struct gfs2_inode *ip, const uint64_t *lblocks, unsigned n,
+                       int create, int prealloc, struct mapped *out)
+{
+	for (unsigned i = 0; i < n; i++) {
+		out[i].new = create;
+		block_map(ip, lblocks[i], &out[i].new, &out[i].dblock, &out[i].extlen, prealloc);
+	}
+}
+
+/* Map lblocks without and with the metapath cache, which must agree */
+static void check_map(struct gfs2_inode *ip, const uint64_t *lblocks, unsigned n, int prealloc)
+{
+	struct mapped *a = calloc(n, sizeof(*a));
+	struct mapped *b = calloc(n, sizeof(*b));
+
+	ck_assert(a != NULL && b != NULL);
+	map_blocks(ip, lblocks, n, 0, prealloc, a);
+	ck_assert(lgfs2_mpcache_start(ip) == 0);
+	map_blocks(ip, lblocks, n, 0, prealloc, b);
+	lgfs2_mpcache_stop(ip);
+	ck_assert(ip->i_mpcache == NULL);
+	for (unsigned i = 0; i < n; i++) {
+		ck_assert(a[i].dblock == b[i].dblock);
+		ck_assert(a[i].extlen == b[i].extlen);
+		ck_assert(a[i].new == 0 && b[i].new == 0);
+	}
+	free(a);
+	free(b);
+}
+
+/* Only the dinode buffers of the inodes may be held */
+static void check_bufs_held(uint64_t n)
+{
+	struct lgfs2_slab_stats bufs, inodes;
+
+	lgfs2_slab_stats(tc_sdp, &bufs, &inodes);
+	ck_assert(bufs.ss_inuse == n);
+}
+
+START_TEST(test_mpcache_create)
+{
+	struct mapped a[MP_LAYOUT_LEN], b[MP_LAYOUT_LEN], c[MP_LAYOUT_LEN];
+	struct gfs2_inode *ip, *ip2;
+	uint64_t used;
+
+	ck_assert(lgfs2_slab_init(tc_sdp) == 0);
+	ip = mock_inode(900, S_IFREG | 0644, 0, NULL, 0, 0);
+	ip2 = mock_inode(901, S_IFREG | 0644, 0, NULL, 0, 0);
+
+	map_blocks(ip, mp_layout, MP_LAYOUT_LEN, 1, 0, a);
+	ck_assert(ip->i_height == 3);
+	used = tc_sdp->blks_alloced;
+
+	/* The same allocations in the same order, after those of ip */
+	ck_assert(lgfs2_mpcache_start(ip2) == 0);
+	map_blocks(ip2, mp_layout, MP_LAYOUT_LEN, 1, 0, b);
+	lgfs2_mpcache_stop(ip2);
+	ck_assert(ip2->i_mpcache == NULL);
+	ck_assert(ip2->i_height == 3);
+	ck_assert(tc_sdp->blks_alloced == 2 * used);
+	check_bufs_held(2);
+	map_blocks(ip2, mp_layout, MP_LAYOUT_LEN, 0, 0, c);
+
+	for (unsigned i = 0; i < MP_LAYOUT_LEN; i++) {
+		ck_assert(a[i].dblock != 0);
+		ck_assert(b[i].dblock == a[i].dblock + used);
+		ck_assert(a[i].extlen == 1 && b[i].extlen == 1);
+		ck_assert(a[i].new == 1 && b[i].new == 1);
+		ck_assert(c[i].dblock == b[i].dblock);
+	}
+	inode_put(&ip);
+	inode_put(&ip2);
+	check_bufs_held(0);
+}
+END_TEST
+
+START_TEST(test_mpcache_lookup)
+{
+	const uint64_t scattered[] = {
+		300001, 0, 491, 300000, 2, 2, 484, 483, 1017, 5, 245847, 1000,
+		1000, 12345678, 6, 299999, 400, 401, 1, 990, 492
+	};
+	const unsigned nscat = sizeof(scattered) / sizeof(scattered[0]);
+	uint64_t ascending[1100];
+	struct mapped m[MP_LAYOUT_LEN];
+	struct gfs2_inode *ip;
+
+	ck_assert(lgfs2_slab_init(tc_sdp) == 0);
+	ip = mock_inode(900, S_IFREG | 0644, 0, NULL, 0, 0);
+	map_blocks(ip, mp_layout, MP_LAYOUT_LEN, 1, 0, m);
+	check_bufs_held(1);
+
+	for (unsigned i = 0; i < 1100; i++)
+		ascending[i] = i;
+	check_map(ip, ascending, 1100, 0);
+	check_map(ip, ascending, 1100, 1);
+	for (unsigned i = 0; i < 1100; i++)
+		ascending[i] = 299500 + i;
+	check_map(ip, ascending, 1100, 0);
+	check_map(ip, ascending, 1100, 1);
+	check_map(ip, scattered, nscat, 0);
+	check_map(ip, scattered, nscat, 1);
+	check_map(ip, mp_layout, MP_LAYOUT_LEN, 0);
+	check_map(ip, mp_layout, MP_LAYOUT_LEN, 1);
+	check_bufs_held(1);
+
+	/* The blocks which were allocated, and the lowest indirect blocks
+	   which lead to them, whether the whole path is cached or not */
+	ck_assert(lgfs2_mpcache_start(ip) == 0);
+	for (unsigned i = 0; i < MP_LAYOUT_LEN; i++) {
+		struct gfs2_buffer_head *bh;
+		struct metapath mp;
+		uint64_t dblock;
+		uint32_t extlen;
+		int new = 0;
+
+		block_map(ip, mp_layout[i], &new, &dblock, &extlen, 0);
+		ck_assert(dblock == m[i].dblock);
+		find_metapath(ip, mp_layout[i], &mp);
+		bh = lgfs2_metapath_get(ip, &mp, ip->i_height - 1, 0, &new);
+		ck_assert(bh != NULL);
+		block_map(ip, mp_layout[i], &new, &dblock, &extlen, 1);
+		ck_assert(dblock == bh->b_blocknr);
+		lgfs2_metapath_put(ip, bh);
+	}
+	lgfs2_mpcache_stop(ip);
+	check_bufs_held(1);
+	inode_put(&ip);
+}
+END_TEST
+
+START_TEST(test_mpcache_nested)
+{
+	struct mapped m[MP_LAYOUT_LEN], c[MP_LAYOUT_LEN];
+	struct gfs2_inode *ip;
+
+	ck_assert(lgfs2_slab_init(tc_sdp) == 0);
+	ip = mock_inode(900, S_IFREG | 0644, 0, NULL, 0, 0);
+
+	/* Growing the tree under an outer user of the cache */
+	ck_assert(lgfs2_mpcache_start(ip) == 0);
+	map_blocks(ip, mp_layout, 7, 1, 0, m);
+	ck_assert(ip->i_height == 1);
+	ck_assert(lgfs2_mpcache_start(ip) == 0);
+	map_blocks(ip, mp_layout + 7, MP_LAYOUT_LEN - 7, 1, 0, m + 7);
+	ck_assert(ip->i_height == 3);
+	lgfs2_mpcache_stop(ip);
+	ck_assert(ip->i_mpcache != NULL);
+	map_blocks(ip, mp_layout, MP_LAYOUT_LEN, 0, 0, c);
+	lgfs2_mpcache_stop(ip);
+	ck_assert(ip->i_mpcache == NULL);
+	check_bufs_held(1);
+
+	for (unsigned i = 0; i < MP_LAYOUT_LEN; i++) {
+		ck_assert(c[i].dblock == m[i].dblock);
+		ck_assert(c[i].new == 0);
+	}
+	map_blocks(ip, mp_layout, MP_LAYOUT_LEN, 0, 0, c);
+	for (unsigned i = 0; i < MP_LAYOUT_LEN; i++)
+		ck_assert(c[i].dblock == m[i].dblock);
+	check_map(ip, mp_layout, MP_LAYOUT_LEN, 0);
+
+	/* inode_put() stops the cache for any users left */
+	ck_assert(lgfs2_mpcache_start(ip) == 0);
+	ck_assert(lgfs2_mpcache_start(ip) == 0);
+	map_blocks(ip, mp_layout, MP_LAYOUT_LEN, 0, 1, c);
+	inode_put(&ip);
+	check_bufs_held(0);
+}
+END_TEST
+
+Suite *suite_fs_ops(void)
+{
+	Suite *s = suite_create("fs_ops.c");
+	TCase *tc;
+
+	tc = tcase_create("io_run");
+	tcase_add_checked_fixture(tc, mockup_fs, teardown_fs);
+	tcase_add_test(tc, test_readi_holes);
+	tcase_add_test(tc, test_writei_holes);
+	tcase_add_test(tc, test_io_run_cached);
+	tcase_add_test(tc, test_io_run_dir);
+	tcase_add_test(tc, test_io_run_jdata);
+	tcase_add_test(tc, test_io_run_short);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("mpcache");
+	tcase_add_checked_fixture(tc, mockup_fs, teardown_fs);
+	tcase_add_test(tc, test_mpcache_create);
+	tcase_add_test(tc, test_mpcache_lookup);
+	tcase_add_test(tc, test_mpcache_nested);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
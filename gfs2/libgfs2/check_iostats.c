@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <check.h>
+#include "libgfs2.h"
+#include "check_common.h"
+
+Suite *suite_iostats(void);
+
+/* Find the fields of the dump line for the call site at line */
+static int find_site(const char *path, int line, unsigned long long *fields, int nfields)
+{
+	char buf[1024];
+	FILE *f = fopen(path, "r");
+	int found = 0;
+
+	ck_assert(f != NULL);
+	while (!found && fgets(buf, sizeof(buf), f) != NULL) {
+		char *p = strchr(buf, '\t');
+
+		if (p == NULL || strtol(p + 1, &p, 10) != line)
+			continue;
+		for (int i = 0; i < nfields; i++)
+			fields[i] = strtoull(p, &p, 10);
+		found = 1;
+	}
+	fclose(f);
+	return found;
+}
+
+START_TEST(test_iostats_sites)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	char path[] = "iostats-XXXXXX";
+	struct gfs2_buffer_head *bh, *bhs[4];
+	unsigned long long f[7];
+	int rline, wline, mline;
+	int fd;
+
+	fd = mkstemp(path);
+	ck_assert(fd >= 0);
+	close(fd);
+
+	/* Nothing is counted until it's enabled */
+	bh = bread(sdp, 1);
+	brelse(bh);
+	ck_assert(lgfs2_iostats_enable(NULL) == 0);
+	ck_assert(lgfs2_iostats_on);
+
+	rline = __LINE__ + 1;
+	bh = bread(sdp, 2);
+	ck_assert(bh != NULL);
+	bmodified(bh);
+	wline = __LINE__ + 1;
+	ck_assert(brelse(bh) == 0);
+	mline = __LINE__ + 1;
+	ck_assert(breadm(sdp, bhs, 4, 3) == 0);
+	for (int i = 0; i < 4; i++)
+		brelse(bhs[i]);
+
+	ck_assert(lgfs2_iostats_dump(path) == 0);
+	/* reads, writes, read bytes, write bytes, sequential, random, errors */
+	ck_assert(find_site(path, rline, f, 7));
+	ck_assert(f[0] == 1 && f[1] == 0 && f[2] == MOCK_BSIZE && f[5] == 1);
+	ck_assert(find_site(path, wline, f, 7));
+	ck_assert(f[0] == 0 && f[1] == 1 && f[3] == MOCK_BSIZE && f[5] == 1);
+	ck_assert(find_site(path, mline, f, 7));
+	ck_assert(f[0] == 1 && f[2] == 4 * MOCK_BSIZE && f[4] == 1);
+	ck_assert(unlink(path) == 0);
+}
+END_TEST
+
+/* Reads queued on the read engine are counted where they were queued, with
+   and without io_uring */
+START_TEST(test_iostats_aio)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	char path[] = "iostats-XXXXXX";
+	struct gfs2_buffer_head *bhs[2];
+	char buf[2 * MOCK_BSIZE];
+	unsigned long long f[7];
+	struct lgfs2_aio *aio;
+	struct lgfs2_aio_done done;
+	int rline = 0, bline = 0, mline = 0;
+	unsigned flags[] = { LGFS2_AIO_SYNC, 0 };
+	int fd;
+
+	fd = mkstemp(path);
+	ck_assert(fd >= 0);
+	close(fd);
+	ck_assert(lgfs2_iostats_enable(NULL) == 0);
+
+	for (int i = 0; i < 2; i++) {
+		aio = lgfs2_aio_init(sdp, 4, flags[i]);
+		ck_assert(aio != NULL);
+		rline = __LINE__ + 1;
+		ck_assert(lgfs2_aio_read(aio, buf, 10, 2, NULL) == 0);
+		bline = __LINE__ + 1;
+		ck_assert(lgfs2_aio_bread(aio, 20, NULL) == 0);
+		mline = __LINE__ + 1;
+		ck_assert(lgfs2_aio_breadm(aio, bhs, 2, 30, NULL) == 0);
+		ck_assert(lgfs2_aio_submit(aio) == 0);
+		for (int n = 0; n < 3; n++) {
+			ck_assert(lgfs2_aio_reap(aio, &done, 1) == 1);
+			ck_assert(done.ad_error == 0);
+			if (done.ad_bh != NULL)
+				brelse(done.ad_bh);
+			for (unsigned j = 0; done.ad_bhs != NULL && j < done.ad_count; j++)
+				brelse(done.ad_bhs[j]);
+		}
+		lgfs2_aio_free(&aio);
+	}
+
+	ck_assert(lgfs2_iostats_dump(path) == 0);
+	ck_assert(find_site(path, rline, f, 7));
+	ck_assert(f[0] == 2 && f[2] == 4 * MOCK_BSIZE);
+	ck_assert(find_site(path, bline, f, 7));
+	ck_assert(f[0] == 2 && f[2] == 2 * MOCK_BSIZE);
+	ck_assert(find_site(path, mline, f, 7));
+	ck_assert(f[0] == 2 && f[2] == 4 * MOCK_BSIZE);
+	ck_assert(unlink(path) == 0);
+}
+END_TEST
+
+START_TEST(test_iostats_direct)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	char path[] = "iostats-XXXXXX";
+	char buf[MOCK_BSIZE];
+	char line[1024];
+	FILE *f;
+	int fd;
+	int found = 0;
+
+	fd = mkstemp(path);
+	ck_assert(fd >= 0);
+	close(fd);
+	ck_assert(lgfs2_iostats_enable(NULL) == 0);
+	ck_assert(lgfs2_dev_pread(sdp, buf, sizeof(buf), 0) == sizeof(buf));
+	/* Reads past the end of the device are short, not errors */
+	ck_assert(lgfs2_dev_pread(sdp, buf, sizeof(buf), MOCK_DEV_BLOCKS * MOCK_BSIZE) == 0);
+	ck_assert(lgfs2_iostats_dump(path) == 0);
+
+	f = fopen(path, "r");
+	ck_assert(f != NULL);
+	ck_assert(fgets(line, sizeof(line), f) != NULL);
+	ck_assert(strncmp(line, "# pid ", 6) == 0);
+	ck_assert(fgets(line, sizeof(line), f) != NULL);
+	ck_assert(strncmp(line, "func\tline\treads\t", 16) == 0);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "lgfs2_dev_pread\t0\t2\t0\t4096\t0\t", 29) == 0)
+			found = 1;
+	}
+	fclose(f);
+	ck_assert(found);
+	ck_assert(unlink(path) == 0);
+}
+END_TEST
+
+START_TEST(test_iostats_sigusr1)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	char path[] = "iostats-XXXXXX";
+	char buf[MOCK_BSIZE];
+	struct stat st;
+	int fd;
+
+	fd = mkstemp(path);
+	ck_assert(fd >= 0);
+	close(fd);
+	ck_assert(lgfs2_iostats_enable(path) == 0);
+	ck_assert(lgfs2_dev_pread(sdp, buf, sizeof(buf), 0) == sizeof(buf));
+
+	/* The dump is written without waiting for more I/O */
+	ck_assert(kill(getpid(), SIGUSR1) == 0);
+	for (int i = 0; i < 200; i++) {
+		ck_assert(stat(path, &st) == 0);
+		if (st.st_size > 0)
+			break;
+		usleep(10000);
+	}
+	ck_assert(st.st_size > 0);
+	ck_assert(lgfs2_iostats_enable(NULL) == 0);
+	ck_assert(unlink(path) == 0);
+}
+END_TEST
+
+Suite *suite_iostats(void)
+{
+	Suite *s = suite_create("iostats.c");
+	TCase *tc;
+
+	tc = tcase_create("iostats");
+	tcase_add_checked_fixture(tc, mockup_sdp, teardown_sdp);
+	tcase_add_test(tc, test_iostats_sites);
+	tcase_add_test(tc, test_iostats_aio);
+	tcase_add_test(tc, test_iostats_direct);
+	tcase_add_test(tc, test_iostats_sigusr1);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
@@ -7,6 +7,17 @@ void print_it(const char *label, const char *fmt, const char *fmt2, ...) {}
 extern Suite *suite_meta(void);
 extern Suite *suite_ondisk(void);
 extern Suite *suite_rgrp(void);
+extern Suite *suite_buf(void);
+extern Suite *suite_aio(void);
+extern Suite *suite_rgpool(void);
+extern Suite *suite_slab(void);
+extern Suite *suite_devio(void);
+extern Suite *suite_readahead(void);
+extern Suite *suite_iostats(void);
+extern Suite *suite_crc32c(void);
+extern Suite *suite_disk_hash(void);
+extern Suite *suite_threads(void);
+extern Suite *suite_fs_ops(void);
 
 int main(void)
 {
@@ -15,6 +26,17 @@ int main(void)
 	SRunner *runner = srunner_create(suite_meta());
 	srunner_add_suite(runner, suite_ondisk());
 	srunner_add_suite(runner, suite_rgrp());
+	srunner_add_suite(runner, suite_buf());
+	srunner_add_suite(runner, suite_aio());
+	srunner_add_suite(runner, suite_rgpool());
+	srunner_add_suite(runner, suite_slab());
+	srunner_add_suite(runner, suite_devio());
+	srunner_add_suite(runner, suite_readahead());
+	srunner_add_suite(runner, suite_iostats());
+	srunner_add_suite(runner, suite_crc32c());
+	srunner_add_suite(runner, suite_disk_hash());
+	srunner_add_suite(runner, suite_threads());
+	srunner_add_suite(runner, suite_fs_ops());
 
 	srunner_run_all(runner, CK_ENV);
 	failures = srunner_ntests_failed(runner);
@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <check.h>
+#include "libgfs2.h"
+#include "check_common.h"
+
+Suite *suite_readahead(void);
+
+static void mockup_ra(void)
+{
+	mockup_sdp();
+	ck_assert(lgfs2_ra_init(tc_sdp) == 0);
+}
+
+static void read_blocks(struct gfs2_sbd *sdp, uint64_t blk, uint64_t count)
+{
+	for (; count > 0; blk++, count--) {
+		struct gfs2_buffer_head *bh = bread(sdp, blk);
+
+		ck_assert(bh != NULL);
+		brelse(bh);
+	}
+}
+
+START_TEST(test_ra_merge)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct lgfs2_ra_stats st;
+
+	/* Hints are ignored outside of a section */
+	lgfs2_ra_hint(sdp, 1, 1);
+	lgfs2_ra_start(sdp);
+	lgfs2_ra_hint(sdp, 10, 2);
+	lgfs2_ra_hint(sdp, 12, 1);
+	lgfs2_ra_hint(sdp, 20, 2);
+	/* Already being prefetched */
+	lgfs2_ra_hint(sdp, 11, 1);
+	read_blocks(sdp, 10, 3);
+	lgfs2_ra_stop(sdp);
+
+	lgfs2_ra_stats(sdp, &st);
+	ck_assert(st.rs_hints == 6);
+	ck_assert(st.rs_extents == 2);
+	ck_assert(st.rs_issued == 5);
+	ck_assert(st.rs_useful == 3);
+	ck_assert(st.rs_wasted == 2);
+}
+END_TEST
+
+START_TEST(test_ra_window)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct lgfs2_ra_stats st;
+	uint64_t blk;
+
+	lgfs2_ra_start(sdp);
+	for (blk = 0; blk < 200; blk++)
+		lgfs2_ra_hint(sdp, blk, 1);
+	/* Only the first window's worth is prefetched up front */
+	lgfs2_ra_stats(sdp, &st);
+	ck_assert(st.rs_issued == st.rs_window);
+	ck_assert(st.rs_extents == 1);
+
+	/* The rest follows as it is read */
+	read_blocks(sdp, 0, 200);
+	lgfs2_ra_stats(sdp, &st);
+	ck_assert(st.rs_issued == 200);
+	ck_assert(st.rs_useful == 200);
+	ck_assert(st.rs_wasted == 0);
+	lgfs2_ra_stop(sdp);
+}
+END_TEST
+
+START_TEST(test_ra_nested)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct lgfs2_ra_stats st;
+	uint64_t window;
+
+	lgfs2_ra_start(sdp);
+	lgfs2_ra_hint(sdp, 0, 100);
+	lgfs2_ra_stats(sdp, &st);
+	window = st.rs_window;
+	ck_assert(st.rs_issued == window);
+
+	/* The inner section's hints go first when there is room */
+	lgfs2_ra_start(sdp);
+	lgfs2_ra_hint(sdp, 500, 4);
+	read_blocks(sdp, 0, 4);
+	lgfs2_ra_stats(sdp, &st);
+	ck_assert(st.rs_issued == window + 4);
+	read_blocks(sdp, 500, 4);
+
+	/* ...and the ones which weren't prefetched are dropped at the end */
+	lgfs2_ra_hint(sdp, 600, 8);
+	lgfs2_ra_stop(sdp);
+	read_blocks(sdp, 4, 96);
+	lgfs2_ra_stop(sdp);
+
+	lgfs2_ra_stats(sdp, &st);
+	ck_assert(st.rs_issued == 104);
+	ck_assert(st.rs_useful == 104);
+	ck_assert(st.rs_wasted == 0);
+}
+END_TEST
+
+START_TEST(test_ra_wasted)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct lgfs2_ra_stats st;
+	uint64_t window;
+
+	lgfs2_ra_start(sdp);
+	lgfs2_ra_hint(sdp, 0, 1024);
+	lgfs2_ra_stats(sdp, &st);
+	window = st.rs_window;
+
+	/* Reading other blocks retires the prefetches and shrinks the window */
+	read_blocks(sdp, 512, 256);
+	lgfs2_ra_stats(sdp, &st);
+	ck_assert(st.rs_useful == 0);
+	ck_assert(st.rs_wasted > 0);
+	ck_assert(st.rs_window < window);
+	lgfs2_ra_stop(sdp);
+}
+END_TEST
+
+START_TEST(test_ra_cached)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct lgfs2_ra_stats st;
+
+	ck_assert(lgfs2_bcache_init(sdp, 16 * (sizeof(struct gfs2_buffer_head) + MOCK_BSIZE), 0) == 0);
+	read_blocks(sdp, 5, 1);
+
+	/* Blocks in the block cache aren't prefetched */
+	lgfs2_ra_start(sdp);
+	lgfs2_ra_hint(sdp, 5, 1);
+	lgfs2_ra_stop(sdp);
+	lgfs2_ra_stats(sdp, &st);
+	ck_assert(st.rs_hints == 1);
+	ck_assert(st.rs_issued == 0);
+}
+END_TEST
+
+Suite *suite_readahead(void)
+{
+	Suite *s = suite_create("readahead.c");
+	TCase *tc;
+
+	tc = tcase_create("readahead");
+	tcase_add_checked_fixture(tc, mockup_ra, teardown_sdp);
+	tcase_add_test(tc, test_ra_merge);
+	tcase_add_test(tc, test_ra_window);
+	tcase_add_test(tc, test_ra_nested);
+	tcase_add_test(tc, test_ra_wasted);
+	tcase_add_test(tc, test_ra_cached);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
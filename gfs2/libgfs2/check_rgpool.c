@@ -0,0 +1,259 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <check.h>
+#include "libgfs2.h"
+#include "rgrp.h"
+
+#define MOCK_DEV_SIZE (256 << 20)
+
+Suite *suite_rgpool(void);
+
+static lgfs2_rgrps_t tc_rgrps;
+
+static void mockup_rgrps(void)
+{
+	struct gfs2_sbd *sdp;
+	lgfs2_rgrps_t rgs;
+	uint64_t addr = 16;
+	struct gfs2_rindex ri = {0};
+	uint32_t rgsize = (4 << 20) / 4096;
+
+	sdp = calloc(1, sizeof(*sdp));
+	ck_assert(sdp != NULL);
+	sdp->device.length = MOCK_DEV_SIZE / 4096;
+	sdp->sd_bsize = 4096;
+	compute_constants(sdp);
+
+	rgs = lgfs2_rgrps_init(sdp, 0, 0);
+	ck_assert(rgs != NULL);
+	lgfs2_rgrps_plan(rgs, sdp->device.length - 16, rgsize);
+	while ((addr = lgfs2_rindex_entry_new(rgs, &ri, addr, rgsize)) != 0)
+		ck_assert(lgfs2_rgrps_append(rgs, &ri, 0) != NULL);
+	lgfs2_attach_rgrps(sdp, rgs);
+	tc_rgrps = rgs;
+}
+
+static void teardown_rgrps(void)
+{
+	struct gfs2_sbd *sdp = tc_rgrps->sdp;
+
+	lgfs2_rgindex_free(sdp);
+	sdp->rgtree.osi_node = NULL;
+	free(sdp);
+	lgfs2_rgrps_free(&tc_rgrps);
+}
+
+struct run_state {
+	unsigned works;      /* Calls to work(), updated atomically */
+	unsigned dones;      /* Calls to done() */
+	uint64_t last_addr;  /* The last resource group passed to done() */
+	uint64_t fail_addr;  /* work() fails for this resource group */
+	uint64_t cancel_addr;/* done() cancels the run at this resource group */
+	int cancel;
+	unsigned ahead;      /* The furthest work() got ahead of done(), updated atomically */
+};
+
+struct run_result {
+	uint64_t rr_addr;
+	unsigned rr_zero;
+};
+
+static int work(struct gfs2_sbd *sdp, lgfs2_rgrp_t rg, void *result, void *arg)
+{
+	struct run_state *st = arg;
+	struct run_result *rr = result;
+	uint64_t last = __atomic_load_n(&st->last_addr, __ATOMIC_RELAXED);
+	unsigned ahead = 0, old;
+	lgfs2_rgrp_t prev;
+
+	if (rr->rr_addr != 0 || rr->rr_zero != 0)
+		return 99; /* Results should start zeroed */
+	__atomic_add_fetch(&st->works, 1, __ATOMIC_RELAXED);
+	rr->rr_addr = rg->rt_addr;
+	for (prev = lgfs2_rgrp_prev(rg); prev != NULL && prev->rt_addr > last; prev = lgfs2_rgrp_prev(prev))
+		ahead++;
+	old = __atomic_load_n(&st->ahead, __ATOMIC_RELAXED);
+	while (ahead > old &&
+	       !__atomic_compare_exchange_n(&st->ahead, &old, ahead, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	if (rg->rt_addr == st->fail_addr)
+		return 5;
+	return 0;
+}
+
+static int done(struct gfs2_sbd *sdp, lgfs2_rgrp_t rg, void *result, void *arg)
+{
+	struct run_state *st = arg;
+	struct run_result *rr = result;
+
+	ck_assert(rr->rr_addr == rg->rt_addr);
+	ck_assert(rg->rt_addr > st->last_addr);
+	__atomic_store_n(&st->last_addr, rg->rt_addr, __ATOMIC_RELAXED);
+	st->dones++;
+	if (rg->rt_addr == st->cancel_addr)
+		st->cancel = 1;
+	return 0;
+}
+
+static unsigned rgrp_count(void)
+{
+	unsigned count = 0;
+
+	for (lgfs2_rgrp_t rg = lgfs2_rgrp_first(tc_rgrps); rg; rg = lgfs2_rgrp_next(rg))
+		count++;
+	return count;
+}
+
+static void run_all(unsigned threads)
+{
+	struct lgfs2_rgpool *pool = lgfs2_rgpool_init(threads);
+	struct run_state st = {0};
+	struct lgfs2_rgjob job = {
+		.rj_work = work,
+		.rj_done = done,
+		.rj_arg = &st,
+		.rj_result_size = sizeof(struct run_result),
+		.rj_cancel = &st.cancel,
+	};
+	unsigned count = rgrp_count();
+
+	ck_assert(pool != NULL);
+	ck_assert(lgfs2_rgpool_threads(pool) == (threads > 1 ? threads : 1));
+	/* The pool can be used for several runs */
+	for (int i = 0; i < 3; i++) {
+		st.works = st.dones = st.last_addr = 0;
+		ck_assert_int_eq(lgfs2_rgpool_run(pool, tc_rgrps->sdp, &job), 0);
+		ck_assert(st.works == count);
+		ck_assert(st.dones == count);
+		ck_assert(st.last_addr == lgfs2_rgrp_last(tc_rgrps)->rt_addr);
+	}
+	lgfs2_rgpool_free(&pool);
+	ck_assert(pool == NULL);
+}
+
+START_TEST(test_rgpool_order)
+{
+	ck_assert(rgrp_count() > 32);
+	run_all(0);
+	run_all(1);
+	run_all(2);
+	run_all(7);
+}
+END_TEST
+
+START_TEST(test_rgpool_stop)
+{
+	struct lgfs2_rgpool *pool = lgfs2_rgpool_init(4);
+	lgfs2_rgrp_t mid = lgfs2_rgrp_first(tc_rgrps);
+	struct run_state st = {0};
+	struct lgfs2_rgjob job = {
+		.rj_work = work,
+		.rj_done = done,
+		.rj_arg = &st,
+		.rj_result_size = sizeof(struct run_result),
+		.rj_cancel = &st.cancel,
+	};
+
+	ck_assert(pool != NULL);
+	for (unsigned i = 0; i < rgrp_count() / 2; i++)
+		mid = lgfs2_rgrp_next(mid);
+
+	/* An error from the job is returned and nothing after it is done */
+	st.fail_addr = mid->rt_addr;
+	ck_assert_int_eq(lgfs2_rgpool_run(pool, tc_rgrps->sdp, &job), 5);
+	ck_assert(st.last_addr < mid->rt_addr);
+	ck_assert(st.dones < rgrp_count());
+
+	/* Cancelling stops the run */
+	st = (struct run_state){ .cancel_addr = mid->rt_addr };
+	errno = 0;
+	ck_assert_int_eq(lgfs2_rgpool_run(pool, tc_rgrps->sdp, &job), -1);
+	ck_assert_int_eq(errno, ECANCELED);
+	ck_assert(st.last_addr == mid->rt_addr);
+
+	/* And the same without threads */
+	st = (struct run_state){ .cancel_addr = mid->rt_addr };
+	errno = 0;
+	ck_assert_int_eq(lgfs2_rgpool_run(NULL, tc_rgrps->sdp, &job), -1);
+	ck_assert_int_eq(errno, ECANCELED);
+	ck_assert(st.last_addr == mid->rt_addr);
+	ck_assert(st.works == st.dones);
+
+	lgfs2_rgpool_free(&pool);
+}
+END_TEST
+
+START_TEST(test_rgpool_window)
+{
+	struct lgfs2_rgpool *pool = lgfs2_rgpool_init(4);
+	lgfs2_rgrp_t mid = lgfs2_rgrp_first(tc_rgrps);
+	struct run_state st = {0};
+	struct lgfs2_rgjob job = {
+		.rj_work = work,
+		.rj_done = done,
+		.rj_arg = &st,
+		.rj_result_size = sizeof(struct run_result),
+		.rj_cancel = &st.cancel,
+		.rj_window = 3,
+	};
+
+	ck_assert(pool != NULL);
+	for (unsigned i = 0; i < rgrp_count() / 2; i++)
+		mid = lgfs2_rgrp_next(mid);
+
+	/* Jobs never start more than rj_window resource groups ahead */
+	ck_assert_int_eq(lgfs2_rgpool_run(pool, tc_rgrps->sdp, &job), 0);
+	ck_assert(st.dones == rgrp_count());
+	ck_assert(st.works == rgrp_count());
+	ck_assert(st.ahead > 0 && st.ahead < job.rj_window);
+
+	/* Stopping doesn't leave threads waiting for the window to move */
+	st = (struct run_state){ .fail_addr = mid->rt_addr };
+	ck_assert_int_eq(lgfs2_rgpool_run(pool, tc_rgrps->sdp, &job), 5);
+	ck_assert(st.last_addr < mid->rt_addr);
+
+	st = (struct run_state){ .cancel_addr = mid->rt_addr };
+	errno = 0;
+	ck_assert_int_eq(lgfs2_rgpool_run(pool, tc_rgrps->sdp, &job), -1);
+	ck_assert_int_eq(errno, ECANCELED);
+	ck_assert(st.last_addr == mid->rt_addr);
+	ck_assert(st.works < rgrp_count());
+
+	lgfs2_rgpool_free(&pool);
+}
+END_TEST
+
+START_TEST(test_parse_jobs)
+{
+	unsigned jobs = 0;
+
+	ck_assert(lgfs2_parse_jobs("3", &jobs) == 0);
+	ck_assert(jobs == 3);
+	ck_assert(lgfs2_parse_jobs("0", &jobs) == 0);
+	ck_assert(jobs >= 1);
+	ck_assert(lgfs2_parse_jobs("100000", &jobs) == 0);
+	ck_assert(jobs == LGFS2_MAX_JOBS);
+	ck_assert(lgfs2_parse_jobs("", &jobs) == -1);
+	ck_assert(lgfs2_parse_jobs("-2", &jobs) == -1);
+	ck_assert(lgfs2_parse_jobs("4x", &jobs) == -1);
+	ck_assert(errno == EINVAL);
+}
+END_TEST
+
+Suite *suite_rgpool(void)
+{
+	Suite *s = suite_create("rgpool.c");
+	TCase *tc;
+
+	tc = tcase_create("rgpool");
+	tcase_add_checked_fixture(tc, mockup_rgrps, teardown_rgrps);
+	tcase_add_test(tc, test_rgpool_order);
+	tcase_add_test(tc, test_rgpool_stop);
+	tcase_add_test(tc, test_rgpool_window);
+	tcase_add_test(tc, test_parse_jobs);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
@@ -1,4 +1,6 @@
 #include <stdlib.h>
+#include <errno.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <check.h>
@@ -158,6 +160,509 @@ START_TEST(test_rgrps_write_final)
 }
 END_TEST
 
+/* The slow but obvious way to find the blocks in a state */
+static unsigned bm_collect_ref(const unsigned char *buf, unsigned len, uint8_t state,
+                               uint64_t base, uint64_t *out)
+{
+	unsigned n = 0;
+
+	for (unsigned blk = 0; blk < len * GFS2_NBBY; blk++) {
+		if (((buf[blk / GFS2_NBBY] >> ((blk % GFS2_NBBY) * GFS2_BIT_SIZE)) & GFS2_BIT_MASK) == state)
+			out[n++] = base + blk;
+	}
+	return n;
+}
+
+static const unsigned bm_lens[] = { 1, 2, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65,
+                                    100, 127, 200, 3968, 4072 };
+
+START_TEST(test_bm_collect)
+{
+	enum lgfs2_bm_impl impl;
+	unsigned char *buf = malloc(4096);
+	uint64_t *exp = malloc(4096 * GFS2_NBBY * sizeof(*exp));
+	uint64_t *got = malloc(4096 * GFS2_NBBY * sizeof(*got));
+
+	ck_assert(buf != NULL && exp != NULL && got != NULL);
+	srandom(42);
+	for (impl = LGFS2_BM_SCALAR; impl <= LGFS2_BM_AVX2; impl++) {
+		if (lgfs2_bm_impl_set(impl) != 0)
+			continue;
+		for (unsigned l = 0; l < sizeof(bm_lens) / sizeof(bm_lens[0]); l++) {
+			unsigned len = bm_lens[l];
+
+			/* Sparse and dense bitmaps, offset to catch unaligned loads */
+			for (unsigned fill = 0; fill < 3; fill++) {
+				for (unsigned i = 0; i < len + 1; i++)
+					buf[i] = fill == 0 ? random() : fill == 1 ? 0 : 0xff;
+				if (fill != 0)
+					buf[random() % len] = random();
+				for (uint8_t state = 0; state < 4; state++) {
+					unsigned n = bm_collect_ref(buf + 1, len, state, 1000, exp);
+
+					ck_assert_uint_eq(lgfs2_bm_collect(buf + 1, len, state, 1000, got), n);
+					ck_assert(memcmp(exp, got, n * sizeof(*got)) == 0);
+				}
+			}
+		}
+	}
+	lgfs2_bm_impl_set(LGFS2_BM_SCALAR);
+	free(buf);
+	free(exp);
+	free(got);
+}
+END_TEST
+
+START_TEST(test_bitfit)
+{
+	enum lgfs2_bm_impl impl;
+	unsigned char *buf = malloc(4096);
+	uint64_t *exp = malloc(4096 * GFS2_NBBY * sizeof(*exp));
+
+	ck_assert(buf != NULL && exp != NULL);
+	srandom(43);
+	for (impl = LGFS2_BM_SCALAR; impl <= LGFS2_BM_AVX2; impl++) {
+		if (lgfs2_bm_impl_set(impl) != 0)
+			continue;
+		for (unsigned l = 0; l < sizeof(bm_lens) / sizeof(bm_lens[0]); l++) {
+			unsigned len = bm_lens[l];
+
+			/* Mostly used, with a few free blocks */
+			memset(buf, 0x55, len);
+			for (unsigned i = 0; i < len / 64 + 1; i++)
+				buf[random() % len] = random();
+			for (uint8_t state = 0; state < 4; state++) {
+				unsigned n = bm_collect_ref(buf, len, state, 0, exp);
+				unsigned next = 0;
+
+				for (unsigned long goal = 0; goal < len * GFS2_NBBY; goal++) {
+					unsigned long blk = gfs2_bitfit(buf, len, goal, state);
+
+					while (next < n && exp[next] < goal)
+						next++;
+					if (next == n)
+						ck_assert(blk == BFITNOENT);
+					else
+						ck_assert_uint_eq(blk, exp[next]);
+				}
+				ck_assert(gfs2_bitfit(buf, len, len * GFS2_NBBY, state) == BFITNOENT);
+			}
+		}
+	}
+	lgfs2_bm_impl_set(LGFS2_BM_SCALAR);
+	free(buf);
+	free(exp);
+}
+END_TEST
+
+START_TEST(test_bm_count)
+{
+	enum lgfs2_bm_impl impl;
+	unsigned char *buf = malloc(4096);
+
+	ck_assert(buf != NULL);
+	srandom(44);
+	for (unsigned i = 0; i < 4096; i++)
+		buf[i] = random();
+	for (impl = LGFS2_BM_SCALAR; impl <= LGFS2_BM_AVX2; impl++) {
+		if (lgfs2_bm_impl_set(impl) != 0)
+			continue;
+		for (unsigned l = 0; l < sizeof(bm_lens) / sizeof(bm_lens[0]); l++) {
+			unsigned len = bm_lens[l];
+			uint32_t count[4];
+
+			lgfs2_bm_count(buf + 1, len, count);
+			for (uint8_t state = 0; state < 4; state++) {
+				uint64_t *out = malloc(len * GFS2_NBBY * sizeof(*out));
+
+				ck_assert(out != NULL);
+				ck_assert_uint_eq(count[state], bm_collect_ref(buf + 1, len, state, 0, out));
+				free(out);
+			}
+		}
+	}
+	lgfs2_bm_impl_set(LGFS2_BM_SCALAR);
+	free(buf);
+}
+END_TEST
+
+START_TEST(test_bm_scan)
+{
+	lgfs2_rgrp_t rg = lgfs2_rgrp_first(tc_rgrps);
+	uint64_t *blks = malloc(tc_rgrps->sdp->sd_bsize * GFS2_NBBY * sizeof(*blks));
+	uint64_t addr = rg->rt_data0 + rg->rt_data - 1;
+	unsigned n;
+
+	ck_assert(blks != NULL);
+	ck_assert_int_eq(gfs2_set_bitmap(rg, rg->rt_data0 + 3, GFS2_BLKST_DINODE), 0);
+	ck_assert_int_eq(gfs2_set_bitmap(rg, addr, GFS2_BLKST_DINODE), 0);
+
+	n = 0;
+	for (unsigned i = 0; i < rg->rt_length; i++)
+		n += lgfs2_bm_scan(rg, i, blks + n, GFS2_BLKST_DINODE);
+	ck_assert_uint_eq(n, 2);
+	ck_assert(blks[0] == rg->rt_data0 + 3);
+	ck_assert(blks[1] == addr);
+	free(blks);
+}
+END_TEST
+
+/* The first run of at least minlen free blocks at or after from, the slow way */
+static uint64_t extent_find_ref(lgfs2_rgrp_t rg, uint64_t from, uint32_t minlen, uint32_t *len)
+{
+	uint64_t end = rg->rt_data0 + rg->rt_data;
+	uint64_t blk;
+
+	for (blk = from; blk < end; blk++) {
+		uint64_t e = blk;
+
+		while (e < end && lgfs2_get_bitmap(rg->rgrps->sdp, e, rg) == GFS2_BLKST_FREE)
+			e++;
+		if (e - blk >= minlen) {
+			*len = e - blk;
+			return blk;
+		}
+		blk = e;
+	}
+	return 0;
+}
+
+static void extents_check(lgfs2_rgrp_t rg)
+{
+	static const uint32_t lens[] = { 1, 2, 3, 5, 17, 100, 1000 };
+	uint64_t froms[] = { 0, rg->rt_data0, rg->rt_data0 + 1, rg->rt_data0 + 50,
+	                     rg->rt_data0 + rg->rt_data / 2, rg->rt_data0 + rg->rt_data - 1 };
+	uint64_t largest_addr = 0, addr;
+	uint32_t largest = 0, len;
+
+	for (unsigned f = 0; f < sizeof(froms) / sizeof(froms[0]); f++) {
+		for (unsigned l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+			uint64_t from = froms[f] < rg->rt_data0 ? rg->rt_data0 : froms[f];
+			uint64_t exp = extent_find_ref(rg, from, lens[l], &len);
+			uint32_t explen = len;
+			int ret = lgfs2_rgrp_extent_find(rg, froms[f], lens[l], &addr, &len);
+
+			if (exp == 0) {
+				ck_assert(ret != 0);
+				ck_assert_int_eq(errno, ENOSPC);
+			} else {
+				ck_assert_int_eq(ret, 0);
+				ck_assert(addr == exp);
+				ck_assert_uint_eq(len, explen);
+			}
+		}
+	}
+	for (addr = rg->rt_data0; extent_find_ref(rg, addr, 1, &len) != 0; addr += len) {
+		addr = extent_find_ref(rg, addr, 1, &len);
+		if (len > largest) {
+			largest = len;
+			largest_addr = addr;
+		}
+	}
+	ck_assert_uint_eq(lgfs2_rgrp_extent_largest(rg, &addr), largest);
+	if (largest > 0)
+		ck_assert(addr == largest_addr);
+}
+
+START_TEST(test_extents)
+{
+	lgfs2_rgrp_t rg = lgfs2_rgrp_first(tc_rgrps);
+	uint64_t addr;
+	uint32_t len;
+	unsigned i;
+
+	/* Empty resource group */
+	ck_assert_int_eq(lgfs2_rgrp_extent_find(rg, 0, 1, &addr, &len), 0);
+	ck_assert(addr == rg->rt_data0);
+	ck_assert_uint_eq(len, rg->rt_data);
+	ck_assert_uint_eq(lgfs2_rgrp_extent_largest(rg, NULL), rg->rt_data);
+	ck_assert(lgfs2_rgrp_extent_find(rg, 0, rg->rt_data + 1, &addr, &len) != 0);
+
+	/* The index follows the bitmaps as blocks are allocated and freed */
+	srandom(45);
+	for (i = 0; i < 3000; i++) {
+		uint64_t blk = rg->rt_data0 + random() % 2000;
+		int state = random() % 4;
+
+		if (random() % 4 == 0)
+			blk = rg->rt_data0 + rg->rt_data - 1 - random() % 64;
+		ck_assert_int_eq(gfs2_set_bitmap(rg, blk, state), 0);
+		if (i % 500 == 0)
+			extents_check(rg);
+	}
+	ck_assert(rg->rt_extents != NULL);
+	extents_check(rg);
+
+	/* Enough extents to fill several leaves of the index, which then empty */
+	ck_assert(rg->rt_data > 4000);
+	for (i = 0; i < 4000; i++) {
+		int state = i % 2 ? GFS2_BLKST_USED : GFS2_BLKST_FREE;
+
+		ck_assert_int_eq(gfs2_set_bitmap(rg, rg->rt_data0 + i, state), 0);
+	}
+	ck_assert(rg->rt_extents != NULL);
+	extents_check(rg);
+	for (i = 0; i < 4000; i += 2)
+		ck_assert_int_eq(gfs2_set_bitmap(rg, rg->rt_data0 + i, GFS2_BLKST_USED), 0);
+	ck_assert(rg->rt_extents != NULL);
+	extents_check(rg);
+
+	/* Nothing free */
+	for (i = 0; i < rg->rt_length; i++)
+		memset(rg->bits[i].bi_data + rg->bits[i].bi_offset, 0x55, rg->bits[i].bi_len);
+	lgfs2_rgrp_extents_free(rg);
+	ck_assert_uint_eq(lgfs2_rgrp_extent_largest(rg, NULL), 0);
+	ck_assert(lgfs2_rgrp_extent_find(rg, 0, 1, &addr, &len) != 0);
+	ck_assert_int_eq(errno, ENOSPC);
+	ck_assert_int_eq(gfs2_set_bitmap(rg, rg->rt_data0 + 7, GFS2_BLKST_FREE), 0);
+	extents_check(rg);
+}
+END_TEST
+
+START_TEST(test_blk2rgrpd)
+{
+	lgfs2_rgrps_t rgs = tc_rgrps;
+	struct gfs2_sbd *sdp = rgs->sdp;
+	struct gfs2_rindex ri = {0};
+	uint32_t rgsize = (20 << 20) / sdp->sd_bsize;
+	lgfs2_rgrp_t rg, last;
+	uint64_t addr, blk;
+	unsigned count = 1;
+
+	lgfs2_attach_rgrps(sdp, rgs);
+	last = lgfs2_rgrp_last(rgs);
+	ck_assert(gfs2_blk2rgrpd(sdp, last->rt_addr) == last);
+	ck_assert(gfs2_blk2rgrpd(sdp, last->rt_data0 + last->rt_data) == NULL);
+
+	/* The lookup array follows new resource groups */
+	addr = last->rt_addr + rgrp_size(last);
+	while ((addr = lgfs2_rindex_entry_new(rgs, &ri, addr, rgsize)) != 0) {
+		ck_assert(lgfs2_rgrps_append(rgs, &ri, 0) != NULL);
+		count++;
+	}
+	lgfs2_attach_rgrps(sdp, rgs);
+	ck_assert(count > 10);
+	for (rg = lgfs2_rgrp_first(rgs); rg != NULL; rg = lgfs2_rgrp_next(rg)) {
+		ck_assert(gfs2_blk2rgrpd(sdp, rg->rt_addr) == rg);
+		ck_assert(gfs2_blk2rgrpd(sdp, rg->rt_data0) == rg);
+		ck_assert(gfs2_blk2rgrpd(sdp, rg->rt_data0 + rg->rt_data / 2) == rg);
+		ck_assert(gfs2_blk2rgrpd(sdp, rg->rt_data0 + rg->rt_data - 1) == rg);
+	}
+	/* Blocks outside of the resource groups */
+	rg = lgfs2_rgrp_first(rgs);
+	for (blk = 0; blk < rg->rt_addr; blk++)
+		ck_assert(gfs2_blk2rgrpd(sdp, blk) == NULL);
+	last = lgfs2_rgrp_last(rgs);
+	ck_assert(gfs2_blk2rgrpd(sdp, last->rt_data0 + last->rt_data) == NULL);
+
+	/* Resource groups changed in place are still found */
+	last->rt_data--;
+	ck_assert(gfs2_blk2rgrpd(sdp, last->rt_data0 + last->rt_data) == NULL);
+	lgfs2_rgindex_free(sdp);
+	sdp->rgtree.osi_node = NULL;
+}
+END_TEST
+
+START_TEST(test_get_bitmaps)
+{
+	lgfs2_rgrps_t rgs = tc_rgrps;
+	struct gfs2_sbd *sdp = rgs->sdp;
+	lgfs2_rgrp_t rg = lgfs2_rgrp_first(rgs);
+	uint64_t blks[1024];
+	int states[1024];
+	unsigned n = 0, valid = 0;
+
+	lgfs2_attach_rgrps(sdp, rgs);
+	for (uint64_t b = 0; b < rg->rt_data; b += 7)
+		gfs2_set_bitmap(rg, rg->rt_data0 + b, (b / 7) % 4);
+
+	/* Runs of blocks within and across bitmaps, mixed with blocks which
+	   aren't in the bitmaps */
+	blks[n++] = 0;
+	blks[n++] = rg->rt_addr;
+	for (uint64_t b = 0; b < 300; b++)
+		blks[n++] = rg->rt_data0 + b;
+	blks[n++] = rg->rt_data0 + rg->rt_data;
+	for (uint64_t b = 0; n < 1000; b += 1231)
+		blks[n++] = rg->rt_data0 + (b * 7919) % rg->rt_data;
+	blks[n++] = rg->rt_data0 + rg->rt_data - 1;
+	blks[n++] = rg->rt_data0 - 1;
+	blks[n++] = rg->rt_data0 + 42;
+
+	ck_assert(lgfs2_get_bitmaps(sdp, blks, 0, states) == 0);
+	for (unsigned i = 0; i < n; i++) {
+		int state = lgfs2_get_bitmap(sdp, blks[i], NULL);
+
+		states[i] = -2;
+		if (state >= 0)
+			valid++;
+		else
+			state = -1;
+		ck_assert(lgfs2_get_bitmaps(sdp, &blks[i], 1, &states[i]) == (state >= 0));
+		ck_assert_int_eq(states[i], state);
+	}
+	memset(states, 0, sizeof(states));
+	ck_assert(lgfs2_get_bitmaps(sdp, blks, n, states) == valid);
+	for (unsigned i = 0; i < n; i++) {
+		int state = lgfs2_get_bitmap(sdp, blks[i], NULL);
+
+		ck_assert_int_eq(states[i], state < 0 ? -1 : state);
+	}
+	lgfs2_rgindex_free(sdp);
+	sdp->rgtree.osi_node = NULL;
+}
+END_TEST
+
+/* A device with several resource groups written to it, for reading back */
+static void mockup_rgrps_disk(void)
+{
+	struct gfs2_sbd *sdp;
+	lgfs2_rgrps_t rgs;
+	uint64_t addr;
+	struct gfs2_rindex ri = {0};
+	uint32_t rgsize = (128 << 20) / 4096;
+	char tmpnam[] = "mockdev-XXXXXX";
+
+	sdp = calloc(1, sizeof(*sdp));
+	ck_assert(sdp != NULL);
+	sdp->device.length = MOCK_DEV_SIZE / 4096;
+	sdp->fssize = sdp->device.length;
+	sdp->device_fd = mkstemp(tmpnam);
+	ck_assert(sdp->device_fd >= 0);
+	ck_assert(unlink(tmpnam) == 0);
+	ck_assert(ftruncate(sdp->device_fd, MOCK_DEV_SIZE) == 0);
+	sdp->sd_bsize = 4096;
+	compute_constants(sdp);
+
+	rgs = lgfs2_rgrps_init(sdp, 0, 0);
+	ck_assert(rgs != NULL);
+	/* The first resource group follows the superblock */
+	addr = LGFS2_SB_ADDR(sdp) + 1;
+	lgfs2_rgrps_plan(rgs, sdp->device.length - addr, rgsize);
+	while ((addr = lgfs2_rindex_entry_new(rgs, &ri, addr, rgsize)) != 0) {
+		lgfs2_rgrp_t rg = lgfs2_rgrps_append(rgs, &ri, 0);
+
+		ck_assert(rg != NULL);
+		ck_assert(lgfs2_rgrp_write(sdp->device_fd, rg) == 0);
+	}
+	lgfs2_attach_rgrps(sdp, rgs);
+	tc_rgrps = rgs;
+}
+
+static void teardown_rgrps_disk(void)
+{
+	struct gfs2_sbd *sdp = tc_rgrps->sdp;
+
+	lgfs2_rgindex_free(sdp);
+	sdp->rgtree.osi_node = NULL;
+	lgfs2_rgrps_free(&tc_rgrps);
+	close(sdp->device_fd);
+	free(sdp);
+}
+
+START_TEST(test_rgcache)
+{
+	lgfs2_rgrps_t rgs = tc_rgrps;
+	struct gfs2_sbd *sdp = rgs->sdp;
+	lgfs2_rgrp_t first = lgfs2_rgrp_first(rgs);
+	size_t rgbytes = first->rt_length * sdp->sd_bsize;
+	struct lgfs2_rgcache_stats st;
+	unsigned count = 0;
+	lgfs2_rgrp_t rg;
+	uint32_t rgfree;
+
+	ck_assert(first->rt_length > 1);
+	ck_assert(lgfs2_rgcache_init(sdp, 0) != 0);
+	ck_assert(lgfs2_rgcache_init(sdp, 2 * rgbytes) == 0);
+
+	/* Only the most recently read bitmaps are kept */
+	for (rg = first; rg != NULL; rg = lgfs2_rgrp_next(rg)) {
+		ck_assert(gfs2_rgrp_read(sdp, rg) == 0);
+		count++;
+	}
+	ck_assert(count > 4);
+	lgfs2_rgcache_stats(sdp, &st);
+	ck_assert(st.rcs_loads == count);
+	ck_assert(st.rcs_evictions == count - 2);
+	ck_assert(st.rcs_resident == 2 * rgbytes);
+	ck_assert(first->bits[0].bi_data == NULL);
+	ck_assert(first->rt_free == first->rt_data);
+
+	/* Headers stay in memory and can be read without the bitmaps */
+	rgfree = first->rt_free;
+	first->rt_free = 0;
+	ck_assert(lgfs2_rgrp_read_hdr(sdp, first) == 0);
+	ck_assert(first->rt_free == rgfree);
+	ck_assert(first->bits[0].bi_data == NULL);
+
+	/* Bitmaps are read in as they are used and written back when dropped */
+	for (rg = first; rg != NULL; rg = lgfs2_rgrp_next(rg)) {
+		uint64_t blk = rg->rt_data0 + rg->rt_data - 1;
+
+		ck_assert(gfs2_set_bitmap(rg, blk, GFS2_BLKST_USED) == 0);
+		rg->rt_free--;
+		ck_assert(lgfs2_rgrp_hdr_update(sdp, rg) == 0);
+	}
+	for (rg = first; rg != NULL; rg = lgfs2_rgrp_next(rg)) {
+		uint64_t blk = rg->rt_data0 + rg->rt_data - 1;
+		int states[2];
+		uint64_t blks[2] = { blk - 1, blk };
+
+		ck_assert_int_eq(lgfs2_get_bitmap(sdp, blk, NULL), GFS2_BLKST_USED);
+		ck_assert_int_eq(lgfs2_get_bitmap(sdp, blk - 1, rg), GFS2_BLKST_FREE);
+		ck_assert(lgfs2_get_bitmaps(sdp, blks, 2, states) == 2);
+		ck_assert_int_eq(states[0], GFS2_BLKST_FREE);
+		ck_assert_int_eq(states[1], GFS2_BLKST_USED);
+	}
+	lgfs2_rgcache_stats(sdp, &st);
+	ck_assert(st.rcs_writebacks >= count - 2);
+	/* Bitmaps are dropped after the new ones have been read */
+	ck_assert(st.rcs_peak == 3 * rgbytes);
+
+	/* Pinned bitmaps are not dropped */
+	ck_assert(lgfs2_rgrp_pin(first) == 0);
+	for (rg = lgfs2_rgrp_next(first); rg != NULL; rg = lgfs2_rgrp_next(rg))
+		ck_assert(lgfs2_rgrp_pin(rg) == 0 && first->bits[0].bi_data != NULL);
+	lgfs2_rgcache_stats(sdp, &st);
+	ck_assert(st.rcs_resident == count * rgbytes);
+	for (rg = first; rg != NULL; rg = lgfs2_rgrp_next(rg))
+		lgfs2_rgrp_unpin(rg);
+	lgfs2_rgcache_stats(sdp, &st);
+	ck_assert(st.rcs_resident == 2 * rgbytes);
+	ck_assert(lgfs2_get_bitmap(sdp, first->rt_data0, NULL) == GFS2_BLKST_FREE);
+
+	/* The least recently used bitmaps are dropped first */
+	for (rg = first; rg != NULL; rg = lgfs2_rgrp_next(rg))
+		ck_assert(lgfs2_get_bitmap(sdp, rg->rt_data0, rg) == GFS2_BLKST_FREE);
+	ck_assert(first->bits[0].bi_data == NULL);
+	rg = lgfs2_rgrp_next(first);
+	ck_assert(lgfs2_get_bitmap(sdp, first->rt_data0, first) == GFS2_BLKST_FREE);
+	ck_assert(lgfs2_get_bitmap(sdp, rg->rt_data0, rg) == GFS2_BLKST_FREE);
+	ck_assert(lgfs2_get_bitmap(sdp, first->rt_data0, first) == GFS2_BLKST_FREE);
+	rg = lgfs2_rgrp_next(rg);
+	ck_assert(lgfs2_get_bitmap(sdp, rg->rt_data0, rg) == GFS2_BLKST_FREE);
+	ck_assert(first->bits[0].bi_data != NULL);
+	ck_assert(lgfs2_rgrp_next(first)->bits[0].bi_data == NULL);
+	ck_assert(rg->bits[0].bi_data != NULL);
+
+	ck_assert(lgfs2_rgcache_free(sdp) == 0);
+	ck_assert(sdp->rgcache == NULL);
+
+	/* Everything made it to the device */
+	for (rg = first; rg != NULL; rg = lgfs2_rgrp_next(rg)) {
+		ck_assert(rg->rt_cache == NULL);
+		ck_assert(rg->bits[0].bi_data == NULL);
+		rgfree = rg->rt_free;
+		rg->rt_free = 0;
+		ck_assert(gfs2_rgrp_read(sdp, rg) == 0);
+		ck_assert(rg->rt_free == rgfree);
+		ck_assert_int_eq(lgfs2_get_bitmap(sdp, rg->rt_data0 + rg->rt_data - 1, rg),
+		                 GFS2_BLKST_USED);
+		gfs2_rgrp_relse(sdp, rg);
+	}
+}
+END_TEST
+
 Suite *suite_rgrp(void)
 {
 
@@ -172,10 +677,37 @@ Suite *suite_rgrp(void)
 	tcase_set_timeout(tc, 0);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("gfs2_blk2rgrpd");
+	tcase_add_checked_fixture(tc, mockup_rgrps, teardown_rgrps);
+	tcase_add_test(tc, test_blk2rgrpd);
+	tcase_add_test(tc, test_get_bitmaps);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("free_extents");
+	tcase_add_checked_fixture(tc, mockup_rgrps, teardown_rgrps);
+	tcase_add_test(tc, test_extents);
+	tcase_set_timeout(tc, 0);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("bitmap_search");
+	tcase_add_checked_fixture(tc, mockup_rgrps, teardown_rgrps);
+	tcase_add_test(tc, test_bm_collect);
+	tcase_add_test(tc, test_bitfit);
+	tcase_add_test(tc, test_bm_count);
+	tcase_add_test(tc, test_bm_scan);
+	tcase_set_timeout(tc, 0);
+	suite_add_tcase(s, tc);
+
 	tc = tcase_create("lgfs2_rgrps_write_final");
 	tcase_add_checked_fixture(tc, mockup_rgrps, teardown_rgrps);
 	tcase_add_test(tc, test_rgrps_write_final);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("rgcache");
+	tcase_add_checked_fixture(tc, mockup_rgrps_disk, teardown_rgrps_disk);
+	tcase_add_test(tc, test_rgcache);
+	tcase_set_timeout(tc, 0);
+	suite_add_tcase(s, tc);
+
 	return s;
 }
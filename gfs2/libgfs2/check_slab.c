@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <check.h>
+#include "libgfs2.h"
+#include "check_common.h"
+
+Suite *suite_slab(void);
+
+static void mockup_slab(void)
+{
+	mockup_sdp();
+	ck_assert(lgfs2_slab_init(tc_sdp) == 0);
+}
+
+START_TEST(test_slab_bufs)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct lgfs2_slab_stats bufs, inodes;
+	struct gfs2_buffer_head *bh, *bh2;
+	char *data;
+
+	bh = bget(sdp, 1);
+	ck_assert(bh != NULL);
+	ck_assert(bh->b_slab);
+	ck_assert(((uintptr_t)bh->b_data % MOCK_BSIZE) == 0);
+	ck_assert(bh->b_data[0] == 0 && bh->b_data[MOCK_BSIZE - 1] == 0);
+	bh->b_data[0] = 'x';
+	data = bh->b_data;
+	brelse(bh);
+
+	/* Freed buffers are recycled, and bget() zeroes them */
+	bh2 = bget(sdp, 2);
+	ck_assert(bh2 != NULL);
+	ck_assert(bh2->b_data == data);
+	ck_assert(bh2->b_data[0] == 0);
+	bh = bread(sdp, 3);
+	ck_assert(bh != NULL);
+	ck_assert(bh->b_data != data);
+
+	lgfs2_slab_stats(sdp, &bufs, &inodes);
+	ck_assert(bufs.ss_allocs == 3);
+	ck_assert(bufs.ss_inuse == 2);
+	ck_assert(bufs.ss_peak == 2);
+	ck_assert(bufs.ss_chunks == 1);
+	ck_assert(inodes.ss_allocs == 0);
+	brelse(bh);
+	brelse(bh2);
+}
+END_TEST
+
+START_TEST(test_slab_bsize)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct gfs2_buffer_head *bh;
+
+	/* Buffers for a different block size come from calloc() */
+	sdp->sd_bsize = MOCK_BSIZE / 2;
+	bh = bget(sdp, 1);
+	ck_assert(bh != NULL);
+	ck_assert(!bh->b_slab);
+	brelse(bh);
+	sdp->sd_bsize = MOCK_BSIZE;
+}
+END_TEST
+
+START_TEST(test_slab_inodes)
+{
+	struct gfs2_sbd *sdp = tc_sdp;
+	struct lgfs2_slab_stats bufs, inodes;
+	struct gfs2_buffer_head *bh;
+	struct gfs2_inode *ip;
+
+	bh = bget(sdp, 5);
+	ck_assert(bh != NULL);
+	ip = lgfs2_inode_get(sdp, bh);
+	ck_assert(ip != NULL);
+	ck_assert(ip->i_slab);
+	ip->bh_owned = 1;
+
+	lgfs2_slab_stats(sdp, &bufs, &inodes);
+	ck_assert(inodes.ss_inuse == 1);
+
+	/* Objects still in use outlive the pools */
+	lgfs2_slab_free(sdp);
+	ck_assert(sdp->slab == NULL);
+	inode_put(&ip);
+	ck_assert(ip == NULL);
+
+	ip = lgfs2_slab_inode_get(sdp);
+	ck_assert(ip != NULL);
+	ck_assert(!ip->i_slab);
+	lgfs2_slab_inode_put(ip);
+}
+END_TEST
+
+Suite *suite_slab(void)
+{
+	Suite *s = suite_create("slab.c");
+	TCase *tc;
+
+	tc = tcase_create("slab");
+	tcase_add_checked_fixture(tc, mockup_slab, teardown_sdp);
+	tcase_add_test(tc, test_slab_bufs);
+	tcase_add_test(tc, test_slab_bsize);
+	tcase_add_test(tc, test_slab_inodes);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
@@ -0,0 +1,408 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <check.h>
+#include "libgfs2.h"
+#include "check_common.h"
+#include "crc32c.h"
+#include "rgrp.h"
+
+#define MOCK_RG_DEV_SIZE (256 << 20)
+#define NTHREADS (4)
+#define NREADS (4000)
+
+Suite *suite_threads(void);
+
+static lgfs2_rgrps_t tc_rgrps;
+
+struct thread_arg {
+	unsigned id;
+	int failed;
+};
+
+static void run_threads(void *(*fn)(void *), struct thread_arg *args)
+{
+	pthread_t threads[NTHREADS];
+
+	for (unsigned i = 0; i < NTHREADS; i++) {
+		args[i].id = i;
+		args[i].failed = 0;
+		ck_assert(pthread_create(&threads[i], NULL, fn, &args[i]) == 0);
+	}
+	for (unsigned i = 0; i < NTHREADS; i++) {
+		ck_assert(pthread_join(threads[i], NULL) == 0);
+		ck_assert_int_eq(args[i].failed, 0);
+	}
+}
+
+/* A small cache, so that it has to evict while the threads run */
+static void mockup_bcache(void)
+{
+	mockup_sdp_tagged();
+	ck_assert(lgfs2_slab_init(tc_sdp) == 0);
+	ck_assert(lgfs2_bcache_init(tc_sdp, 16 * (sizeof(struct gfs2_buffer_head) + MOCK_BSIZE),
+	                            LGFS2_BCACHE_WRITEBACK) == 0);
+}
+
+/* Threads read the first half of the device and each writes its own blocks
+   in the second half */
+static void *bread_thread(void *p)
+{
+	struct thread_arg *arg = p;
+	unsigned seed = arg->id;
+	uint64_t half = MOCK_DEV_BLOCKS / 2;
+
+	for (unsigned i = 0; i < NREADS; i++) {
+		struct gfs2_buffer_head *bh;
+		uint64_t blk, val;
+
+		blk = rand_r(&seed) % half;
+		if (i % 4 == 0)
+			blk = half + (blk / NTHREADS) * NTHREADS + arg->id;
+		bh = bread(tc_sdp, blk);
+		if (bh == NULL) {
+			arg->failed = 1;
+			break;
+		}
+		if (blk < half) {
+			if (mock_block_tag(bh->b_data) != blk)
+				arg->failed = 1;
+		} else {
+			/* The count of writes goes after the address */
+			memcpy(&val, bh->b_data + sizeof(val), sizeof(val));
+			val++;
+			memcpy(bh->b_data + sizeof(val), &val, sizeof(val));
+			bmodified(bh);
+		}
+		brelse(bh);
+	}
+	return NULL;
+}
+
+START_TEST(test_threads_bread)
+{
+	struct thread_arg args[NTHREADS];
+	struct lgfs2_bcache_stats st;
+	uint64_t writes = 0;
+
+	run_threads(bread_thread, args);
+	lgfs2_bcache_stats(tc_sdp, &st);
+	ck_assert(st.bs_hits + st.bs_misses >= NTHREADS * NREADS);
+	ck_assert(st.bs_cached <= st.bs_max);
+	ck_assert(lgfs2_bcache_flush(tc_sdp) == 0);
+
+	/* Every write made it to the device */
+	for (uint64_t blk = MOCK_DEV_BLOCKS / 2; blk < MOCK_DEV_BLOCKS; blk++) {
+		uint64_t val[2];
+
+		ck_assert(pread(tc_sdp->device_fd, val, sizeof(val), blk * MOCK_BSIZE) == sizeof(val));
+		ck_assert(val[0] == blk);
+		writes += val[1];
+	}
+	ck_assert(writes == NTHREADS * NREADS / 4);
+}
+END_TEST
+
+/* A savemeta file of the mock device where every third block was not saved
+   and the others are tagged with their address */
+static void mockup_savemeta(void)
+{
+	struct savemeta_header smh = {
+		.sh_magic = cpu_to_be32(SAVEMETA_MAGIC),
+		.sh_format = cpu_to_be32(SAVEMETA_FORMAT),
+		.sh_fs_bytes = cpu_to_be64(MOCK_DEV_BLOCKS * MOCK_BSIZE)
+	};
+	struct gfs2_sb sb = {
+		.sb_header.mh_magic = cpu_to_be32(GFS2_MAGIC),
+		.sb_header.mh_type = cpu_to_be32(GFS2_METATYPE_SB),
+		.sb_bsize = cpu_to_be32(MOCK_BSIZE)
+	};
+	uint64_t sb_blk = GFS2_SB_ADDR * GFS2_BASIC_BLOCK / MOCK_BSIZE;
+	char tmpnam[] = "mockmeta-XXXXXX";
+	char spec[64];
+	int fd;
+
+	fd = mkstemp(tmpnam);
+	ck_assert(fd >= 0);
+	ck_assert(write(fd, &smh, sizeof(smh)) == sizeof(smh));
+	for (uint64_t blk = sb_blk; blk < MOCK_DEV_BLOCKS; blk++) {
+		struct saved_metablock svb = { .blk = cpu_to_be64(blk) };
+		const void *data = &blk;
+		uint16_t len = sizeof(blk);
+
+		if (blk == sb_blk) {
+			data = &sb;
+			len = sizeof(sb);
+		} else if (blk % 3 == 0) {
+			continue;
+		}
+		svb.siglen = cpu_to_be16(len);
+		ck_assert(write(fd, &svb, sizeof(svb)) == sizeof(svb));
+		ck_assert(write(fd, data, len) == len);
+	}
+	close(fd);
+
+	tc_sdp = calloc(1, sizeof(*tc_sdp));
+	ck_assert(tc_sdp != NULL);
+	tc_sdp->device_fd = -1;
+	tc_sdp->sd_bsize = MOCK_BSIZE;
+	snprintf(spec, sizeof(spec), "savemeta:%s", tmpnam);
+	ck_assert(lgfs2_dev_open(tc_sdp, spec, O_RDONLY) == 0);
+	/* The file stays mapped */
+	ck_assert(unlink(tmpnam) == 0);
+}
+
+static void teardown_savemeta(void)
+{
+	lgfs2_dev_close(tc_sdp);
+	free(tc_sdp);
+	tc_sdp = NULL;
+}
+
+/* Threads read runs of blocks, which share the sequential read hint */
+static void *savemeta_thread(void *p)
+{
+	uint64_t sb_blk = GFS2_SB_ADDR * GFS2_BASIC_BLOCK / MOCK_BSIZE;
+	struct thread_arg *arg = p;
+	unsigned seed = arg->id;
+	char buf[MOCK_BSIZE];
+
+	for (unsigned i = 0; i < NREADS / 16; i++) {
+		uint64_t blk = sb_blk + 1 + rand_r(&seed) % (MOCK_DEV_BLOCKS - sb_blk - 64);
+
+		for (uint64_t end = blk + 64; blk < end; blk++) {
+			uint64_t expected = blk % 3 == 0 ? 0 : blk;
+
+			if (lgfs2_dev_pread(tc_sdp, buf, sizeof(buf), blk * MOCK_BSIZE) != sizeof(buf) ||
+			    mock_block_tag(buf) != expected) {
+				arg->failed = 1;
+				return NULL;
+			}
+		}
+	}
+	return NULL;
+}
+
+START_TEST(test_threads_savemeta)
+{
+	struct thread_arg args[NTHREADS];
+
+	run_threads(savemeta_thread, args);
+}
+END_TEST
+
+static void mockup_rgrps(void)
+{
+	struct gfs2_sbd *sdp;
+	lgfs2_rgrps_t rgs;
+	uint64_t addr;
+	struct gfs2_rindex ri = {0};
+	lgfs2_rgrp_t rg;
+	uint32_t rgsize = (32 << 20) / 4096;
+	char tmpnam[] = "mockdev-XXXXXX";
+
+	sdp = calloc(1, sizeof(*sdp));
+	ck_assert(sdp != NULL);
+
+	sdp->device.length = MOCK_RG_DEV_SIZE / 4096;
+	sdp->device_fd = mkstemp(tmpnam);
+	ck_assert(sdp->device_fd >= 0);
+	ck_assert(unlink(tmpnam) == 0);
+	ck_assert(ftruncate(sdp->device_fd, MOCK_RG_DEV_SIZE) == 0);
+	sdp->sd_bsize = 4096;
+	compute_constants(sdp);
+
+	rgs = lgfs2_rgrps_init(sdp, 0, 0);
+	ck_assert(rgs != NULL);
+	lgfs2_rgrps_plan(rgs, sdp->device.length - 16, rgsize);
+
+	addr = 16;
+	while ((addr = lgfs2_rindex_entry_new(rgs, &ri, addr, rgsize)) != 0) {
+		rg = lgfs2_rgrps_append(rgs, &ri, 0);
+		ck_assert(rg != NULL);
+		ck_assert(lgfs2_rgrp_bitbuf_alloc(rg) == 0);
+		/* Build the free extent index so that it is updated too */
+		lgfs2_rgrp_extent_largest(rg, NULL);
+	}
+	lgfs2_attach_rgrps(sdp, rgs);
+	tc_rgrps = rgs;
+}
+
+static void teardown_rgrps(void)
+{
+	struct gfs2_sbd *sdp = tc_rgrps->sdp;
+	lgfs2_rgrp_t rg;
+
+	lgfs2_rgindex_free(sdp);
+	sdp->rgtree.osi_node = NULL;
+	for (rg = lgfs2_rgrp_first(tc_rgrps); rg != NULL; rg = lgfs2_rgrp_next(rg))
+		lgfs2_rgrp_bitbuf_free(rg);
+	close(sdp->device_fd);
+	free(sdp);
+	lgfs2_rgrps_free(&tc_rgrps);
+}
+
+/* Each thread marks every NTHREADS'th block, which shares bitmap bytes with
+   the other threads' blocks, and reads back the states as it goes */
+static void *bitmap_thread(void *p)
+{
+	struct thread_arg *arg = p;
+	struct gfs2_sbd *sdp = tc_rgrps->sdp;
+	lgfs2_rgrp_t rg;
+
+	for (rg = lgfs2_rgrp_first(tc_rgrps); rg != NULL; rg = lgfs2_rgrp_next(rg)) {
+		for (uint64_t blk = rg->rt_data0 + arg->id; blk < rg->rt_data0 + rg->rt_data;
+		     blk += NTHREADS) {
+			if (gfs2_blk2rgrpd(sdp, blk) != rg ||
+			    gfs2_set_bitmap(rg, blk, GFS2_BLKST_USED) != 0 ||
+			    lgfs2_get_bitmap(sdp, blk, NULL) != GFS2_BLKST_USED)
+				arg->failed = 1;
+		}
+	}
+	return NULL;
+}
+
+START_TEST(test_threads_bitmap)
+{
+	struct gfs2_sbd *sdp = tc_rgrps->sdp;
+	struct thread_arg args[NTHREADS];
+	lgfs2_rgrp_t rg;
+
+	run_threads(bitmap_thread, args);
+	for (rg = lgfs2_rgrp_first(tc_rgrps); rg != NULL; rg = lgfs2_rgrp_next(rg)) {
+		for (uint64_t blk = rg->rt_data0; blk < rg->rt_data0 + rg->rt_data; blk++)
+			ck_assert_int_eq(lgfs2_get_bitmap(sdp, blk, rg), GFS2_BLKST_USED);
+		ck_assert(lgfs2_rgrp_extent_largest(rg, NULL) == 0);
+	}
+}
+END_TEST
+
+/* The same, with the bitmaps read in on demand and a budget for only a few */
+static void mockup_rgrps_cached(void)
+{
+	struct gfs2_sbd *sdp;
+	lgfs2_rgrps_t rgs;
+	uint64_t addr;
+	struct gfs2_rindex ri = {0};
+	lgfs2_rgrp_t rg;
+	uint32_t rgsize = (32 << 20) / 4096;
+	char tmpnam[] = "mockdev-XXXXXX";
+
+	sdp = calloc(1, sizeof(*sdp));
+	ck_assert(sdp != NULL);
+
+	sdp->device.length = MOCK_RG_DEV_SIZE / 4096;
+	sdp->fssize = sdp->device.length;
+	sdp->device_fd = mkstemp(tmpnam);
+	ck_assert(sdp->device_fd >= 0);
+	ck_assert(unlink(tmpnam) == 0);
+	ck_assert(ftruncate(sdp->device_fd, MOCK_RG_DEV_SIZE) == 0);
+	sdp->sd_bsize = 4096;
+	compute_constants(sdp);
+
+	rgs = lgfs2_rgrps_init(sdp, 0, 0);
+	ck_assert(rgs != NULL);
+	addr = LGFS2_SB_ADDR(sdp) + 1;
+	lgfs2_rgrps_plan(rgs, sdp->device.length - addr, rgsize);
+	while ((addr = lgfs2_rindex_entry_new(rgs, &ri, addr, rgsize)) != 0) {
+		rg = lgfs2_rgrps_append(rgs, &ri, 0);
+		ck_assert(rg != NULL);
+		ck_assert(lgfs2_rgrp_write(sdp->device_fd, rg) == 0);
+	}
+	lgfs2_attach_rgrps(sdp, rgs);
+	ck_assert(lgfs2_rgcache_init(sdp, 3 * rgs->sdp->sd_bsize) == 0);
+	for (rg = lgfs2_rgrp_first(rgs); rg != NULL; rg = lgfs2_rgrp_next(rg))
+		ck_assert(lgfs2_rgrp_read_hdr(sdp, rg) == 0);
+	tc_rgrps = rgs;
+}
+
+static void teardown_rgrps_cached(void)
+{
+	struct gfs2_sbd *sdp = tc_rgrps->sdp;
+
+	ck_assert(lgfs2_rgcache_free(sdp) == 0);
+	lgfs2_rgindex_free(sdp);
+	sdp->rgtree.osi_node = NULL;
+	close(sdp->device_fd);
+	free(sdp);
+	lgfs2_rgrps_free(&tc_rgrps);
+}
+
+START_TEST(test_threads_bitmap_cached)
+{
+	struct gfs2_sbd *sdp = tc_rgrps->sdp;
+	struct lgfs2_rgcache_stats st;
+	struct thread_arg args[NTHREADS];
+	lgfs2_rgrp_t rg;
+
+	run_threads(bitmap_thread, args);
+	lgfs2_rgcache_stats(sdp, &st);
+	ck_assert(st.rcs_evictions > 0);
+	ck_assert(st.rcs_writebacks > 0);
+	for (rg = lgfs2_rgrp_first(tc_rgrps); rg != NULL; rg = lgfs2_rgrp_next(rg)) {
+		for (uint64_t blk = rg->rt_data0; blk < rg->rt_data0 + rg->rt_data; blk++)
+			ck_assert_int_eq(lgfs2_get_bitmap(sdp, blk, rg), GFS2_BLKST_USED);
+	}
+}
+END_TEST
+
+static unsigned char crc_buf[MOCK_BSIZE];
+static uint32_t crc_expected;
+
+static void *crc32c_thread(void *p)
+{
+	struct thread_arg *arg = p;
+
+	for (unsigned i = 0; i < 1000; i++)
+		if (crc32c(~0, crc_buf, sizeof(crc_buf)) != crc_expected)
+			arg->failed = 1;
+	return NULL;
+}
+
+START_TEST(test_threads_crc32c)
+{
+	struct thread_arg args[NTHREADS];
+
+	for (unsigned i = 0; i < sizeof(crc_buf); i++)
+		crc_buf[i] = i * 7;
+	crc_expected = crc32c(~0, crc_buf, sizeof(crc_buf));
+	run_threads(crc32c_thread, args);
+}
+END_TEST
+
+Suite *suite_threads(void)
+{
+	Suite *s = suite_create("threads");
+	TCase *tc;
+
+	tc = tcase_create("bcache");
+	tcase_add_checked_fixture(tc, mockup_bcache, teardown_sdp);
+	tcase_add_test(tc, test_threads_bread);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("savemeta");
+	tcase_add_checked_fixture(tc, mockup_savemeta, teardown_savemeta);
+	tcase_add_test(tc, test_threads_savemeta);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("bitmaps");
+	tcase_add_checked_fixture(tc, mockup_rgrps, teardown_rgrps);
+	tcase_add_test(tc, test_threads_bitmap);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("bitmaps_cached");
+	tcase_add_checked_fixture(tc, mockup_rgrps_cached, teardown_rgrps_cached);
+	tcase_add_test(tc, test_threads_bitmap_cached);
+	tcase_set_timeout(tc, 0);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("crc32c");
+	tcase_add_test(tc, test_threads_crc32c);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
@@ -9,118 +9,38 @@
  *
  */
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <inttypes.h>
-#include "crc32c.h"
-
-static uint32_t __crc32c_le(uint32_t crc, unsigned char const *data, size_t length);
-static uint32_t (*crc_function)(uint32_t crc, unsigned char const *data, size_t length) = __crc32c_le;
-
 #ifdef __x86_64__
-
-/*
- * Based on a posting to lkml by Austin Zhang <austin.zhang@intel.com>
- *
- * Using hardware provided CRC32 instruction to accelerate the CRC32 disposal.
- * CRC32C polynomial:0x1EDC6F41(BE)/0x82F63B78(LE)
- * CRC32 is a new instruction in Intel SSE4.2, the reference can be found at:
- * http://www.intel.com/products/processor/manuals/
- * Intel(R) 64 and IA-32 Architectures Software Developer's Manual
- * Volume 2A: Instruction Set Reference, A-M
- */
-#if  __SIZEOF_LONG__ == 8
-#define REX_PRE "0x48, "
-#define SCALE_F 8
-#else
-#define REX_PRE
-#define SCALE_F 4
+#include <nmmintrin.h>
 #endif
-
-static int crc32c_probed = 0;
-static int crc32c_intel_available = 0;
-
-static uint32_t crc32c_intel_le_hw_byte(uint32_t crc, unsigned char const *data,
-					unsigned long length)
-{
-	while (length--) {
-		__asm__ __volatile__(
-			".byte 0xf2, 0xf, 0x38, 0xf0, 0xf1"
-			:"=S"(crc)
-			:"0"(crc), "c"(*data)
-		);
-		data++;
-	}
-
-	return crc;
-}
+#ifdef __aarch64__
+#include <sys/auxv.h>
+#include <arm_acle.h>
+#endif
+#include "crc32c.h"
 
 /*
- * Steps through buffer one byte at at time, calculates reflected 
- * crc using table.
+ * The hardware implementations run three independent CRCs over consecutive
+ * chunks of the buffer at the same time, to hide the latency of the CRC
+ * instruction, and then combine them. A CRC is combined with the one which
+ * follows it by "shifting" it over the length of the next chunk, which is the
+ * same as appending that many zero bytes to it. That is a linear operation on
+ * the 32 bits of the CRC, so it is done with four table lookups.
  */
-static uint32_t crc32c_intel(uint32_t crc, unsigned char const *data, unsigned long length)
-{
-	unsigned int iquotient = length / SCALE_F;
-	unsigned int iremainder = length % SCALE_F;
-	unsigned long *ptmp = (unsigned long *)data;
-
-	while (iquotient--) {
-		__asm__ __volatile__(
-			".byte 0xf2, " REX_PRE "0xf, 0x38, 0xf1, 0xf1;"
-			:"=S"(crc)
-			:"0"(crc), "c"(*ptmp)
-		);
-		ptmp++;
-	}
-
-	if (iremainder)
-		crc = crc32c_intel_le_hw_byte(crc, (unsigned char *)ptmp,
-				 iremainder);
-
-	return crc;
-}
-
-static void do_cpuid(unsigned int *eax, unsigned int *ebx, unsigned int *ecx,
-		     unsigned int *edx)
-{
-	int id = *eax;
-
-	asm("movl %4, %%eax;"
-	    "cpuid;"
-	    "movl %%eax, %0;"
-	    "movl %%ebx, %1;"
-	    "movl %%ecx, %2;"
-	    "movl %%edx, %3;"
-		: "=r" (*eax), "=r" (*ebx), "=r" (*ecx), "=r" (*edx)
-		: "r" (id)
-		: "eax", "ebx", "ecx", "edx");
-}
-
-static void crc32c_intel_probe(void)
-{
-	if (!crc32c_probed) {
-		unsigned int eax, ebx, ecx, edx;
+#define CRC32C_LONG (1024) /* Bytes per stream in the long loop */
+#define CRC32C_SHORT (128) /* Bytes per stream in the short loop */
 
-		eax = 1;
-
-		do_cpuid(&eax, &ebx, &ecx, &edx);
-		crc32c_intel_available = (ecx & (1 << 20)) != 0;
-		crc32c_probed = 1;
-	}
-}
-
-void crc32c_optimization_init(void)
-{
-	crc32c_intel_probe();
-	if (crc32c_intel_available)
-		crc_function = crc32c_intel;
-}
-#else
-
-void crc32c_optimization_init(void)
-{
-}
+static uint32_t __crc32c_le(uint32_t crc, unsigned char const *data, size_t length);
+/* Set up before main() so that it never changes under threads, see crc32c_init() */
+static uint32_t (*crc_function)(uint32_t crc, unsigned char const *data, size_t length) = __crc32c_le;
+static const char *crc_name;
 
-#endif /* __x86_64__ */
+static uint32_t crc32c_slice8_table[8][256];
+static uint32_t crc32c_long_zeros[4][256];
+static uint32_t crc32c_short_zeros[4][256];
+static int crc32c_tables_ready = 0;
 
 /*
  * This is the CRC-32C table
@@ -211,11 +131,281 @@ static uint32_t __crc32c_le(uint32_t crc, unsigned char const *data, size_t leng
 	return crc;
 }
 
-uint32_t crc32c(uint32_t crc, unsigned char const *data, size_t length)
+/* Build the table for appending len zero bytes to a crc */
+static void crc32c_zeros_init(uint32_t zeros[4][256], size_t len)
+{
+	uint32_t bit[32];
+
+	for (int i = 0; i < 32; i++) {
+		uint32_t crc = 1U << i;
+
+		for (size_t n = 0; n < len; n++)
+			crc = crc32c_table[crc & 0xff] ^ (crc >> 8);
+		bit[i] = crc;
+	}
+	for (int j = 0; j < 4; j++) {
+		for (int b = 0; b < 256; b++) {
+			uint32_t crc = 0;
+
+			for (int i = 0; i < 8; i++)
+				if (b & (1 << i))
+					crc ^= bit[j * 8 + i];
+			zeros[j][b] = crc;
+		}
+	}
+}
+
+static void crc32c_tables_init(void)
+{
+	if (crc32c_tables_ready)
+		return;
+	for (int i = 0; i < 256; i++) {
+		uint32_t crc = crc32c_table[i];
+
+		crc32c_slice8_table[0][i] = crc;
+		for (int k = 1; k < 8; k++) {
+			crc = crc32c_table[crc & 0xff] ^ (crc >> 8);
+			crc32c_slice8_table[k][i] = crc;
+		}
+	}
+	crc32c_zeros_init(crc32c_long_zeros, CRC32C_LONG);
+	crc32c_zeros_init(crc32c_short_zeros, CRC32C_SHORT);
+	crc32c_tables_ready = 1;
+}
+
+static inline uint32_t crc32c_shift(uint32_t zeros[4][256], uint32_t crc)
+{
+	return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+	       zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static inline uint64_t crc32c_load64(unsigned char const *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/*
+ * Slicing-by-8: looks up each of 8 bytes in its own table, so the lookups
+ * for a 64-bit word are independent of each other.
+ */
+static uint32_t crc32c_slice8(uint32_t crc, unsigned char const *data, size_t length)
 {
-	/* Use by-byte access for unaligned buffers */
-	if ((unsigned long)data % sizeof(unsigned long))
-		return __crc32c_le(crc, data, length);
+	uint32_t (*t)[256] = crc32c_slice8_table;
 
+	while (length >= 8) {
+		crc ^= data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+		crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff] ^
+		      t[5][(crc >> 16) & 0xff] ^ t[4][crc >> 24] ^
+		      t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+		data += 8;
+		length -= 8;
+	}
+	return __crc32c_le(crc, data, length);
+}
+
+#ifdef __x86_64__
+
+/*
+ * Using hardware provided CRC32 instruction to accelerate the CRC32 disposal.
+ * CRC32C polynomial:0x1EDC6F41(BE)/0x82F63B78(LE)
+ * CRC32 is a new instruction in Intel SSE4.2, the reference can be found at:
+ * http://www.intel.com/products/processor/manuals/
+ * Intel(R) 64 and IA-32 Architectures Software Developer's Manual
+ * Volume 2A: Instruction Set Reference, A-M
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, unsigned char const *data, size_t length)
+{
+	uint64_t crc0 = crc, crc1, crc2;
+
+	while (length > 0 && ((uintptr_t)data & 7)) {
+		crc0 = _mm_crc32_u8(crc0, *data++);
+		length--;
+	}
+	while (length >= 3 * CRC32C_LONG) {
+		unsigned char const *end = data + CRC32C_LONG;
+
+		crc1 = crc2 = 0;
+		do {
+			crc0 = _mm_crc32_u64(crc0, crc32c_load64(data));
+			crc1 = _mm_crc32_u64(crc1, crc32c_load64(data + CRC32C_LONG));
+			crc2 = _mm_crc32_u64(crc2, crc32c_load64(data + 2 * CRC32C_LONG));
+			data += 8;
+		} while (data < end);
+		crc0 = crc32c_shift(crc32c_long_zeros, crc0) ^ crc1;
+		crc0 = crc32c_shift(crc32c_long_zeros, crc0) ^ crc2;
+		data += 2 * CRC32C_LONG;
+		length -= 3 * CRC32C_LONG;
+	}
+	while (length >= 3 * CRC32C_SHORT) {
+		unsigned char const *end = data + CRC32C_SHORT;
+
+		crc1 = crc2 = 0;
+		do {
+			crc0 = _mm_crc32_u64(crc0, crc32c_load64(data));
+			crc1 = _mm_crc32_u64(crc1, crc32c_load64(data + CRC32C_SHORT));
+			crc2 = _mm_crc32_u64(crc2, crc32c_load64(data + 2 * CRC32C_SHORT));
+			data += 8;
+		} while (data < end);
+		crc0 = crc32c_shift(crc32c_short_zeros, crc0) ^ crc1;
+		crc0 = crc32c_shift(crc32c_short_zeros, crc0) ^ crc2;
+		data += 2 * CRC32C_SHORT;
+		length -= 3 * CRC32C_SHORT;
+	}
+	while (length >= 8) {
+		crc0 = _mm_crc32_u64(crc0, crc32c_load64(data));
+		data += 8;
+		length -= 8;
+	}
+	while (length--)
+		crc0 = _mm_crc32_u8(crc0, *data++);
+	return crc0;
+}
+
+static int crc32c_sse42_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+}
+
+#endif /* __x86_64__ */
+
+#ifdef __aarch64__
+
+/* The ARMv8 CRC32 extension, same algorithm as crc32c_sse42() */
+__attribute__((target("+crc")))
+static uint32_t crc32c_armv8(uint32_t crc, unsigned char const *data, size_t length)
+{
+	uint32_t crc0 = crc, crc1, crc2;
+
+	while (length > 0 && ((uintptr_t)data & 7)) {
+		crc0 = __crc32cb(crc0, *data++);
+		length--;
+	}
+	while (length >= 3 * CRC32C_LONG) {
+		unsigned char const *end = data + CRC32C_LONG;
+
+		crc1 = crc2 = 0;
+		do {
+			crc0 = __crc32cd(crc0, crc32c_load64(data));
+			crc1 = __crc32cd(crc1, crc32c_load64(data + CRC32C_LONG));
+			crc2 = __crc32cd(crc2, crc32c_load64(data + 2 * CRC32C_LONG));
+			data += 8;
+		} while (data < end);
+		crc0 = crc32c_shift(crc32c_long_zeros, crc0) ^ crc1;
+		crc0 = crc32c_shift(crc32c_long_zeros, crc0) ^ crc2;
+		data += 2 * CRC32C_LONG;
+		length -= 3 * CRC32C_LONG;
+	}
+	while (length >= 3 * CRC32C_SHORT) {
+		unsigned char const *end = data + CRC32C_SHORT;
+
+		crc1 = crc2 = 0;
+		do {
+			crc0 = __crc32cd(crc0, crc32c_load64(data));
+			crc1 = __crc32cd(crc1, crc32c_load64(data + CRC32C_SHORT));
+			crc2 = __crc32cd(crc2, crc32c_load64(data + 2 * CRC32C_SHORT));
+			data += 8;
+		} while (data < end);
+		crc0 = crc32c_shift(crc32c_short_zeros, crc0) ^ crc1;
+		crc0 = crc32c_shift(crc32c_short_zeros, crc0) ^ crc2;
+		data += 2 * CRC32C_SHORT;
+		length -= 3 * CRC32C_SHORT;
+	}
+	while (length >= 8) {
+		crc0 = __crc32cd(crc0, crc32c_load64(data));
+		data += 8;
+		length -= 8;
+	}
+	while (length--)
+		crc0 = __crc32cb(crc0, *data++);
+	return crc0;
+}
+
+static int crc32c_armv8_supported(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+#endif /* __aarch64__ */
+
+static const struct {
+	const char *name;
+	uint32_t (*fn)(uint32_t crc, unsigned char const *data, size_t length);
+} crc32c_impls[] = {
+	[CRC32C_BYTEWISE] = { "bytewise", __crc32c_le },
+	[CRC32C_SLICE8] = { "slice8", crc32c_slice8 },
+#ifdef __x86_64__
+	[CRC32C_SSE42] = { "sse4.2", crc32c_sse42 },
+#endif
+#ifdef __aarch64__
+	[CRC32C_ARMV8] = { "armv8", crc32c_armv8 },
+#endif
+};
+
+/**
+ * Use a particular crc32c implementation instead of the best one available.
+ * This must not be called while other threads may be computing crcs.
+ * Returns 0 on success or -1 with errno set to ENOTSUP if impl is not
+ * supported by this build or cpu.
+ */
+int crc32c_impl_set(enum crc32c_impl impl)
+{
+	int supported = 0;
+
+	switch (impl) {
+	case CRC32C_BYTEWISE:
+	case CRC32C_SLICE8:
+		supported = 1;
+		break;
+	case CRC32C_SSE42:
+#ifdef __x86_64__
+		supported = crc32c_sse42_supported();
+#endif
+		break;
+	case CRC32C_ARMV8:
+#ifdef __aarch64__
+		supported = crc32c_armv8_supported();
+#endif
+		break;
+	}
+	if (!supported) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	crc32c_tables_init();
+	crc_function = crc32c_impls[impl].fn;
+	crc_name = crc32c_impls[impl].name;
+	return 0;
+}
+
+/**
+ * Returns the name of the crc32c implementation in use.
+ */
+const char *crc32c_impl_name(void)
+{
+	return crc_name;
+}
+
+void crc32c_optimization_init(void)
+{
+	if (crc_name != NULL)
+		return;
+	if (crc32c_impl_set(CRC32C_ARMV8) == 0 ||
+	    crc32c_impl_set(CRC32C_SSE42) == 0)
+		return;
+	crc32c_impl_set(CRC32C_SLICE8);
+}
+
+static void __attribute__((constructor)) crc32c_init(void)
+{
+	crc32c_optimization_init();
+}
+
+uint32_t crc32c(uint32_t crc, unsigned char const *data, size_t length)
+{
 	return crc_function(crc, data, length);
 }
@@ -3,7 +3,16 @@
 #include <stdlib.h>
 #include <inttypes.h>
 
+enum crc32c_impl {
+	CRC32C_BYTEWISE = 0,
+	CRC32C_SLICE8 = 1,
+	CRC32C_SSE42 = 2,
+	CRC32C_ARMV8 = 3,
+};
+
 uint32_t crc32c(uint32_t seed, unsigned char const *data, size_t length);
 void crc32c_optimization_init(void);
+int crc32c_impl_set(enum crc32c_impl impl);
+const char *crc32c_impl_name(void);
 
 #endif
@@ -105,3 +105,94 @@ void fix_device_geometry(struct gfs2_sbd *sdp)
 		printf("\nDevice Size: %"PRIu64"\n", sdp->dinfo.size);
 	}
 }
+
+/* The alignment O_DIRECT needs for buffers, offsets and lengths on the device */
+static unsigned dio_alignment(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_dev_info di = sdp->dinfo;
+	unsigned align = 512;
+
+	/* Not all of the tools fill in sdp->dinfo */
+	if (di.stat.st_mode == 0) {
+		if (fstat(sdp->device_fd, &di.stat) != 0)
+			return 0;
+		if (S_ISBLK(di.stat.st_mode)) {
+			ioctl(sdp->device_fd, BLKSSZGET, &di.logical_block_size);
+			ioctl(sdp->device_fd, BLKIOMIN, &di.io_min_size);
+		}
+	}
+	if (S_ISBLK(di.stat.st_mode)) {
+		if (di.logical_block_size > align)
+			align = di.logical_block_size;
+		/* Avoid read-modify-write cycles in the device if we can */
+		if (di.io_min_size > align && di.io_min_size <= sdp->sd_bsize &&
+		    (di.io_min_size & (di.io_min_size - 1)) == 0)
+			align = di.io_min_size;
+	} else if (di.stat.st_blksize > align) {
+		/* The host file system's block size is a safe upper bound */
+		align = di.stat.st_blksize;
+	}
+	return align;
+}
+
+/**
+ * lgfs2_set_direct_io - switch O_DIRECT on or off for sdp->device_fd
+ * @sdp: The super block, with sd_bsize and dinfo set
+ * @enable: Non-zero to bypass the page cache, zero to use it again
+ *
+ * While direct I/O is enabled, buffers which are read or written directly
+ * from or to the device must come from lgfs2_dev_buf() or bread()/bget().
+ * Buffers allocated before this is called are not aligned, so it should be
+ * called before the resource groups are read in.
+ *
+ * Returns 0 on success or -1 with errno set. EINVAL means the block size is
+ * not a multiple of the device's alignment or the device does not support
+ * direct I/O.
+ */
+int lgfs2_set_direct_io(struct gfs2_sbd *sdp, int enable)
+{
+	unsigned align = 0;
+	int flags;
+
+	if (enable) {
+		align = dio_alignment(sdp);
+		if (align == 0)
+			return -1;
+		if (sdp->sd_bsize == 0 || sdp->sd_bsize % align != 0) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	flags = fcntl(sdp->device_fd, F_GETFL);
+	if (flags < 0)
+		return -1;
+	flags = enable ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+	if (fcntl(sdp->device_fd, F_SETFL, flags) != 0)
+		return -1;
+	sdp->dio_align = align;
+	return 0;
+}
+
+/**
+ * lgfs2_dev_buf - allocate a zeroed buffer for I/O on the device
+ * @sdp: The super block
+ * @len: The size of the buffer
+ *
+ * The buffer is suitably aligned for direct I/O if it is enabled and must be
+ * freed with free().
+ * Returns the buffer or NULL with errno set.
+ */
+void *lgfs2_dev_buf(const struct gfs2_sbd *sdp, size_t len)
+{
+	size_t align = sdp->dio_align ? sdp->dio_align : sizeof(void *);
+	void *buf;
+	int err;
+
+	err = posix_memalign(&buf, align, len);
+	if (err != 0) {
+		errno = err;
+		return NULL;
+	}
+	memset(buf, 0, len);
+	return buf;
+}
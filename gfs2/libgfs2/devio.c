@@ -0,0 +1,727 @@
+#include "clusterautoconfig.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "libgfs2.h"
+
+/*
+ * I/O backends for the device. All reads and writes of the device go
+ * through the lgfs2_dev_*() functions, which use sdp->dev_ops if it is set
+ * and sdp->device_fd otherwise, so tools which open the device themselves
+ * keep working unchanged. Tools which want to support the other backends
+ * open the device with lgfs2_dev_open() instead.
+ */
+
+static const struct {
+	const char *prefix;
+	enum lgfs2_dev_type type;
+} dev_prefixes[] = {
+	{ "mmap:", LGFS2_DEV_TYPE_MMAP },
+	{ "memfd:", LGFS2_DEV_TYPE_MEMFD },
+	{ "savemeta:", LGFS2_DEV_TYPE_SAVEMETA },
+};
+
+/* The path part of a device spec */
+static const char *dev_path(const char *spec)
+{
+	for (unsigned i = 0; i < sizeof(dev_prefixes) / sizeof(dev_prefixes[0]); i++) {
+		size_t len = strlen(dev_prefixes[i].prefix);
+
+		if (strncmp(spec, dev_prefixes[i].prefix, len) == 0)
+			return spec + len;
+	}
+	return spec;
+}
+
+/**
+ * Find out which backend a device spec selects. A spec is a path with an
+ * optional "<type>:" prefix, e.g. "savemeta:/tmp/gfsmeta.XXXXXX".
+ */
+enum lgfs2_dev_type lgfs2_dev_type(const char *spec)
+{
+	for (unsigned i = 0; i < sizeof(dev_prefixes) / sizeof(dev_prefixes[0]); i++) {
+		if (strncmp(spec, dev_prefixes[i].prefix, strlen(dev_prefixes[i].prefix)) == 0)
+			return dev_prefixes[i].type;
+	}
+	return LGFS2_DEV_TYPE_FD;
+}
+
+/* Plain file descriptor, also used for memfd */
+
+static ssize_t fd_preadv(struct gfs2_sbd *sdp, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return preadv(sdp->device_fd, iov, iovcnt, offset);
+}
+
+static ssize_t fd_pwritev(struct gfs2_sbd *sdp, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return pwritev(sdp->device_fd, iov, iovcnt, offset);
+}
+
+static int fd_sync(struct gfs2_sbd *sdp)
+{
+	return fsync(sdp->device_fd);
+}
+
+static void fd_close(struct gfs2_sbd *sdp)
+{
+	close(sdp->device_fd);
+}
+
+static int fd_advise(struct gfs2_sbd *sdp, off_t offset, off_t len, int advice)
+{
+	int err = posix_fadvise(sdp->device_fd, offset, len, advice);
+
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+static const struct lgfs2_dev_ops fd_ops = {
+	.name = "fd",
+	.flags = LGFS2_DEV_FD,
+	.preadv = fd_preadv,
+	.pwritev = fd_pwritev,
+	.sync = fd_sync,
+	.close = fd_close,
+	.advise = fd_advise,
+};
+
+static const struct lgfs2_dev_ops memfd_ops = {
+	.name = "memfd",
+	.flags = LGFS2_DEV_FD,
+	.preadv = fd_preadv,
+	.pwritev = fd_pwritev,
+	.sync = fd_sync,
+	.close = fd_close,
+};
+
+/* Read-only backends */
+
+static ssize_t rdonly_pwritev(struct gfs2_sbd *sdp, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	errno = EROFS;
+	return -1;
+}
+
+static int rdonly_sync(struct gfs2_sbd *sdp)
+{
+	return 0;
+}
+
+struct dev_map {
+	const char *dm_map;
+	size_t dm_len;
+};
+
+/* Map the first size bytes of a file or block device read-only */
+static int dev_map_file(int fd, uint64_t size, struct dev_map *dm)
+{
+	void *map;
+
+	if (size == 0 || size > SIZE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	dm->dm_map = map;
+	dm->dm_len = size;
+	return 0;
+}
+
+/* mmap: the device or image file is mapped read-only and device_fd stays open
+   for fstat(). Block devices are sized by lgfs2_get_dev_info(). */
+
+static ssize_t mmap_preadv(struct gfs2_sbd *sdp, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	struct dev_map *dm = sdp->dev_priv;
+	size_t done = 0;
+
+	for (int i = 0; i < iovcnt && offset < dm->dm_len; i++) {
+		size_t len = iov[i].iov_len;
+
+		if (len > dm->dm_len - offset)
+			len = dm->dm_len - offset;
+		memcpy(iov[i].iov_base, dm->dm_map + offset, len);
+		offset += len;
+		done += len;
+	}
+	return done;
+}
+
+static void mmap_close(struct gfs2_sbd *sdp)
+{
+	struct dev_map *dm = sdp->dev_priv;
+
+	munmap((void *)dm->dm_map, dm->dm_len);
+	free(dm);
+	close(sdp->device_fd);
+}
+
+static int mmap_advise(struct gfs2_sbd *sdp, off_t offset, off_t len, int advice)
+{
+	struct dev_map *dm = sdp->dev_priv;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	off_t start = offset & ~(pagesize - 1);
+
+	if (offset >= dm->dm_len)
+		return 0;
+	if (len == 0 || offset + len > dm->dm_len)
+		len = dm->dm_len - offset;
+	switch (advice) {
+	case POSIX_FADV_WILLNEED:
+		advice = MADV_WILLNEED;
+		break;
+	case POSIX_FADV_RANDOM:
+		advice = MADV_RANDOM;
+		break;
+	case POSIX_FADV_SEQUENTIAL:
+		advice = MADV_SEQUENTIAL;
+		break;
+	case POSIX_FADV_NORMAL:
+		advice = MADV_NORMAL;
+		break;
+	default:
+		return 0;
+	}
+	return madvise((void *)(dm->dm_map + start), len + (offset - start), advice);
+}
+
+static const struct lgfs2_dev_ops mmap_ops = {
+	.name = "mmap",
+	.flags = LGFS2_DEV_RDONLY,
+	.preadv = mmap_preadv,
+	.pwritev = rdonly_pwritev,
+	.sync = rdonly_sync,
+	.close = mmap_close,
+	.advise = mmap_advise,
+};
+
+static int mmap_open(struct gfs2_sbd *sdp, const char *path)
+{
+	struct dev_map *dm;
+	int fd;
+
+	dm = malloc(sizeof(*dm));
+	if (dm == NULL)
+		return -1;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		goto out_free;
+	if (lgfs2_get_dev_info(fd, &sdp->dinfo) != 0 ||
+	    dev_map_file(fd, sdp->dinfo.size, dm) != 0)
+		goto out_close;
+	sdp->dinfo.readonly = 1;
+	sdp->device_fd = fd;
+	sdp->dev_priv = dm;
+	sdp->dev_ops = &mmap_ops;
+	return 0;
+out_close:
+	close(fd);
+out_free:
+	free(dm);
+	return -1;
+}
+
+/* memfd: the data extents of an image file are copied into memory */
+
+#define MEMFD_COPY_SIZE (1 << 20)
+
+static int is_zero(const char *buf, size_t len)
+{
+	return buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0;
+}
+
+/* Copy [start, end) from src to dst, leaving holes where the data is zero */
+static int memfd_copy_range(int src, int dst, char *buf, off_t start, off_t end)
+{
+	while (start < end) {
+		size_t len = MEMFD_COPY_SIZE;
+		ssize_t ret;
+
+		if (len > end - start)
+			len = end - start;
+		ret = pread(src, buf, len, start);
+		if (ret <= 0) {
+			if (ret == 0)
+				errno = EIO;
+			return -1;
+		}
+		if (!is_zero(buf, ret) && pwrite(dst, buf, ret, start) != ret)
+			return -1;
+		start += ret;
+	}
+	return 0;
+}
+
+static int memfd_copy(int src, int dst, off_t size)
+{
+	off_t data = 0;
+	int ret = 0;
+	char *buf;
+
+	buf = malloc(MEMFD_COPY_SIZE);
+	if (buf == NULL)
+		return -1;
+	while (data < size) {
+		off_t hole;
+
+		data = lseek(src, data, SEEK_DATA);
+		if (data < 0) {
+			/* ENXIO means there's no more data */
+			if (errno == ENXIO)
+				break;
+			/* SEEK_DATA isn't supported so copy everything */
+			ret = memfd_copy_range(src, dst, buf, 0, size);
+			break;
+		}
+		hole = lseek(src, data, SEEK_HOLE);
+		if (hole < 0 || hole > size)
+			hole = size;
+		ret = memfd_copy_range(src, dst, buf, data, hole);
+		if (ret != 0)
+			break;
+		data = hole;
+	}
+	free(buf);
+	return ret;
+}
+
+static int memfd_open(struct gfs2_sbd *sdp, const char *path)
+{
+#ifdef HAVE_MEMFD_CREATE
+	char name[NAME_MAX];
+	char *pathcopy;
+	off_t size;
+	int src;
+	int fd;
+
+	src = open(path, O_RDONLY | O_CLOEXEC);
+	if (src < 0)
+		return -1;
+	size = lseek(src, 0, SEEK_END);
+	if (size < 0)
+		goto out_src;
+	pathcopy = strdup(path);
+	if (pathcopy == NULL)
+		goto out_src;
+	snprintf(name, sizeof(name), "gfs2:%s", basename(pathcopy));
+	free(pathcopy);
+	fd = memfd_create(name, MFD_CLOEXEC);
+	if (fd < 0)
+		goto out_src;
+	if (ftruncate(fd, size) != 0 || memfd_copy(src, fd, size) != 0)
+		goto out_fd;
+	if (lgfs2_get_dev_info(fd, &sdp->dinfo) != 0)
+		goto out_fd;
+	close(src);
+	sdp->device_fd = fd;
+	sdp->dev_priv = NULL;
+	sdp->dev_ops = &memfd_ops;
+	return 0;
+out_fd:
+	close(fd);
+out_src:
+	close(src);
+	return -1;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * savemeta: the blocks saved in an uncompressed savemeta file are indexed by
+ * block number and read straight from a mapping of the file. Blocks which
+ * were not saved read as zeroes. There is no file descriptor for the device.
+ */
+
+struct sm_block {
+	uint64_t sb_blk;
+	size_t sb_off; /* Offset of the block's data in the file */
+	unsigned sb_len;
+};
+
+struct sm_view {
+	struct dev_map sv_map;
+	struct sm_block *sv_blocks; /* Sorted by block number */
+	size_t sv_count;
+	size_t sv_last;    /* Index of the last block looked up */
+	unsigned sv_bsize;
+	uint64_t sv_size;  /* File system size in bytes */
+};
+
+static int sm_blkcmp(const void *a, const void *b)
+{
+	const struct sm_block *sba = a;
+	const struct sm_block *sbb = b;
+
+	if (sba->sb_blk != sbb->sb_blk)
+		return sba->sb_blk < sbb->sb_blk ? -1 : 1;
+	/* Later copies of a block replace earlier ones, as in restoremeta */
+	return sba->sb_off < sbb->sb_off ? -1 : (sba->sb_off > sbb->sb_off);
+}
+
+/* Reads can come from any thread, so the hint is only a guess: it is read and
+   stored atomically and never relied upon without checking the block. */
+static const struct sm_block *sm_lookup(struct sm_view *sv, uint64_t blk)
+{
+	size_t last = __atomic_load_n(&sv->sv_last, __ATOMIC_RELAXED);
+	size_t lo = 0, hi = sv->sv_count;
+
+	/* Reads are mostly sequential so try the next block first */
+	if (last + 1 < sv->sv_count && sv->sv_blocks[last + 1].sb_blk == blk) {
+		lo = last + 1;
+		goto found;
+	}
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (sv->sv_blocks[mid].sb_blk < blk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == sv->sv_count || sv->sv_blocks[lo].sb_blk != blk)
+		return NULL;
+found:
+	__atomic_store_n(&sv->sv_last, lo, __ATOMIC_RELAXED);
+	return &sv->sv_blocks[lo];
+}
+
+static ssize_t sm_preadv(struct gfs2_sbd *sdp, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	struct sm_view *sv = sdp->dev_priv;
+	size_t done = 0;
+
+	for (int i = 0; i < iovcnt; i++) {
+		char *buf = iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+
+		while (left > 0 && offset < sv->sv_size) {
+			const struct sm_block *sb = sm_lookup(sv, offset / sv->sv_bsize);
+			unsigned start = offset % sv->sv_bsize;
+			size_t len = sv->sv_bsize - start;
+			size_t copied = 0;
+
+			if (len > left)
+				len = left;
+			if (sb != NULL && start < sb->sb_len) {
+				copied = sb->sb_len - start;
+				if (copied > len)
+					copied = len;
+				memcpy(buf, sv->sv_map.dm_map + sb->sb_off + start, copied);
+			}
+			memset(buf + copied, 0, len - copied);
+			buf += len;
+			left -= len;
+			offset += len;
+			done += len;
+		}
+	}
+	return done;
+}
+
+static void sm_view_free(struct sm_view *sv)
+{
+	munmap((void *)sv->sv_map.dm_map, sv->sv_map.dm_len);
+	free(sv->sv_blocks);
+	free(sv);
+}
+
+static void sm_close(struct gfs2_sbd *sdp)
+{
+	sm_view_free(sdp->dev_priv);
+}
+
+static const struct lgfs2_dev_ops savemeta_ops = {
+	.name = "savemeta",
+	.flags = LGFS2_DEV_RDONLY,
+	.preadv = sm_preadv,
+	.pwritev = rdonly_pwritev,
+	.sync = rdonly_sync,
+	.close = sm_close,
+};
+
+/* Build the block index of a mapped savemeta file */
+static int sm_index(struct sm_view *sv)
+{
+	const char *map = sv->sv_map.dm_map;
+	size_t len = sv->sv_map.dm_len;
+	const struct savemeta_header *smh = (const void *)map;
+	const struct gfs2_sb *sb;
+	size_t off = 0, max = 0;
+	uint64_t lastblk = 0;
+
+	if (len >= 3 && ((map[0] == '\x1f' && map[1] == '\x8b') || memcmp(map, "BZh", 3) == 0)) {
+		/* Compressed files can't be read in place */
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (len >= sizeof(*smh) && be32_to_cpu(smh->sh_magic) == SAVEMETA_MAGIC) {
+		if (be32_to_cpu(smh->sh_format) > SAVEMETA_FORMAT) {
+			errno = EINVAL;
+			return -1;
+		}
+		sv->sv_size = be64_to_cpu(smh->sh_fs_bytes);
+		off = sizeof(*smh);
+	}
+	while (off + sizeof(struct saved_metablock) <= len) {
+		const struct saved_metablock *svb = (const void *)(map + off);
+		struct sm_block *smb;
+
+		off += sizeof(*svb);
+		if (off + be16_to_cpu(svb->siglen) > len)
+			break; /* Truncated */
+		if (sv->sv_count == max) {
+			max = max ? max * 2 : 4096;
+			smb = realloc(sv->sv_blocks, max * sizeof(*smb));
+			if (smb == NULL)
+				return -1;
+			sv->sv_blocks = smb;
+		}
+		smb = &sv->sv_blocks[sv->sv_count++];
+		smb->sb_blk = be64_to_cpu(svb->blk);
+		smb->sb_off = off;
+		smb->sb_len = be16_to_cpu(svb->siglen);
+		if (smb->sb_blk > lastblk)
+			lastblk = smb->sb_blk;
+		off += smb->sb_len;
+	}
+	/* The superblock is saved first and tells us the block size */
+	if (sv->sv_count == 0 ||
+	    sv->sv_blocks[0].sb_len < offsetof(struct gfs2_sb, sb_bsize) + sizeof(uint32_t)) {
+		errno = EINVAL;
+		return -1;
+	}
+	sb = (const void *)(map + sv->sv_blocks[0].sb_off);
+	sv->sv_bsize = be32_to_cpu(sb->sb_bsize);
+	if (be32_to_cpu(sb->sb_header.mh_magic) != GFS2_MAGIC ||
+	    sv->sv_bsize < GFS2_BASIC_BLOCK || sv->sv_bsize > 65536 ||
+	    (sv->sv_bsize & (sv->sv_bsize - 1)) != 0 ||
+	    sv->sv_blocks[0].sb_blk * sv->sv_bsize != GFS2_SB_ADDR * GFS2_BASIC_BLOCK) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (size_t i = 0; i < sv->sv_count; i++) {
+		if (sv->sv_blocks[i].sb_len > sv->sv_bsize) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	qsort(sv->sv_blocks, sv->sv_count, sizeof(*sv->sv_blocks), sm_blkcmp);
+	/* Keep only the last copy of each block */
+	max = 0;
+	for (size_t i = 0; i < sv->sv_count; i++) {
+		if (max > 0 && sv->sv_blocks[max - 1].sb_blk == sv->sv_blocks[i].sb_blk)
+			max--;
+		sv->sv_blocks[max++] = sv->sv_blocks[i];
+	}
+	sv->sv_count = max;
+	/* Old savemeta files don't record the file system size */
+	if (sv->sv_size == 0)
+		sv->sv_size = (lastblk + 1) * sv->sv_bsize;
+	return 0;
+}
+
+static int savemeta_open(struct gfs2_sbd *sdp, const char *path)
+{
+	struct sm_view *sv;
+	struct stat st;
+	int fd;
+
+	sv = calloc(1, sizeof(*sv));
+	if (sv == NULL)
+		return -1;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		goto out_free;
+	if (fstat(fd, &st) != 0)
+		goto out_close;
+	if (!S_ISREG(st.st_mode)) {
+		errno = EINVAL;
+		goto out_close;
+	}
+	if (dev_map_file(fd, st.st_size, &sv->sv_map) != 0)
+		goto out_close;
+	/* The mapping stays valid after the file is closed */
+	close(fd);
+	if (sm_index(sv) != 0) {
+		int err = errno;
+
+		sm_view_free(sv);
+		errno = err;
+		return -1;
+	}
+	memset(&sdp->dinfo, 0, sizeof(sdp->dinfo));
+	sdp->dinfo.stat = st;
+	sdp->dinfo.stat.st_size = sv->sv_size;
+	sdp->dinfo.readonly = 1;
+	sdp->dinfo.size = sv->sv_size;
+	sdp->device_fd = -1;
+	sdp->dev_priv = sv;
+	sdp->dev_ops = &savemeta_ops;
+	return 0;
+out_close:
+	close(fd);
+out_free:
+	free(sv);
+	return -1;
+}
+
+/**
+ * lgfs2_dev_open - open a device with the backend selected by a device spec
+ * @sdp: The super block, which gets device_fd, dev_ops, dev_priv and dinfo set
+ * @spec: The path to the device or image file, optionally prefixed with
+ *        "mmap:", "memfd:" or "savemeta:" (see enum lgfs2_dev_type)
+ * @flags: The open(2) flags for a plain device or image file. The mmap and
+ *         savemeta backends are read-only and fail with EROFS unless O_RDONLY
+ *         is given. Changes made through memfd are not written back.
+ *
+ * Returns 0 on success or -1 with errno set. A savemeta file which is
+ * compressed fails with ENOTSUP.
+ */
+int lgfs2_dev_open(struct gfs2_sbd *sdp, const char *spec, int flags)
+{
+	enum lgfs2_dev_type type = lgfs2_dev_type(spec);
+	const char *path = dev_path(spec);
+	int fd;
+
+	sdp->dev_ops = NULL;
+	sdp->dev_priv = NULL;
+	switch (type) {
+	case LGFS2_DEV_TYPE_MMAP:
+	case LGFS2_DEV_TYPE_SAVEMETA:
+		if ((flags & O_ACCMODE) != O_RDONLY) {
+			errno = EROFS;
+			return -1;
+		}
+		if (type == LGFS2_DEV_TYPE_MMAP)
+			return mmap_open(sdp, path);
+		return savemeta_open(sdp, path);
+	case LGFS2_DEV_TYPE_MEMFD:
+		return memfd_open(sdp, path);
+	case LGFS2_DEV_TYPE_FD:
+		break;
+	}
+	fd = open(path, flags);
+	if (fd < 0)
+		return -1;
+	if (lgfs2_get_dev_info(fd, &sdp->dinfo) != 0) {
+		int err = errno;
+
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	sdp->device_fd = fd;
+	sdp->dev_ops = &fd_ops;
+	return 0;
+}
+
+/**
+ * Close the device, whichever backend it was opened with.
+ */
+void lgfs2_dev_close(struct gfs2_sbd *sdp)
+{
+	if (sdp->dev_ops != NULL)
+		sdp->dev_ops->close(sdp);
+	else if (sdp->device_fd >= 0)
+		close(sdp->device_fd);
+	sdp->device_fd = -1;
+	sdp->dev_ops = NULL;
+	sdp->dev_priv = NULL;
+}
+
+static ssize_t dev_io(struct gfs2_sbd *sdp, int rw, const struct iovec *iov, int iovcnt,
+                      off_t offset, const char *func)
+{
+	struct timespec start;
+	ssize_t ret;
+
+	if (lgfs2_iostats_on)
+		clock_gettime(CLOCK_MONOTONIC, &start);
+	if (rw == LGFS2_IOSTATS_WRITE)
+		ret = sdp->dev_ops == NULL ? pwritev(sdp->device_fd, iov, iovcnt, offset) :
+		                             sdp->dev_ops->pwritev(sdp, iov, iovcnt, offset);
+	else
+		ret = sdp->dev_ops == NULL ? preadv(sdp->device_fd, iov, iovcnt, offset) :
+		                             sdp->dev_ops->preadv(sdp, iov, iovcnt, offset);
+	if (lgfs2_iostats_on) {
+		int err = errno;
+
+		lgfs2_iostats_account(rw, offset, ret, &start, func, 0);
+		errno = err;
+	}
+	return ret;
+}
+
+ssize_t lgfs2_dev_preadv(struct gfs2_sbd *sdp, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return dev_io(sdp, LGFS2_IOSTATS_READ, iov, iovcnt, offset, __FUNCTION__);
+}
+
+ssize_t lgfs2_dev_pwritev(struct gfs2_sbd *sdp, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return dev_io(sdp, LGFS2_IOSTATS_WRITE, iov, iovcnt, offset, __FUNCTION__);
+}
+
+ssize_t lgfs2_dev_pread(struct gfs2_sbd *sdp, void *buf, size_t len, off_t offset)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+	return dev_io(sdp, LGFS2_IOSTATS_READ, &iov, 1, offset, __FUNCTION__);
+}
+
+ssize_t lgfs2_dev_pwrite(struct gfs2_sbd *sdp, const void *buf, size_t len, off_t offset)
+{
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+	return dev_io(sdp, LGFS2_IOSTATS_WRITE, &iov, 1, offset, __FUNCTION__);
+}
+
+int lgfs2_dev_sync(struct gfs2_sbd *sdp)
+{
+	if (sdp->dev_ops == NULL)
+		return fsync(sdp->device_fd);
+	return sdp->dev_ops->sync(sdp);
+}
+
+/**
+ * Pass an access pattern hint for a range of the device to the backend, like
+ * posix_fadvise(2). A len of 0 means up to the end of the device. Backends
+ * which keep the device in memory ignore the hints.
+ * Returns 0 on success or -1 with errno set.
+ */
+int lgfs2_dev_advise(struct gfs2_sbd *sdp, off_t offset, off_t len, int advice)
+{
+	if (sdp->dev_ops == NULL)
+		return fd_advise(sdp, offset, len, advice);
+	if (sdp->dev_ops->advise == NULL)
+		return 0;
+	return sdp->dev_ops->advise(sdp, offset, len, advice);
+}
+
+/**
+ * Returns the size of the device in bytes or -1 with errno set.
+ */
+off_t lgfs2_dev_size(struct gfs2_sbd *sdp)
+{
+	if (sdp->dev_ops == NULL || (sdp->dev_ops->flags & LGFS2_DEV_FD))
+		return lseek(sdp->device_fd, 0, SEEK_END);
+	return sdp->dinfo.size;
+}
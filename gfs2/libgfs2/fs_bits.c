@@ -5,8 +5,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <limits.h>
+#include <errno.h>
 
 #include "libgfs2.h"
+#include "rgrp.h"
 
 #if BITS_PER_LONG == 32
 #define LBITMASK   (0x55555555UL)
@@ -20,39 +22,306 @@
 
 #define ALIGN(x,a) (((x)+(a)-1)&~((a)-1))
 
-/**
- * gfs2_bit_search
- * @ptr: Pointer to bitmap data
- * @mask: Mask to use (normally 0x55555.... but adjusted for search start)
- * @state: The state we are searching for
- *
- * We xor the bitmap data with a patter which is the bitwise opposite
- * of what we are looking for, this gives rise to a pattern of ones
- * wherever there is a match. Since we have two bits per entry, we
- * take this pattern, shift it down by one place and then and it with
- * the original. All the even bit positions (0,2,4, etc) then represent
- * successful matches, so we mask with 0x55555..... to remove the unwanted
- * odd bit positions.
+/*
+ * Bitmap searches. Each block has two bits in the bitmap so a 64 bit word
+ * covers 32 blocks. To find the blocks in a given state, we xor the bitmap
+ * data with a pattern which is the bitwise opposite of what we are looking
+ * for, which gives rise to a pattern of ones wherever there is a match.
+ * Since we have two bits per entry, we take this pattern, shift it down by
+ * one place and then and it with the original. All the even bit positions
+ * (0,2,4, etc) then represent successful matches, so we mask with
+ * 0x55555..... to remove the unwanted odd bit positions.
  *
- * This allows searching of a whole u64 at once (32 blocks) with a
- * single test (on 64 bit arches).
+ * The vector versions do the same thing on 16 or 32 bytes at a time, which
+ * works because the two bits of an entry never straddle a 64 bit lane. The
+ * fastest version the CPU supports is picked the first time a search is
+ * done, or it can be set with lgfs2_bm_impl_set().
+ */
+
+static const uint64_t bm_search[] = {
+	[0] = 0xffffffffffffffffULL,
+	[1] = 0xaaaaaaaaaaaaaaaaULL,
+	[2] = 0x5555555555555555ULL,
+	[3] = 0x0000000000000000ULL,
+};
+
+static inline uint64_t bm_match(uint64_t word, uint8_t state)
+{
+	uint64_t tmp = word ^ bm_search[state];
+
+	return tmp & (tmp >> 1) & 0x5555555555555555ULL;
+}
+
+/* The matches in the word at byte off, ignoring any bytes from len onwards */
+static inline uint64_t bm_match_at(const unsigned char *buf, unsigned off,
+                                   unsigned len, uint8_t state)
+{
+	uint64_t word = 0;
+
+	if (off + sizeof(word) <= len) {
+		memcpy(&word, buf + off, sizeof(word));
+		return bm_match(le64_to_cpu(word), state);
+	}
+	memcpy(&word, buf + off, len - off);
+	return bm_match(le64_to_cpu(word), state) & (~0ULL >> (64 - 8 * (len - off)));
+}
+
+/* Add base plus the block number of each match to out */
+static inline unsigned bm_emit(uint64_t match, uint64_t base, uint64_t *out)
+{
+	unsigned n = 0;
+
+	while (match != 0) {
+		out[n++] = base + (__builtin_ctzll(match) >> 1);
+		match &= match - 1;
+	}
+	return n;
+}
+
+/*
+ * Each implementation has two functions:
+ * find: Returns the offset of the first whole word at or after byte off
+ *       which has a match. If there is none it returns the offset of the
+ *       partial word at the end of the buffer, or len or more if there isn't
+ *       one.
+ * collect: Stores base plus the block number of every match in out and
+ *          returns the number of matches.
+ * count: Adds the number of used, unlinked and dinode blocks to count[1-3].
+ *        Free blocks are left to the caller, as padding bytes read as free.
+ */
+struct bm_impl {
+	const char *name;
+	unsigned (*find)(const unsigned char *buf, unsigned off, unsigned len, uint8_t state);
+	unsigned (*collect)(const unsigned char *buf, unsigned len, uint8_t state,
+	                    uint64_t base, uint64_t *out);
+	void (*count)(const unsigned char *buf, unsigned len, uint32_t *count);
+};
+
+static unsigned bm_find_scalar(const unsigned char *buf, unsigned off, unsigned len, uint8_t state)
+{
+	unsigned end = len & ~7U;
+
+	for (; off < end; off += 8) {
+		if (bm_match_at(buf, off, len, state) != 0)
+			break;
+	}
+	return off;
+}
+
+static unsigned bm_collect_scalar(const unsigned char *buf, unsigned len, uint8_t state,
+                                  uint64_t base, uint64_t *out)
+{
+	unsigned n = 0;
+
+	for (unsigned off = 0; off < len; off += 8)
+		n += bm_emit(bm_match_at(buf, off, len, state), base + off * GFS2_NBBY, out + n);
+	return n;
+}
+
+static void bm_count_scalar(const unsigned char *buf, unsigned len, uint32_t *count)
+{
+	for (unsigned off = 0; off < len; off += 8) {
+		uint64_t word = 0;
+		uint64_t lo, hi;
+
+		memcpy(&word, buf + off, off + 8 <= len ? 8 : len - off);
+		word = le64_to_cpu(word);
+		lo = word & 0x5555555555555555ULL;
+		hi = (word >> 1) & 0x5555555555555555ULL;
+		count[GFS2_BLKST_USED] += __builtin_popcountll(lo & ~hi);
+		count[GFS2_BLKST_UNLINKED] += __builtin_popcountll(hi & ~lo);
+		count[GFS2_BLKST_DINODE] += __builtin_popcountll(lo & hi);
+	}
+}
+
+#ifdef __x86_64__
+#include <immintrin.h>
+
+static unsigned bm_find_sse2(const unsigned char *buf, unsigned off, unsigned len, uint8_t state)
+{
+	const __m128i pat = _mm_set1_epi64x(bm_search[state]);
+	const __m128i even = _mm_set1_epi64x(0x5555555555555555ULL);
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; off + 16 <= len; off += 16) {
+		__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(buf + off)), pat);
+
+		v = _mm_and_si128(_mm_and_si128(v, _mm_srli_epi64(v, 1)), even);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff)
+			break;
+	}
+	return bm_find_scalar(buf, off, len, state);
+}
+
+static unsigned bm_collect_sse2(const unsigned char *buf, unsigned len, uint8_t state,
+                                uint64_t base, uint64_t *out)
+{
+	const __m128i pat = _mm_set1_epi64x(bm_search[state]);
+	const __m128i even = _mm_set1_epi64x(0x5555555555555555ULL);
+	const __m128i zero = _mm_setzero_si128();
+	unsigned n = 0;
+	unsigned off;
+
+	for (off = 0; off + 16 <= len; off += 16) {
+		__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(buf + off)), pat);
+		uint64_t m[2];
+
+		v = _mm_and_si128(_mm_and_si128(v, _mm_srli_epi64(v, 1)), even);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) == 0xffff)
+			continue;
+		_mm_storeu_si128((__m128i *)m, v);
+		n += bm_emit(m[0], base + off * GFS2_NBBY, out + n);
+		n += bm_emit(m[1], base + (off + 8) * GFS2_NBBY, out + n);
+	}
+	return n + bm_collect_scalar(buf + off, len - off, state, base + off * GFS2_NBBY, out + n);
+}
+
+__attribute__((target("avx2")))
+static unsigned bm_find_avx2(const unsigned char *buf, unsigned off, unsigned len, uint8_t state)
+{
+	const __m256i pat = _mm256_set1_epi64x(bm_search[state]);
+	const __m256i even = _mm256_set1_epi64x(0x5555555555555555ULL);
+
+	for (; off + 32 <= len; off += 32) {
+		__m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(buf + off)), pat);
+
+		v = _mm256_and_si256(_mm256_and_si256(v, _mm256_srli_epi64(v, 1)), even);
+		if (!_mm256_testz_si256(v, v))
+			break;
+	}
+	return bm_find_scalar(buf, off, len, state);
+}
+
+__attribute__((target("avx2")))
+static unsigned bm_collect_avx2(const unsigned char *buf, unsigned len, uint8_t state,
+                                uint64_t base, uint64_t *out)
+{
+	const __m256i pat = _mm256_set1_epi64x(bm_search[state]);
+	const __m256i even = _mm256_set1_epi64x(0x5555555555555555ULL);
+	unsigned n = 0;
+	unsigned off;
+
+	for (off = 0; off + 32 <= len; off += 32) {
+		__m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(buf + off)), pat);
+		uint64_t m[4];
+
+		v = _mm256_and_si256(_mm256_and_si256(v, _mm256_srli_epi64(v, 1)), even);
+		if (_mm256_testz_si256(v, v))
+			continue;
+		_mm256_storeu_si256((__m256i *)m, v);
+		for (unsigned i = 0; i < 4; i++)
+			n += bm_emit(m[i], base + (off + 8 * i) * GFS2_NBBY, out + n);
+	}
+	return n + bm_collect_scalar(buf + off, len - off, state, base + off * GFS2_NBBY, out + n);
+}
+
+/* The number of bits set in each byte of v */
+__attribute__((target("avx2")))
+static inline __m256i bm_popcnt8_avx2(__m256i v)
+{
+	const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+	                                     0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	__m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, nibble));
+	__m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+
+	return _mm256_add_epi8(lo, hi);
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t bm_hsum_avx2(__m256i v)
+{
+	return _mm256_extract_epi64(v, 0) + _mm256_extract_epi64(v, 1) +
+	       _mm256_extract_epi64(v, 2) + _mm256_extract_epi64(v, 3);
+}
+
+__attribute__((target("avx2")))
+static void bm_count_avx2(const unsigned char *buf, unsigned len, uint32_t *count)
+{
+	const __m256i even = _mm256_set1_epi64x(0x5555555555555555ULL);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i used = zero, unlinked = zero, dinode = zero;
+	unsigned off;
+
+	/* 64 bytes at a time, so the byte counts can't overflow before they're summed */
+	for (off = 0; off + 64 <= len; off += 64) {
+		__m256i u = zero, n = zero, d = zero;
+
+		for (unsigned i = 0; i < 64; i += 32) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(buf + off + i));
+			__m256i lo = _mm256_and_si256(v, even);
+			__m256i hi = _mm256_and_si256(_mm256_srli_epi64(v, 1), even);
+
+			u = _mm256_add_epi8(u, bm_popcnt8_avx2(_mm256_andnot_si256(hi, lo)));
+			n = _mm256_add_epi8(n, bm_popcnt8_avx2(_mm256_andnot_si256(lo, hi)));
+			d = _mm256_add_epi8(d, bm_popcnt8_avx2(_mm256_and_si256(lo, hi)));
+		}
+		used = _mm256_add_epi64(used, _mm256_sad_epu8(u, zero));
+		unlinked = _mm256_add_epi64(unlinked, _mm256_sad_epu8(n, zero));
+		dinode = _mm256_add_epi64(dinode, _mm256_sad_epu8(d, zero));
+	}
+	count[GFS2_BLKST_USED] += bm_hsum_avx2(used);
+	count[GFS2_BLKST_UNLINKED] += bm_hsum_avx2(unlinked);
+	count[GFS2_BLKST_DINODE] += bm_hsum_avx2(dinode);
+	bm_count_scalar(buf + off, len - off, count);
+}
+#endif /* __x86_64__ */
+
+static const struct bm_impl bm_impls[] = {
+	[LGFS2_BM_SCALAR] = { "scalar", bm_find_scalar, bm_collect_scalar, bm_count_scalar },
+#ifdef __x86_64__
+	[LGFS2_BM_SSE2] = { "sse2", bm_find_sse2, bm_collect_sse2, bm_count_scalar },
+	[LGFS2_BM_AVX2] = { "avx2", bm_find_avx2, bm_collect_avx2, bm_count_avx2 },
+#endif
+};
+
+static const struct bm_impl *bm_cur;
+
+static int bm_impl_supported(enum lgfs2_bm_impl impl)
+{
+	if (impl >= sizeof(bm_impls) / sizeof(bm_impls[0]) || bm_impls[impl].name == NULL)
+		return 0;
+#ifdef __x86_64__
+	if (impl == LGFS2_BM_AVX2) {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+	}
+#endif
+	return 1;
+}
+
+/* Chosen before main() runs so that threads never race to pick one */
+static void __attribute__((constructor)) bm_impl_init(void)
+{
+	enum lgfs2_bm_impl impl = LGFS2_BM_AVX2;
+
+	while (!bm_impl_supported(impl))
+		impl--;
+	bm_cur = &bm_impls[impl];
+}
+
+/**
+ * Choose the bitmap search implementation, mainly for testing. This must not
+ * be called while other threads are searching bitmaps.
+ * Returns 0 on success or -1 with errno set to ENOTSUP if the CPU doesn't
+ * support it.
  */
+int lgfs2_bm_impl_set(enum lgfs2_bm_impl impl)
+{
+	if (!bm_impl_supported(impl)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	bm_cur = &bm_impls[impl];
+	return 0;
+}
 
-static inline uint64_t gfs2_bit_search(const __le64 *ptr,
-				       unsigned long long mask,
-				       uint8_t state)
+/**
+ * Returns the name of the bitmap search implementation in use.
+ */
+const char *lgfs2_bm_impl_name(void)
 {
-	unsigned long long tmp;
-	static const unsigned long long search[] = {
-		[0] = 0xffffffffffffffffULL,
-		[1] = 0xaaaaaaaaaaaaaaaaULL,
-		[2] = 0x5555555555555555ULL,
-		[3] = 0x0000000000000000ULL,
-	};
-	tmp = le64_to_cpu(*ptr) ^ search[state];
-	tmp &= (tmp >> 1);
-	tmp &= mask;
-	return tmp;
+	return bm_cur->name;
 }
 
 /**
@@ -68,34 +337,55 @@ unsigned long gfs2_bitfit(const unsigned char *buf, const unsigned int len,
 			  unsigned long goal, unsigned char state)
 {
 	uint32_t spoint = (goal << 1) & ((8 * sizeof(uint64_t)) - 1);
-	const __le64 *ptr = ((__le64 *)buf) + (goal >> 5);
-	const __le64 *end = (__le64 *) (buf + ALIGN(len, sizeof(uint64_t)));
+	unsigned off = (goal >> 5) * sizeof(uint64_t);
 	uint64_t tmp;
-	uint64_t mask = 0x5555555555555555ULL;
-	uint32_t bit;
 
 	if (state > 3)
 		return 0;
+	if (off >= len)
+		return BFITNOENT;
 
 	/* Mask off bits we don't care about at the start of the search */
-	mask <<= spoint;
-	tmp = gfs2_bit_search(ptr, mask, state);
-	ptr++;
-	while(tmp == 0 && ptr < end) {
-		tmp = gfs2_bit_search(ptr, 0x5555555555555555ULL, state);
-		ptr++;
-	}
-	/* Mask off any bits which are more than len bytes from the start */
-	if (ptr == end && (len & (sizeof(uint64_t) - 1)))
-		tmp &= (((uint64_t)~0) >>
-			(64 - 8 * (len & (sizeof(uint64_t) - 1))));
-	/* Didn't find anything, so return */
-	if (tmp == 0)
-		return BFITNOENT;
-	ptr--;
-	bit = ffsll(tmp);
-	bit /= 2;	/* two bits per entry in the bitmap */
-	return (((const unsigned char *)ptr - buf) * GFS2_NBBY) + bit;
+	tmp = bm_match_at(buf, off, len, state) & (0x5555555555555555ULL << spoint);
+	if (tmp == 0) {
+		off = bm_cur->find(buf, off + 8, len, state);
+		if (off >= len)
+			return BFITNOENT;
+		/* The partial word at the end, if any, isn't searched by find() */
+		tmp = bm_match_at(buf, off, len, state);
+		if (tmp == 0)
+			return BFITNOENT;
+	}
+	return off * GFS2_NBBY + (__builtin_ctzll(tmp) >> 1);
+}
+
+/**
+ * Find every block in a given state in a bitmap in one pass.
+ * buf, len: The bitmap
+ * state: The state to look for
+ * base: Added to the bitmap-relative block numbers
+ * out: Where to put the block numbers, which must have room for len * GFS2_NBBY
+ * Returns the number of blocks found.
+ */
+unsigned lgfs2_bm_collect(const unsigned char *buf, unsigned len, uint8_t state,
+                          uint64_t base, uint64_t *out)
+{
+	if (state > 3)
+		return 0;
+	return bm_cur->collect(buf, len, state, base, out);
+}
+
+/**
+ * Count the blocks in each state in a bitmap.
+ * buf, len: The bitmap
+ * count: Set to the number of blocks in each state, indexed by GFS2_BLKST_*
+ */
+void lgfs2_bm_count(const unsigned char *buf, unsigned len, uint32_t count[4])
+{
+	count[GFS2_BLKST_USED] = count[GFS2_BLKST_UNLINKED] = count[GFS2_BLKST_DINODE] = 0;
+	bm_cur->count(buf, len, count);
+	count[GFS2_BLKST_FREE] = len * GFS2_NBBY - count[GFS2_BLKST_USED] -
+	                         count[GFS2_BLKST_UNLINKED] - count[GFS2_BLKST_DINODE];
 }
 
 /*
@@ -128,7 +418,7 @@ int gfs2_set_bitmap(lgfs2_rgrp_t rgd, uint64_t blkno, int state)
 	int           buf;
 	uint32_t        rgrp_block;
 	struct gfs2_bitmap *bits = NULL;
-	unsigned char *byte, cur_state;
+	unsigned char *byte, val, cur_state;
 	unsigned int bit;
 
 	/* FIXME: should GFS2_BLKST_INVALID be allowed */
@@ -147,15 +437,27 @@ int gfs2_set_bitmap(lgfs2_rgrp_t rgd, uint64_t blkno, int state)
 
 	if (bits == NULL)
 		return -1;
+
+	/* Other threads may be marking blocks in this resource group and
+	   reading its bitmaps without the lock (see lgfs2_get_bitmap()) */
+	lgfs2_rgrp_lock(rgd);
+	if (lgfs2_rgrp_fault(rgd) != 0) {
+		lgfs2_rgrp_unlock(rgd);
+		return -1;
+	}
 	byte = (unsigned char *)(bits->bi_data + bits->bi_offset) +
 		(rgrp_block/GFS2_NBBY - bits->bi_start);
 	bit = (rgrp_block % GFS2_NBBY) * GFS2_BIT_SIZE;
+	val = *byte;
+	cur_state = (val >> bit) & GFS2_BIT_MASK;
+	val ^= cur_state << bit;
+	val |= state << bit;
+	__atomic_store_n(byte, val, __ATOMIC_RELAXED);
 
-	cur_state = (*byte >> bit) & GFS2_BIT_MASK;
-	*byte ^= cur_state << bit;
-	*byte |= state << bit;
-
+	if ((cur_state == GFS2_BLKST_FREE) != (state == GFS2_BLKST_FREE))
+		lgfs2_rgrp_extents_set(rgd, rgrp_block, state == GFS2_BLKST_FREE);
 	bits->bi_modified = 1;
+	lgfs2_rgrp_unlock(rgd);
 	return 0;
 }
 
@@ -181,6 +483,7 @@ int lgfs2_get_bitmap(struct gfs2_sbd *sdp, uint64_t blkno, struct rgrp_tree *rgd
 	char *byte;
 	unsigned int bit;
 	struct gfs2_bitmap *bi;
+	int state;
 
 	if (rgd == NULL) {
 		rgd = gfs2_blk2rgrpd(sdp, blkno);
@@ -206,11 +509,103 @@ int lgfs2_get_bitmap(struct gfs2_sbd *sdp, uint64_t blkno, struct rgrp_tree *rgd
 	}
 
 	bi = &rgd->bits[i];
+	bit = (offset % GFS2_NBBY) * GFS2_BIT_SIZE;
+	if (rgd->rt_cache != NULL) {
+		/* The bitmaps may be dropped by other threads unless locked */
+		lgfs2_rgrp_lock(rgd);
+		if (lgfs2_rgrp_fault(rgd) != 0) {
+			lgfs2_rgrp_unlock(rgd);
+			return -1;
+		}
+		state = (bi->bi_data[bi->bi_offset + offset / GFS2_NBBY] >> bit) & GFS2_BIT_MASK;
+		lgfs2_rgrp_unlock(rgd);
+		return state;
+	}
 	if (bi->bi_data == NULL)
 		return GFS2_BLKST_FREE;
 
 	byte = (bi->bi_data + bi->bi_offset) + (offset/GFS2_NBBY);
-	bit = (offset % GFS2_NBBY) * GFS2_BIT_SIZE;
 
-	return (*byte >> bit) & GFS2_BIT_MASK;
+	return (__atomic_load_n(byte, __ATOMIC_RELAXED) >> bit) & GFS2_BIT_MASK;
+}
+
+/*
+ * lgfs2_get_bitmaps - get the FS bitmap values of a list of blocks
+ * @sdp: super block
+ * @blks: block numbers relative to file system
+ * @n: number of blocks in blks
+ * @states: array of n entries to hold the states
+ *
+ * Like lgfs2_get_bitmap() for each block, but the resource group and bitmap
+ * are only looked up when a block falls outside of the previous block's
+ * bitmap, so runs of nearby blocks, such as the pointers in an indirect
+ * block, cost little more than the bit extraction. The states are returned
+ * in the order of blks. A block which is not represented in the bitmaps,
+ * including block 0, gets the state -1.
+ *
+ * Returns: the number of blocks with a valid state
+ */
+unsigned lgfs2_get_bitmaps(struct gfs2_sbd *sdp, const uint64_t *blks, unsigned n, int *states)
+{
+	struct rgrp_tree *rgd = NULL;
+	struct rgrp_tree *locked = NULL; /* Held while reading bitmaps loaded on demand */
+	struct gfs2_bitmap *bi = NULL;
+	uint64_t first = 0, end = 0; /* Blocks covered by bi */
+	unsigned valid = 0;
+
+	for (unsigned i = 0; i < n; i++) {
+		uint64_t blk = blks[i];
+		const char *byte;
+		uint64_t offset;
+
+		if (blk == 0) { /* Unused pointers are common, skip the lookup */
+			states[i] = -1;
+			continue;
+		}
+		if (blk < first || blk >= end) {
+			if (rgd == NULL || blk < rgd->rt_data0 || blk - rgd->rt_data0 >= rgd->rt_data)
+				rgd = gfs2_blk2rgrpd(sdp, blk);
+			if (rgd == NULL || blk < rgd->rt_data0 || blk - rgd->rt_data0 >= rgd->rt_data) {
+				states[i] = -1;
+				first = end = 0;
+				continue;
+			}
+			offset = blk - rgd->rt_data0;
+			bi = rgd->bits;
+			while (bi < rgd->bits + rgd->rt_length - 1 &&
+			       offset >= (uint64_t)(bi->bi_start + bi->bi_len) * GFS2_NBBY)
+				bi++;
+			first = rgd->rt_data0 + (uint64_t)bi->bi_start * GFS2_NBBY;
+			end = first + (uint64_t)bi->bi_len * GFS2_NBBY;
+			if (blk >= end) {
+				states[i] = -1;
+				continue;
+			}
+		}
+		if (rgd->rt_cache != NULL && locked != rgd) {
+			if (locked != NULL)
+				lgfs2_rgrp_unlock(locked);
+			lgfs2_rgrp_lock(rgd);
+			if (lgfs2_rgrp_fault(rgd) != 0) {
+				lgfs2_rgrp_unlock(rgd);
+				locked = NULL;
+				states[i] = -1;
+				first = end = 0;
+				continue;
+			}
+			locked = rgd;
+		}
+		valid++;
+		if (bi->bi_data == NULL) {
+			states[i] = GFS2_BLKST_FREE;
+			continue;
+		}
+		offset = blk - first;
+		byte = bi->bi_data + bi->bi_offset + offset / GFS2_NBBY;
+		states[i] = (__atomic_load_n(byte, __ATOMIC_RELAXED) >>
+		             ((offset % GFS2_NBBY) * GFS2_BIT_SIZE)) & GFS2_BIT_MASK;
+	}
+	if (locked != NULL)
+		lgfs2_rgrp_unlock(locked);
+	return valid;
 }
@@ -10,6 +10,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 #include "libgfs2.h"
 #include "rgrp.h"
@@ -30,11 +31,69 @@ static int inode_is_stuffed(const struct gfs2_inode *ip)
 	return !ip->i_height;
 }
 
+/*
+ * The metapath cache of an inode keeps the indirect blocks on the path to the
+ * last block looked up, so that a run of lookups in ascending order only reads
+ * an indirect block when the path moves on to a new one. It is set up by
+ * lgfs2_mpcache_start() and holds on to the buffers until the matching
+ * lgfs2_mpcache_stop(), so the indirect blocks of the inode must not be changed
+ * through other buffers in between.
+ */
+struct lgfs2_mpcache {
+	unsigned mc_users;
+	unsigned mc_valid; /* mc_bh[1] to mc_bh[mc_valid] are in use */
+	struct metapath mc_mp;
+	struct gfs2_buffer_head *mc_bh[GFS2_MAX_META_HEIGHT];
+};
+
+static void mpcache_release(struct gfs2_inode *ip, unsigned height)
+{
+	struct lgfs2_mpcache *mc = ip->i_mpcache;
+
+	while (mc->mc_valid > height) {
+		struct gfs2_buffer_head *bh = mc->mc_bh[mc->mc_valid--];
+
+		if (bh != ip->i_bh)
+			brelse(bh);
+	}
+}
+
+/**
+ * Start caching the metapath of an inode. Calls may be nested.
+ * Returns 0 on success or -1 if the cache could not be allocated, in which
+ * case lookups work as before and lgfs2_mpcache_stop() does nothing.
+ */
+int lgfs2_mpcache_start(struct gfs2_inode *ip)
+{
+	if (ip->i_mpcache == NULL) {
+		ip->i_mpcache = calloc(1, sizeof(*ip->i_mpcache));
+		if (ip->i_mpcache == NULL)
+			return -1;
+	}
+	ip->i_mpcache->mc_users++;
+	return 0;
+}
+
+/**
+ * Stop caching the metapath of an inode, releasing the cached buffers when
+ * the outermost user stops.
+ */
+void lgfs2_mpcache_stop(struct gfs2_inode *ip)
+{
+	struct lgfs2_mpcache *mc = ip->i_mpcache;
+
+	if (mc == NULL || --mc->mc_users > 0)
+		return;
+	mpcache_release(ip, 0);
+	free(mc);
+	ip->i_mpcache = NULL;
+}
+
 struct gfs2_inode *lgfs2_inode_get(struct gfs2_sbd *sdp, struct gfs2_buffer_head *bh)
 {
 	struct gfs2_inode *ip;
 
-	ip = calloc(1, sizeof(struct gfs2_inode));
+	ip = lgfs2_slab_inode_get(sdp);
 	if (ip == NULL) {
 		return NULL;
 	}
@@ -93,6 +152,10 @@ void inode_put(struct gfs2_inode **ip_in)
 	uint64_t block = ip->i_num.in_addr;
 	struct gfs2_sbd *sdp = ip->i_sbd;
 
+	if (ip->i_mpcache != NULL) {
+		ip->i_mpcache->mc_users = 1;
+		lgfs2_mpcache_stop(ip);
+	}
 	if (ip->i_bh != NULL) {
 		if (ip->i_bh->b_modified) {
 			lgfs2_dinode_out(ip, ip->i_bh->b_data);
@@ -103,31 +166,20 @@ void inode_put(struct gfs2_inode **ip_in)
 			brelse(ip->i_bh);
 		ip->i_bh = NULL;
 	}
-	free(ip);
+	lgfs2_slab_inode_put(ip);
 	*ip_in = NULL; /* make sure the memory isn't accessed again */
 }
 
 static uint64_t find_free_block(struct rgrp_tree *rgd)
 {
-	unsigned bm;
-	uint64_t blkno = 0;
+	uint64_t blkno;
 
 	if (rgd == NULL || rgd->rt_free == 0) {
 		errno = ENOSPC;
 		return 0;
 	}
-
-	for (bm = 0; bm < rgd->rt_length; bm++) {
-		unsigned long blk = 0;
-		struct gfs2_bitmap *bits = &rgd->bits[bm];
-
-		blk = gfs2_bitfit((uint8_t *)bits->bi_data + bits->bi_offset,
-		                  bits->bi_len, blk, GFS2_BLKST_FREE);
-		if (blk != BFITNOENT) {
-			blkno = blk + (bits->bi_start * GFS2_NBBY) + rgd->rt_data0;
-			break;
-		}
-	}
+	if (lgfs2_rgrp_extent_find(rgd, rgd->rt_data0, 1, &blkno, NULL) != 0)
+		return 0;
 	return blkno;
 }
 
@@ -147,11 +199,8 @@ static int blk_alloc_in_rg(struct gfs2_sbd *sdp, unsigned state, struct rgrp_tre
 	}
 
 	rgd->rt_free--;
-	if (sdp->gfs1)
-		lgfs2_gfs_rgrp_out(rgd, rgd->bits[0].bi_data);
-	else
-		lgfs2_rgrp_out(rgd, rgd->bits[0].bi_data);
-	rgd->bits[0].bi_modified = 1;
+	if (lgfs2_rgrp_hdr_update(sdp, rgd) != 0)
+		return -1;
 	sdp->blks_alloced++;
 	return 0;
 }
@@ -177,7 +226,10 @@ static int block_alloc(struct gfs2_sbd *sdp, const uint64_t blksreq, int state,
 	if (rgt == NULL)
 		return -1;
 
-	if (rgt->bits[0].bi_data == NULL) {
+	if (rgt->rt_cache != NULL) {
+		if (lgfs2_rgrp_pin(rgt))
+			return -1;
+	} else if (rgt->bits[0].bi_data == NULL) {
 		if (gfs2_rgrp_read(sdp, rgt))
 			return -1;
 		release = 1;
@@ -187,6 +239,8 @@ static int block_alloc(struct gfs2_sbd *sdp, const uint64_t blksreq, int state,
 	ret = blk_alloc_in_rg(sdp, state, rgt, bn, dinode);
 	if (release)
 		gfs2_rgrp_relse(sdp, rgt);
+	else
+		lgfs2_rgrp_unpin(rgt);
 	*blkno = bn;
 	return ret;
 }
@@ -384,6 +438,10 @@ void build_height(struct gfs2_inode *ip, int height)
 	unsigned int x;
 	int new_block;
 
+	/* The indirect blocks move down a level */
+	if (ip->i_mpcache != NULL)
+		mpcache_release(ip, 0);
+
 	while (ip->i_height < height) {
 		new_block = 0;
 		bp = (uint64_t *)(ip->i_bh->b_data + sizeof(struct gfs2_dinode));
@@ -461,6 +519,67 @@ void lookup_block(struct gfs2_inode *ip, struct gfs2_buffer_head *bh,
 	*new = 1;
 }
 
+/**
+ * Find the buffer of the block at the given height on the metapath mp,
+ * allocating the missing indirect blocks above it if create is set, in which
+ * case *new is set if any were allocated. Height 0 is the dinode.
+ * Returns NULL if a block is missing. The buffer must be released with
+ * lgfs2_metapath_put().
+ */
+struct gfs2_buffer_head *lgfs2_metapath_get(struct gfs2_inode *ip, struct metapath *mp,
+                                            unsigned height, int create, int *new)
+{
+	struct lgfs2_mpcache *mc = ip->i_mpcache;
+	struct gfs2_buffer_head *bh = ip->i_bh;
+	uint64_t block;
+	unsigned x = 0;
+
+	if (mc != NULL) {
+		while (x < mc->mc_valid && x < height && mc->mc_mp.mp_list[x] == mp->mp_list[x])
+			x++;
+		if (x < height)
+			mpcache_release(ip, x);
+		if (x > 0)
+			bh = mc->mc_bh[x];
+	}
+	for (; x < height; x++) {
+		lookup_block(ip, bh, x, mp, create, new, &block);
+		if (mc == NULL && bh != ip->i_bh)
+			brelse(bh);
+		if (!block)
+			return NULL;
+
+		if (*new) {
+			struct gfs2_meta_header mh = {
+				.mh_magic = cpu_to_be32(GFS2_MAGIC),
+				.mh_type = cpu_to_be32(GFS2_METATYPE_IN),
+				.mh_format = cpu_to_be32(GFS2_FORMAT_IN)
+			};
+			bh = bget(ip->i_sbd, block);
+			memcpy(bh->b_data, &mh, sizeof(mh));
+			bmodified(bh);
+		} else if (block == ip->i_num.in_addr) {
+			bh = ip->i_bh;
+		} else {
+			bh = bread(ip->i_sbd, block);
+			if (bh == NULL)
+				return NULL;
+		}
+		if (mc != NULL) {
+			mc->mc_mp.mp_list[x] = mp->mp_list[x];
+			mc->mc_bh[x + 1] = bh;
+			mc->mc_valid = x + 1;
+		}
+	}
+	return bh;
+}
+
+void lgfs2_metapath_put(struct gfs2_inode *ip, struct gfs2_buffer_head *bh)
+{
+	if (ip->i_mpcache == NULL && bh != ip->i_bh)
+		brelse(bh);
+}
+
 void block_map(struct gfs2_inode *ip, uint64_t lblock, int *new,
 	       uint64_t *dblock, uint32_t *extlen, int prealloc)
 {
@@ -471,7 +590,6 @@ void block_map(struct gfs2_inode *ip, uint64_t lblock, int *new,
 	unsigned int bsize;
 	unsigned int height;
 	unsigned int end_of_metadata;
-	unsigned int x;
 
 	*new = 0;
 	*dblock = 0;
@@ -500,34 +618,14 @@ void block_map(struct gfs2_inode *ip, uint64_t lblock, int *new,
 	find_metapath(ip, lblock, &mp);
 	end_of_metadata = ip->i_height - 1;
 
-	bh = ip->i_bh;
-
-	for (x = 0; x < end_of_metadata; x++) {
-		lookup_block(ip, bh, x, &mp, create, new, dblock);
-		if (bh != ip->i_bh)
-			brelse(bh);
-		if (!*dblock)
-			return;
-
-		if (*new) {
-			struct gfs2_meta_header mh = {
-				.mh_magic = cpu_to_be32(GFS2_MAGIC),
-				.mh_type = cpu_to_be32(GFS2_METATYPE_IN),
-				.mh_format = cpu_to_be32(GFS2_FORMAT_IN)
-			};
-			bh = bget(sdp, *dblock);
-			memcpy(bh->b_data, &mh, sizeof(mh));
-			bmodified(bh);
-		} else {
-			if (*dblock == ip->i_num.in_addr)
-				bh = ip->i_bh;
-			else
-				bh = bread(sdp, *dblock);
-		}
-	}
+	bh = lgfs2_metapath_get(ip, &mp, end_of_metadata, create, new);
+	if (bh == NULL)
+		return;
 
 	if (!prealloc)
 		lookup_block(ip, bh, end_of_metadata, &mp, create, new, dblock);
+	else if (end_of_metadata > 0)
+		*dblock = bh->b_blocknr;
 
 	if (extlen && *dblock) {
 		*extlen = 1;
@@ -551,8 +649,7 @@ void block_map(struct gfs2_inode *ip, uint64_t lblock, int *new,
 		}
 	}
 
-	if (bh != ip->i_bh)
-		brelse(bh);
+	lgfs2_metapath_put(ip, bh);
 }
 
 static void
@@ -569,6 +666,122 @@ copy2mem(struct gfs2_buffer_head *bh, void **buf, unsigned int offset,
 	*p += size;
 }
 
+/*
+ * A run of consecutive whole blocks which gfs2_readi() and __gfs2_writei()
+ * transfer with a single vectored I/O, straight to or from the caller's
+ * buffer. Each block's data follows the previous block's in the buffer. For
+ * journaled data, which has a meta header in each block, the headers get
+ * iovecs of their own.
+ */
+#define IO_RUN_IOVS (256)
+
+struct io_run {
+	uint64_t ir_start;
+	unsigned ir_count;
+	unsigned ir_hdr;  /* Size of the header in each block */
+	void *ir_hdrbuf;  /* The header to write, or where to read the headers */
+	char *ir_buf;     /* Data of the first block */
+	int ir_iovcnt;
+	struct iovec ir_iov[IO_RUN_IOVS];
+};
+
+/*
+ * Blocks in the block cache go through buffer heads, to pick up changes
+ * which haven't been written back. O_DIRECT would need the caller's buffer to
+ * be aligned.
+ */
+static int io_run_ok(struct gfs2_sbd *sdp, uint64_t blk)
+{
+	return !sdp->dio_align && !lgfs2_bcache_cached(sdp, blk);
+}
+
+/**
+ * Add a block to the run. Returns 0 if it doesn't fit, in which case the run
+ * must be flushed first.
+ */
+static int io_run_add(struct io_run *run, uint64_t blk, char *data, unsigned len)
+{
+	struct iovec *iov = &run->ir_iov[run->ir_iovcnt];
+
+	if (run->ir_count == 0) {
+		run->ir_start = blk;
+		run->ir_buf = data;
+	} else if (blk != run->ir_start + run->ir_count ||
+	           run->ir_iovcnt + 2 > IO_RUN_IOVS) {
+		return 0;
+	}
+	if (run->ir_hdr) {
+		iov->iov_base = run->ir_hdrbuf;
+		iov->iov_len = run->ir_hdr;
+		iov++;
+		run->ir_iovcnt++;
+	} else if (run->ir_iovcnt > 0 && (char *)iov[-1].iov_base + iov[-1].iov_len == data) {
+		iov[-1].iov_len += len;
+		run->ir_count++;
+		return 1;
+	}
+	iov->iov_base = data;
+	iov->iov_len = len;
+	run->ir_iovcnt++;
+	run->ir_count++;
+	return 1;
+}
+
+static void io_run_read(struct gfs2_sbd *sdp, struct io_run *run)
+{
+	size_t size = (size_t)run->ir_count * sdp->sd_bsize;
+	unsigned len = sdp->sd_bsize - run->ir_hdr;
+	struct timespec start;
+	ssize_t ret;
+
+	if (run->ir_count == 0)
+		return;
+	if (sdp->readahead != NULL)
+		clock_gettime(CLOCK_MONOTONIC, &start);
+	lgfs2_iostats_site(__FUNCTION__, __LINE__);
+	ret = lgfs2_dev_preadv(sdp, run->ir_iov, run->ir_iovcnt, run->ir_start * sdp->sd_bsize);
+	if (ret == size) {
+		lgfs2_ra_note(sdp, run->ir_start, run->ir_count, &start);
+	} else {
+		/* Let bread() report the error, zeroing the blocks it can't read */
+		for (unsigned i = 0; i < run->ir_count; i++) {
+			struct gfs2_buffer_head *bh = bread(sdp, run->ir_start + i);
+			void *p = run->ir_buf + (size_t)i * len;
+
+			copy2mem(bh, &p, run->ir_hdr, len);
+			if (bh)
+				brelse(bh);
+		}
+	}
+	run->ir_count = 0;
+	run->ir_iovcnt = 0;
+}
+
+static void io_run_write(struct gfs2_sbd *sdp, struct io_run *run)
+{
+	size_t size = (size_t)run->ir_count * sdp->sd_bsize;
+	unsigned len = sdp->sd_bsize - run->ir_hdr;
+	ssize_t ret;
+
+	if (run->ir_count == 0)
+		return;
+	lgfs2_iostats_site(__FUNCTION__, __LINE__);
+	ret = lgfs2_dev_pwritev(sdp, run->ir_iov, run->ir_iovcnt, run->ir_start * sdp->sd_bsize);
+	if (ret != size) {
+		/* Write them through buffer heads, which report any errors */
+		for (unsigned i = 0; i < run->ir_count; i++) {
+			struct gfs2_buffer_head *bh = bget(sdp, run->ir_start + i);
+
+			memcpy(bh->b_data, run->ir_hdrbuf, run->ir_hdr);
+			memcpy(bh->b_data + run->ir_hdr, run->ir_buf + (size_t)i * len, len);
+			bmodified(bh);
+			brelse(bh);
+		}
+	}
+	run->ir_count = 0;
+	run->ir_iovcnt = 0;
+}
+
 int gfs2_readi(struct gfs2_inode *ip, void *buf,
 			   uint64_t offset, unsigned int size)
 {
@@ -582,6 +795,8 @@ int gfs2_readi(struct gfs2_inode *ip, void *buf,
 	int isdir = !!(S_ISDIR(ip->i_mode));
 	int journaled = ip->i_flags & GFS2_DIF_JDATA;
 	int copied = 0;
+	struct gfs2_meta_header mh;
+	struct io_run run = { .ir_hdrbuf = &mh };
 
 	if (offset >= ip->i_size)
 		return 0;
@@ -596,6 +811,7 @@ int gfs2_readi(struct gfs2_inode *ip, void *buf,
 		lblock = offset;
 		o = lblock % sdp->sd_jbsize;
 		lblock /= sdp->sd_jbsize;
+		run.ir_hdr = sizeof(struct gfs2_meta_header);
 	} else {
 		lblock = offset >> sdp->sd_bsize_shift;
 		o = offset & (sdp->sd_bsize - 1);
@@ -603,9 +819,10 @@ int gfs2_readi(struct gfs2_inode *ip, void *buf,
 
 	if (inode_is_stuffed(ip))
 		o += sizeof(struct gfs2_dinode);
-	else if ((sdp->gfs1 && journaled) || (!sdp->gfs1 && isdir))
-		o += sizeof(struct gfs2_meta_header);
+	else
+		o += run.ir_hdr;
 
+	lgfs2_mpcache_start(ip);
 	while (copied < size) {
 		amount = size - copied;
 		if (amount > sdp->sd_bsize - o)
@@ -620,28 +837,38 @@ int gfs2_readi(struct gfs2_inode *ip, void *buf,
 					  &extlen, 0);
 		}
 
-		if (dblock) {
-			if (dblock == ip->i_num.in_addr)
-				bh = ip->i_bh;
-			else
-				bh = bread(sdp, dblock);
+		if (dblock && dblock != ip->i_num.in_addr && o == run.ir_hdr &&
+		    amount == sdp->sd_bsize - o && io_run_ok(sdp, dblock)) {
+			/* Whole block, read it straight into buf */
+			if (!io_run_add(&run, dblock, buf, amount)) {
+				io_run_read(sdp, &run);
+				io_run_add(&run, dblock, buf, amount);
+			}
+			buf = (char *)buf + amount;
 			dblock++;
 			extlen--;
-		} else
-			bh = NULL;
+		} else {
+			if (dblock) {
+				if (dblock == ip->i_num.in_addr)
+					bh = ip->i_bh;
+				else
+					bh = bread(sdp, dblock);
+				dblock++;
+				extlen--;
+			} else
+				bh = NULL;
 
-		copy2mem(bh, &buf, o, amount);
-		if (bh && bh != ip->i_bh)
-			brelse(bh);
+			copy2mem(bh, &buf, o, amount);
+			if (bh && bh != ip->i_bh)
+				brelse(bh);
+		}
 
 		copied += amount;
 		lblock++;
-
-		if (sdp->gfs1)
-			o = (journaled) ? sizeof(struct gfs2_meta_header) : 0;
-		else
-			o = (isdir) ? sizeof(struct gfs2_meta_header) : 0;
+		o = run.ir_hdr;
 	}
+	io_run_read(sdp, &run);
+	lgfs2_mpcache_stop(ip);
 
 	return copied;
 }
@@ -669,6 +896,12 @@ int __gfs2_writei(struct gfs2_inode *ip, void *buf,
 	int isdir = !!(S_ISDIR(ip->i_mode));
 	const uint64_t start = offset;
 	int copied = 0;
+	struct gfs2_meta_header mh = {
+		.mh_magic = cpu_to_be32(GFS2_MAGIC),
+		.mh_type = cpu_to_be32(GFS2_METATYPE_JD),
+		.mh_format = cpu_to_be32(GFS2_FORMAT_JD),
+	};
+	struct io_run run = { .ir_hdrbuf = &mh };
 
 	if (!size)
 		return 0;
@@ -681,6 +914,7 @@ int __gfs2_writei(struct gfs2_inode *ip, void *buf,
 		lblock = offset;
 		o = lblock % sdp->sd_jbsize;
 		lblock /= sdp->sd_jbsize;
+		run.ir_hdr = sizeof(struct gfs2_meta_header);
 	} else {
 		lblock = offset >> sdp->sd_bsize_shift;
 		o = offset & (sdp->sd_bsize - 1);
@@ -688,9 +922,10 @@ int __gfs2_writei(struct gfs2_inode *ip, void *buf,
 
 	if (inode_is_stuffed(ip))
 		o += sizeof(struct gfs2_dinode);
-	else if (isdir)
-		o += sizeof(struct gfs2_meta_header);
+	else
+		o += run.ir_hdr;
 
+	lgfs2_mpcache_start(ip);
 	while (copied < size) {
 		amount = size - copied;
 		if (amount > sdp->sd_bsize - o)
@@ -701,34 +936,44 @@ int __gfs2_writei(struct gfs2_inode *ip, void *buf,
 			block_map(ip, lblock, &new, &dblock, &extlen, 0);
 		}
 
-		if (new) {
-			bh = bget(sdp, dblock);
-			if (isdir) {
-				struct gfs2_meta_header mh = {
-					.mh_magic = cpu_to_be32(GFS2_MAGIC),
-					.mh_type = cpu_to_be32(GFS2_METATYPE_JD),
-					.mh_format = cpu_to_be32(GFS2_FORMAT_JD),
-				};
-				memcpy(bh->b_data, &mh, sizeof(mh));
-				bmodified(bh);
+		/* The whole block is written, including the header of a new
+		   directory block. Existing directory blocks keep their
+		   headers so they go through a buffer. */
+		if (dblock != ip->i_num.in_addr && o == run.ir_hdr &&
+		    amount == sdp->sd_bsize - o && (new || !isdir) &&
+		    io_run_ok(sdp, dblock)) {
+			if (!io_run_add(&run, dblock, buf, amount)) {
+				io_run_write(sdp, &run);
+				io_run_add(&run, dblock, buf, amount);
 			}
+			buf = (char *)buf + amount;
 		} else {
-			if (dblock == ip->i_num.in_addr)
-				bh = ip->i_bh;
-			else
-				bh = bread(sdp, dblock);
+			if (new) {
+				bh = bget(sdp, dblock);
+				if (isdir) {
+					memcpy(bh->b_data, &mh, sizeof(mh));
+					bmodified(bh);
+				}
+			} else {
+				if (dblock == ip->i_num.in_addr)
+					bh = ip->i_bh;
+				else
+					bh = bread(sdp, dblock);
+			}
+			copy_from_mem(bh, &buf, o, amount);
+			if (bh != ip->i_bh)
+				brelse(bh);
 		}
-		copy_from_mem(bh, &buf, o, amount);
-		if (bh != ip->i_bh)
-			brelse(bh);
 
 		copied += amount;
 		lblock++;
 		dblock++;
 		extlen--;
 
-		o = (isdir) ? sizeof(struct gfs2_meta_header) : 0;
+		o = run.ir_hdr;
 	}
+	io_run_write(sdp, &run);
+	lgfs2_mpcache_stop(ip);
 
 	if (resize && ip->i_size < start + copied) {
 		bmodified(ip->i_bh);
@@ -1476,13 +1721,13 @@ int lgfs2_write_filemeta(struct gfs2_inode *ip)
 			}
 			lgfs2_fill_indir(start, bh->b_data + sdp->sd_bsize, ptr0, ptrs, &p);
 			if (bwrite(bh)) {
-				free(bh);
+				lgfs2_bh_discard(bh);
 				return 1;
 			}
 		}
 		ptr0 += ptrs;
 	}
-	free(bh);
+	lgfs2_bh_discard(bh);
 	return 0;
 }
 
@@ -1905,11 +2150,7 @@ void gfs2_free_block(struct gfs2_sbd *sdp, uint64_t block)
 	if (rgd) {
 		gfs2_set_bitmap(rgd, block, GFS2_BLKST_FREE);
 		rgd->rt_free++; /* adjust the free count */
-		if (sdp->gfs1)
-			lgfs2_gfs_rgrp_out(rgd, rgd->bits[0].bi_data);
-		else
-			lgfs2_rgrp_out(rgd, rgd->bits[0].bi_data);
-		rgd->bits[0].bi_modified = 1;
+		lgfs2_rgrp_hdr_update(sdp, rgd);
 		sdp->blks_alloced--;
 	}
 }
@@ -1976,11 +2217,7 @@ int gfs2_freedi(struct gfs2_sbd *sdp, uint64_t diblock)
 	sdp->blks_alloced--;
 	rgd->rt_free++;
 	rgd->rt_dinodes--;
-	if (sdp->gfs1)
-		lgfs2_gfs_rgrp_out(rgd, rgd->bits[0].bi_data);
-	else
-		lgfs2_rgrp_out(rgd, rgd->bits[0].bi_data);
-	rgd->bits[0].bi_modified = 1;
+	lgfs2_rgrp_hdr_update(sdp, rgd);
 	sdp->dinodes_alloced--;
 	return 0;
 }
@@ -250,7 +250,7 @@ static struct gfs2_inode *__gfs_inode_get(struct gfs2_sbd *sdp, char *buf)
 	struct gfs_dinode *di;
 	struct gfs2_inode *ip;
 
-	ip = calloc(1, sizeof(struct gfs2_inode));
+	ip = lgfs2_slab_inode_get(sdp);
 	if (ip == NULL) {
 		return NULL;
 	}
@@ -297,7 +297,7 @@ struct gfs2_inode *lgfs2_gfs_inode_read(struct gfs2_sbd *sdp, uint64_t di_addr)
 	bh = bget(sdp, di_addr);
 	if (bh == NULL)
 		return NULL;
-	if (pread(sdp->device_fd, bh->b_data, sdp->sd_bsize, di_addr * sdp->sd_bsize) != sdp->sd_bsize) {
+	if (lgfs2_dev_pread(sdp, bh->b_data, sdp->sd_bsize, di_addr * sdp->sd_bsize) != sdp->sd_bsize) {
 		brelse(bh);
 		return NULL;
 	}
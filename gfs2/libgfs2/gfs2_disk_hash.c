@@ -1,6 +1,7 @@
 #include "clusterautoconfig.h"
 
 #include <stdio.h>
+#include <stdint.h>
 #include "libgfs2.h"
 
 static const uint32_t crc_32_tab[] =
@@ -59,16 +60,82 @@ static const uint32_t crc_32_tab[] =
  * Returns: the hash
  */
 
-uint32_t gfs2_disk_hash(const char *data, int len)
+
+/* Slicing-by-8 tables, the first one being crc_32_tab */
+static uint32_t crc_32_slice[8][256];
+
+static void __attribute__((constructor)) disk_hash_init(void)
 {
-	uint32_t hash = 0xFFFFFFFF;
+	for (int i = 0; i < 256; i++) {
+		uint32_t crc = crc_32_tab[i];
 
-	for (; len--; data++)
-		hash = crc_32_tab[(hash ^ *data) & 0xFF] ^ (hash >> 8);
+		crc_32_slice[0][i] = crc;
+		for (int k = 1; k < 8; k++) {
+			crc = crc_32_tab[crc & 0xff] ^ (crc >> 8);
+			crc_32_slice[k][i] = crc;
+		}
+	}
+}
 
-	hash = ~hash;
+static inline uint32_t disk_hash_slice8(uint32_t hash, const unsigned char *data)
+{
+	uint32_t (*t)[256] = crc_32_slice;
+
+	hash ^= data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+	return t[7][hash & 0xff] ^ t[6][(hash >> 8) & 0xff] ^
+	       t[5][(hash >> 16) & 0xff] ^ t[4][hash >> 24] ^
+	       t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+}
 
+static uint32_t disk_hash_update(uint32_t hash, const unsigned char *data, unsigned len)
+{
+	uint32_t (*t)[256] = crc_32_slice;
+
+	for (; len >= 8; len -= 8, data += 8)
+		hash = disk_hash_slice8(hash, data);
+	if (len >= 4) {
+		hash ^= data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+		hash = t[3][hash & 0xff] ^ t[2][(hash >> 8) & 0xff] ^
+		       t[1][(hash >> 16) & 0xff] ^ t[0][hash >> 24];
+		data += 4;
+		len -= 4;
+	}
+	for (; len--; data++)
+		hash = crc_32_tab[(hash ^ *data) & 0xFF] ^ (hash >> 8);
 	return hash;
 }
 
+uint32_t gfs2_disk_hash(const char *data, int len)
+{
+	return ~disk_hash_update(0xFFFFFFFF, (const unsigned char *)data, len);
+}
+
+/**
+ * lgfs2_dirent_hashes - Hash the names of the entries in a directory block
+ * @buf: The first directory entry in the block
+ * @len: The number of bytes from buf to the end of the block
+ * @hashes: Array to hold the gfs2_disk_hash() of each entry's name, in order
+ * @max: The number of entries in hashes
+ *
+ * The walk stops at the end of the block or at an entry whose record length
+ * is too short for its name. The hashes don't depend on each other, so the
+ * cpu overlaps them.
+ *
+ * Returns: the number of entries hashed
+ */
+unsigned lgfs2_dirent_hashes(const char *buf, unsigned len, uint32_t *hashes, unsigned max)
+{
+	unsigned off = 0, n = 0;
+
+	while (n < max && off + sizeof(struct gfs2_dirent) <= len) {
+		const struct gfs2_dirent *dent = (const struct gfs2_dirent *)(buf + off);
+		unsigned rec_len = be16_to_cpu(dent->de_rec_len);
+		unsigned name_len = be16_to_cpu(dent->de_name_len);
 
+		if (rec_len < sizeof(*dent) + name_len || off + sizeof(*dent) + name_len > len)
+			break;
+		hashes[n++] = ~disk_hash_update(0xFFFFFFFF, (const unsigned char *)(dent + 1), name_len);
+		off += rec_len;
+	}
+	return n;
+}
@@ -13,6 +13,8 @@ static void usage(const char *cmd)
 	printf("  -f <script_path>  Path to script file or '-' for stdin (the default)\n");
 	printf("  -T                Print a list of gfs2 structure types and exit\n");
 	printf("  -F <type>         Print a list of fields belonging to a type and exit\n");
+	printf("<fs_path> may be prefixed with mmap:, memfd: or savemeta: to read an image\n");
+	printf("file through a mapping, a copy in memory or a savemeta file respectively.\n");
 }
 
 struct cmdopts {
@@ -106,30 +108,26 @@ static int getopts(int argc, char *argv[], struct cmdopts *opts)
 
 static int openfs(const char *path, struct gfs2_sbd *sdp)
 {
-	int fd;
 	int ret;
 	int ok;
 	uint64_t count;
 
-	fd = open(path, O_RDWR);
-	if (fd < 0) {
-		fprintf(stderr, "Failed to open %s\n", path);
+	memset(sdp, 0, sizeof(*sdp));
+	ret = lgfs2_dev_open(sdp, path, O_RDWR);
+	/* Read-only backends can still be queried */
+	if (ret != 0 && errno == EROFS)
+		ret = lgfs2_dev_open(sdp, path, O_RDONLY);
+	if (ret != 0) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
 		return 1;
 	}
 
-	memset(sdp, 0, sizeof(*sdp));
 	sdp->sd_bsize = GFS2_BASIC_BLOCK;
-	sdp->device_fd = fd;
 	ret = compute_constants(sdp);
 	if (ret != 0) {
 		perror("Bad constants");
 		return 1;
 	}
-	ret = lgfs2_get_dev_info(fd, &sdp->dinfo);
-	if (ret != 0) {
-		perror("Failed to gather device info");
-		return 1;
-	}
 	fix_device_geometry(sdp);
 
 	ret = read_sb(sdp);
@@ -0,0 +1,302 @@
+#include "clusterautoconfig.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libgfs2.h"
+
+/*
+ * Optional accounting of device I/O by call site. Programs which support it
+ * call lgfs2_iostats_init() to turn it on when LGFS2_IOSTATS is set to the
+ * path of a file, or call lgfs2_iostats_enable() themselves. The statistics
+ * are written to the file when the program exits and whenever it receives
+ * SIGUSR1. SIGUSR1 is blocked and waited for by a thread of our own, so it is
+ * only used when a path is given and the dump doesn't wait for the next I/O.
+ * gfs2_grow and gfs2_jadd don't support it: they catch SIGUSR1 to unmount
+ * their private metafs mount, and their I/O goes through that mount rather
+ * than through libgfs2.
+ *
+ * Every read and write which goes through the lgfs2_dev_*() functions or the
+ * io_uring read engine is counted. The call site is the caller of bread(),
+ * breadm(), bwrite() or brelse() which caused the I/O, the caller of
+ * lgfs2_aio_read(), lgfs2_aio_bread() or lgfs2_aio_breadm() which queued it,
+ * or the lgfs2_dev_*() function itself for direct callers. Buffers written
+ * back by the block cache are counted against the block cache.
+ *
+ * The call site is remembered per thread and the table is protected by a
+ * mutex, so threads can do I/O at the same time.
+ *
+ * The file has a line for each call site with tab separated fields, as
+ * described by its header line. The latency fields count the I/Os which took
+ * less than the number of microseconds in the field name, the last one
+ * counting the rest. An I/O is sequential if it starts where the previous one
+ * ended.
+ */
+
+#define IOSTATS_SITES (1024) /* Must be a power of two */
+
+struct iostats_site {
+	const char *is_func;
+	int is_line;
+	uint64_t is_count[2]; /* Indexed by LGFS2_IOSTATS_READ/WRITE */
+	uint64_t is_bytes[2];
+	uint64_t is_seq;
+	uint64_t is_random;
+	uint64_t is_errors;
+	uint64_t is_lat[LGFS2_IOSTATS_BUCKETS];
+};
+
+int lgfs2_iostats_on = 0;
+
+static pthread_mutex_t iostats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct iostats_site *iostats_sites;
+static unsigned iostats_nsites;
+static char *iostats_path;
+static __thread const char *cur_func;
+static __thread int cur_line;
+static off_t last_end = -1;
+
+/* Used when the table is full */
+static struct iostats_site other_site = { .is_func = "(other)" };
+
+static int iostats_write(const char *path);
+
+static void *iostats_sigwait(void *arg)
+{
+	sigset_t *set = arg;
+	int sig;
+
+	while (sigwait(set, &sig) == 0) {
+		pthread_mutex_lock(&iostats_lock);
+		if (iostats_path != NULL)
+			iostats_write(iostats_path);
+		pthread_mutex_unlock(&iostats_lock);
+	}
+	return NULL;
+}
+
+/* Block SIGUSR1 and start a thread to dump the statistics when it arrives */
+static int iostats_sigwait_start(void)
+{
+	static sigset_t set;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int err;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	err = pthread_sigmask(SIG_BLOCK, &set, NULL);
+	if (err == 0)
+		err = pthread_attr_init(&attr);
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&thread, &attr, iostats_sigwait, &set);
+	pthread_attr_destroy(&attr);
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+static void iostats_exit(void)
+{
+	pthread_mutex_lock(&iostats_lock);
+	if (iostats_path != NULL)
+		iostats_write(iostats_path);
+	pthread_mutex_unlock(&iostats_lock);
+}
+
+/**
+ * Start accounting I/O by call site. The statistics are written to path when
+ * the program exits or receives SIGUSR1, or when lgfs2_iostats_dump() is
+ * called. If path is NULL they are only written by lgfs2_iostats_dump().
+ * Given a path, this blocks SIGUSR1 in the calling thread, so it must be
+ * called before any other threads are started, and the program must not
+ * handle SIGUSR1 itself.
+ * Returns 0 on success or -1 with errno set.
+ */
+int lgfs2_iostats_enable(const char *path)
+{
+	static int exit_registered = 0;
+	static int sigwait_started = 0;
+	char *newpath = NULL;
+
+	if (iostats_sites == NULL) {
+		iostats_sites = calloc(IOSTATS_SITES, sizeof(*iostats_sites));
+		if (iostats_sites == NULL)
+			return -1;
+	}
+	if (path != NULL) {
+		newpath = strdup(path);
+		if (newpath == NULL)
+			return -1;
+		if (!sigwait_started) {
+			if (iostats_sigwait_start() != 0) {
+				free(newpath);
+				return -1;
+			}
+			sigwait_started = 1;
+		}
+		if (!exit_registered && atexit(iostats_exit) == 0)
+			exit_registered = 1;
+	}
+	pthread_mutex_lock(&iostats_lock);
+	free(iostats_path);
+	iostats_path = newpath;
+	pthread_mutex_unlock(&iostats_lock);
+	lgfs2_iostats_on = 1;
+	return 0;
+}
+
+/**
+ * Turn on I/O accounting if LGFS2_IOSTATS is set to the path of a file. The
+ * same rules apply as for lgfs2_iostats_enable().
+ * Returns 0 on success or if LGFS2_IOSTATS isn't set, or -1 with errno set.
+ */
+int lgfs2_iostats_init(void)
+{
+	const char *path = getenv("LGFS2_IOSTATS");
+
+	if (path == NULL || *path == '\0')
+		return 0;
+	return lgfs2_iostats_enable(path);
+}
+
+/**
+ * Set the call site for the next I/O. Used by the functions which do I/O on
+ * behalf of their callers.
+ */
+void lgfs2_iostats_site(const char *func, int line)
+{
+	cur_func = func;
+	cur_line = line;
+}
+
+static struct iostats_site *site_get(const char *func, int line)
+{
+	uintptr_t h = ((uintptr_t)func * 31 + line) * 0x9e3779b97f4a7c15ULL;
+	unsigned i = (h >> 32) & (IOSTATS_SITES - 1);
+
+	for (unsigned n = 0; n < IOSTATS_SITES; n++, i = (i + 1) & (IOSTATS_SITES - 1)) {
+		struct iostats_site *is = &iostats_sites[i];
+
+		if (is->is_func == func && is->is_line == line)
+			return is;
+		if (is->is_func == NULL) {
+			if (iostats_nsites == IOSTATS_SITES - 1)
+				break;
+			is->is_func = func;
+			is->is_line = line;
+			iostats_nsites++;
+			return is;
+		}
+	}
+	return &other_site;
+}
+
+/**
+ * Account for an I/O of bytes at offset which was started at start. ret is
+ * the return value of the read or write. The I/O is counted against the site
+ * set with lgfs2_iostats_site(), or func if there is none.
+ */
+void lgfs2_iostats_account(int rw, off_t offset, ssize_t ret, const struct timespec *start,
+                           const char *func, int line)
+{
+	struct iostats_site *is;
+	struct timespec now;
+	uint64_t us;
+	unsigned b = 0;
+
+	if (!lgfs2_iostats_on)
+		return;
+	if (cur_func != NULL) {
+		func = cur_func;
+		line = cur_line;
+		cur_func = NULL;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = ((now.tv_sec - start->tv_sec) * 1000000000ULL + now.tv_nsec - start->tv_nsec) / 1000;
+	while (us > 0 && b < LGFS2_IOSTATS_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+	pthread_mutex_lock(&iostats_lock);
+	is = site_get(func, line);
+	is->is_lat[b]++;
+	is->is_count[rw]++;
+	if (ret < 0) {
+		is->is_errors++;
+		ret = 0;
+	}
+	is->is_bytes[rw] += ret;
+	if (offset == last_end)
+		is->is_seq++;
+	else
+		is->is_random++;
+	last_end = offset + ret;
+	pthread_mutex_unlock(&iostats_lock);
+}
+
+static void site_print(FILE *f, const struct iostats_site *is)
+{
+	fprintf(f, "%s\t%d\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64,
+	        is->is_func, is->is_line, is->is_count[LGFS2_IOSTATS_READ],
+	        is->is_count[LGFS2_IOSTATS_WRITE], is->is_bytes[LGFS2_IOSTATS_READ],
+	        is->is_bytes[LGFS2_IOSTATS_WRITE], is->is_seq, is->is_random, is->is_errors);
+	for (unsigned b = 0; b < LGFS2_IOSTATS_BUCKETS; b++)
+		fprintf(f, "\t%"PRIu64, is->is_lat[b]);
+	fputc('\n', f);
+}
+
+static int iostats_write(const char *path)
+{
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (f == NULL)
+		return -1;
+	fprintf(f, "# pid %d\n", (int)getpid());
+	fprintf(f, "func\tline\treads\twrites\tread_bytes\twrite_bytes\tsequential\trandom\terrors");
+	for (unsigned b = 0; b < LGFS2_IOSTATS_BUCKETS - 1; b++)
+		fprintf(f, "\tlat_lt_%luus", 1UL << b);
+	fprintf(f, "\tlat_more\n");
+	for (unsigned i = 0; i < IOSTATS_SITES; i++) {
+		if (iostats_sites[i].is_func != NULL)
+			site_print(f, &iostats_sites[i]);
+	}
+	if (other_site.is_count[LGFS2_IOSTATS_READ] || other_site.is_count[LGFS2_IOSTATS_WRITE])
+		site_print(f, &other_site);
+	if (fclose(f) != 0)
+		return -1;
+	return 0;
+}
+
+/**
+ * Write the statistics to the file at path, replacing its contents.
+ * Returns 0 on success or -1 with errno set.
+ */
+int lgfs2_iostats_dump(const char *path)
+{
+	int ret;
+
+	if (iostats_sites == NULL || path == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_mutex_lock(&iostats_lock);
+	ret = iostats_write(path);
+	pthread_mutex_unlock(&iostats_lock);
+	return ret;
+}
@@ -12,6 +12,7 @@
 #include <endian.h>
 #include <byteswap.h>
 #include <mntent.h>
+#include <pthread.h>
 
 #include <linux/gfs2_ondisk.h>
 #include "osi_list.h"
@@ -160,6 +161,54 @@ struct device {
 	uint64_t length;
 };
 
+/* Header for the savemeta output file */
+struct savemeta_header {
+#define SAVEMETA_MAGIC (0x01171970)
+	__be32 sh_magic;
+#define SAVEMETA_FORMAT (1)
+	__be32 sh_format; /* In case we want to change the layout */
+	__be64 sh_time; /* When savemeta was run */
+	__be64 sh_fs_bytes; /* Size of the fs */
+	uint8_t __reserved[104];
+};
+
+/* Each saved block is preceded by one of these in the savemeta file */
+struct saved_metablock {
+	__be64 blk;
+	__be16 siglen; /* significant data length */
+/* This needs to be packed because old versions of gfs2_edit read and write the
+   individual fields separately, so the hole after siglen must be eradicated
+   before the struct reflects what's on disk. */
+} __attribute__((__packed__));
+
+struct gfs2_sbd;
+
+/*
+ * I/O backend for the device. Offsets and lengths are in bytes and the
+ * functions behave like preadv(2)/pwritev(2)/fsync(2), returning -1 with
+ * errno set on error.
+ */
+struct lgfs2_dev_ops {
+	const char *name;
+	unsigned flags;
+#define LGFS2_DEV_RDONLY (1 << 0) /* Writes fail with EROFS */
+#define LGFS2_DEV_FD     (1 << 1) /* I/O can be done on device_fd directly */
+	ssize_t (*preadv)(struct gfs2_sbd *sdp, const struct iovec *iov, int iovcnt, off_t offset);
+	ssize_t (*pwritev)(struct gfs2_sbd *sdp, const struct iovec *iov, int iovcnt, off_t offset);
+	int (*sync)(struct gfs2_sbd *sdp);
+	void (*close)(struct gfs2_sbd *sdp);
+	/* Takes POSIX_FADV_* advice, may be NULL */
+	int (*advise)(struct gfs2_sbd *sdp, off_t offset, off_t len, int advice);
+};
+
+/* Backends which can be selected with a "<type>:" prefix on the device path */
+enum lgfs2_dev_type {
+	LGFS2_DEV_TYPE_FD = 0,   /* No prefix, the device or image file itself */
+	LGFS2_DEV_TYPE_MMAP,     /* "mmap:", a read-only mapping of an image file */
+	LGFS2_DEV_TYPE_MEMFD,    /* "memfd:", a copy of an image file in memory */
+	LGFS2_DEV_TYPE_SAVEMETA, /* "savemeta:", a read-only view of a savemeta file */
+};
+
 struct gfs2_bitmap
 {
 	char *bi_data;
@@ -171,6 +220,7 @@ struct gfs2_bitmap
 
 struct gfs2_sbd;
 struct gfs2_inode;
+struct lgfs2_rgcache;
 typedef struct _lgfs2_rgrps *lgfs2_rgrps_t;
 
 struct rgrp_tree {
@@ -209,6 +259,14 @@ struct rgrp_tree {
 			uint32_t rt_freemeta;
 		};
 	};
+	/* Index of free extents, built on demand. See rgrp.c */
+	struct lgfs2_extents *rt_extents;
+	pthread_mutex_t rt_lock; /* See lgfs2_rgrp_lock() */
+	/* Bitmaps loaded on demand, see rgrp.c */
+	struct lgfs2_rgcache *rt_cache;
+	osi_list_t rt_resident;
+	uint64_t rt_lastuse;
+	unsigned rt_pins;
 };
 
 typedef struct rgrp_tree *lgfs2_rgrp_t;
@@ -231,6 +289,15 @@ extern lgfs2_rgrp_t lgfs2_rgrp_first(lgfs2_rgrps_t rgs);
 extern lgfs2_rgrp_t lgfs2_rgrp_last(lgfs2_rgrps_t rgs);
 extern lgfs2_rgrp_t lgfs2_rgrp_next(lgfs2_rgrp_t rg);
 extern lgfs2_rgrp_t lgfs2_rgrp_prev(lgfs2_rgrp_t rg);
+extern void lgfs2_rgrp_lock(lgfs2_rgrp_t rg);
+extern void lgfs2_rgrp_unlock(lgfs2_rgrp_t rg);
+extern int lgfs2_rgrp_pin(lgfs2_rgrp_t rg);
+extern void lgfs2_rgrp_unpin(lgfs2_rgrp_t rg);
+extern int lgfs2_rgrp_hdr_update(struct gfs2_sbd *sdp, lgfs2_rgrp_t rg);
+extern int lgfs2_rgrp_extent_find(lgfs2_rgrp_t rg, uint64_t from, uint32_t minlen,
+                                  uint64_t *addr, uint32_t *len);
+extern uint32_t lgfs2_rgrp_extent_largest(lgfs2_rgrp_t rg, uint64_t *addr);
+extern void lgfs2_rgrp_extents_free(lgfs2_rgrp_t rg);
 // Temporary function to aid API migration
 extern void lgfs2_attach_rgrps(struct gfs2_sbd *sdp, lgfs2_rgrps_t rgs);
 
@@ -243,6 +310,56 @@ struct gfs2_buffer_head {
 	};
 	struct gfs2_sbd *sdp;
 	int b_modified;
+
+	/* Block cache bookkeeping, see buf.c */
+	osi_list_t b_lru;
+	struct gfs2_buffer_head *b_hnext;
+	uint64_t b_cachenr;
+	unsigned b_cached:1;
+	unsigned b_inuse:1;
+	unsigned b_slab:1; /* Allocated from the sdp->slab pools */
+	unsigned b_stale:1; /* A private copy of the block was written while held */
+};
+
+struct lgfs2_bcache;
+struct lgfs2_slab;
+struct lgfs2_readahead;
+
+struct lgfs2_slab_stats {
+	uint64_t ss_allocs; /* Objects handed out */
+	uint64_t ss_inuse;  /* Objects not yet freed */
+	uint64_t ss_peak;   /* Highest ss_inuse */
+	uint64_t ss_chunks; /* Chunks allocated from the system */
+	uint64_t ss_bytes;  /* Memory used by the chunks */
+};
+
+struct lgfs2_bcache_stats {
+	uint64_t bs_hits;       /* Reads satisfied from the cache */
+	uint64_t bs_misses;     /* Reads that went to the device */
+	uint64_t bs_evictions;  /* Buffers dropped to make room */
+	uint64_t bs_writebacks; /* Dirty buffers written on eviction or flush */
+	uint64_t bs_cached;     /* Buffers currently in the cache */
+	uint64_t bs_max;        /* Maximum number of cached buffers */
+	uint64_t bs_dirty;      /* Released buffers waiting to be written back */
+	uint64_t bs_writes;     /* Writes used to write back the dirty buffers */
+};
+
+struct lgfs2_rgcache_stats {
+	uint64_t rcs_loads;      /* Bitmaps read in */
+	uint64_t rcs_evictions;  /* Bitmaps dropped to stay within the budget */
+	uint64_t rcs_writebacks; /* Dropped bitmaps which had to be written */
+	uint64_t rcs_resident;   /* Bytes of bitmaps in memory */
+	uint64_t rcs_peak;       /* Highest rcs_resident */
+	uint64_t rcs_max;        /* The budget */
+};
+
+struct lgfs2_ra_stats {
+	uint64_t rs_hints;   /* Blocks passed to lgfs2_ra_hint() */
+	uint64_t rs_issued;  /* Blocks prefetched */
+	uint64_t rs_extents; /* Prefetch requests sent to the device */
+	uint64_t rs_useful;  /* Prefetched blocks which were read */
+	uint64_t rs_wasted;  /* Prefetched blocks which were not read in time */
+	uint64_t rs_window;  /* Current limit on prefetched, unread blocks */
 };
 
 struct lgfs2_inum {
@@ -255,6 +372,8 @@ struct gfs2_inode {
 	struct gfs2_sbd *i_sbd;
 	struct rgrp_tree *i_rgd; /* performance hint */
 	int bh_owned; /* Is this bh owned, iow, should we release it later? */
+	int i_slab; /* Allocated from the sdp->slab pool */
+	struct lgfs2_mpcache *i_mpcache; /* See lgfs2_mpcache_start() */
 
 	/* Native-endian versions of the dinode fields */
 	uint32_t i_magic;
@@ -317,6 +436,35 @@ struct master_dir
 };
 
 #define LGFS2_SB_ADDR(sdp) (GFS2_SB_ADDR >> (sdp)->sd_fsb2bb_shift)
+/*
+ * Threads
+ *
+ * A program can use a file system from several threads once it has been set
+ * up, as long as it keeps to these rules:
+ *
+ *  - The superblock fields, the resource group tree and the system inodes
+ *    are set up by one thread and then only read. gfs2_blk2rgrpd() and the
+ *    other lookups can be called by any thread.
+ *  - The block cache, the slab pools, the readahead engine and the I/O
+ *    statistics have their own locks. bread(), bget(), brelse() and the
+ *    lgfs2_dev_*() functions can be called by any thread.
+ *  - A buffer head or an inode is used by one thread at a time. bread() of a
+ *    block whose cached buffer is held by another thread gives a private
+ *    copy, so threads must not change the same block at the same time. A
+ *    thread can read a block while another changes it: the cache won't keep
+ *    the older contents.
+ *  - gfs2_set_bitmap() takes the resource group's lock, and lgfs2_get_bitmap()
+ *    reads the bitmap atomically, so blocks can be marked by several threads.
+ *    Callers hold lgfs2_rgrp_lock() to change the resource group's counters,
+ *    or to read them consistently with the bitmaps. Block allocation and the
+ *    free extent index are not safe against other threads changing the same
+ *    resource group.
+ *  - With lgfs2_rgcache_init(), bitmaps can be dropped from memory at any
+ *    time, so code which uses rg->bits[].bi_data directly holds a pin from
+ *    lgfs2_rgrp_pin() while it does.
+ *  - crc32c() and gfs2_disk_hash() have no state which changes after
+ *    startup.
+ */
 struct gfs2_sbd {
 	/* CPU-endian counterparts to the on-disk superblock fields */
 	uint32_t sd_bsize;
@@ -363,8 +511,10 @@ struct gfs2_sbd {
 	struct lgfs2_dev_info dinfo;
 	struct device device;
 
-	int device_fd;
+	int device_fd; /* -1 if the backend has no file descriptor for the device */
 	int path_fd;
+	const struct lgfs2_dev_ops *dev_ops; /* NULL for plain I/O on device_fd */
+	void *dev_priv; /* Private data of dev_ops */
 
 	uint64_t fssize;
 	uint64_t blks_total;
@@ -373,10 +523,20 @@ struct gfs2_sbd {
 
 	uint64_t rgrps;
 	struct osi_root rgtree;
+	struct lgfs2_rgindex *rgindex; /* Used by gfs2_blk2rgrpd(), see rgrp.c */
+	struct lgfs2_rgcache *rgcache; /* NULL unless lgfs2_rgcache_init() was called */
+
+	struct lgfs2_bcache *bcache; /* NULL unless lgfs2_bcache_init() was called */
+	struct lgfs2_slab *slab; /* NULL unless lgfs2_slab_init() was called */
+	struct lgfs2_readahead *readahead; /* NULL unless lgfs2_ra_init() was called */
+	unsigned dio_align; /* Buffer alignment for O_DIRECT, 0 if not in use */
 
 	struct gfs2_inode *master_dir;
 	struct master_dir md;
 
+	osi_list_t sd_revoke_list; /* Revokes found during journal recovery */
+	void *sd_private; /* The program's own state for this file system */
+
 	unsigned int gfs1:1;
 };
 
@@ -462,14 +622,92 @@ extern struct gfs2_buffer_head *bget(struct gfs2_sbd *sdp, uint64_t num);
 extern struct gfs2_buffer_head *__bread(struct gfs2_sbd *sdp, uint64_t num,
 					int line, const char *caller);
 extern int __breadm(struct gfs2_sbd *sdp, struct gfs2_buffer_head **bhs, size_t n, uint64_t block, int line, const char *caller);
-extern int bwrite(struct gfs2_buffer_head *bh);
-extern int brelse(struct gfs2_buffer_head *bh);
+extern int __bwrite(struct gfs2_buffer_head *bh, int line, const char *caller);
+extern int __brelse(struct gfs2_buffer_head *bh, int line, const char *caller);
 extern uint32_t lgfs2_get_block_type(const char *buf);
+extern int lgfs2_bcache_init(struct gfs2_sbd *sdp, size_t maxbytes, unsigned flags);
+extern int lgfs2_bcache_flush(struct gfs2_sbd *sdp);
+extern void lgfs2_bcache_invalidate(struct gfs2_sbd *sdp, uint64_t blk, uint64_t count);
+extern int lgfs2_bcache_free(struct gfs2_sbd *sdp);
+extern void lgfs2_bcache_stats(struct gfs2_sbd *sdp, struct lgfs2_bcache_stats *stats);
+/* Used by the read paths in aio.c */
+extern struct gfs2_buffer_head *lgfs2_bcache_take(struct gfs2_sbd *sdp, uint64_t num);
+extern struct gfs2_buffer_head *lgfs2_bh_new(struct gfs2_sbd *sdp, uint64_t num);
+extern int lgfs2_bcache_cached(struct gfs2_sbd *sdp, uint64_t num);
+extern void lgfs2_bh_discard(struct gfs2_buffer_head *bh);
+
+/* lgfs2_bcache_init() flags */
+#define LGFS2_BCACHE_WRITEBACK 0x1 /* Defer writes of released buffers, see buf.c */
 
 #define bmodified(bh) do { bh->b_modified = 1; } while(0)
 
 #define bread(bl, num) __bread(bl, num, __LINE__, __FUNCTION__)
 #define breadm(bl, bhs, n, block) __breadm(bl, bhs, n, block, __LINE__, __FUNCTION__)
+#define bwrite(bh) __bwrite(bh, __LINE__, __FUNCTION__)
+#define brelse(bh) __brelse(bh, __LINE__, __FUNCTION__)
+
+/* aio.c */
+struct lgfs2_aio;
+
+struct lgfs2_aio_done {
+	void *ad_priv;                   /* As passed when the request was queued */
+	struct gfs2_buffer_head *ad_bh;  /* The buffer for lgfs2_aio_bread() requests */
+	struct gfs2_buffer_head **ad_bhs;/* The buffers for lgfs2_aio_breadm() requests,
+	                                    all NULL if it failed */
+	unsigned ad_count;               /* The number of buffers in ad_bhs */
+	uint64_t ad_blk;                 /* First block of the request */
+	int ad_error;                    /* 0 or an errno value */
+};
+
+/* lgfs2_aio_init() flags */
+#define LGFS2_AIO_SYNC 0x1 /* Don't use io_uring even if it's available */
+
+extern struct lgfs2_aio *lgfs2_aio_init(struct gfs2_sbd *sdp, unsigned depth, unsigned flags);
+extern void lgfs2_aio_free(struct lgfs2_aio **aiop);
+extern int lgfs2_aio_async(const struct lgfs2_aio *aio);
+extern unsigned lgfs2_aio_pending(const struct lgfs2_aio *aio);
+extern unsigned lgfs2_aio_space(const struct lgfs2_aio *aio);
+extern int __lgfs2_aio_read(struct lgfs2_aio *aio, void *buf, uint64_t blk, unsigned count, void *priv,
+                            int line, const char *caller);
+extern int __lgfs2_aio_bread(struct lgfs2_aio *aio, uint64_t blk, void *priv, int line,
+                             const char *caller);
+extern int __lgfs2_aio_breadm(struct lgfs2_aio *aio, struct gfs2_buffer_head **bhs, unsigned n,
+                              uint64_t blk, void *priv, int line, const char *caller);
+extern int lgfs2_aio_submit(struct lgfs2_aio *aio);
+extern int lgfs2_aio_reap(struct lgfs2_aio *aio, struct lgfs2_aio_done *done, int wait);
+
+#define lgfs2_aio_read(aio, buf, blk, count, priv) \
+	__lgfs2_aio_read(aio, buf, blk, count, priv, __LINE__, __FUNCTION__)
+#define lgfs2_aio_bread(aio, blk, priv) \
+	__lgfs2_aio_bread(aio, blk, priv, __LINE__, __FUNCTION__)
+#define lgfs2_aio_breadm(aio, bhs, n, blk, priv) \
+	__lgfs2_aio_breadm(aio, bhs, n, blk, priv, __LINE__, __FUNCTION__)
+
+/* rgpool.c */
+struct lgfs2_rgpool;
+
+/* A job for lgfs2_rgpool_run() */
+struct lgfs2_rgjob {
+	/* Called for each resource group by any of the pool's threads */
+	int (*rj_work)(struct gfs2_sbd *sdp, lgfs2_rgrp_t rg, void *result, void *arg);
+	/* If set, called for each resource group in block order by the thread
+	   which started the run, after rj_work() has finished with it */
+	int (*rj_done)(struct gfs2_sbd *sdp, lgfs2_rgrp_t rg, void *result, void *arg);
+	void *rj_arg;           /* Passed to rj_work() and rj_done() */
+	size_t rj_result_size;  /* Size of the result for each resource group */
+	const int *rj_cancel;   /* If set, the run stops when this becomes non-zero */
+	unsigned rj_window;     /* If non-zero, rj_work() is started in block order and at
+	                           most this many resource groups ahead of rj_done() */
+};
+
+/* Most threads which tools will use with -j */
+#define LGFS2_MAX_JOBS (256)
+
+extern int lgfs2_parse_jobs(const char *str, unsigned *jobs);
+extern struct lgfs2_rgpool *lgfs2_rgpool_init(unsigned threads);
+extern void lgfs2_rgpool_free(struct lgfs2_rgpool **poolp);
+extern unsigned lgfs2_rgpool_threads(const struct lgfs2_rgpool *pool);
+extern int lgfs2_rgpool_run(struct lgfs2_rgpool *pool, struct gfs2_sbd *sdp, const struct lgfs2_rgjob *job);
 
 /* config.c */
 extern void lgfs2_set_debug(int enable);
@@ -477,6 +715,20 @@ extern void lgfs2_set_debug(int enable);
 /* device_geometry.c */
 extern int lgfs2_get_dev_info(int fd, struct lgfs2_dev_info *i);
 extern void fix_device_geometry(struct gfs2_sbd *sdp);
+extern int lgfs2_set_direct_io(struct gfs2_sbd *sdp, int enable);
+extern void *lgfs2_dev_buf(const struct gfs2_sbd *sdp, size_t len);
+
+/* devio.c */
+extern enum lgfs2_dev_type lgfs2_dev_type(const char *spec);
+extern int lgfs2_dev_open(struct gfs2_sbd *sdp, const char *spec, int flags);
+extern void lgfs2_dev_close(struct gfs2_sbd *sdp);
+extern ssize_t lgfs2_dev_pread(struct gfs2_sbd *sdp, void *buf, size_t len, off_t offset);
+extern ssize_t lgfs2_dev_pwrite(struct gfs2_sbd *sdp, const void *buf, size_t len, off_t offset);
+extern ssize_t lgfs2_dev_preadv(struct gfs2_sbd *sdp, const struct iovec *iov, int iovcnt, off_t offset);
+extern ssize_t lgfs2_dev_pwritev(struct gfs2_sbd *sdp, const struct iovec *iov, int iovcnt, off_t offset);
+extern int lgfs2_dev_sync(struct gfs2_sbd *sdp);
+extern off_t lgfs2_dev_size(struct gfs2_sbd *sdp);
+extern int lgfs2_dev_advise(struct gfs2_sbd *sdp, off_t offset, off_t len, int advice);
 
 /* fs_bits.c */
 #define BFITNOENT (0xFFFFFFFF)
@@ -485,6 +737,18 @@ extern void fix_device_geometry(struct gfs2_sbd *sdp);
 extern unsigned long gfs2_bitfit(const unsigned char *buffer,
 				 const unsigned int buflen,
 				 unsigned long goal, unsigned char old_state);
+extern unsigned lgfs2_bm_collect(const unsigned char *buf, unsigned len, uint8_t state,
+                                 uint64_t base, uint64_t *out);
+extern void lgfs2_bm_count(const unsigned char *buf, unsigned len, uint32_t count[4]);
+
+/* Bitmap search implementations, for testing */
+enum lgfs2_bm_impl {
+	LGFS2_BM_SCALAR = 0,
+	LGFS2_BM_SSE2 = 1,
+	LGFS2_BM_AVX2 = 2,
+};
+extern int lgfs2_bm_impl_set(enum lgfs2_bm_impl impl);
+extern const char *lgfs2_bm_impl_name(void);
 
 /* functions with blk #'s that are rgrp relative */
 extern uint32_t gfs2_blkalloc_internal(struct rgrp_tree *rgd, uint32_t goal,
@@ -494,6 +758,7 @@ extern int gfs2_check_range(struct gfs2_sbd *sdp, uint64_t blkno);
 
 /* functions with blk #'s that are file system relative */
 extern int lgfs2_get_bitmap(struct gfs2_sbd *sdp, uint64_t blkno, struct rgrp_tree *rgd);
+extern unsigned lgfs2_get_bitmaps(struct gfs2_sbd *sdp, const uint64_t *blks, unsigned n, int *states);
 extern int gfs2_set_bitmap(lgfs2_rgrp_t rg, uint64_t blkno, int state);
 
 extern uint32_t rgblocks2bitblocks(const unsigned int bsize, const uint32_t rgblocks,
@@ -507,6 +772,11 @@ extern void find_metapath(struct gfs2_inode *ip, uint64_t block, struct metapath
 extern void lookup_block(struct gfs2_inode *ip, struct gfs2_buffer_head *bh,
 			 unsigned int height, struct metapath *mp,
 			 int create, int *new, uint64_t *block);
+extern int lgfs2_mpcache_start(struct gfs2_inode *ip);
+extern void lgfs2_mpcache_stop(struct gfs2_inode *ip);
+extern struct gfs2_buffer_head *lgfs2_metapath_get(struct gfs2_inode *ip, struct metapath *mp,
+                                                   unsigned height, int create, int *new);
+extern void lgfs2_metapath_put(struct gfs2_inode *ip, struct gfs2_buffer_head *bh);
 extern struct gfs2_inode *lgfs2_inode_get(struct gfs2_sbd *sdp,
 				    struct gfs2_buffer_head *bh);
 extern struct gfs2_inode *lgfs2_inode_read(struct gfs2_sbd *sdp, uint64_t di_addr);
@@ -761,19 +1031,62 @@ extern struct rgrp_tree *gfs2_blk2rgrpd(struct gfs2_sbd *sdp, uint64_t blk);
 extern int lgfs2_rgrp_crc_check(char *buf);
 extern void lgfs2_rgrp_crc_set(char *buf);
 extern uint64_t gfs2_rgrp_read(struct gfs2_sbd *sdp, struct rgrp_tree *rgd);
+extern uint64_t lgfs2_rgrp_read_hdr(struct gfs2_sbd *sdp, struct rgrp_tree *rgd);
+extern uint64_t lgfs2_rgrp_read_bits(struct gfs2_sbd *sdp, struct rgrp_tree *rgd);
 extern void gfs2_rgrp_relse(struct gfs2_sbd *sdp, struct rgrp_tree *rgd);
 extern struct rgrp_tree *rgrp_insert(struct osi_root *rgtree,
 				     uint64_t rgblock);
 extern void gfs2_rgrp_free(struct gfs2_sbd *sdp, struct osi_root *rgrp_tree);
+extern void lgfs2_rgindex_free(struct gfs2_sbd *sdp);
+extern int lgfs2_rgcache_init(struct gfs2_sbd *sdp, size_t maxbytes);
+extern int lgfs2_rgcache_free(struct gfs2_sbd *sdp);
+extern void lgfs2_rgcache_stats(struct gfs2_sbd *sdp, struct lgfs2_rgcache_stats *stats);
+extern void lgfs2_rgrp_extents_set(lgfs2_rgrp_t rg, uint32_t blk, int free);
 /* figure out the size of the given resource group, in blocks */
 static inline unsigned int rgrp_size(struct rgrp_tree *rgrp)
 {
 	return rgrp->rt_data + rgrp->rt_length;
 }
 
+/* iostats.c */
+#define LGFS2_IOSTATS_READ    (0)
+#define LGFS2_IOSTATS_WRITE   (1)
+#define LGFS2_IOSTATS_BUCKETS (24) /* Latency histogram buckets, powers of two in usecs */
+extern int lgfs2_iostats_on;
+extern int lgfs2_iostats_init(void);
+extern int lgfs2_iostats_enable(const char *path);
+extern int lgfs2_iostats_dump(const char *path);
+/* Used by the I/O paths */
+struct timespec;
+extern void lgfs2_iostats_site(const char *func, int line);
+extern void lgfs2_iostats_account(int rw, off_t offset, ssize_t ret, const struct timespec *start,
+                                  const char *func, int line);
+
+/* readahead.c */
+extern int lgfs2_ra_init(struct gfs2_sbd *sdp);
+extern void lgfs2_ra_free(struct gfs2_sbd *sdp);
+extern void lgfs2_ra_stats(struct gfs2_sbd *sdp, struct lgfs2_ra_stats *stats);
+extern void lgfs2_ra_start(struct gfs2_sbd *sdp);
+extern void lgfs2_ra_stop(struct gfs2_sbd *sdp);
+extern void lgfs2_ra_hint(struct gfs2_sbd *sdp, uint64_t blk, uint64_t len);
+/* Used by the read paths in buf.c */
+extern void lgfs2_ra_note(struct gfs2_sbd *sdp, uint64_t blk, unsigned count,
+                          const struct timespec *start);
+
+/* slab.c */
+extern int lgfs2_slab_init(struct gfs2_sbd *sdp);
+extern void lgfs2_slab_free(struct gfs2_sbd *sdp);
+extern void lgfs2_slab_stats(struct gfs2_sbd *sdp, struct lgfs2_slab_stats *bufs,
+                             struct lgfs2_slab_stats *inodes);
+/* Used by buf.c, fs_ops.c and gfs1.c */
+extern struct gfs2_buffer_head *lgfs2_slab_bh_get(struct gfs2_sbd *sdp);
+extern void lgfs2_slab_bh_put(struct gfs2_buffer_head *bh);
+extern struct gfs2_inode *lgfs2_slab_inode_get(struct gfs2_sbd *sdp);
+extern void lgfs2_slab_inode_put(struct gfs2_inode *ip);
+
 /* structures.c */
 extern int build_master(struct gfs2_sbd *sdp);
-extern int lgfs2_sb_write(const struct gfs2_sbd *sdp, int fd);
+extern int lgfs2_sb_write(struct gfs2_sbd *sdp);
 extern int build_journal(struct gfs2_sbd *sdp, int j,
 			 struct gfs2_inode *jindex);
 extern int build_jindex(struct gfs2_sbd *sdp);
@@ -801,6 +1114,7 @@ extern int write_sb(struct gfs2_sbd *sdp);
 
 /* ondisk.c */
 extern uint32_t gfs2_disk_hash(const char *data, int len);
+extern unsigned lgfs2_dirent_hashes(const char *buf, unsigned len, uint32_t *hashes, unsigned max);
 extern void print_it(const char *label, const char *fmt, const char *fmt2, ...)
 	__attribute__((format(printf,2,4)));
 
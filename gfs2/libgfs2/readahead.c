@@ -0,0 +1,374 @@
+#include "clusterautoconfig.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libgfs2.h"
+
+/*
+ * Readahead engine. Callers which know which blocks they are going to read
+ * next pass them in with lgfs2_ra_hint() between lgfs2_ra_start() and
+ * lgfs2_ra_stop(). Adjacent hints are merged into extents which are queued
+ * and handed to the device as POSIX_FADV_WILLNEED hints, so the kernel reads
+ * them in the background, while bread() and breadm() report the blocks they
+ * read from the device with lgfs2_ra_note(). The last extent is only
+ * prefetched once it can't grow any more or the next block is read.
+ *
+ * Only a window's worth of blocks is prefetched and not yet read at any time,
+ * so prefetches are issued just ahead of the reads which use them. Every
+ * RA_ADAPT_BLOCKS blocks read, the window is halved if more than a quarter of
+ * the blocks prefetched in that period were wasted, and doubled if reads of
+ * prefetched blocks took more than half as long as reads of blocks which
+ * weren't prefetched, meaning the prefetches were issued too late to help.
+ *
+ * A prefetched block is wasted if it hasn't been read after twice the
+ * window's worth of other blocks has been read, or if it's still unread when
+ * the outermost lgfs2_ra_stop() is called.
+ *
+ * lgfs2_ra_start() calls nest. Hints given in an inner section are prefetched
+ * before those of the outer sections, and any which haven't been prefetched
+ * are dropped when the inner section ends.
+ *
+ * The engine is shared by the threads using the file system and protected by
+ * ra_lock. Sections are too, so threads which give hints at the same time
+ * should do so within a section started before they were started.
+ */
+
+#define RA_WINDOW_MIN   (8)
+#define RA_WINDOW_INIT  (64)
+#define RA_WINDOW_MAX   (2048)
+#define RA_EXTENT_MAX   (64) /* Blocks, the size of re_read */
+#define RA_INFLIGHT     (128) /* Extents prefetched and not yet fully read */
+#define RA_DEPTH        (8)
+#define RA_ADAPT_BLOCKS (256)
+
+struct ra_extent {
+	uint64_t re_start;
+	unsigned re_len;
+	unsigned re_left;  /* Blocks not read yet */
+	uint64_t re_issued; /* ra_reads when it was prefetched */
+	uint64_t re_read;  /* Bitmap of the blocks which have been read */
+};
+
+struct lgfs2_readahead {
+	pthread_mutex_t ra_lock;
+	struct ra_extent *ra_queue; /* Hints which haven't been prefetched */
+	unsigned ra_queued;
+	unsigned ra_size;
+	unsigned ra_depth;
+	unsigned ra_frame[RA_DEPTH]; /* Start of each section's hints in ra_queue */
+	unsigned ra_head[RA_DEPTH];  /* Next hint of each section to prefetch */
+
+	struct ra_extent ra_inflight[RA_INFLIGHT];
+	unsigned ra_ninflight;
+	uint64_t ra_unread; /* Prefetched blocks not yet read */
+
+	uint64_t ra_reads; /* Blocks read from the device */
+	uint64_t ra_cold_ns; /* Average time to read a block which wasn't prefetched */
+	uint64_t ra_warm_ns; /* ...and one which was */
+	uint64_t ra_period; /* ra_reads at the last window adjustment */
+	uint64_t ra_period_useful;
+	uint64_t ra_period_wasted;
+	struct lgfs2_ra_stats ra_stats;
+};
+
+/**
+ * Set up the readahead engine for a file system. Until this is called, or if
+ * it fails, the other lgfs2_ra_*() functions do nothing.
+ * Returns 0 on success or -1 on failure with errno set
+ */
+int lgfs2_ra_init(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_readahead *ra;
+
+	if (sdp->readahead != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	ra = calloc(1, sizeof(*ra));
+	if (ra == NULL)
+		return -1;
+	pthread_mutex_init(&ra->ra_lock, NULL);
+	ra->ra_stats.rs_window = RA_WINDOW_INIT;
+	sdp->readahead = ra;
+	return 0;
+}
+
+static void ra_retire(struct lgfs2_readahead *ra, unsigned i)
+{
+	struct ra_extent *re = &ra->ra_inflight[i];
+
+	ra->ra_stats.rs_wasted += re->re_left;
+	ra->ra_period_wasted += re->re_left;
+	ra->ra_unread -= re->re_left;
+	*re = ra->ra_inflight[--ra->ra_ninflight];
+}
+
+void lgfs2_ra_free(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_readahead *ra = sdp->readahead;
+
+	if (ra == NULL)
+		return;
+	free(ra->ra_queue);
+	pthread_mutex_destroy(&ra->ra_lock);
+	free(ra);
+	sdp->readahead = NULL;
+}
+
+void lgfs2_ra_stats(struct gfs2_sbd *sdp, struct lgfs2_ra_stats *stats)
+{
+	struct lgfs2_readahead *ra = sdp->readahead;
+
+	if (ra == NULL) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+	pthread_mutex_lock(&ra->ra_lock);
+	*stats = ra->ra_stats;
+	pthread_mutex_unlock(&ra->ra_lock);
+}
+
+static struct ra_extent *ra_inflight_find(struct lgfs2_readahead *ra, uint64_t blk)
+{
+	/* Most recently prefetched first, that's where the reads usually are */
+	for (unsigned i = ra->ra_ninflight; i > 0; i--) {
+		struct ra_extent *re = &ra->ra_inflight[i - 1];
+
+		if (blk >= re->re_start && blk < re->re_start + re->re_len)
+			return re;
+	}
+	return NULL;
+}
+
+/*
+ * Prefetch queued hints, innermost section first, until the window is full.
+ * Unless all is set, the last hint is held back while more can be merged in.
+ */
+static void ra_issue(struct gfs2_sbd *sdp, struct lgfs2_readahead *ra, int all)
+{
+	unsigned window = ra->ra_stats.rs_window;
+	unsigned d = ra->ra_depth < RA_DEPTH ? ra->ra_depth : RA_DEPTH;
+
+	while (d > 0) {
+		unsigned end = (d == RA_DEPTH || d == ra->ra_depth) ? ra->ra_queued : ra->ra_frame[d];
+		struct ra_extent *re;
+
+		if (ra->ra_head[d - 1] == end) {
+			d--;
+			continue;
+		}
+		re = &ra->ra_queue[ra->ra_head[d - 1]];
+		if (!all && end == ra->ra_queued && ra->ra_head[d - 1] == end - 1 &&
+		    re->re_len < RA_EXTENT_MAX)
+			return;
+		if (ra->ra_ninflight == RA_INFLIGHT ||
+		    (ra->ra_unread > 0 && ra->ra_unread + re->re_len > window))
+			return;
+		ra->ra_head[d - 1]++;
+		re->re_left = re->re_len;
+		re->re_issued = ra->ra_reads;
+		re->re_read = 0;
+		ra->ra_inflight[ra->ra_ninflight++] = *re;
+		ra->ra_unread += re->re_len;
+		ra->ra_stats.rs_issued += re->re_len;
+		ra->ra_stats.rs_extents++;
+		/* Page cache hints don't help reads which bypass it */
+		if (!sdp->dio_align)
+			lgfs2_dev_advise(sdp, re->re_start * sdp->sd_bsize,
+			                 (off_t)re->re_len * sdp->sd_bsize, POSIX_FADV_WILLNEED);
+	}
+}
+
+/**
+ * Start a section of code which gives readahead hints. The outermost section
+ * turns off the kernel's own readahead for the device, since the hints
+ * replace it.
+ */
+void lgfs2_ra_start(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_readahead *ra = sdp->readahead;
+
+	if (ra == NULL)
+		return;
+	pthread_mutex_lock(&ra->ra_lock);
+	if (ra->ra_depth == 0)
+		lgfs2_dev_advise(sdp, 0, 0, POSIX_FADV_RANDOM);
+	if (ra->ra_depth < RA_DEPTH) {
+		ra->ra_frame[ra->ra_depth] = ra->ra_queued;
+		ra->ra_head[ra->ra_depth] = ra->ra_queued;
+	}
+	ra->ra_depth++;
+	pthread_mutex_unlock(&ra->ra_lock);
+}
+
+/**
+ * End a section started with lgfs2_ra_start(). Its hints which haven't been
+ * prefetched are dropped.
+ */
+void lgfs2_ra_stop(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_readahead *ra = sdp->readahead;
+
+	if (ra == NULL)
+		return;
+	pthread_mutex_lock(&ra->ra_lock);
+	if (ra->ra_depth == 0)
+		goto out;
+	ra->ra_depth--;
+	if (ra->ra_depth < RA_DEPTH)
+		ra->ra_queued = ra->ra_frame[ra->ra_depth];
+	if (ra->ra_depth > 0) {
+		ra_issue(sdp, ra, 1);
+		goto out;
+	}
+	while (ra->ra_ninflight > 0)
+		ra_retire(ra, ra->ra_ninflight - 1);
+	lgfs2_dev_advise(sdp, 0, 0, POSIX_FADV_NORMAL);
+out:
+	pthread_mutex_unlock(&ra->ra_lock);
+}
+
+static int ra_queue_grow(struct lgfs2_readahead *ra)
+{
+	unsigned size = ra->ra_size ? ra->ra_size * 2 : 256;
+	struct ra_extent *queue = realloc(ra->ra_queue, size * sizeof(*queue));
+
+	if (queue == NULL)
+		return -1;
+	ra->ra_queue = queue;
+	ra->ra_size = size;
+	return 0;
+}
+
+/**
+ * Tell the readahead engine that len blocks starting at blk are going to be
+ * read soon. Blocks which are in the block cache or already being prefetched
+ * are skipped. Hints are prefetched in the order they were given.
+ */
+void lgfs2_ra_hint(struct gfs2_sbd *sdp, uint64_t blk, uint64_t len)
+{
+	struct lgfs2_readahead *ra = sdp->readahead;
+	unsigned d;
+
+	if (ra == NULL)
+		return;
+	pthread_mutex_lock(&ra->ra_lock);
+	if (ra->ra_depth == 0) {
+		pthread_mutex_unlock(&ra->ra_lock);
+		return;
+	}
+	d = (ra->ra_depth < RA_DEPTH ? ra->ra_depth : RA_DEPTH) - 1;
+	ra->ra_stats.rs_hints += len;
+	for (; len > 0; blk++, len--) {
+		struct ra_extent *last = NULL;
+
+		if (lgfs2_bcache_cached(sdp, blk) || ra_inflight_find(ra, blk) != NULL)
+			continue;
+		if (ra->ra_queued > ra->ra_head[d])
+			last = &ra->ra_queue[ra->ra_queued - 1];
+		if (last != NULL && blk >= last->re_start && blk < last->re_start + last->re_len)
+			continue;
+		if (last != NULL && last->re_start + last->re_len == blk &&
+		    last->re_len < RA_EXTENT_MAX) {
+			last->re_len++;
+			continue;
+		}
+		/* Reuse the space of prefetched hints when the section has none left */
+		if (ra->ra_queued == ra->ra_head[d] && ra->ra_queued > ra->ra_frame[d])
+			ra->ra_queued = ra->ra_head[d] = ra->ra_frame[d];
+		if (ra->ra_queued == ra->ra_size && ra_queue_grow(ra) != 0)
+			break;
+		last = &ra->ra_queue[ra->ra_queued++];
+		last->re_start = blk;
+		last->re_len = 1;
+	}
+	ra_issue(sdp, ra, 0);
+	pthread_mutex_unlock(&ra->ra_lock);
+}
+
+static uint64_t ra_avg(uint64_t avg, uint64_t sample)
+{
+	if (avg == 0)
+		return sample;
+	return avg - (avg >> 3) + (sample >> 3);
+}
+
+static void ra_adapt(struct lgfs2_readahead *ra)
+{
+	uint64_t done = ra->ra_period_useful + ra->ra_period_wasted;
+	uint64_t window = ra->ra_stats.rs_window;
+
+	if (done > 0 && ra->ra_period_wasted * 4 > done) {
+		window /= 2;
+		if (window < RA_WINDOW_MIN)
+			window = RA_WINDOW_MIN;
+	} else if (ra->ra_period_useful > 0 && ra->ra_cold_ns > 0 &&
+	           ra->ra_warm_ns * 2 > ra->ra_cold_ns) {
+		window *= 2;
+		if (window > RA_WINDOW_MAX)
+			window = RA_WINDOW_MAX;
+	}
+	ra->ra_stats.rs_window = window;
+	ra->ra_period = ra->ra_reads;
+	ra->ra_period_useful = 0;
+	ra->ra_period_wasted = 0;
+}
+
+/**
+ * Called by the read paths after count blocks starting at blk have been read
+ * from the device. start is when the read was started.
+ */
+void lgfs2_ra_note(struct gfs2_sbd *sdp, uint64_t blk, unsigned count,
+                   const struct timespec *start)
+{
+	struct lgfs2_readahead *ra = sdp->readahead;
+	struct timespec now;
+	unsigned useful = 0;
+	uint64_t ns;
+
+	if (ra == NULL || count == 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (now.tv_sec - start->tv_sec) * 1000000000ULL + now.tv_nsec - start->tv_nsec;
+	pthread_mutex_lock(&ra->ra_lock);
+	for (unsigned i = 0; i < count; i++) {
+		struct ra_extent *re = ra_inflight_find(ra, blk + i);
+		uint64_t bit;
+
+		if (re == NULL)
+			continue;
+		bit = 1ULL << (blk + i - re->re_start);
+		if (re->re_read & bit)
+			continue;
+		re->re_read |= bit;
+		re->re_left--;
+		ra->ra_unread--;
+		useful++;
+		if (re->re_left == 0)
+			*re = ra->ra_inflight[--ra->ra_ninflight];
+	}
+	ra->ra_stats.rs_useful += useful;
+	ra->ra_period_useful += useful;
+	if (useful > 0)
+		ra->ra_warm_ns = ra_avg(ra->ra_warm_ns, ns / count);
+	else
+		ra->ra_cold_ns = ra_avg(ra->ra_cold_ns, ns / count);
+	ra->ra_reads += count;
+
+	/* Give up on prefetched blocks which the reads have passed by */
+	for (unsigned i = ra->ra_ninflight; i > 0; i--) {
+		if (ra->ra_reads - ra->ra_inflight[i - 1].re_issued > 2 * ra->ra_stats.rs_window)
+			ra_retire(ra, i - 1);
+	}
+	if (ra->ra_reads - ra->ra_period >= RA_ADAPT_BLOCKS)
+		ra_adapt(ra);
+	if (ra->ra_depth > 0)
+		ra_issue(sdp, ra, 1);
+	pthread_mutex_unlock(&ra->ra_lock);
+}
@@ -0,0 +1,461 @@
+#include "clusterautoconfig.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "libgfs2.h"
+
+/*
+ * A pool of threads which run a job on every resource group of a file system.
+ *
+ * Each thread is given an equal, contiguous share of the resource groups, so
+ * it works through neighbouring parts of the device in order. A thread which
+ * runs out of resource groups steals them from the far end of another
+ * thread's share, so a few slow resource groups don't hold up the run while
+ * the other threads sit idle.
+ *
+ * The results of the job are passed to an optional rj_done() callback in the
+ * thread which started the run, in resource group order. Output and questions
+ * for the user belong there, so tools print the same things in the same order
+ * whatever the number of threads. rj_work() must keep to the rules in
+ * libgfs2.h for using a file system from several threads.
+ *
+ * A job which only prepares for its rj_done() step, e.g. by reading blocks
+ * into the block cache, gains nothing from running far ahead of it. Such jobs
+ * set rj_window, and the threads then take resource groups from a shared
+ * cursor in block order, waiting while they are rj_window resource groups
+ * ahead of the calling thread.
+ */
+
+/* One thread's share of the resource groups of a run */
+struct rgpool_deque {
+	pthread_mutex_t rd_lock;
+	unsigned rd_head; /* The owner takes resource groups from here */
+	unsigned rd_tail; /* Other threads steal from here */
+};
+
+struct lgfs2_rgpool {
+	unsigned rp_nthreads;
+	pthread_t *rp_threads;
+	struct rgpool_deque *rp_deques;
+	pthread_mutex_t rp_lock;
+	pthread_cond_t rp_start;    /* Signalled when a run starts or the pool is freed */
+	pthread_cond_t rp_progress; /* Signalled when a resource group is done */
+	pthread_cond_t rp_advance;  /* Signalled when rp_ndone moves or the run stops */
+	unsigned rp_generation;     /* Incremented for each run */
+	unsigned rp_running;        /* Threads still working on the current run */
+	int rp_exit;
+	/* The current run */
+	struct gfs2_sbd *rp_sdp;
+	const struct lgfs2_rgjob *rp_job;
+	lgfs2_rgrp_t *rp_rgs;
+	unsigned rp_count;
+	char *rp_results;
+	uint8_t *rp_done;           /* Protected by rp_lock */
+	unsigned rp_next;           /* With rj_window, the next resource group to start */
+	unsigned rp_ndone;          /* With rj_window, resource groups passed to rj_done() */
+	int rp_stop;                /* Set, atomically, to end the run early */
+	int rp_error;               /* The first error returned by rj_work() */
+};
+
+struct rgpool_thread {
+	struct lgfs2_rgpool *rt_pool;
+	unsigned rt_id;
+};
+
+static void *rgpool_result(struct lgfs2_rgpool *pool, unsigned i)
+{
+	return pool->rp_results + (size_t)i * pool->rp_job->rj_result_size;
+}
+
+static int rgpool_cancelled(const struct lgfs2_rgjob *job)
+{
+	return job->rj_cancel != NULL && __atomic_load_n(job->rj_cancel, __ATOMIC_RELAXED);
+}
+
+static int rgpool_next_window(struct lgfs2_rgpool *pool)
+{
+	unsigned window = pool->rp_job->rj_window;
+	int i = -1;
+
+	pthread_mutex_lock(&pool->rp_lock);
+	while (!__atomic_load_n(&pool->rp_stop, __ATOMIC_RELAXED) &&
+	       pool->rp_next < pool->rp_count && pool->rp_next >= pool->rp_ndone + window)
+		pthread_cond_wait(&pool->rp_advance, &pool->rp_lock);
+	if (pool->rp_next < pool->rp_count)
+		i = pool->rp_next++;
+	pthread_mutex_unlock(&pool->rp_lock);
+	return i;
+}
+
+static int rgpool_next(struct lgfs2_rgpool *pool, unsigned id)
+{
+	struct rgpool_deque *rd = &pool->rp_deques[id];
+	int i = -1;
+
+	if (pool->rp_job->rj_window > 0)
+		return rgpool_next_window(pool);
+
+	pthread_mutex_lock(&rd->rd_lock);
+	if (rd->rd_head < rd->rd_tail)
+		i = rd->rd_head++;
+	pthread_mutex_unlock(&rd->rd_lock);
+	if (i >= 0)
+		return i;
+
+	for (unsigned k = 1; k < pool->rp_nthreads && i < 0; k++) {
+		rd = &pool->rp_deques[(id + k) % pool->rp_nthreads];
+		pthread_mutex_lock(&rd->rd_lock);
+		if (rd->rd_head < rd->rd_tail)
+			i = --rd->rd_tail;
+		pthread_mutex_unlock(&rd->rd_lock);
+	}
+	return i;
+}
+
+static void rgpool_work(struct lgfs2_rgpool *pool, unsigned id)
+{
+	const struct lgfs2_rgjob *job = pool->rp_job;
+	int i;
+
+	while ((i = rgpool_next(pool, id)) >= 0) {
+		int ret;
+
+		if (__atomic_load_n(&pool->rp_stop, __ATOMIC_RELAXED) || rgpool_cancelled(job)) {
+			/* Don't leave other threads waiting for the window to move */
+			pthread_mutex_lock(&pool->rp_lock);
+			__atomic_store_n(&pool->rp_stop, 1, __ATOMIC_RELAXED);
+			pthread_cond_broadcast(&pool->rp_advance);
+			pthread_mutex_unlock(&pool->rp_lock);
+			break;
+		}
+		ret = job->rj_work(pool->rp_sdp, pool->rp_rgs[i], rgpool_result(pool, i), job->rj_arg);
+
+		pthread_mutex_lock(&pool->rp_lock);
+		if (ret == 0)
+			pool->rp_done[i] = 1;
+		else if (pool->rp_error == 0) {
+			pool->rp_error = ret;
+			__atomic_store_n(&pool->rp_stop, 1, __ATOMIC_RELAXED);
+			pthread_cond_broadcast(&pool->rp_advance);
+		}
+		pthread_cond_signal(&pool->rp_progress);
+		pthread_mutex_unlock(&pool->rp_lock);
+	}
+}
+
+static void *rgpool_thread(void *arg)
+{
+	struct rgpool_thread *rt = arg;
+	struct lgfs2_rgpool *pool = rt->rt_pool;
+	unsigned seen = 0;
+	int quit;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->rp_lock);
+		while (!pool->rp_exit && pool->rp_generation == seen)
+			pthread_cond_wait(&pool->rp_start, &pool->rp_lock);
+		seen = pool->rp_generation;
+		quit = pool->rp_exit;
+		pthread_mutex_unlock(&pool->rp_lock);
+		if (quit)
+			break;
+
+		rgpool_work(pool, rt->rt_id);
+
+		pthread_mutex_lock(&pool->rp_lock);
+		pool->rp_running--;
+		pthread_cond_signal(&pool->rp_progress);
+		pthread_mutex_unlock(&pool->rp_lock);
+	}
+	free(rt);
+	return NULL;
+}
+
+/**
+ * Parse the argument of a -j option
+ * @str: The number of threads to use, or 0 to use one per online CPU
+ * @jobs: Set to the number of threads on success
+ * Returns 0 on success or -1 with errno set if str is not a valid number.
+ */
+int lgfs2_parse_jobs(const char *str, unsigned *jobs)
+{
+	unsigned long n;
+	char *end;
+
+	errno = 0;
+	n = strtoul(str, &end, 10);
+	if (errno != 0 || end == str || *end != '\0' || str[0] == '-') {
+		errno = EINVAL;
+		return -1;
+	}
+	if (n == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n = cpus > 0 ? cpus : 1;
+	}
+	if (n > LGFS2_MAX_JOBS)
+		n = LGFS2_MAX_JOBS;
+	*jobs = n;
+	return 0;
+}
+
+/**
+ * Create a pool of threads for lgfs2_rgpool_run()
+ * @threads: The number of threads. With 1 or fewer, no threads are created
+ *           and jobs run in the calling thread.
+ * Returns the pool or NULL with errno set on failure.
+ */
+struct lgfs2_rgpool *lgfs2_rgpool_init(unsigned threads)
+{
+	struct lgfs2_rgpool *pool;
+	sigset_t all, old;
+
+	pool = calloc(1, sizeof(*pool));
+	if (pool == NULL)
+		return NULL;
+	if (threads <= 1)
+		return pool;
+	if (threads > LGFS2_MAX_JOBS)
+		threads = LGFS2_MAX_JOBS;
+
+	pool->rp_threads = calloc(threads, sizeof(*pool->rp_threads));
+	pool->rp_deques = calloc(threads, sizeof(*pool->rp_deques));
+	if (pool->rp_threads == NULL || pool->rp_deques == NULL)
+		goto fail;
+	pthread_mutex_init(&pool->rp_lock, NULL);
+	pthread_cond_init(&pool->rp_start, NULL);
+	pthread_cond_init(&pool->rp_progress, NULL);
+	pthread_cond_init(&pool->rp_advance, NULL);
+	for (unsigned i = 0; i < threads; i++)
+		pthread_mutex_init(&pool->rp_deques[i].rd_lock, NULL);
+
+	/* Signals are left to the program's own threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (; pool->rp_nthreads < threads; pool->rp_nthreads++) {
+		struct rgpool_thread *rt = malloc(sizeof(*rt));
+		int err;
+
+		if (rt == NULL)
+			break;
+		rt->rt_pool = pool;
+		rt->rt_id = pool->rp_nthreads;
+		err = pthread_create(&pool->rp_threads[pool->rp_nthreads], NULL, rgpool_thread, rt);
+		if (err != 0) {
+			free(rt);
+			errno = err;
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	/* Make do with the threads we got */
+	if (pool->rp_nthreads > 0)
+		return pool;
+	pthread_mutex_destroy(&pool->rp_lock);
+	pthread_cond_destroy(&pool->rp_start);
+	pthread_cond_destroy(&pool->rp_progress);
+	pthread_cond_destroy(&pool->rp_advance);
+	for (unsigned i = 0; i < threads; i++)
+		pthread_mutex_destroy(&pool->rp_deques[i].rd_lock);
+fail:
+	free(pool->rp_threads);
+	free(pool->rp_deques);
+	free(pool);
+	return NULL;
+}
+
+/**
+ * Stop the threads of a pool and free it
+ * @poolp: The pool, set to NULL on return
+ */
+void lgfs2_rgpool_free(struct lgfs2_rgpool **poolp)
+{
+	struct lgfs2_rgpool *pool = *poolp;
+
+	if (pool == NULL)
+		return;
+	if (pool->rp_nthreads > 0) {
+		pthread_mutex_lock(&pool->rp_lock);
+		pool->rp_exit = 1;
+		pthread_cond_broadcast(&pool->rp_start);
+		pthread_mutex_unlock(&pool->rp_lock);
+		for (unsigned i = 0; i < pool->rp_nthreads; i++) {
+			pthread_join(pool->rp_threads[i], NULL);
+			pthread_mutex_destroy(&pool->rp_deques[i].rd_lock);
+		}
+		pthread_mutex_destroy(&pool->rp_lock);
+		pthread_cond_destroy(&pool->rp_start);
+		pthread_cond_destroy(&pool->rp_progress);
+		pthread_cond_destroy(&pool->rp_advance);
+	}
+	free(pool->rp_threads);
+	free(pool->rp_deques);
+	free(pool);
+	*poolp = NULL;
+}
+
+/**
+ * Returns the number of threads in a pool, or 1 if jobs run in the calling
+ * thread.
+ */
+unsigned lgfs2_rgpool_threads(const struct lgfs2_rgpool *pool)
+{
+	if (pool == NULL || pool->rp_nthreads == 0)
+		return 1;
+	return pool->rp_nthreads;
+}
+
+static int rgpool_run_serial(struct gfs2_sbd *sdp, lgfs2_rgrp_t *rgs, unsigned count,
+                             const struct lgfs2_rgjob *job)
+{
+	void *result = NULL;
+	int ret = 0;
+
+	if (job->rj_result_size > 0) {
+		result = malloc(job->rj_result_size);
+		if (result == NULL)
+			return -1;
+	}
+	for (unsigned i = 0; i < count; i++) {
+		if (rgpool_cancelled(job)) {
+			errno = ECANCELED;
+			ret = -1;
+			break;
+		}
+		if (result != NULL)
+			memset(result, 0, job->rj_result_size);
+		ret = job->rj_work(sdp, rgs[i], result, job->rj_arg);
+		if (ret == 0 && job->rj_done != NULL)
+			ret = job->rj_done(sdp, rgs[i], result, job->rj_arg);
+		if (ret != 0)
+			break;
+	}
+	free(result);
+	return ret;
+}
+
+/**
+ * Run a job on each resource group of a file system
+ * @pool: The threads to run rj_work() in. If NULL, or created for one thread,
+ *        the job runs in the calling thread.
+ * @sdp: The file system, whose resource groups must not change during the run
+ * @job: The job
+ *
+ * rj_work() is called once for each resource group, with a zeroed result
+ * buffer of rj_result_size bytes, by any of the pool's threads. If rj_done()
+ * is set, it is then called with the same result buffer in the calling
+ * thread, for each resource group in block order. The run stops early when
+ * rj_work() or rj_done() returns non-zero or *rj_cancel becomes non-zero,
+ * after the resource groups already started have finished.
+ *
+ * Returns 0 when the job has run on every resource group, the first non-zero
+ * value returned by rj_done() or rj_work(), or -1 with errno set to ECANCELED
+ * when the run was cancelled, or another errno on failure.
+ */
+int lgfs2_rgpool_run(struct lgfs2_rgpool *pool, struct gfs2_sbd *sdp, const struct lgfs2_rgjob *job)
+{
+	struct osi_node *n;
+	lgfs2_rgrp_t *rgs;
+	unsigned count = 0;
+	unsigned nthreads;
+	unsigned passed = 0;
+	int ret = 0;
+
+	for (n = osi_first(&sdp->rgtree); n != NULL; n = osi_next(n))
+		count++;
+	if (count == 0)
+		return 0;
+	rgs = malloc(count * sizeof(*rgs));
+	if (rgs == NULL)
+		return -1;
+	count = 0;
+	for (n = osi_first(&sdp->rgtree); n != NULL; n = osi_next(n))
+		rgs[count++] = (lgfs2_rgrp_t)n;
+
+	nthreads = lgfs2_rgpool_threads(pool);
+	if (nthreads == 1 || count == 1) {
+		ret = rgpool_run_serial(sdp, rgs, count, job);
+		free(rgs);
+		return ret;
+	}
+
+	pool->rp_results = calloc(count, job->rj_result_size ? job->rj_result_size : 1);
+	pool->rp_done = calloc(count, sizeof(*pool->rp_done));
+	if (pool->rp_results == NULL || pool->rp_done == NULL) {
+		free(pool->rp_results);
+		free(pool->rp_done);
+		free(rgs);
+		return -1;
+	}
+	for (unsigned i = 0; i < nthreads; i++) {
+		pool->rp_deques[i].rd_head = (uint64_t)count * i / nthreads;
+		pool->rp_deques[i].rd_tail = (uint64_t)count * (i + 1) / nthreads;
+	}
+	pthread_mutex_lock(&pool->rp_lock);
+	pool->rp_sdp = sdp;
+	pool->rp_job = job;
+	pool->rp_rgs = rgs;
+	pool->rp_count = count;
+	pool->rp_next = 0;
+	pool->rp_ndone = 0;
+	pool->rp_stop = 0;
+	pool->rp_error = 0;
+	pool->rp_running = nthreads;
+	pool->rp_generation++;
+	pthread_cond_broadcast(&pool->rp_start);
+	pthread_mutex_unlock(&pool->rp_lock);
+
+	for (unsigned i = 0; i < count; i++) {
+		int done;
+
+		pthread_mutex_lock(&pool->rp_lock);
+		while (!pool->rp_done[i] && pool->rp_running > 0)
+			pthread_cond_wait(&pool->rp_progress, &pool->rp_lock);
+		done = pool->rp_done[i];
+		pthread_mutex_unlock(&pool->rp_lock);
+		/* The run stopped before this resource group was reached */
+		if (!done)
+			break;
+		if (rgpool_cancelled(job))
+			break;
+		passed++;
+		if (job->rj_done != NULL)
+			ret = job->rj_done(sdp, rgs[i], rgpool_result(pool, i), job->rj_arg);
+		if (ret != 0)
+			break;
+		if (job->rj_window > 0) {
+			pthread_mutex_lock(&pool->rp_lock);
+			pool->rp_ndone = passed;
+			pthread_cond_broadcast(&pool->rp_advance);
+			pthread_mutex_unlock(&pool->rp_lock);
+		}
+	}
+
+	pthread_mutex_lock(&pool->rp_lock);
+	if (passed < count)
+		__atomic_store_n(&pool->rp_stop, 1, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&pool->rp_advance);
+	while (pool->rp_running > 0)
+		pthread_cond_wait(&pool->rp_progress, &pool->rp_lock);
+	pthread_mutex_unlock(&pool->rp_lock);
+
+	if (ret == 0)
+		ret = pool->rp_error;
+	if (ret == 0 && rgpool_cancelled(job)) {
+		errno = ECANCELED;
+		ret = -1;
+	}
+	free(pool->rp_results);
+	free(pool->rp_done);
+	free(rgs);
+	pool->rp_results = NULL;
+	pool->rp_done = NULL;
+	pool->rp_rgs = NULL;
+	pool->rp_job = NULL;
+	return ret;
+}
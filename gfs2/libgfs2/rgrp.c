@@ -79,14 +79,134 @@ errbits:
 }
 
 
-/**
- * blk2rgrpd - Find resource group for a given data block number
- * @sdp: The GFS superblock
- * @n: The data block number
+/*
+ * Resource group lookup
  *
- * Returns: Ths resource group, or NULL if not found
+ * gfs2_blk2rgrpd() is called for most blocks that the tools look at, so
+ * rather than walking the tree each time it uses a sorted array of the
+ * resource groups' extents, built from sdp->rgtree when it is first needed.
+ * Any change to a resource group tree bumps rgtree_gen, which causes the
+ * array to be rebuilt on the next lookup, as does sdp->rgtree being replaced.
+ * The last resource group found is remembered per thread as lookups tend to
+ * hit the same one many times in a row.
+ *
+ * Lookups may be done by several threads at once. The array is built under
+ * rgindex_lock and only published when it is complete, but the tree must not
+ * be changed while other threads are looking up resource groups.
  */
-struct rgrp_tree *gfs2_blk2rgrpd(struct gfs2_sbd *sdp, uint64_t blk)
+
+struct lgfs2_rgindex {
+	uint64_t *ri_start;  /* rt_addr of each resource group, sorted */
+	uint64_t *ri_end;    /* The block after the end of each resource group */
+	struct rgrp_tree **ri_rgs;
+	unsigned ri_count;
+	unsigned ri_size;
+	unsigned long ri_gen;
+	struct osi_node *ri_root;
+};
+
+static unsigned long rgtree_gen = 1;
+static pthread_mutex_t rgindex_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct {
+	const struct lgfs2_rgindex *index;
+	unsigned long gen;
+	struct rgrp_tree *rg;
+} rgindex_hit;
+
+/* Note that a resource group tree has changed */
+static inline void rgtree_changed(void)
+{
+	__atomic_add_fetch(&rgtree_gen, 1, __ATOMIC_RELAXED);
+}
+
+void lgfs2_rgindex_free(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_rgindex *ri = sdp->rgindex;
+
+	if (ri == NULL)
+		return;
+	free(ri->ri_start);
+	free(ri->ri_end);
+	free(ri->ri_rgs);
+	free(ri);
+	sdp->rgindex = NULL;
+}
+
+static int rgindex_current(const struct gfs2_sbd *sdp, const struct lgfs2_rgindex *ri)
+{
+	return ri != NULL && ri->ri_gen == __atomic_load_n(&rgtree_gen, __ATOMIC_RELAXED) &&
+	       ri->ri_root == sdp->rgtree.osi_node;
+}
+
+static struct lgfs2_rgindex *rgindex_build(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_rgindex *ri = sdp->rgindex;
+	struct osi_node *n;
+	unsigned count = 0;
+
+	/* Another thread may have built it while we waited for the lock */
+	if (rgindex_current(sdp, ri))
+		return ri;
+	if (ri == NULL) {
+		ri = calloc(1, sizeof(*ri));
+		if (ri == NULL)
+			return NULL;
+	}
+	for (n = osi_first(&sdp->rgtree); n != NULL; n = osi_next(n))
+		count++;
+	if (count > ri->ri_size) {
+		uint64_t *start = realloc(ri->ri_start, count * sizeof(*start));
+		uint64_t *end = realloc(ri->ri_end, count * sizeof(*end));
+		struct rgrp_tree **rgs = realloc(ri->ri_rgs, count * sizeof(*rgs));
+
+		if (start != NULL)
+			ri->ri_start = start;
+		if (end != NULL)
+			ri->ri_end = end;
+		if (rgs != NULL)
+			ri->ri_rgs = rgs;
+		if (start == NULL || end == NULL || rgs == NULL) {
+			sdp->rgindex = ri;
+			lgfs2_rgindex_free(sdp);
+			return NULL;
+		}
+		ri->ri_size = count;
+	}
+	ri->ri_count = 0;
+	for (n = osi_first(&sdp->rgtree); n != NULL; n = osi_next(n)) {
+		struct rgrp_tree *rg = (struct rgrp_tree *)n;
+
+		ri->ri_start[ri->ri_count] = rg->rt_addr;
+		ri->ri_end[ri->ri_count] = rg->rt_data0 + rg->rt_data;
+		ri->ri_rgs[ri->ri_count] = rg;
+		ri->ri_count++;
+	}
+	ri->ri_gen = __atomic_load_n(&rgtree_gen, __ATOMIC_RELAXED);
+	ri->ri_root = sdp->rgtree.osi_node;
+	__atomic_store_n(&sdp->rgindex, ri, __ATOMIC_RELEASE);
+	return ri;
+}
+
+static struct lgfs2_rgindex *rgindex_get(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_rgindex *ri = __atomic_load_n(&sdp->rgindex, __ATOMIC_ACQUIRE);
+
+	if (rgindex_current(sdp, ri))
+		return ri;
+	pthread_mutex_lock(&rgindex_lock);
+	ri = rgindex_build(sdp);
+	pthread_mutex_unlock(&rgindex_lock);
+	return ri;
+}
+
+static inline int rgrp_contains(const struct rgrp_tree *rg, uint64_t blk)
+{
+	return blk >= rg->rt_addr && blk < rg->rt_data0 + rg->rt_data;
+}
+
+/* Walk the tree, for when the array can't be used */
+static struct rgrp_tree *rgtree_lookup(struct gfs2_sbd *sdp, uint64_t blk)
 {
 	struct rgrp_tree *rgd = (struct rgrp_tree *)sdp->rgtree.osi_node;
 	while (rgd) {
@@ -100,6 +220,41 @@ struct rgrp_tree *gfs2_blk2rgrpd(struct gfs2_sbd *sdp, uint64_t blk)
 	return NULL;
 }
 
+/**
+ * blk2rgrpd - Find resource group for a given data block number
+ * @sdp: The GFS superblock
+ * @n: The data block number
+ *
+ * Returns: Ths resource group, or NULL if not found
+ */
+struct rgrp_tree *gfs2_blk2rgrpd(struct gfs2_sbd *sdp, uint64_t blk)
+{
+	struct lgfs2_rgindex *ri = rgindex_get(sdp);
+	const uint64_t *base;
+	unsigned n, i;
+
+	if (ri == NULL || ri->ri_count == 0)
+		return rgtree_lookup(sdp, blk);
+	if (rgindex_hit.index == ri && rgindex_hit.gen == ri->ri_gen &&
+	    rgrp_contains(rgindex_hit.rg, blk))
+		return rgindex_hit.rg;
+
+	/* Find the last resource group starting at or before blk, without
+	   branching on the comparisons */
+	base = ri->ri_start;
+	for (n = ri->ri_count; n > 1; n -= n / 2)
+		base = (base[n / 2] <= blk) ? base + n / 2 : base;
+	i = base - ri->ri_start;
+
+	/* Resource groups can be changed in place, so check the real thing too */
+	if (blk >= ri->ri_end[i] || !rgrp_contains(ri->ri_rgs[i], blk))
+		return rgtree_lookup(sdp, blk);
+	rgindex_hit.index = ri;
+	rgindex_hit.gen = ri->ri_gen;
+	rgindex_hit.rg = ri->ri_rgs[i];
+	return ri->ri_rgs[i];
+}
+
 /**
  * Allocate a multi-block buffer for a resource group's bitmaps. This is done
  * as one chunk and should be freed using lgfs2_rgrp_bitbuf_free().
@@ -124,6 +279,7 @@ int lgfs2_rgrp_bitbuf_alloc(lgfs2_rgrp_t rg)
 	}
 	memset(bufs, 0, len);
 
+	lgfs2_rgrp_extents_free(rg);
 	for (i = 0; i < rg->rt_length; i++) {
 		rg->bits[i].bi_data = bufs + (i * sdp->sd_bsize);
 		rg->bits[i].bi_modified = 0;
@@ -142,6 +298,7 @@ void lgfs2_rgrp_bitbuf_free(lgfs2_rgrp_t rg)
 {
 	unsigned i;
 
+	lgfs2_rgrp_extents_free(rg);
 	free(rg->bits[0].bi_data);
 	for (i = 0; i < rg->rt_length; i++) {
 		rg->bits[i].bi_data = NULL;
@@ -182,12 +339,261 @@ void lgfs2_rgrp_crc_set(char *buf)
 	rg->rg_crc = cpu_to_be32(crc);
 }
 
+/*
+ * Reading resource groups
+ *
+ * A resource group's header fields are read into the rgrp_tree by
+ * lgfs2_rgrp_read_hdr() and its bitmap blocks by lgfs2_rgrp_read_bits().
+ * gfs2_rgrp_read() does both with one read from the device.
+ *
+ * When lgfs2_rgcache_init() has been called, the bitmaps of the resource
+ * groups read after that are also read in on demand by gfs2_set_bitmap(),
+ * lgfs2_get_bitmap(), lgfs2_get_bitmaps() and lgfs2_rgrp_pin(). When the
+ * bitmaps in memory would take up more than the cache's budget, the least
+ * recently used ones are dropped, after being written back if they were
+ * modified. The header fields always stay in memory.
+ *
+ * A resource group's bitmaps are loaded and dropped with its rt_lock held.
+ * The list of resource groups with bitmaps in memory is kept in least
+ * recently used order and protected by rc_lock, which is taken while holding
+ * an rt_lock. Eviction takes resource groups from the head of the list and
+ * only tries their locks, moving those in use to the tail. Pinned
+ * resource groups are not dropped, so the budget can be exceeded while
+ * there are more pinned resource groups than fit in it.
+ */
+
+struct lgfs2_rgcache {
+	struct gfs2_sbd *rc_sdp;
+	pthread_mutex_t rc_lock;
+	osi_list_t rc_resident; /* Resource groups with bitmaps in memory, least recently used first */
+	unsigned rc_count;      /* Entries in rc_resident */
+	uint64_t rc_clock;      /* Advanced for each load, for rt_lastuse */
+	struct lgfs2_rgcache_stats rc_stats;
+};
+
+static inline size_t rgrp_bits_size(const struct gfs2_sbd *sdp, const struct rgrp_tree *rgd)
+{
+	return (size_t)rgd->rt_length * sdp->sd_bsize;
+}
+
+/* Move a resource group to the most recently used end of the list. Called
+   with rc_lock held. */
+static void rgcache_move_tail(struct lgfs2_rgcache *rc, struct rgrp_tree *rgd)
+{
+	osi_list_del(&rgd->rt_resident);
+	osi_list_add_prev(&rgd->rt_resident, &rc->rc_resident);
+	__atomic_store_n(&rgd->rt_lastuse, rc->rc_clock, __ATOMIC_RELAXED);
+}
+
+/* Note that a resource group's bitmaps have been used. It is only moved once
+   between loads, so most uses don't take rc_lock. Called with its rt_lock held. */
+static inline void rgcache_touch(struct lgfs2_rgcache *rc, struct rgrp_tree *rgd)
+{
+	uint64_t now = __atomic_load_n(&rc->rc_clock, __ATOMIC_RELAXED);
+
+	if (__atomic_load_n(&rgd->rt_lastuse, __ATOMIC_RELAXED) == now)
+		return;
+	pthread_mutex_lock(&rc->rc_lock);
+	rgcache_move_tail(rc, rgd);
+	pthread_mutex_unlock(&rc->rc_lock);
+}
+
+/* Write the modified blocks of a resource group's bitmaps */
+static int rgrp_write_bits(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
+{
+	int err = 0;
+
+	/* The blocks are contiguous in memory so write runs of modified blocks together */
+	for (unsigned i = 0; i < rgd->rt_length; i++) {
+		off_t offset = sdp->sd_bsize * (rgd->rt_addr + i);
+		size_t len;
+		unsigned n;
+		ssize_t ret;
+
+		if (rgd->bits[i].bi_data == NULL || !rgd->bits[i].bi_modified)
+			continue;
+
+		for (n = 1; i + n < rgd->rt_length && rgd->bits[i + n].bi_modified; n++)
+			rgd->bits[i + n].bi_modified = 0;
+		len = n * sdp->sd_bsize;
+
+		lgfs2_bcache_invalidate(sdp, rgd->rt_addr + i, n);
+		lgfs2_iostats_site(__FUNCTION__, __LINE__);
+		ret = lgfs2_dev_pwrite(sdp, rgd->bits[i].bi_data, len, offset);
+		if (ret != len) {
+			fprintf(stderr, "Failed to write modified resource group at block %"PRIu64": %s\n",
+			        rgd->rt_addr, strerror(errno));
+			err = -1;
+		}
+		rgd->bits[i].bi_modified = 0;
+		i += n - 1;
+	}
+	return err;
+}
+
+static void rgrp_drop_bits(struct rgrp_tree *rgd)
+{
+	lgfs2_rgrp_extents_free(rgd);
+	free(rgd->bits[0].bi_data);
+	for (unsigned i = 0; i < rgd->rt_length; i++) {
+		rgd->bits[i].bi_data = NULL;
+		rgd->bits[i].bi_modified = 0;
+	}
+}
+
+/* Write back and drop a resource group's bitmaps to make room. Called with
+   rc_lock and the resource group's rt_lock held. */
+static void rgcache_evict(struct lgfs2_rgcache *rc, struct rgrp_tree *rgd)
+{
+	for (unsigned i = 0; i < rgd->rt_length; i++) {
+		if (rgd->bits[i].bi_modified) {
+			rc->rc_stats.rcs_writebacks++;
+			break;
+		}
+	}
+	rgrp_write_bits(rc->rc_sdp, rgd);
+	rgrp_drop_bits(rgd);
+	osi_list_del(&rgd->rt_resident);
+	rc->rc_count--;
+	rc->rc_stats.rcs_resident -= rgrp_bits_size(rc->rc_sdp, rgd);
+	rc->rc_stats.rcs_evictions++;
+}
+
+/* Drop the least recently used bitmaps until the ones in memory fit in the
+   budget. Called with rc_lock held. */
+static void rgcache_shrink(struct lgfs2_rgcache *rc)
+{
+	unsigned tries = rc->rc_count;
+
+	while (rc->rc_stats.rcs_resident > rc->rc_stats.rcs_max && tries-- > 0) {
+		struct rgrp_tree *victim;
+
+		victim = osi_list_entry(rc->rc_resident.next, struct rgrp_tree, rt_resident);
+		if (pthread_mutex_trylock(&victim->rt_lock) == 0) {
+			if (victim->rt_pins == 0) {
+				rgcache_evict(rc, victim);
+				pthread_mutex_unlock(&victim->rt_lock);
+				continue;
+			}
+			pthread_mutex_unlock(&victim->rt_lock);
+		}
+		/* It's in use, which makes it the most recently used */
+		rgcache_move_tail(rc, victim);
+	}
+}
+
+/* Account for a resource group's newly read bitmaps. Called with its rt_lock held. */
+static void rgcache_add(struct lgfs2_rgcache *rc, struct rgrp_tree *rgd)
+{
+	pthread_mutex_lock(&rc->rc_lock);
+	rgd->rt_cache = rc;
+	osi_list_add_prev(&rgd->rt_resident, &rc->rc_resident);
+	rc->rc_count++;
+	rc->rc_stats.rcs_loads++;
+	rc->rc_stats.rcs_resident += rgrp_bits_size(rc->rc_sdp, rgd);
+	if (rc->rc_stats.rcs_resident > rc->rc_stats.rcs_peak)
+		rc->rc_stats.rcs_peak = rc->rc_stats.rcs_resident;
+	__atomic_store_n(&rc->rc_clock, rc->rc_clock + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&rgd->rt_lastuse, rc->rc_clock, __ATOMIC_RELAXED);
+	rgcache_shrink(rc);
+	pthread_mutex_unlock(&rc->rc_lock);
+}
+
+/* Forget a resource group's bitmaps, which are about to be dropped by the caller */
+static void rgcache_del(struct lgfs2_rgcache *rc, struct rgrp_tree *rgd)
+{
+	pthread_mutex_lock(&rc->rc_lock);
+	osi_list_del(&rgd->rt_resident);
+	rc->rc_count--;
+	rc->rc_stats.rcs_resident -= rgrp_bits_size(rc->rc_sdp, rgd);
+	pthread_mutex_unlock(&rc->rc_lock);
+}
+
 /**
- * gfs2_rgrp_read - read in the resource group information from disk.
- * @rgd - resource group structure
- * returns: 0 if no error, otherwise the block number that failed
+ * Set up on-demand loading of resource group bitmaps for the resource groups
+ * read after this call. See above.
+ * maxbytes: The most memory to use for the bitmaps
+ * Returns 0 on success or non-zero with errno set on failure.
  */
-uint64_t gfs2_rgrp_read(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
+int lgfs2_rgcache_init(struct gfs2_sbd *sdp, size_t maxbytes)
+{
+	struct lgfs2_rgcache *rc;
+
+	if (sdp->rgcache != NULL || maxbytes == 0) {
+		errno = EINVAL;
+		return 1;
+	}
+	rc = calloc(1, sizeof(*rc));
+	if (rc == NULL)
+		return 1;
+	rc->rc_sdp = sdp;
+	pthread_mutex_init(&rc->rc_lock, NULL);
+	osi_list_init(&rc->rc_resident);
+	rc->rc_stats.rcs_max = maxbytes;
+	sdp->rgcache = rc;
+	return 0;
+}
+
+/**
+ * Write back and drop the bitmaps in memory and stop loading them on demand.
+ * Returns 0 on success or non-zero if the bitmaps could not all be written.
+ */
+int lgfs2_rgcache_free(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_rgcache *rc = sdp->rgcache;
+	struct osi_node *n;
+	int err = 0;
+
+	if (rc == NULL)
+		return 0;
+	while (!osi_list_empty(&rc->rc_resident)) {
+		struct rgrp_tree *rgd;
+
+		rgd = osi_list_entry(rc->rc_resident.next, struct rgrp_tree, rt_resident);
+		if (rgrp_write_bits(sdp, rgd) != 0)
+			err = 1;
+		rgrp_drop_bits(rgd);
+		osi_list_del(&rgd->rt_resident);
+		rgd->rt_cache = NULL;
+	}
+	for (n = osi_first(&sdp->rgtree); n != NULL; n = osi_next(n))
+		((struct rgrp_tree *)n)->rt_cache = NULL;
+	pthread_mutex_destroy(&rc->rc_lock);
+	free(rc);
+	sdp->rgcache = NULL;
+	return err;
+}
+
+void lgfs2_rgcache_stats(struct gfs2_sbd *sdp, struct lgfs2_rgcache_stats *stats)
+{
+	struct lgfs2_rgcache *rc = sdp->rgcache;
+
+	if (rc == NULL) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+	pthread_mutex_lock(&rc->rc_lock);
+	*stats = rc->rc_stats;
+	pthread_mutex_unlock(&rc->rc_lock);
+}
+
+/* Parse the header of a resource group from its first block */
+static uint64_t rgrp_hdr_in(struct gfs2_sbd *sdp, struct rgrp_tree *rgd, char *buf)
+{
+	if (gfs2_check_meta(buf, GFS2_METATYPE_RG))
+		return rgd->rt_addr;
+	if (sdp->gfs1)
+		lgfs2_gfs_rgrp_in(rgd, buf);
+	else {
+		if (lgfs2_rgrp_crc_check(buf))
+			return rgd->rt_addr;
+		lgfs2_rgrp_in(rgd, buf);
+	}
+	return 0;
+}
+
+/* Read a resource group's bitmaps, with its rt_lock held if other threads could be using it */
+static uint64_t rgrp_load(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
 {
 	unsigned length = rgd->rt_length * sdp->sd_bsize;
 	off_t offset = rgd->rt_addr * sdp->sd_bsize;
@@ -196,58 +602,194 @@ uint64_t gfs2_rgrp_read(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
 	if (length == 0 || gfs2_check_range(sdp, rgd->rt_addr))
 		return -1;
 
-	buf = calloc(1, length);
+	buf = lgfs2_dev_buf(sdp, length);
 	if (buf == NULL)
 		return -1;
 
-	if (pread(sdp->device_fd, buf, length, offset) != length) {
+	lgfs2_rgrp_extents_free(rgd);
+	lgfs2_bcache_invalidate(sdp, rgd->rt_addr, rgd->rt_length);
+	lgfs2_iostats_site(__FUNCTION__, __LINE__);
+	if (lgfs2_dev_pread(sdp, buf, length, offset) != length) {
 		free(buf);
 		return -1;
 	}
+	if (rgd->bits[0].bi_data != NULL && rgd->rt_cache != NULL)
+		rgcache_del(rgd->rt_cache, rgd);
 
 	for (unsigned i = 0; i < rgd->rt_length; i++) {
 		int mtype = (i ? GFS2_METATYPE_RB : GFS2_METATYPE_RG);
 
 		rgd->bits[i].bi_data = buf + (i * sdp->sd_bsize);
+		rgd->bits[i].bi_modified = 0;
 		if (gfs2_check_meta(rgd->bits[i].bi_data, mtype)) {
 			free(buf);
-			rgd->bits[0].bi_data = NULL;
+			for (unsigned j = 0; j <= i; j++)
+				rgd->bits[j].bi_data = NULL;
 			return rgd->rt_addr + i;
 		}
 	}
-	if (sdp->gfs1)
-		lgfs2_gfs_rgrp_in(rgd, buf);
-	else {
-		if (lgfs2_rgrp_crc_check(buf)) {
-			free(buf);
-			return rgd->rt_addr;
+	if (sdp->rgcache != NULL)
+		rgcache_add(sdp->rgcache, rgd);
+	return 0;
+}
+
+/**
+ * lgfs2_rgrp_read_hdr - read the header fields of a resource group
+ * The header is taken from the bitmaps if they are in memory, otherwise only
+ * the first block of the resource group is read.
+ * Returns: 0 if no error, otherwise the block number that failed
+ */
+uint64_t lgfs2_rgrp_read_hdr(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
+{
+	uint64_t ret;
+	char *buf;
+
+	if (rgd->rt_length == 0 || gfs2_check_range(sdp, rgd->rt_addr))
+		return -1;
+
+	lgfs2_rgrp_lock(rgd);
+	if (rgd->bits[0].bi_data != NULL) {
+		ret = rgrp_hdr_in(sdp, rgd, rgd->bits[0].bi_data);
+		goto out;
+	}
+	ret = -1;
+	buf = lgfs2_dev_buf(sdp, sdp->sd_bsize);
+	if (buf == NULL)
+		goto out;
+	lgfs2_iostats_site(__FUNCTION__, __LINE__);
+	if (lgfs2_dev_pread(sdp, buf, sdp->sd_bsize, rgd->rt_addr * sdp->sd_bsize) == sdp->sd_bsize)
+		ret = rgrp_hdr_in(sdp, rgd, buf);
+	free(buf);
+	if (ret == 0 && sdp->rgcache != NULL)
+		rgd->rt_cache = sdp->rgcache;
+out:
+	lgfs2_rgrp_unlock(rgd);
+	return ret;
+}
+
+/**
+ * lgfs2_rgrp_read_bits - read in the bitmap blocks of a resource group
+ * The header fields are left as they are.
+ * Returns: 0 if no error, otherwise the block number that failed
+ */
+uint64_t lgfs2_rgrp_read_bits(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
+{
+	uint64_t ret;
+
+	lgfs2_rgrp_lock(rgd);
+	ret = rgrp_load(sdp, rgd);
+	lgfs2_rgrp_unlock(rgd);
+	return ret;
+}
+
+/**
+ * gfs2_rgrp_read - read in the resource group information from disk.
+ * @rgd - resource group structure
+ * returns: 0 if no error, otherwise the block number that failed
+ */
+uint64_t gfs2_rgrp_read(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
+{
+	uint64_t ret;
+
+	lgfs2_rgrp_lock(rgd);
+	ret = rgrp_load(sdp, rgd);
+	if (ret == 0) {
+		ret = rgrp_hdr_in(sdp, rgd, rgd->bits[0].bi_data);
+		if (ret != 0) {
+			if (rgd->rt_cache != NULL)
+				rgcache_del(rgd->rt_cache, rgd);
+			rgrp_drop_bits(rgd);
 		}
-		lgfs2_rgrp_in(rgd, buf);
+	}
+	lgfs2_rgrp_unlock(rgd);
+	return ret;
+}
+
+/**
+ * Make sure that a resource group's bitmaps are in memory, reading them in if
+ * they were dropped or have not been read yet. Called with the resource
+ * group's rt_lock held.
+ * Returns 0 on success, including when the bitmaps are not loaded on demand,
+ * or non-zero if they could not be read.
+ */
+int lgfs2_rgrp_fault(lgfs2_rgrp_t rg)
+{
+	struct lgfs2_rgcache *rc = rg->rt_cache;
+
+	if (rc == NULL)
+		return 0;
+	if (rg->bits[0].bi_data != NULL) {
+		rgcache_touch(rc, rg);
+		return 0;
+	}
+	if (rgrp_load(rc->rc_sdp, rg) != 0) {
+		errno = EIO;
+		return 1;
 	}
 	return 0;
 }
 
-void gfs2_rgrp_relse(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
+/**
+ * Keep a resource group's bitmaps in memory until lgfs2_rgrp_unpin(), reading
+ * them in if needed. Pins can be nested. Does nothing if the bitmaps are not
+ * loaded on demand.
+ * Returns 0 on success or non-zero if the bitmaps could not be read.
+ */
+int lgfs2_rgrp_pin(lgfs2_rgrp_t rg)
 {
-	if (rgd->bits == NULL)
+	int ret = 0;
+
+	if (rg->rt_cache == NULL)
+		return 0;
+	lgfs2_rgrp_lock(rg);
+	ret = lgfs2_rgrp_fault(rg);
+	if (ret == 0)
+		rg->rt_pins++;
+	lgfs2_rgrp_unlock(rg);
+	return ret;
+}
+
+void lgfs2_rgrp_unpin(lgfs2_rgrp_t rg)
+{
+	struct lgfs2_rgcache *rc = rg->rt_cache;
+
+	if (rc == NULL)
 		return;
-	for (unsigned i = 0; i < rgd->rt_length; i++) {
-		off_t offset = sdp->sd_bsize * (rgd->rt_addr + i);
-		ssize_t ret;
+	lgfs2_rgrp_lock(rg);
+	rg->rt_pins--;
+	lgfs2_rgrp_unlock(rg);
+	/* Pins may have kept more bitmaps than the budget allows */
+	pthread_mutex_lock(&rc->rc_lock);
+	rgcache_shrink(rc);
+	pthread_mutex_unlock(&rc->rc_lock);
+}
 
-		if (rgd->bits[i].bi_data == NULL || !rgd->bits[i].bi_modified)
-			continue;
+/**
+ * Copy a resource group's header fields into its first bitmap block, which
+ * is marked as modified so that they are written out with the bitmaps.
+ * Returns 0 on success or non-zero if the bitmaps could not be read in.
+ */
+int lgfs2_rgrp_hdr_update(struct gfs2_sbd *sdp, lgfs2_rgrp_t rg)
+{
+	if (lgfs2_rgrp_pin(rg) != 0)
+		return 1;
+	if (sdp->gfs1)
+		lgfs2_gfs_rgrp_out(rg, rg->bits[0].bi_data);
+	else
+		lgfs2_rgrp_out(rg, rg->bits[0].bi_data);
+	rg->bits[0].bi_modified = 1;
+	lgfs2_rgrp_unpin(rg);
+	return 0;
+}
 
-		ret = pwrite(sdp->device_fd, rgd->bits[i].bi_data, sdp->sd_bsize, offset);
-		if (ret != sdp->sd_bsize) {
-			fprintf(stderr, "Failed to write modified resource group at block %"PRIu64": %s\n",
-			        rgd->rt_addr, strerror(errno));
-		}
-		rgd->bits[i].bi_modified = 0;
-	}
-	free(rgd->bits[0].bi_data);
-	for (unsigned i = 0; i < rgd->rt_length; i++)
-		rgd->bits[i].bi_data = NULL;
+void gfs2_rgrp_relse(struct gfs2_sbd *sdp, struct rgrp_tree *rgd)
+{
+	if (rgd->bits == NULL)
+		return;
+	if (rgd->bits[0].bi_data != NULL && rgd->rt_cache != NULL)
+		rgcache_del(rgd->rt_cache, rgd);
+	rgrp_write_bits(sdp, rgd);
+	rgrp_drop_bits(rgd);
 }
 
 struct rgrp_tree *rgrp_insert(struct osi_root *rgtree, uint64_t rgblock)
@@ -272,9 +814,11 @@ struct rgrp_tree *rgrp_insert(struct osi_root *rgtree, uint64_t rgblock)
 	if (!data)
 		return NULL;
 	/* Add new node and rebalance tree. */
+	pthread_mutex_init(&data->rt_lock, NULL);
 	data->rt_addr = rgblock;
 	osi_link_node(&data->node, parent, newn);
 	osi_insert_color(&data->node, rgtree);
+	rgtree_changed();
 
 	return data;
 }
@@ -284,8 +828,11 @@ void gfs2_rgrp_free(struct gfs2_sbd *sdp, struct osi_root *rgrp_tree)
 	struct rgrp_tree *rgd;
 	struct osi_node *n;
 
+	if (rgrp_tree == &sdp->rgtree)
+		lgfs2_rgindex_free(sdp);
 	if (OSI_EMPTY_ROOT(rgrp_tree))
 		return;
+	rgtree_changed();
 	while ((n = osi_first(rgrp_tree))) {
 		rgd = (struct rgrp_tree *)n;
 
@@ -293,6 +840,7 @@ void gfs2_rgrp_free(struct gfs2_sbd *sdp, struct osi_root *rgrp_tree)
 		free(rgd->bits);
 		rgd->bits = NULL;
 		osi_erase(&rgd->node, rgrp_tree);
+		pthread_mutex_destroy(&rgd->rt_lock);
 		free(rgd);
 	}
 }
@@ -504,13 +1052,18 @@ void lgfs2_rgrps_free(lgfs2_rgrps_t *rgs)
 	lgfs2_rgrp_t rg;
 	struct osi_root *tree = &(*rgs)->root;
 
+	rgtree_changed();
 	while ((rg = (struct rgrp_tree *)osi_first(tree))) {
 		int i;
+		if (rg->bits[0].bi_data != NULL && rg->rt_cache != NULL)
+			rgcache_del(rg->rt_cache, rg);
+		lgfs2_rgrp_extents_free(rg);
 		free(rg->bits[0].bi_data);
 		for (i = 0; i < rg->rt_length; i++) {
 			rg->bits[i].bi_data = NULL;
 		}
 		osi_erase(&rg->node, tree);
+		pthread_mutex_destroy(&rg->rt_lock);
 		free(rg);
 	}
 	free((*rgs)->plan);
@@ -609,6 +1162,7 @@ unsigned lgfs2_rgsize_for_data(uint64_t blksreq, unsigned bsize)
 void lgfs2_attach_rgrps(struct gfs2_sbd *sdp, lgfs2_rgrps_t rgs)
 {
 	sdp->rgtree.osi_node = rgs->root.osi_node;
+	rgtree_changed();
 }
 
 /**
@@ -640,9 +1194,11 @@ lgfs2_rgrp_t lgfs2_rgrps_append(lgfs2_rgrps_t rgs, struct gfs2_rindex *entry, ui
 		return NULL;
 
 	rg->bits = (struct gfs2_bitmap *)(rg + 1);
+	pthread_mutex_init(&rg->rt_lock, NULL);
 
 	osi_link_node(&rg->node, parent, link);
 	osi_insert_color(&rg->node, &rgs->root);
+	rgtree_changed();
 
 	rg->rt_addr = be64_to_cpu(entry->ri_addr);
 	rg->rt_length = be32_to_cpu(entry->ri_length);
@@ -689,6 +1245,7 @@ int lgfs2_rgrp_write(int fd, const lgfs2_rgrp_t rg)
 	if (rg->rgrps->align > 0)
 		len = ROUND_UP(len, rg->rgrps->align * sdp->sd_bsize);
 
+	lgfs2_bcache_invalidate(sdp, rg->rt_addr, rg->rt_length);
 	ret = pwrite(fd, rg->bits[0].bi_data, len, rg->rt_addr * sdp->sd_bsize);
 
 	if (freebufs)
@@ -734,6 +1291,22 @@ lgfs2_rgrp_t lgfs2_rgrp_last(lgfs2_rgrps_t rgs)
 	return (lgfs2_rgrp_t)osi_last(&rgs->root);
 }
 
+/**
+ * Lock a resource group against changes made by other threads
+ * gfs2_set_bitmap() takes the lock itself, so it must not be held by the
+ * caller when marking blocks. Hold it to update the counters in rt_free,
+ * rt_dinodes etc. or to read them together with the bitmaps.
+ */
+void lgfs2_rgrp_lock(lgfs2_rgrp_t rg)
+{
+	pthread_mutex_lock(&rg->rt_lock);
+}
+
+void lgfs2_rgrp_unlock(lgfs2_rgrp_t rg)
+{
+	pthread_mutex_unlock(&rg->rt_lock);
+}
+
 /**
  * gfs2_rbm_from_block - Set the rbm based upon rgd and block number
  * @rbm: The rbm with rgd already set correctly
@@ -935,6 +1508,20 @@ int lgfs2_rbm_find(struct lgfs2_rbm *rbm, uint8_t state, uint32_t *minext)
 	int iters = rbm->rgd->rt_length;
 	uint32_t extlen;
 
+	if (state == GFS2_BLKST_FREE) {
+		uint64_t addr;
+
+		if (rbm->rgd->rt_free < *minext) {
+			errno = ENOSPC;
+			return 1;
+		}
+		if (lgfs2_rgrp_extent_find(rbm->rgd, lgfs2_rbm_to_block(rbm), *minext, &addr, NULL) == 0)
+			return lgfs2_rbm_from_block(rbm, addr);
+		if (errno == ENOSPC)
+			return 1;
+		/* Fall back to searching the bitmaps */
+	}
+
 	/* If we are not starting at the beginning of a bitmap, then we
 	 * need to add one to the bitmap count to ensure that we search
 	 * the starting bitmap twice.
@@ -1019,3 +1606,540 @@ unsigned lgfs2_alloc_extent(const struct lgfs2_rbm *rbm, int state, const unsign
 	}
 	return len;
 }
+
+/*
+ * Free extent index
+ *
+ * To avoid scanning the bitmaps for each allocation, each resource group can
+ * have an index of its free extents. It is built from the bitmaps the first
+ * time it is needed and kept up to date by gfs2_set_bitmap(). Code which
+ * changes the bitmaps in any other way must drop it with
+ * lgfs2_rgrp_extents_free() so that it is rebuilt.
+ *
+ * The extents are kept sorted by address in leaves of up to EXTENTS_LEAF
+ * extents, along with a tree of the longest extent in each range of leaves,
+ * so that the first extent of a given length can be found in O(log n). A
+ * bitmap change updates one leaf and the tree above it, so splitting or
+ * merging extents only moves the extents of that leaf along. The leaves are
+ * only moved and the tree rebuilt when a leaf fills up and is split, or
+ * empties and is removed.
+ */
+
+#define EXTENTS_LEAF (128)
+
+struct lgfs2_extent {
+	uint32_t e_start; /* Data block offset in the resource group */
+	uint32_t e_len;
+};
+
+struct extents_leaf {
+	unsigned el_count; /* Never 0 */
+	uint32_t el_max;   /* The longest extent in el_list */
+	struct lgfs2_extent el_list[EXTENTS_LEAF];
+};
+
+struct lgfs2_extents {
+	struct extents_leaf **ex_leaves;
+	uint32_t *ex_max;  /* ex_max[1] is the root and ex_max[ex_size + l] is ex_leaves[l]->el_max */
+	unsigned ex_nleaves;
+	unsigned ex_size;  /* Room in ex_leaves, always a power of two */
+};
+
+/* Extent i of leaf l. i is -1 before the first extent */
+struct extent_pos {
+	unsigned l;
+	int i;
+};
+
+static void extents_destroy(struct lgfs2_extents *ex)
+{
+	for (unsigned l = 0; l < ex->ex_nleaves; l++)
+		free(ex->ex_leaves[l]);
+	free(ex->ex_leaves);
+	free(ex->ex_max);
+	free(ex);
+}
+
+void lgfs2_rgrp_extents_free(lgfs2_rgrp_t rg)
+{
+	struct lgfs2_extents *ex = rg->rt_extents;
+
+	if (ex == NULL)
+		return;
+	extents_destroy(ex);
+	rg->rt_extents = NULL;
+}
+
+/* The larger of the maxima of node n's children */
+static inline uint32_t extents_max(const struct lgfs2_extents *ex, unsigned n)
+{
+	uint32_t l = ex->ex_max[2 * n], r = ex->ex_max[2 * n + 1];
+
+	return l > r ? l : r;
+}
+
+static uint32_t leaf_max(const struct extents_leaf *el)
+{
+	uint32_t max = 0;
+
+	for (unsigned i = 0; i < el->el_count; i++) {
+		if (el->el_list[i].e_len > max)
+			max = el->el_list[i].e_len;
+	}
+	return max;
+}
+
+static void extents_tree_build(struct lgfs2_extents *ex)
+{
+	unsigned n;
+
+	for (n = 0; n < ex->ex_size; n++)
+		ex->ex_max[ex->ex_size + n] = n < ex->ex_nleaves ? ex->ex_leaves[n]->el_max : 0;
+	for (n = ex->ex_size - 1; n > 0; n--)
+		ex->ex_max[n] = extents_max(ex, n);
+}
+
+/* Update the maxima after an extent in leaf l changed from oldlen to newlen
+   blocks long, or was removed, in which case newlen is 0 */
+static void extents_update(struct lgfs2_extents *ex, unsigned l, uint32_t oldlen, uint32_t newlen)
+{
+	struct extents_leaf *el = ex->ex_leaves[l];
+	unsigned n = ex->ex_size + l;
+
+	if (newlen > el->el_max)
+		el->el_max = newlen;
+	else if (oldlen == el->el_max && newlen < oldlen)
+		el->el_max = leaf_max(el);
+	else
+		return;
+	ex->ex_max[n] = el->el_max;
+	for (n /= 2; n > 0; n /= 2)
+		ex->ex_max[n] = extents_max(ex, n);
+}
+
+static int extents_grow(struct lgfs2_extents *ex)
+{
+	unsigned size = ex->ex_size ? ex->ex_size * 2 : 16;
+	struct extents_leaf **leaves;
+	uint32_t *max;
+
+	leaves = realloc(ex->ex_leaves, size * sizeof(*leaves));
+	if (leaves == NULL)
+		return -1;
+	ex->ex_leaves = leaves;
+	max = realloc(ex->ex_max, 2 * size * sizeof(*max));
+	if (max == NULL)
+		return -1;
+	ex->ex_max = max;
+	ex->ex_size = size;
+	return 0;
+}
+
+/* Add an empty leaf at index l, without updating the tree */
+static struct extents_leaf *extents_leaf_add(struct lgfs2_extents *ex, unsigned l)
+{
+	struct extents_leaf *el;
+
+	if (ex->ex_nleaves == ex->ex_size && extents_grow(ex) != 0)
+		return NULL;
+	el = malloc(sizeof(*el));
+	if (el == NULL)
+		return NULL;
+	el->el_count = 0;
+	el->el_max = 0;
+	memmove(&ex->ex_leaves[l + 1], &ex->ex_leaves[l], (ex->ex_nleaves - l) * sizeof(*ex->ex_leaves));
+	ex->ex_leaves[l] = el;
+	ex->ex_nleaves++;
+	return el;
+}
+
+static inline struct lgfs2_extent *extent_at(const struct lgfs2_extents *ex, struct extent_pos pos)
+{
+	if (pos.l >= ex->ex_nleaves || pos.i < 0 || pos.i >= (int)ex->ex_leaves[pos.l]->el_count)
+		return NULL;
+	return &ex->ex_leaves[pos.l]->el_list[pos.i];
+}
+
+static inline struct extent_pos extents_next(const struct lgfs2_extents *ex, struct extent_pos pos)
+{
+	if (pos.l < ex->ex_nleaves && pos.i + 1 >= (int)ex->ex_leaves[pos.l]->el_count) {
+		pos.l++;
+		pos.i = 0;
+	} else {
+		pos.i++;
+	}
+	return pos;
+}
+
+/* Add an extent to the end of the index, without updating the tree */
+static int extents_append(struct lgfs2_extents *ex, uint32_t start, uint32_t len)
+{
+	struct extents_leaf *el = NULL;
+
+	if (ex->ex_nleaves > 0)
+		el = ex->ex_leaves[ex->ex_nleaves - 1];
+	if (el == NULL || el->el_count == EXTENTS_LEAF) {
+		el = extents_leaf_add(ex, ex->ex_nleaves);
+		if (el == NULL)
+			return -1;
+	}
+	el->el_list[el->el_count].e_start = start;
+	el->el_list[el->el_count].e_len = len;
+	el->el_count++;
+	if (len > el->el_max)
+		el->el_max = len;
+	return 0;
+}
+
+/* Insert an extent after the one at pos, which is moved to the new extent */
+static int extents_insert(struct lgfs2_extents *ex, struct extent_pos *pos, uint32_t start, uint32_t len)
+{
+	struct extents_leaf *el;
+	unsigned i = pos->i + 1;
+	int rebuild = 0;
+
+	if (ex->ex_nleaves == 0) {
+		if (extents_leaf_add(ex, 0) == NULL)
+			return -1;
+		rebuild = 1;
+	}
+	el = ex->ex_leaves[pos->l];
+	if (el->el_count == EXTENTS_LEAF) {
+		struct extents_leaf *nl = extents_leaf_add(ex, pos->l + 1);
+		unsigned half = EXTENTS_LEAF / 2;
+
+		if (nl == NULL)
+			return -1;
+		nl->el_count = EXTENTS_LEAF - half;
+		memcpy(nl->el_list, el->el_list + half, nl->el_count * sizeof(*nl->el_list));
+		el->el_count = half;
+		el->el_max = leaf_max(el);
+		nl->el_max = leaf_max(nl);
+		if (i >= half) {
+			el = nl;
+			i -= half;
+			pos->l++;
+		}
+		rebuild = 1;
+	}
+	memmove(&el->el_list[i + 1], &el->el_list[i], (el->el_count - i) * sizeof(*el->el_list));
+	el->el_list[i].e_start = start;
+	el->el_list[i].e_len = len;
+	el->el_count++;
+	pos->i = i;
+	if (rebuild) {
+		if (len > el->el_max)
+			el->el_max = len;
+		extents_tree_build(ex);
+	} else {
+		extents_update(ex, pos->l, 0, len);
+	}
+	return 0;
+}
+
+/* Remove the extent at pos, which was oldlen blocks long as far as the
+   maxima are concerned */
+static void extents_remove(struct lgfs2_extents *ex, struct extent_pos pos, uint32_t oldlen)
+{
+	struct extents_leaf *el = ex->ex_leaves[pos.l];
+
+	el->el_count--;
+	memmove(&el->el_list[pos.i], &el->el_list[pos.i + 1], (el->el_count - pos.i) * sizeof(*el->el_list));
+	if (el->el_count > 0) {
+		extents_update(ex, pos.l, oldlen, 0);
+		return;
+	}
+	free(el);
+	ex->ex_nleaves--;
+	memmove(&ex->ex_leaves[pos.l], &ex->ex_leaves[pos.l + 1],
+	        (ex->ex_nleaves - pos.l) * sizeof(*ex->ex_leaves));
+	extents_tree_build(ex);
+}
+
+/* The position of the last extent starting at or before blk, with i set to
+   -1 if there is none */
+static struct extent_pos extents_lookup(const struct lgfs2_extents *ex, uint32_t blk)
+{
+	struct extent_pos pos = { .l = 0, .i = -1 };
+	const struct extents_leaf *el;
+	unsigned lo = 0, hi = ex->ex_nleaves;
+	int l, h;
+
+	if (ex->ex_nleaves == 0)
+		return pos;
+	while (hi - lo > 1) {
+		unsigned mid = lo + (hi - lo) / 2;
+
+		if (ex->ex_leaves[mid]->el_list[0].e_start <= blk)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	el = ex->ex_leaves[lo];
+	l = 0;
+	h = (int)el->el_count - 1;
+	while (l <= h) {
+		int mid = (l + h) / 2;
+
+		if (el->el_list[mid].e_start <= blk)
+			l = mid + 1;
+		else
+			h = mid - 1;
+	}
+	pos.l = lo;
+	pos.i = h;
+	return pos;
+}
+
+/* Move pos to the first extent at or after it which is at least len long.
+   Returns 0 on success or -1 if there is none. */
+static int extents_first_fit(const struct lgfs2_extents *ex, struct extent_pos *pos, uint32_t len)
+{
+	const struct extents_leaf *el;
+	unsigned n;
+	int i;
+
+	if (pos->l >= ex->ex_nleaves)
+		return -1;
+	el = ex->ex_leaves[pos->l];
+	if (el->el_max >= len) {
+		for (i = pos->i; i < (int)el->el_count; i++) {
+			if (el->el_list[i].e_len >= len) {
+				pos->i = i;
+				return 0;
+			}
+		}
+	}
+	/* Climb until a subtree of leaves to the right has a long enough extent... */
+	n = ex->ex_size + pos->l;
+	do {
+		while (n & 1) {
+			n /= 2;
+			if (n <= 1)
+				return -1;
+		}
+		n++;
+	} while (ex->ex_max[n] < len);
+	/* ...then descend to its leftmost one */
+	while (n < ex->ex_size)
+		n = ex->ex_max[2 * n] >= len ? 2 * n : 2 * n + 1;
+	pos->l = n - ex->ex_size;
+	el = ex->ex_leaves[pos->l];
+	for (i = 0; el->el_list[i].e_len < len; i++)
+		;
+	pos->i = i;
+	return 0;
+}
+
+/* The first block at or after blk which is free (or not, if used is set), or rt_data */
+static uint32_t rgrp_next(lgfs2_rgrp_t rg, uint32_t blk, int used)
+{
+	uint32_t found = rg->rt_data;
+
+	for (unsigned i = 0; i < rg->rt_length && blk < rg->rt_data; i++) {
+		struct gfs2_bitmap *bi = &rg->bits[i];
+		const uint8_t *buf = (uint8_t *)bi->bi_data + bi->bi_offset;
+		uint32_t first = bi->bi_start * GFS2_NBBY;
+		uint32_t end = first + bi->bi_len * GFS2_NBBY;
+		uint32_t r;
+
+		if (blk >= end)
+			continue;
+		r = blk - first;
+		if (!used) {
+			unsigned long bfit = gfs2_bitfit(buf, bi->bi_len, r, GFS2_BLKST_FREE);
+
+			if (bfit != BFITNOENT) {
+				found = first + bfit;
+				break;
+			}
+		} else {
+			for (; r < end - first; r = (r / GFS2_NBBY + 1) * GFS2_NBBY) {
+				uint8_t byte = buf[r / GFS2_NBBY] >> ((r % GFS2_NBBY) * GFS2_BIT_SIZE);
+
+				if (byte != 0) {
+					found = first + r + __builtin_ctz(byte) / GFS2_BIT_SIZE;
+					break;
+				}
+			}
+			if (found < rg->rt_data)
+				break;
+		}
+		blk = end;
+	}
+	return found < rg->rt_data ? found : rg->rt_data;
+}
+
+static struct lgfs2_extents *extents_get(lgfs2_rgrp_t rg)
+{
+	struct lgfs2_extents *ex = rg->rt_extents;
+	uint32_t blk = 0;
+
+	if (ex != NULL)
+		return ex;
+	if (rg->bits == NULL || rg->bits[0].bi_data == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	ex = calloc(1, sizeof(*ex));
+	if (ex == NULL || extents_grow(ex) != 0)
+		goto fail;
+	while ((blk = rgrp_next(rg, blk, 0)) < rg->rt_data) {
+		uint32_t end = rgrp_next(rg, blk, 1);
+
+		if (extents_append(ex, blk, end - blk) != 0)
+			goto fail;
+		blk = end;
+	}
+	extents_tree_build(ex);
+	rg->rt_extents = ex;
+	return ex;
+fail:
+	if (ex != NULL)
+		extents_destroy(ex);
+	errno = ENOMEM;
+	return NULL;
+}
+
+/**
+ * Update the free extent index, if there is one, when a block changes
+ * between free and not free. Called by gfs2_set_bitmap().
+ * blk: The data block offset in the resource group
+ * free: Whether the block is now free
+ */
+void lgfs2_rgrp_extents_set(lgfs2_rgrp_t rg, uint32_t blk, int free)
+{
+	struct lgfs2_extents *ex = rg->rt_extents;
+	struct lgfs2_extent *e, *ne;
+	struct extent_pos pos, next;
+	uint32_t len;
+
+	if (ex == NULL || blk >= rg->rt_data)
+		return;
+	pos = extents_lookup(ex, blk);
+	e = extent_at(ex, pos);
+	if (!free) {
+		if (e == NULL || blk >= e->e_start + e->e_len)
+			goto rebuild;
+		len = e->e_len;
+		if (blk == e->e_start) {
+			e->e_start++;
+			e->e_len--;
+		} else if (blk == e->e_start + e->e_len - 1) {
+			e->e_len--;
+		} else {
+			uint32_t end = e->e_start + e->e_len;
+
+			e->e_len = blk - e->e_start;
+			extents_update(ex, pos.l, len, e->e_len);
+			if (extents_insert(ex, &pos, blk + 1, end - blk - 1) != 0)
+				goto rebuild;
+			return;
+		}
+		if (e->e_len == 0)
+			extents_remove(ex, pos, len);
+		else
+			extents_update(ex, pos.l, len, e->e_len);
+		return;
+	}
+	if (e != NULL && blk < e->e_start + e->e_len)
+		goto rebuild;
+	next = extents_next(ex, pos);
+	ne = extent_at(ex, next);
+	if (e != NULL && e->e_start + e->e_len == blk) {
+		len = e->e_len;
+		e->e_len++;
+		if (ne != NULL && ne->e_start == blk + 1) {
+			uint32_t nlen = ne->e_len;
+
+			e->e_len += nlen;
+			extents_update(ex, pos.l, len, e->e_len);
+			extents_remove(ex, next, nlen);
+			return;
+		}
+		extents_update(ex, pos.l, len, e->e_len);
+	} else if (ne != NULL && ne->e_start == blk + 1) {
+		ne->e_start--;
+		ne->e_len++;
+		extents_update(ex, next.l, ne->e_len - 1, ne->e_len);
+	} else if (extents_insert(ex, &pos, blk, 1) != 0) {
+		goto rebuild;
+	}
+	return;
+rebuild:
+	/* The index is out of step with the bitmaps, build it again when needed */
+	lgfs2_rgrp_extents_free(rg);
+}
+
+/**
+ * Find the first free extent of at least minlen blocks at or after block
+ * from in a resource group, using the free extent index. If from is in a
+ * free extent, only the part of it from that block onwards counts.
+ * rg: The resource group, with its bitmaps read in
+ * from: The block to search from (file system relative)
+ * minlen: The minimum length of the extent
+ * addr: Set to the address of the first block of the extent
+ * len: If not NULL, set to the length of the extent
+ * Returns 0 on success or non-zero with errno set to ENOSPC if there is no
+ * such extent, or another error.
+ */
+int lgfs2_rgrp_extent_find(lgfs2_rgrp_t rg, uint64_t from, uint32_t minlen,
+                           uint64_t *addr, uint32_t *len)
+{
+	struct lgfs2_extents *ex = extents_get(rg);
+	struct lgfs2_extent *e;
+	struct extent_pos pos;
+	uint32_t blk = 0;
+
+	if (ex == NULL)
+		return 1;
+	if (from > rg->rt_data0)
+		blk = from - rg->rt_data0 < rg->rt_data ? from - rg->rt_data0 : rg->rt_data;
+	if (minlen == 0)
+		minlen = 1;
+	pos = extents_lookup(ex, blk);
+	e = extent_at(ex, pos);
+	if (e != NULL && e->e_start + e->e_len >= blk + minlen) {
+		*addr = rg->rt_data0 + blk;
+		if (len != NULL)
+			*len = e->e_start + e->e_len - blk;
+		return 0;
+	}
+	pos = extents_next(ex, pos);
+	if (extents_first_fit(ex, &pos, minlen) != 0) {
+		errno = ENOSPC;
+		return 1;
+	}
+	e = extent_at(ex, pos);
+	*addr = rg->rt_data0 + e->e_start;
+	if (len != NULL)
+		*len = e->e_len;
+	return 0;
+}
+
+/**
+ * Find the largest free extent in a resource group, using the free extent
+ * index. The first one is used if there are several.
+ * rg: The resource group, with its bitmaps read in
+ * addr: If not NULL, set to the address of the first block of the extent
+ * Returns the length of the extent, or 0 if there are no free blocks or on
+ * error, with errno set.
+ */
+uint32_t lgfs2_rgrp_extent_largest(lgfs2_rgrp_t rg, uint64_t *addr)
+{
+	struct lgfs2_extents *ex = extents_get(rg);
+	struct extent_pos pos = { .l = 0, .i = 0 };
+	uint32_t len;
+
+	if (ex == NULL)
+		return 0;
+	len = ex->ex_max[1];
+	if (len == 0) {
+		errno = ENOSPC;
+		return 0;
+	}
+	extents_first_fit(ex, &pos, len);
+	if (addr != NULL)
+		*addr = rg->rt_data0 + extent_at(ex, pos)->e_start;
+	return len;
+}
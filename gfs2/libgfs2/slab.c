@@ -0,0 +1,285 @@
+#include "clusterautoconfig.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "libgfs2.h"
+
+/*
+ * Fixed size object pools for the buffer heads, block buffers and inodes
+ * which are allocated and freed for every block and dinode that the tools
+ * look at. Objects are carved out of large, aligned chunks and freed objects
+ * are kept on a free list to be handed out again, so the chunks are only
+ * returned to the system when the pools are destroyed.
+ *
+ * The chunk an object belongs to is found by masking its address, so freeing
+ * an object doesn't need a reference to the pool. Chunks which still have
+ * objects in use when their pool is destroyed are orphaned and freed when
+ * their last object is freed.
+ *
+ * All of the pools share one mutex, which also covers the orphaned chunks,
+ * so objects can be allocated and freed by any thread.
+ */
+
+#define SLAB_CHUNK_SIZE (1UL << 20) /* Must be a power of two */
+
+struct slab_pool;
+
+struct slab_chunk {
+	struct slab_chunk *sc_next;
+	struct slab_pool *sc_pool; /* NULL once the pool has been destroyed */
+	unsigned sc_live;          /* Objects in use */
+};
+
+struct slab_pool {
+	size_t sp_objsize;
+	size_t sp_first;      /* Offset of the first object in a chunk */
+	unsigned sp_perchunk;
+	void *sp_free;        /* Free objects, linked through their first word */
+	struct slab_chunk *sp_chunks;
+	struct slab_chunk *sp_fill; /* Chunk with unused space at the end */
+	unsigned sp_filled;         /* Objects handed out from sp_fill so far */
+	struct lgfs2_slab_stats sp_stats;
+};
+
+struct lgfs2_slab {
+	struct slab_pool sl_heads; /* struct gfs2_buffer_head */
+	struct slab_pool sl_data;  /* Block buffers, aligned to the block size */
+	struct slab_pool sl_inodes; /* struct gfs2_inode */
+};
+
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int pool_init(struct slab_pool *sp, size_t objsize, size_t align)
+{
+	memset(sp, 0, sizeof(*sp));
+	objsize = (objsize + align - 1) & ~(align - 1);
+	sp->sp_objsize = objsize;
+	sp->sp_first = (sizeof(struct slab_chunk) + align - 1) & ~(align - 1);
+	if (sp->sp_first + objsize > SLAB_CHUNK_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	sp->sp_perchunk = (SLAB_CHUNK_SIZE - sp->sp_first) / objsize;
+	return 0;
+}
+
+static void pool_destroy(struct slab_pool *sp)
+{
+	struct slab_chunk *sc = sp->sp_chunks;
+
+	while (sc != NULL) {
+		struct slab_chunk *next = sc->sc_next;
+
+		if (sc->sc_live == 0)
+			free(sc);
+		else
+			sc->sc_pool = NULL;
+		sc = next;
+	}
+	sp->sp_chunks = NULL;
+	sp->sp_free = NULL;
+}
+
+static void *__pool_get(struct slab_pool *sp)
+{
+	struct slab_chunk *sc;
+	char *obj = sp->sp_free;
+
+	if (obj != NULL) {
+		sp->sp_free = *(void **)obj;
+		sc = (struct slab_chunk *)((uintptr_t)obj & ~(SLAB_CHUNK_SIZE - 1));
+		goto out;
+	}
+	if (sp->sp_fill == NULL || sp->sp_filled == sp->sp_perchunk) {
+		void *mem;
+
+		if (posix_memalign(&mem, SLAB_CHUNK_SIZE, SLAB_CHUNK_SIZE) != 0)
+			return NULL;
+		sc = mem;
+		sc->sc_pool = sp;
+		sc->sc_live = 0;
+		sc->sc_next = sp->sp_chunks;
+		sp->sp_chunks = sc;
+		sp->sp_fill = sc;
+		sp->sp_filled = 0;
+		sp->sp_stats.ss_chunks++;
+	}
+	sc = sp->sp_fill;
+	obj = (char *)sc + sp->sp_first + (sp->sp_filled++ * sp->sp_objsize);
+out:
+	sc->sc_live++;
+	sp->sp_stats.ss_allocs++;
+	if (++sp->sp_stats.ss_inuse > sp->sp_stats.ss_peak)
+		sp->sp_stats.ss_peak = sp->sp_stats.ss_inuse;
+	return obj;
+}
+
+static void *pool_get(struct slab_pool *sp)
+{
+	void *obj;
+
+	pthread_mutex_lock(&slab_lock);
+	obj = __pool_get(sp);
+	pthread_mutex_unlock(&slab_lock);
+	return obj;
+}
+
+static void __pool_put(void *obj)
+{
+	struct slab_chunk *sc = (struct slab_chunk *)((uintptr_t)obj & ~(SLAB_CHUNK_SIZE - 1));
+	struct slab_pool *sp = sc->sc_pool;
+
+	sc->sc_live--;
+	if (sp == NULL) {
+		if (sc->sc_live == 0)
+			free(sc);
+		return;
+	}
+	*(void **)obj = sp->sp_free;
+	sp->sp_free = obj;
+	sp->sp_stats.ss_inuse--;
+}
+
+static void pool_put(void *obj)
+{
+	pthread_mutex_lock(&slab_lock);
+	__pool_put(obj);
+	pthread_mutex_unlock(&slab_lock);
+}
+
+/**
+ * Set up object pools for the buffer heads and inodes of a file system.
+ * Until this is called, or if it fails, they are allocated with calloc().
+ * sdp: The superblock. sd_bsize must be set.
+ * Returns 0 on success or -1 on failure with errno set
+ */
+int lgfs2_slab_init(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_slab *sl;
+
+	if (sdp->slab != NULL || sdp->sd_bsize == 0 ||
+	    (sdp->sd_bsize & (sdp->sd_bsize - 1)) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	sl = malloc(sizeof(*sl));
+	if (sl == NULL)
+		return -1;
+	if (pool_init(&sl->sl_heads, sizeof(struct gfs2_buffer_head), sizeof(void *)) != 0 ||
+	    pool_init(&sl->sl_data, sdp->sd_bsize, sdp->sd_bsize) != 0 ||
+	    pool_init(&sl->sl_inodes, sizeof(struct gfs2_inode), sizeof(void *)) != 0) {
+		free(sl);
+		return -1;
+	}
+	sdp->slab = sl;
+	return 0;
+}
+
+/**
+ * Tear down the object pools. Buffer heads and inodes which are still in use
+ * remain valid and can be freed normally later.
+ */
+void lgfs2_slab_free(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_slab *sl = sdp->slab;
+
+	if (sl == NULL)
+		return;
+	pthread_mutex_lock(&slab_lock);
+	pool_destroy(&sl->sl_heads);
+	pool_destroy(&sl->sl_data);
+	pool_destroy(&sl->sl_inodes);
+	pthread_mutex_unlock(&slab_lock);
+	free(sl);
+	sdp->slab = NULL;
+}
+
+/**
+ * Get the statistics for the buffer pools and the inode pool. Buffer heads
+ * and their block buffers are allocated together so only the buffer head
+ * pool's chunk count is reported in bufs, with ss_bytes covering both.
+ */
+void lgfs2_slab_stats(struct gfs2_sbd *sdp, struct lgfs2_slab_stats *bufs,
+                      struct lgfs2_slab_stats *inodes)
+{
+	struct lgfs2_slab *sl = sdp->slab;
+
+	if (sl == NULL) {
+		memset(bufs, 0, sizeof(*bufs));
+		memset(inodes, 0, sizeof(*inodes));
+		return;
+	}
+	pthread_mutex_lock(&slab_lock);
+	*bufs = sl->sl_heads.sp_stats;
+	bufs->ss_bytes = (sl->sl_heads.sp_stats.ss_chunks + sl->sl_data.sp_stats.ss_chunks) *
+	                 SLAB_CHUNK_SIZE;
+	*inodes = sl->sl_inodes.sp_stats;
+	pthread_mutex_unlock(&slab_lock);
+	inodes->ss_bytes = inodes->ss_chunks * SLAB_CHUNK_SIZE;
+}
+
+/**
+ * Allocate a buffer head and its block buffer from the pools. The buffer is
+ * not zeroed. Returns NULL if there are no pools for this block size or the
+ * allocation failed, in which case the caller should use calloc().
+ */
+struct gfs2_buffer_head *lgfs2_slab_bh_get(struct gfs2_sbd *sdp)
+{
+	struct lgfs2_slab *sl = sdp->slab;
+	struct gfs2_buffer_head *bh;
+	char *data;
+
+	/* The block size can change while a file system is being probed */
+	if (sl == NULL || sl->sl_data.sp_objsize != sdp->sd_bsize)
+		return NULL;
+	pthread_mutex_lock(&slab_lock);
+	bh = __pool_get(&sl->sl_heads);
+	data = (bh == NULL) ? NULL : __pool_get(&sl->sl_data);
+	if (data == NULL && bh != NULL) {
+		__pool_put(bh);
+		bh = NULL;
+	}
+	pthread_mutex_unlock(&slab_lock);
+	if (bh == NULL)
+		return NULL;
+	memset(bh, 0, sizeof(*bh));
+	bh->b_data = data;
+	bh->b_slab = 1;
+	return bh;
+}
+
+void lgfs2_slab_bh_put(struct gfs2_buffer_head *bh)
+{
+	pthread_mutex_lock(&slab_lock);
+	__pool_put(bh->b_data);
+	__pool_put(bh);
+	pthread_mutex_unlock(&slab_lock);
+}
+
+/**
+ * Allocate a zeroed inode from the pool, or with calloc() if there is none.
+ */
+struct gfs2_inode *lgfs2_slab_inode_get(struct gfs2_sbd *sdp)
+{
+	struct gfs2_inode *ip = NULL;
+
+	if (sdp->slab != NULL)
+		ip = pool_get(&sdp->slab->sl_inodes);
+	if (ip == NULL)
+		return calloc(1, sizeof(*ip));
+	memset(ip, 0, sizeof(*ip));
+	ip->i_slab = 1;
+	return ip;
+}
+
+void lgfs2_slab_inode_put(struct gfs2_inode *ip)
+{
+	if (ip->i_slab)
+		pool_put(ip);
+	else
+		free(ip);
+}
@@ -46,7 +46,7 @@ int build_master(struct gfs2_sbd *sdp)
 	return 0;
 }
 
-int lgfs2_sb_write(const struct gfs2_sbd *sdp, int fd)
+int lgfs2_sb_write(struct gfs2_sbd *sdp)
 {
 	int i, err = -1;
 	struct iovec *iov;
@@ -54,7 +54,7 @@ int lgfs2_sb_write(const struct gfs2_sbd *sdp, int fd)
 	const size_t len = sb_addr + 1;
 
 	/* We only need 2 blocks: one for zeroing and a second for the superblock */
-	char *buf = calloc(2, sdp->sd_bsize);
+	char *buf = lgfs2_dev_buf(sdp, 2 * sdp->sd_bsize);
 	if (buf == NULL)
 		return -1;
 
@@ -70,7 +70,7 @@ int lgfs2_sb_write(const struct gfs2_sbd *sdp, int fd)
 	lgfs2_sb_out(sdp, buf + sdp->sd_bsize);
 	iov[sb_addr].iov_base = buf + sdp->sd_bsize;
 
-	if (pwritev(fd, iov, len, 0) < (len * sdp->sd_bsize))
+	if (lgfs2_dev_pwritev(sdp, iov, len, 0) != (ssize_t)(len * sdp->sd_bsize))
 		goto out_iov;
 
 	err = 0;
@@ -116,7 +116,7 @@ int lgfs2_write_journal_data(struct gfs2_inode *ip)
 	uint64_t jblk = jext0;
 	char *buf;
 
-	buf = calloc(1, sdp->sd_bsize);
+	buf = lgfs2_dev_buf(sdp, sdp->sd_bsize);
 	if (buf == NULL)
 		return -1;
 
@@ -139,7 +139,8 @@ int lgfs2_write_journal_data(struct gfs2_inode *ip)
 		hash = lgfs2_log_header_crc(buf, sdp->sd_bsize);
 		lh->lh_crc = cpu_to_be32(hash);
 
-		if (pwrite(sdp->device_fd, buf, sdp->sd_bsize, jblk * sdp->sd_bsize) != sdp->sd_bsize) {
+		lgfs2_bcache_invalidate(sdp, jblk, 1);
+		if (lgfs2_dev_pwrite(sdp, buf, sdp->sd_bsize, jblk * sdp->sd_bsize) != sdp->sd_bsize) {
 			free(buf);
 			return -1;
 		}
@@ -193,10 +194,11 @@ int write_journal(struct gfs2_inode *jnl, unsigned bsize, unsigned int blocks)
 	height = calc_tree_height(jnl, (blocks + 1) * bsize);
 	build_height(jnl, height);
 
+	lgfs2_mpcache_start(jnl);
 	for (x = 0; x < blocks; x++) {
 		struct gfs2_buffer_head *bh = get_file_buf(jnl, x, 1);
 		if (!bh)
-			return -1;
+			goto fail;
 		bmodified(bh);
 		brelse(bh);
 	}
@@ -204,7 +206,7 @@ int write_journal(struct gfs2_inode *jnl, unsigned bsize, unsigned int blocks)
 	for (x = 0; x < blocks; x++) {
 		struct gfs2_buffer_head *bh = get_file_buf(jnl, x, 0);
 		if (!bh)
-			return -1;
+			goto fail;
 
 		memset(bh->b_data, 0, bsize);
 		lh = (void *)bh->b_data;
@@ -228,8 +230,11 @@ int write_journal(struct gfs2_inode *jnl, unsigned bsize, unsigned int blocks)
 		if (++seq == blocks)
 			seq = 0;
 	}
-
+	lgfs2_mpcache_stop(jnl);
 	return 0;
+fail:
+	lgfs2_mpcache_stop(jnl);
+	return -1;
 }
 
 int build_journal(struct gfs2_sbd *sdp, int j, struct gfs2_inode *jindex)
@@ -390,16 +395,20 @@ int build_quota_change(struct gfs2_inode *per_node, unsigned int j)
 	hgt = calc_tree_height(ip, (blocks + 1) * sdp->sd_bsize);
 	build_height(ip, hgt);
 
+	lgfs2_mpcache_start(ip);
 	for (x = 0; x < blocks; x++) {
 		bh = get_file_buf(ip, x, 0);
-		if (!bh)
+		if (!bh) {
+			lgfs2_mpcache_stop(ip);
 			return -1;
+		}
 
 		memset(bh->b_data, 0, sdp->sd_bsize);
 		memcpy(bh->b_data, &mh, sizeof(mh));
 		bmodified(bh);
 		brelse(bh);
 	}
+	lgfs2_mpcache_stop(ip);
 
 	if (cfg_debug) {
 		printf("\nQuota Change %u:\n", j);
@@ -638,16 +647,7 @@ int gfs2_check_meta(const char *buf, int type)
 unsigned lgfs2_bm_scan(struct rgrp_tree *rgd, unsigned idx, uint64_t *buf, uint8_t state)
 {
 	struct gfs2_bitmap *bi = &rgd->bits[idx];
-	unsigned n = 0;
-	uint32_t blk = 0;
-
-	while(blk < (bi->bi_len * GFS2_NBBY)) {
-		blk = gfs2_bitfit((uint8_t *)bi->bi_data + bi->bi_offset,
-				  bi->bi_len, blk, state);
-		if (blk == BFITNOENT)
-			break;
-		buf[n++] = blk + (bi->bi_start * GFS2_NBBY) + rgd->rt_data0;
-		blk++;
-	}
-	return n;
+
+	return lgfs2_bm_collect((uint8_t *)bi->bi_data + bi->bi_offset, bi->bi_len, state,
+	                        (bi->bi_start * GFS2_NBBY) + rgd->rt_data0, buf);
 }
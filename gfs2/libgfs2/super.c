@@ -129,7 +129,7 @@ int read_sb(struct gfs2_sbd *sdp)
 		errno = E2BIG;
 		return -1;
 	}
-	sdp->fssize = lseek(sdp->device_fd, 0, SEEK_END) / sdp->sd_bsize;
+	sdp->fssize = lgfs2_dev_size(sdp) / sdp->sd_bsize;
 	sdp->sd_blocks_per_bitmap = (sdp->sd_bsize - sizeof(struct gfs2_meta_header))
 	                             * GFS2_NBBY;
 	sdp->qcsize = GFS2_DEFAULT_QCSIZE;
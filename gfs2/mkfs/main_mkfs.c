@@ -1131,6 +1131,8 @@ int main(int argc, char *argv[])
 	setlocale(LC_ALL, "");
 	textdomain("gfs2-utils");
 	srandom(time(NULL) ^ getpid());
+	if (lgfs2_iostats_init() != 0)
+		perror(_("Unable to enable I/O statistics"));
 
 	opts_init(&opts);
 	error = opts_get(argc, argv, &opts);
@@ -1271,7 +1273,7 @@ int main(int argc, char *argv[])
 		fflush(stdout);
 	}
 
-	error = lgfs2_sb_write(&sbd, opts.dev.fd);
+	error = lgfs2_sb_write(&sbd);
 	if (error) {
 		perror(_("Failed to write superblock\n"));
 		exit(EXIT_FAILURE);
@@ -14,6 +14,7 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <libgfs2.h>
 #include "tunegfs2.h"
 
 static struct tunegfs2 tunegfs2_struct;
@@ -67,6 +68,8 @@ int main(int argc, char **argv)
 	int c, status;
 	int flags = O_RDWR | O_EXCL;
 
+	if (lgfs2_iostats_init() != 0)
+		fprintf(stderr, _("Unable to enable I/O statistics: %s\n"), strerror(errno));
 	memset(tfs, 0, sizeof(struct tunegfs2));
 	while((c = getopt(argc, argv, "hL:U:lo:Vr:")) != -1) {
 		switch(c) {
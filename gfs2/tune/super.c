@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <string.h>
+#include <time.h>
 #include <libintl.h>
 #define _(String) gettext(String)
 #include <libgfs2.h>
@@ -16,6 +17,7 @@
 
 int read_super(struct tunegfs2 *tfs)
 {
+	struct timespec start;
 	void *block;
 	int n;
        	tfs->sb_start = GFS2_SB_ADDR << GFS2_BASIC_BLOCK_SHIFT;
@@ -24,7 +26,11 @@ int read_super(struct tunegfs2 *tfs)
 		perror("read_super: malloc");
 		return EX_UNAVAILABLE;
 	}
+	if (lgfs2_iostats_on)
+		clock_gettime(CLOCK_MONOTONIC, &start);
 	n = pread(tfs->fd, block, GFS2_DEFAULT_BSIZE, tfs->sb_start);
+	if (lgfs2_iostats_on)
+		lgfs2_iostats_account(LGFS2_IOSTATS_READ, tfs->sb_start, n, &start, __FUNCTION__, __LINE__);
 	if (n < 0) {
 		perror("read_super: pread");
 		free(block);
@@ -70,8 +76,14 @@ int print_super(const struct tunegfs2 *tfs)
 
 int write_super(const struct tunegfs2 *tfs)
 {
+	struct timespec start;
 	int n;
+
+	if (lgfs2_iostats_on)
+		clock_gettime(CLOCK_MONOTONIC, &start);
 	n = pwrite(tfs->fd, tfs->sb, GFS2_DEFAULT_BSIZE, tfs->sb_start);
+	if (lgfs2_iostats_on)
+		lgfs2_iostats_account(LGFS2_IOSTATS_WRITE, tfs->sb_start, n, &start, __FUNCTION__, __LINE__);
 	if (n < 0) {
 		perror("write_super: pwrite");
 		return EX_IOERR;
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "crc32c.h"
+
+/*
+ * Measure the throughput of each crc32c implementation supported by the cpu.
+ * Usage: crcbench [megabytes]
+ */
+
+static const struct {
+	enum crc32c_impl impl;
+	const char *name;
+} impls[] = {
+	{ CRC32C_BYTEWISE, "bytewise" },
+	{ CRC32C_SLICE8, "slice8" },
+	{ CRC32C_SSE42, "sse4.2" },
+	{ CRC32C_ARMV8, "armv8" },
+};
+
+/* Journal log headers are checksummed from lh_nsec to the end of the block */
+static const size_t lens[] = { 64, 512, 4096 - 52, 65536 };
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned mb = argc > 1 ? strtoul(argv[1], NULL, 0) : 256;
+	unsigned char *buf = malloc(65536);
+
+	if (mb == 0 || buf == NULL) {
+		fprintf(stderr, "Usage: %s [megabytes]\n", argv[0]);
+		return 1;
+	}
+	srandom(1);
+	for (unsigned i = 0; i < 65536; i++)
+		buf[i] = random();
+
+	printf("%-10s", "bytes");
+	for (unsigned l = 0; l < sizeof(lens) / sizeof(lens[0]); l++)
+		printf(" %10zu", lens[l]);
+	printf("  (MB/s)\n");
+	for (unsigned i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+		if (crc32c_impl_set(impls[i].impl) != 0)
+			continue;
+		printf("%-10s", impls[i].name);
+		for (unsigned l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+			uint64_t n = ((uint64_t)mb << 20) / lens[l];
+			uint32_t crc = ~0;
+			double start = now();
+
+			/* Bytewise is slow, don't wait for it */
+			if (impls[i].impl == CRC32C_BYTEWISE)
+				n /= 16;
+			for (uint64_t j = 0; j < n; j++)
+				crc = crc32c(crc, buf, lens[l]);
+			printf(" %10.0f", n * lens[l] / (now() - start) / (1 << 20));
+			if (crc == 0)
+				printf("*"); /* Keep the result live */
+		}
+		printf("\n");
+	}
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,71 @@
+#!/bin/bash
+
+# Compare the run times of fsck.gfs2 -n and gfs2_edit savemeta with buffered
+# and direct I/O. The page cache is dropped before each run so that both modes
+# start cold, which needs root. The file system is not modified.
+# Usage:
+#   iobench.sh <device> [runs]
+#
+# To test a different fsck.gfs2 (or gfs2_edit) adjust your PATH accordingly
+
+FSCK=fsck.gfs2
+GFS2EDIT=gfs2_edit
+
+device="$1"
+runs="${2:-3}"
+if [ ! -r "$device" ]
+then
+	echo "Usage: $(basename "$0") <device> [runs]" >&2
+	exit 1
+fi
+
+savefile=$(mktemp iobench.XXXXXX) || exit 1
+trap 'rm -f "$savefile"' EXIT
+
+function drop_caches()
+{
+	sync
+	if ! echo 3 2>/dev/null > /proc/sys/vm/drop_caches
+	then
+		echo "Warning: unable to drop caches, results will be skewed" >&2
+	fi
+}
+
+function page_cache_kb()
+{
+	awk '/^Cached:/ { print $2 }' /proc/meminfo
+}
+
+# Prints the elapsed milliseconds and the growth of the page cache in KiB
+function bench()
+{
+	local start end before after
+
+	drop_caches
+	before=$(page_cache_kb)
+	start=$(date +%s%N)
+	"$@" > /dev/null 2>&1
+	end=$(date +%s%N)
+	after=$(page_cache_kb)
+	echo "$(((end - start) / 1000000)) $((after - before))"
+}
+
+function report()
+{
+	local name="$1"
+	shift
+	local total=0 ms kb
+
+	for i in $(seq "$runs")
+	do
+		read ms kb < <(bench "$@")
+		total=$((total + ms))
+	done
+	printf "%-28s %6d.%03ds %10d KiB\n" "$name" $((total / runs / 1000)) $((total / runs % 1000)) "$kb"
+}
+
+printf "%-28s %9s %14s\n" "" "mean time" "page cache"
+report "fsck.gfs2 -n" $FSCK -n "$device"
+report "fsck.gfs2 -n -D" $FSCK -n -D "$device"
+report "gfs2_edit savemeta" $GFS2EDIT savemeta -z0 "$device" "$savefile"
+report "gfs2_edit -direct savemeta" $GFS2EDIT -direct savemeta -z0 "$device" "$savefile"
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libgfs2.h>
+#include "fsck.h"
+#include "util.h"
+
+/*
+ * Compare the memory used and the time taken by fsck.gfs2's flat block map
+ * and its compressed block map (fsck.gfs2 -z) for a made up file system. The
+ * resource groups are filled from the start to the given percentage with
+ * files of random sizes, the way pass1 would find them, then the map is read
+ * back in the 64 byte pieces which pass5 compares with the bitmaps, and
+ * looked up at random blocks.
+ * Usage: mapbench [rgrps] [percent full]
+ */
+
+#define RG_BLOCKS (65536)
+#define EXTRACT_BYTES (64)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The same as gfs2_blockmap_set() in pass1.c */
+static int map_set(struct gfs2_bmap *bmap, uint64_t block, int mark)
+{
+	unsigned char *byte;
+	unsigned b;
+
+	if (bmap->chunks != NULL)
+		return bmap_compressed_set(bmap, block, mark);
+	byte = bmap->map + BLOCKMAP_SIZE2(block);
+	b = BLOCKMAP_BYTE_OFFSET2(block);
+	*byte &= ~(BLOCKMAP_MASK2 << b);
+	*byte |= (mark & BLOCKMAP_MASK2) << b;
+	return 0;
+}
+
+static void fill(struct gfs2_bmap *bmap, unsigned nrgs, unsigned percent)
+{
+	srandom(1);
+	for (unsigned rg = 0; rg < nrgs; rg++) {
+		uint64_t start = (uint64_t)rg * RG_BLOCKS;
+		uint64_t used = (uint64_t)RG_BLOCKS * percent / 100;
+		uint64_t b = start;
+
+		while (b < start + used) {
+			uint64_t len = 1 + random() % (random() % 8 ? 16 : 4096);
+
+			map_set(bmap, b++, GFS2_BLKST_DINODE);
+			for (uint64_t i = 0; i < len && b < start + used; i++)
+				map_set(bmap, b++, GFS2_BLKST_USED);
+		}
+		bmap_compact(bmap, start, start + RG_BLOCKS - 1);
+	}
+}
+
+static void run(const char *name, struct gfs2_bmap *bmap, unsigned nrgs, unsigned percent,
+                const uint64_t *blks, unsigned n)
+{
+	uint64_t blocks = (uint64_t)nrgs * RG_BLOCKS;
+	unsigned char out[EXTRACT_BYTES];
+	double start, t_fill, t_read, t_lookup;
+	unsigned long sum = 0;
+	uint64_t mem;
+
+	start = now();
+	fill(bmap, nrgs, percent);
+	t_fill = now() - start;
+
+	start = now();
+	for (uint64_t byte = 0; byte < blocks / 4; byte += EXTRACT_BYTES) {
+		if (bmap->chunks != NULL)
+			bmap_compressed_read(bmap, byte, out, EXTRACT_BYTES);
+		else
+			memcpy(out, bmap->map + byte, EXTRACT_BYTES);
+		sum += out[EXTRACT_BYTES - 1];
+	}
+	t_read = now() - start;
+
+	start = now();
+	for (unsigned i = 0; i < n; i++)
+		sum += block_type(bmap, blks[i]);
+	t_lookup = now() - start;
+
+	mem = bmap->chunks != NULL ? bmap_compressed_mem(bmap) : bmap->mapsize;
+	printf("  %-12s %10.1f MB %9.3f s fill %9.3f s read %8.1f ns/lookup (%lx)\n",
+	       name, mem / 1048576.0, t_fill, t_read, t_lookup * 1e9 / n, sum & 0xfff);
+}
+
+void print_it(const char *label, const char *fmt, const char *fmt2, ...) {}
+
+int main(int argc, char *argv[])
+{
+	unsigned nrgs = argc > 1 ? strtoul(argv[1], NULL, 0) : 4096;
+	unsigned percent = argc > 2 ? strtoul(argv[2], NULL, 0) : 30;
+	uint64_t blocks = (uint64_t)nrgs * RG_BLOCKS;
+	unsigned n = 10000000;
+	struct gfs2_bmap flat = {0}, compressed = {0};
+	uint64_t *blks;
+
+	blks = malloc(n * sizeof(*blks));
+	if (nrgs == 0 || percent > 100 || blks == NULL) {
+		fprintf(stderr, "Usage: %s [rgrps] [percent full]\n", argv[0]);
+		return 1;
+	}
+	flat.size = blocks - 1;
+	flat.mapsize = BLOCKMAP_SIZE2(blocks) + 1;
+	flat.map = calloc(flat.mapsize, 1);
+	if (flat.map == NULL || bmap_compressed_alloc(&compressed, blocks - 1) != 0) {
+		perror("Unable to allocate the block maps");
+		return 1;
+	}
+	srandom(2);
+	for (unsigned i = 0; i < n; i++)
+		blks[i] = (((uint64_t)random() << 31) | random()) % blocks;
+
+	printf("%u resource groups of %u blocks, %u%% full\n", nrgs, RG_BLOCKS, percent);
+	run("flat", &flat, nrgs, percent, blks, n);
+	run("compressed", &compressed, nrgs, percent, blks, n);
+
+	free(flat.map);
+	bmap_compressed_free(&compressed);
+	free(blks);
+	return 0;
+}
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libgfs2.h>
+
+/*
+ * Compare the speed of gfs2_blk2rgrpd() with a walk of the resource group
+ * tree, which is how it used to find resource groups.
+ * Usage: rgbench [rgrps] [lookups]
+ */
+
+#define RG_BLOCKS (65536)
+
+static struct rgrp_tree *tree_walk(struct gfs2_sbd *sdp, uint64_t blk)
+{
+	struct rgrp_tree *rgd = (struct rgrp_tree *)sdp->rgtree.osi_node;
+
+	while (rgd) {
+		if (blk < rgd->rt_addr)
+			rgd = (struct rgrp_tree *)rgd->node.osi_left;
+		else if (blk >= rgd->rt_data0 + rgd->rt_data)
+			rgd = (struct rgrp_tree *)rgd->node.osi_right;
+		else
+			return rgd;
+	}
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char *name, struct gfs2_sbd *sdp, const uint64_t *blks, unsigned n,
+                struct rgrp_tree *(*lookup)(struct gfs2_sbd *, uint64_t))
+{
+	uintptr_t sum = 0;
+	double start = now();
+
+	for (unsigned i = 0; i < n; i++)
+		sum += (uintptr_t)lookup(sdp, blks[i]);
+	printf("  %-16s %8.1f ns/lookup (%lx)\n", name, (now() - start) * 1e9 / n,
+	       (unsigned long)(sum & 0xfff));
+}
+
+void print_it(const char *label, const char *fmt, const char *fmt2, ...) {}
+
+int main(int argc, char *argv[])
+{
+	unsigned nrgs = argc > 1 ? strtoul(argv[1], NULL, 0) : 50000;
+	unsigned n = argc > 2 ? strtoul(argv[2], NULL, 0) : 10000000;
+	struct gfs2_sbd sbd;
+	uint64_t *blks;
+
+	memset(&sbd, 0, sizeof(sbd));
+	blks = malloc(n * sizeof(*blks));
+	if (nrgs == 0 || n == 0 || blks == NULL) {
+		fprintf(stderr, "Usage: %s [rgrps] [lookups]\n", argv[0]);
+		return 1;
+	}
+	for (unsigned i = 0; i < nrgs; i++) {
+		struct rgrp_tree *rg = rgrp_insert(&sbd.rgtree, 16 + (uint64_t)i * RG_BLOCKS);
+
+		if (rg == NULL) {
+			perror("rgrp_insert");
+			return 1;
+		}
+		rg->rt_length = 5;
+		rg->rt_data0 = rg->rt_addr + rg->rt_length;
+		rg->rt_data = RG_BLOCKS - rg->rt_length;
+	}
+	gfs2_blk2rgrpd(&sbd, 0); /* Build the lookup array */
+	srandom(1);
+
+	printf("%u resource groups, %u lookups\n", nrgs, n);
+	printf("Random blocks:\n");
+	for (unsigned i = 0; i < n; i++)
+		blks[i] = 16 + (((uint64_t)random() << 31) | random()) % ((uint64_t)nrgs * RG_BLOCKS);
+	run("tree walk", &sbd, blks, n, tree_walk);
+	run("gfs2_blk2rgrpd", &sbd, blks, n, gfs2_blk2rgrpd);
+
+	printf("Sequential blocks:\n");
+	for (unsigned i = 0; i < n; i++)
+		blks[i] = 16 + ((uint64_t)i * 7) % ((uint64_t)nrgs * RG_BLOCKS);
+	run("tree walk", &sbd, blks, n, tree_walk);
+	run("gfs2_blk2rgrpd", &sbd, blks, n, gfs2_blk2rgrpd);
+
+	gfs2_rgrp_free(&sbd, &sbd.rgtree);
+	free(blks);
+	return 0;
+}